@@ -82,6 +82,7 @@ if test "$PHP_EPEG" != "no"; then
   export OLD_CPPFLAGS="$CPPFLAGS"
   export CPPFLAGS="$CPPFLAGS $EPEG_INCLINE"
   AC_CHECK_HEADER([Epeg.h], [], AC_MSG_ERROR([Epeg.h header not found.]))
+  AC_CHECK_HEADER([jpeglib.h], [], AC_MSG_ERROR([jpeglib.h header not found.]))
   export CPPFLAGS="$OLD_CPPFLAGS"
 
   PHP_EVAL_INCLINE($EPEG_INCLINE)
@@ -98,8 +99,33 @@ if test "$PHP_EPEG" != "no"; then
       $EPEG_LIBLINE
     ])
 
+  PHP_CHECK_LIBRARY(jpeg, jpeg_CreateDecompress,
+    [
+      PHP_ADD_LIBRARY(jpeg, 1, EPEG_SHARED_LIBADD)
+    ],[
+      AC_MSG_ERROR([libjpeg not found. Check config.log for more information.])
+    ],[
+      $EPEG_LIBLINE
+    ])
+
+  dnl
+  dnl Check the thread support of epeg_thumbnail_batch() and the asynchronous jobs
+  dnl
+  AC_CHECK_HEADERS([pthread.h], [
+    PHP_ADD_LIBRARY(pthread, 1, EPEG_SHARED_LIBADD)
+  ])
+  AC_CHECK_HEADERS([sys/eventfd.h])
+
+  dnl
+  dnl Check the subsecond file times for the keys of the caches
+  dnl
+  AC_CHECK_MEMBERS([struct stat.st_mtim.tv_nsec, struct stat.st_mtimespec.tv_nsec], [], [], [
+#include <sys/types.h>
+#include <sys/stat.h>
+  ])
+
   PHP_ADD_LIBRARY(m, 1, EPEG_SHARED_LIBADD)
   PHP_SUBST(EPEG_SHARED_LIBADD)
-  PHP_NEW_EXTENSION(epeg, epeg.c , $ext_shared)
+  PHP_NEW_EXTENSION(epeg, epeg.c epeg_header_cache.c epeg_jpeg.c epeg_memory.c epeg_placeholder.c epeg_pool.c epeg_resample.c, $ext_shared)
 
 fi
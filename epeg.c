@@ -31,15 +31,23 @@
 
 /* {{{ globals */
 
+ZEND_DECLARE_MODULE_GLOBALS(epeg)
+
 static int le_epeg;
 static zend_class_entry *ce_Epeg = NULL;
 static zend_object_handlers _php_epeg_object_handlers;
 
+/* shared by the processes forked after MINIT, NULL if disabled */
+static php_epeg_header_cache_t *php_epeg_header_cache = NULL;
+
 /* }}} */
 
 /* {{{ module function prototypes */
 
 static PHP_MINIT_FUNCTION(epeg);
+static PHP_MSHUTDOWN_FUNCTION(epeg);
+static PHP_RINIT_FUNCTION(epeg);
+static PHP_RSHUTDOWN_FUNCTION(epeg);
 static PHP_MINFO_FUNCTION(epeg);
 
 /* }}} */
@@ -47,6 +55,7 @@ static PHP_MINFO_FUNCTION(epeg);
 /* {{{ PHP function prototypes */
 
 static PHP_FUNCTION(epeg_thumbnail_create);
+static PHP_FUNCTION(epeg_thumbnail_batch);
 static PHP_FUNCTION(epeg_open);
 static PHP_FUNCTION(epeg_file_open);
 static PHP_FUNCTION(epeg_memory_open);
@@ -59,11 +68,25 @@ static PHP_FUNCTION(epeg_decode_colorspace_set);
 static PHP_FUNCTION(epeg_comment_get);
 static PHP_FUNCTION(epeg_comment_set);
 static PHP_FUNCTION(epeg_quality_set);
+static PHP_FUNCTION(epeg_filter_set);
 static PHP_FUNCTION(epeg_thumbnail_comments_get);
 static PHP_FUNCTION(epeg_thumbnail_comments_enable);
+static PHP_FUNCTION(epeg_retained_pixels_enable);
+static PHP_FUNCTION(epeg_exif_thumbnail_enable);
+static PHP_FUNCTION(epeg_transform);
 static PHP_FUNCTION(epeg_encode);
+static PHP_FUNCTION(epeg_encode_multiple);
+static PHP_FUNCTION(epeg_encode_async);
+static PHP_FUNCTION(epeg_tile_pyramid);
+static PHP_FUNCTION(epeg_jobs_fd);
+static PHP_FUNCTION(epeg_jobs_collect);
 static PHP_FUNCTION(epeg_trim);
+static PHP_FUNCTION(epeg_crop_lossless);
+static PHP_FUNCTION(epeg_placeholder);
+static PHP_FUNCTION(epeg_pixels_get);
 static PHP_FUNCTION(epeg_close);
+static PHP_FUNCTION(epeg_probe);
+static PHP_FUNCTION(epeg_memory_get_peak_usage);
 
 static PHP_METHOD(Epeg, openFile);
 static PHP_METHOD(Epeg, openBuffer);
@@ -81,22 +104,113 @@ round_to_i(double num)
 static php_epeg_t *
 php_epeg_file_open(char *file TSRMLS_DC);
 
+static php_epeg_t *
+php_epeg_file_read(char *file TSRMLS_DC);
+
+static int
+php_epeg_header_key_make(char *file, php_epeg_header_key_t *key TSRMLS_DC);
+
+#ifdef PHP_EPEG_USE_HEADER_CACHE
+static int
+php_epeg_header_fill(php_epeg_t *im, php_epeg_header_t *header);
+
+static php_epeg_t *
+php_epeg_header_open(const php_epeg_header_key_t *key, const php_epeg_header_t *header);
+#endif
+
+static int
+php_epeg_load(php_epeg_t *im TSRMLS_DC);
+
 static php_epeg_t *
 php_epeg_memory_open(char *data, int data_len TSRMLS_DC);
 
+static php_epeg_t *
+php_epeg_zval_open(zval *zdata TSRMLS_DC);
+
+static php_epeg_t *
+php_epeg_data_open(unsigned char *data, int data_len, int data_type, zval *zdata TSRMLS_DC);
+
+#ifdef PHP_EPEG_USE_MMAP
+static unsigned char *
+php_epeg_stream_mmap(php_stream *sth, int *data_len TSRMLS_DC);
+#endif
+
+static void
+php_epeg_data_free(php_epeg_t *im);
+
+static php_epeg_decoder_t *
+php_epeg_input_open(char *file, php_epeg_input_t *in TSRMLS_DC);
+
+static int
+php_epeg_input_read_all(php_epeg_input_t *in TSRMLS_DC);
+
+static void
+php_epeg_input_close(php_epeg_input_t *in TSRMLS_DC);
+
 static void
 php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAMETERS, int mode);
 
+static int
+php_epeg_stream_read_all(php_stream *sth, unsigned char *buf, size_t len TSRMLS_DC);
+
+static int
+php_epeg_probe_stream(php_stream *sth, php_epeg_probe_t *info TSRMLS_DC);
+
 static void
 php_epeg_set_retval(unsigned char *buf, int buf_len,
 		char *file, int file_len, zval *retval TSRMLS_DC);
 
+static void *
+php_epeg_erealloc(void *ptr, size_t size);
+
+static void
+php_epeg_efree(void *ptr);
+
+static php_stream *
+php_epeg_file_stream_open(char *file, char *src, char **path, char **tmp_path TSRMLS_DC);
+
+static int
+php_epeg_file_stream_close(php_stream *sth, char *path, char *tmp_path, int ok TSRMLS_DC);
+
+static int
+php_epeg_output_open(php_epeg_output_t *out, char *file, int file_len, char *src TSRMLS_DC);
+
+static int
+php_epeg_output_close(php_epeg_output_t *out, int result, zval *retval TSRMLS_DC);
+
+static void
+php_epeg_outputs_discard(php_epeg_output_t *outs, int count TSRMLS_DC);
+
+static int
+php_epeg_cache_enabled(TSRMLS_D);
+
+static void
+php_epeg_cache_path(PHP_MD5_CTX *ctx, char *path, size_t path_size TSRMLS_DC);
+
+static int
+php_epeg_cache_fetch(const char *path, unsigned char **buf, int *buf_len TSRMLS_DC);
+
+static void
+php_epeg_cache_store(const char *path, const unsigned char *buf, size_t len TSRMLS_DC);
+
+static void
+php_epeg_cache_sweep(TSRMLS_D);
+
+static void
+php_epeg_cache_key_handle(php_epeg_t *im, char *path, size_t path_size TSRMLS_DC);
+
+static const char *
+php_epeg_error_string(int errcode);
+
 static void
 php_epeg_encode_error(int errcode TSRMLS_DC);
 
 static void
 php_epeg_trim_error(int errcode TSRMLS_DC);
 
+static void
+php_epeg_memory_error(TSRMLS_D);
+
 static void
 php_epeg_free_resource(zend_rsrc_list_entry *rsrc TSRMLS_DC);
 
@@ -115,9 +229,100 @@ php_epeg_calc_thumb_size(
 		int max_width, int max_height,
 		int *dst_width, int *dst_height);
 
+static void
+php_epeg_fit_fast(int src_width, int src_height, int *width, int *height);
+
+static void
+php_epeg_fit_dc(int src_width, int src_height, int *width, int *height);
+
+static void
+php_epeg_size_array(zval *zv, int width, int height);
+
 static void
 php_epeg_reset(php_epeg_t *im);
 
+static int
+php_epeg_strip_markers(const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t *out_len);
+
+static int
+php_epeg_thumbnail_run(const unsigned char *data, size_t data_len,
+		int max_width, int max_height, int quality, php_epeg_output_t *out);
+
+static int
+php_epeg_transform_run(const unsigned char *data, size_t data_len, int transform,
+		const php_epeg_params_t *params, php_epeg_output_t *out);
+
+static const unsigned char *
+php_epeg_exif_thumbnail_fit(const unsigned char *data, size_t data_len,
+		int src_width, int src_height, int transform, int width, int height,
+		double tolerance, size_t *thumb_len);
+
+static int
+php_epeg_batch_job_fetch(zval *entry, php_epeg_batch_job_t *job, char **in_file TSRMLS_DC);
+
+static int
+php_epeg_batch_job_read(php_epeg_batch_job_t *job, char *in_file TSRMLS_DC);
+
+static void
+php_epeg_batch_job_run(php_epeg_task_t *task);
+
+static void
+php_epeg_batch_job_finish(php_epeg_pool_t *pool, php_epeg_batch_job_t *job,
+		zval *results TSRMLS_DC);
+
+static void
+php_epeg_params_fill(php_epeg_t *im, php_epeg_params_t *params TSRMLS_DC);
+
+static void
+php_epeg_init_globals(zend_epeg_globals *epeg_globals);
+
+static void
+php_epeg_destroy_globals(zend_epeg_globals *epeg_globals);
+
+static php_epeg_pool_t *
+php_epeg_pool_get(TSRMLS_D);
+
+static php_epeg_pool_t *
+php_epeg_parallel_pool(php_epeg_t *im TSRMLS_DC);
+
+static void
+php_epeg_jobs_check_fork(TSRMLS_D);
+
+static int
+php_epeg_jobs_start(TSRMLS_D);
+
+static int
+php_epeg_scale_handle(php_epeg_t *im, const php_epeg_params_t *params,
+		php_epeg_pixels_t *px TSRMLS_DC);
+
+static int
+php_epeg_tile_emit(const php_epeg_pixels_t *px, const php_epeg_params_t *params,
+		int level, int col, int row, int x, int y, int width, int height,
+		const char *dir, zval *sink TSRMLS_DC);
+
+static void
+php_epeg_async_job_run(php_epeg_task_t *task);
+
+static void
+php_epeg_async_job_free(php_epeg_async_job_t *job);
+
+static int
+php_epeg_size_fetch(zval *entry, long *width, long *height,
+		char **file, int *file_len TSRMLS_DC);
+
+static int
+php_epeg_pixels_retain(php_epeg_t *im, const php_epeg_params_t *params);
+
+static int
+php_epeg_encode_retained(php_epeg_t *im, php_epeg_output_t *out TSRMLS_DC);
+
+static int
+php_epeg_transform_handle(php_epeg_t *im, php_epeg_output_t *out TSRMLS_DC);
+
+static int
+php_epeg_encode_handle(php_epeg_t *im, zend_bool trim, php_epeg_output_t *out TSRMLS_DC);
+
 /* }}} */
 
 /* {{{ function shortcurs */
@@ -138,8 +343,14 @@ php_epeg_reset(php_epeg_t *im);
 	im = intern->ptr; \
 }
 
-/* expect a parameter */
-#define PHP_EPEG_PARSE_PARAMETER() \
+/* read the data of an image opened from the header cache */
+#define PHP_EPEG_LOAD_IMAGE(im) \
+	if ((im)->data == NULL && php_epeg_load((im) TSRMLS_CC) == FAILURE) { \
+		RETURN_FALSE; \
+	}
+
+/* expect a parameter, the image may be a header only */
+#define PHP_EPEG_FETCH_PARAMETER() \
 	if (obj) { \
 		if (ZEND_NUM_ARGS() != 0) { \
 			WRONG_PARAM_COUNT; \
@@ -152,6 +363,11 @@ php_epeg_reset(php_epeg_t *im);
 		FETCH_IMAGE_FROM_RESOURCE(im, zim); \
 	}
 
+/* expect a parameter */
+#define PHP_EPEG_PARSE_PARAMETER() \
+	PHP_EPEG_FETCH_PARAMETER(); \
+	PHP_EPEG_LOAD_IMAGE(im)
+
 /* expect many parameters */
 #define PHP_EPEG_PARSE_PARAMETERS(fmt, ...) \
 	if (obj) { \
@@ -164,7 +380,8 @@ php_epeg_reset(php_epeg_t *im);
 			return; \
 		} \
 		FETCH_IMAGE_FROM_RESOURCE(im, zim); \
-	}
+	} \
+	PHP_EPEG_LOAD_IMAGE(im)
 
 /* }}} */
 
@@ -192,6 +409,77 @@ ZEND_BEGIN_ARG_INFO(arginfo_epeg__output_m, 0)
 	ZEND_ARG_INFO(0, filename)
 ZEND_END_ARG_INFO()
 
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_encode_multiple, 0, 0, 2)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, sizes)
+	ZEND_ARG_INFO(0, keep_aspect)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_encode_multiple_m, 0, 0, 1)
+	ZEND_ARG_INFO(0, sizes)
+	ZEND_ARG_INFO(0, keep_aspect)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO(arginfo_epeg_tile_pyramid, 0)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, tile_size)
+	ZEND_ARG_INFO(0, overlap)
+	ZEND_ARG_INFO(0, sink)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO(arginfo_epeg_tile_pyramid_m, 0)
+	ZEND_ARG_INFO(0, tile_size)
+	ZEND_ARG_INFO(0, overlap)
+	ZEND_ARG_INFO(0, sink)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_crop_lossless, 0, 0, 5)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, x)
+	ZEND_ARG_INFO(0, y)
+	ZEND_ARG_INFO(0, width)
+	ZEND_ARG_INFO(0, height)
+	ZEND_ARG_INFO(0, filename)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_crop_lossless_m, 0, 0, 4)
+	ZEND_ARG_INFO(0, x)
+	ZEND_ARG_INFO(0, y)
+	ZEND_ARG_INFO(0, width)
+	ZEND_ARG_INFO(0, height)
+	ZEND_ARG_INFO(0, filename)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO(arginfo_epeg_placeholder, 0)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, width)
+	ZEND_ARG_INFO(0, height)
+	ZEND_ARG_INFO(0, format)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO(arginfo_epeg_placeholder_m, 0)
+	ZEND_ARG_INFO(0, width)
+	ZEND_ARG_INFO(0, height)
+	ZEND_ARG_INFO(0, format)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO(arginfo_epeg_jobs_fd, 0)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_jobs_collect, 0, 0, 0)
+	ZEND_ARG_INFO(0, wait)
+ZEND_END_ARG_INFO()
+
 ARG_INFO_STATIC
 ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_thumbnail_create, 0, 0, 4)
 	ZEND_ARG_INFO(0, in_file)
@@ -199,6 +487,16 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_thumbnail_create, 0, 0, 4)
 	ZEND_ARG_INFO(0, max_width)
 	ZEND_ARG_INFO(0, max_height)
 	ZEND_ARG_INFO(0, quality)
+	ZEND_ARG_INFO(0, auto_orient)
+	ZEND_ARG_INFO(0, fit)
+	ZEND_ARG_INFO(1, size)
+	ZEND_ARG_INFO(0, exif_tolerance)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_thumbnail_batch, 0, 0, 1)
+	ZEND_ARG_INFO(0, jobs)
+	ZEND_ARG_INFO(0, threads)
 ZEND_END_ARG_INFO()
 
 ARG_INFO_STATIC
@@ -218,16 +516,29 @@ ZEND_BEGIN_ARG_INFO(arginfo_epeg_memory_open, 0)
 ZEND_END_ARG_INFO()
 
 ARG_INFO_STATIC
-ZEND_BEGIN_ARG_INFO(arginfo_epeg_decode_size_set, 0)
+ZEND_BEGIN_ARG_INFO(arginfo_epeg_probe, 0)
+	ZEND_ARG_INFO(0, filename)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO(arginfo_epeg_memory_get_peak_usage, 0)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_decode_size_set, 0, 0, 3)
 	ZEND_ARG_INFO(0, image)
 	ZEND_ARG_INFO(0, width)
 	ZEND_ARG_INFO(0, height)
+	ZEND_ARG_INFO(0, keep_aspect)
+	ZEND_ARG_INFO(0, fit)
 ZEND_END_ARG_INFO()
 
 ARG_INFO_STATIC
-ZEND_BEGIN_ARG_INFO(arginfo_epeg_decode_size_set_m, 0)
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_decode_size_set_m, 0, 0, 2)
 	ZEND_ARG_INFO(0, width)
 	ZEND_ARG_INFO(0, height)
+	ZEND_ARG_INFO(0, keep_aspect)
+	ZEND_ARG_INFO(0, fit)
 ZEND_END_ARG_INFO()
 
 #ifdef PHP_EPEG_ENABLE_DECODE_BOUNDS_SET
@@ -282,6 +593,19 @@ ZEND_BEGIN_ARG_INFO(arginfo_epeg_quality_set_m, 0)
 	ZEND_ARG_INFO(0, quality)
 ZEND_END_ARG_INFO()
 
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_filter_set, 0, 0, 2)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, filter)
+	ZEND_ARG_INFO(0, sharpen)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_filter_set_m, 0, 0, 1)
+	ZEND_ARG_INFO(0, filter)
+	ZEND_ARG_INFO(0, sharpen)
+ZEND_END_ARG_INFO()
+
 ARG_INFO_STATIC
 ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_thumbnail_comments_enable, 0, 0, 1)
 	ZEND_ARG_INFO(0, image)
@@ -293,6 +617,41 @@ ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_thumbnail_comments_enable_m, 0, 0, 0)
 	ZEND_ARG_INFO(0, onoff)
 ZEND_END_ARG_INFO()
 
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_retained_pixels_enable, 0, 0, 1)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, onoff)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_retained_pixels_enable_m, 0, 0, 0)
+	ZEND_ARG_INFO(0, onoff)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_exif_thumbnail_enable, 0, 0, 1)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, onoff)
+	ZEND_ARG_INFO(0, tolerance)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO_EX(arginfo_epeg_exif_thumbnail_enable_m, 0, 0, 0)
+	ZEND_ARG_INFO(0, onoff)
+	ZEND_ARG_INFO(0, tolerance)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO(arginfo_epeg_transform, 0)
+	ZEND_ARG_INFO(0, image)
+	ZEND_ARG_INFO(0, op)
+ZEND_END_ARG_INFO()
+
+ARG_INFO_STATIC
+ZEND_BEGIN_ARG_INFO(arginfo_epeg_transform_m, 0)
+	ZEND_ARG_INFO(0, op)
+ZEND_END_ARG_INFO()
+
 /* }}} */
 
 /* {{{ Class definitions */
@@ -302,6 +661,7 @@ ZEND_END_ARG_INFO()
 static zend_function_entry epeg_methods[] = {
 	PHP_ME(Epeg, openFile,   arginfo_epeg_file_open,   ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
 	PHP_ME(Epeg, openBuffer, arginfo_epeg_memory_open, ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
+	PHP_ME_MAPPING(probe,                   epeg_probe,                     arginfo_epeg_probe,                         ZEND_ACC_PUBLIC | ZEND_ACC_STATIC)
 	PHP_ME_MAPPING(__construct,             epeg_open,                      arginfo_epeg_open,          ZEND_ACC_CTOR | ZEND_ACC_PUBLIC)
 	PHP_ME_MAPPING(getSize,                 epeg_size_get,                  NULL,                                       ZEND_ACC_PUBLIC)
 	PHP_ME_MAPPING(setDecodeSize,           epeg_decode_size_set,           arginfo_epeg_decode_size_set_m,             ZEND_ACC_PUBLIC)
@@ -312,10 +672,20 @@ static zend_function_entry epeg_methods[] = {
 	PHP_ME_MAPPING(getComment,              epeg_comment_get,               NULL,                                       ZEND_ACC_PUBLIC)
 	PHP_ME_MAPPING(setComment,              epeg_comment_set,               arginfo_epeg_comment_set_m,                 ZEND_ACC_PUBLIC)
 	PHP_ME_MAPPING(setQuality,              epeg_quality_set,               arginfo_epeg_quality_set_m,                 ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(setFilter,               epeg_filter_set,                arginfo_epeg_filter_set_m,                  ZEND_ACC_PUBLIC)
 	PHP_ME_MAPPING(getThumbnailComments,    epeg_thumbnail_comments_get,    NULL,                                       ZEND_ACC_PUBLIC)
 	PHP_ME_MAPPING(enableThumbnailComments, epeg_thumbnail_comments_enable, arginfo_epeg_thumbnail_comments_enable_m,   ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(enableRetainedPixels,    epeg_retained_pixels_enable,    arginfo_epeg_retained_pixels_enable_m,      ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(enableExifThumbnail,     epeg_exif_thumbnail_enable,     arginfo_epeg_exif_thumbnail_enable_m,       ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(transform,               epeg_transform,                 arginfo_epeg_transform_m,                   ZEND_ACC_PUBLIC)
 	PHP_ME_MAPPING(encode,                  epeg_encode,                    arginfo_epeg__output_m,                     ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(encodeMultiple,          epeg_encode_multiple,           arginfo_epeg_encode_multiple_m,             ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(encodeAsync,             epeg_encode_async,              NULL,                                       ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(tilePyramid,             epeg_tile_pyramid,              arginfo_epeg_tile_pyramid_m,                ZEND_ACC_PUBLIC)
 	PHP_ME_MAPPING(trim,                    epeg_trim,                      arginfo_epeg__output_m,                     ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(cropLossless,            epeg_crop_lossless,             arginfo_epeg_crop_lossless_m,               ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(placeholder,             epeg_placeholder,               arginfo_epeg_placeholder_m,                 ZEND_ACC_PUBLIC)
+	PHP_ME_MAPPING(getPixels,               epeg_pixels_get,                NULL,                                       ZEND_ACC_PUBLIC)
 	{ NULL, NULL, NULL }
 };
 /* }}} */
@@ -324,6 +694,7 @@ static zend_function_entry epeg_methods[] = {
 /* {{{ epeg_functions[] */
 static zend_function_entry epeg_functions[] = {
 	PHP_FE(epeg_thumbnail_create,           arginfo_epeg_thumbnail_create)
+	PHP_FE(epeg_thumbnail_batch,            arginfo_epeg_thumbnail_batch)
 	PHP_FE(epeg_open,                       arginfo_epeg_open)
 	PHP_FE(epeg_file_open,                  arginfo_epeg_file_open)
 	PHP_FE(epeg_memory_open,                arginfo_epeg_memory_open)
@@ -336,11 +707,25 @@ static zend_function_entry epeg_functions[] = {
 	PHP_FE(epeg_comment_get,                arginfo_epeg__epeg)
 	PHP_FE(epeg_comment_set,                arginfo_epeg_comment_set)
 	PHP_FE(epeg_quality_set,                arginfo_epeg_quality_set)
+	PHP_FE(epeg_filter_set,                 arginfo_epeg_filter_set)
 	PHP_FE(epeg_thumbnail_comments_get,     arginfo_epeg__epeg)
 	PHP_FE(epeg_thumbnail_comments_enable,  arginfo_epeg_thumbnail_comments_enable)
+	PHP_FE(epeg_retained_pixels_enable,     arginfo_epeg_retained_pixels_enable)
+	PHP_FE(epeg_exif_thumbnail_enable,      arginfo_epeg_exif_thumbnail_enable)
+	PHP_FE(epeg_transform,                  arginfo_epeg_transform)
 	PHP_FE(epeg_encode,                     arginfo_epeg__output)
+	PHP_FE(epeg_encode_multiple,            arginfo_epeg_encode_multiple)
+	PHP_FE(epeg_encode_async,               arginfo_epeg__epeg)
+	PHP_FE(epeg_tile_pyramid,               arginfo_epeg_tile_pyramid)
+	PHP_FE(epeg_jobs_fd,                    arginfo_epeg_jobs_fd)
+	PHP_FE(epeg_jobs_collect,               arginfo_epeg_jobs_collect)
 	PHP_FE(epeg_trim,                       arginfo_epeg__output)
+	PHP_FE(epeg_crop_lossless,              arginfo_epeg_crop_lossless)
+	PHP_FE(epeg_placeholder,                arginfo_epeg_placeholder)
+	PHP_FE(epeg_pixels_get,                 arginfo_epeg__epeg)
 	PHP_FE(epeg_close,                      arginfo_epeg__epeg)
+	PHP_FE(epeg_probe,                      arginfo_epeg_probe)
+	PHP_FE(epeg_memory_get_peak_usage,      arginfo_epeg_memory_get_peak_usage)
 	{ NULL, NULL, NULL }
 };
 /* }}} */
@@ -351,9 +736,9 @@ zend_module_entry epeg_module_entry = {
 	"epeg",
 	epeg_functions,
 	PHP_MINIT(epeg),
-	NULL,
-	NULL,
-	NULL,
+	PHP_MSHUTDOWN(epeg),
+	PHP_RINIT(epeg),
+	PHP_RSHUTDOWN(epeg),
 	PHP_MINFO(epeg),
 	PHP_EPEG_MODULE_VERSION,
 	STANDARD_MODULE_PROPERTIES
@@ -364,17 +749,72 @@ zend_module_entry epeg_module_entry = {
 ZEND_GET_MODULE(epeg)
 #endif
 
+/* {{{ PHP_INI_MH */
+static PHP_INI_MH(OnUpdateEpegMemoryLimit)
+{
+	if (OnUpdateLong(entry, new_value, new_value_length,
+			mh_arg1, mh_arg2, mh_arg3, stage TSRMLS_CC) == FAILURE)
+	{
+		return FAILURE;
+	}
+
+	/* the limit is shared by the whole process, the worker threads cannot read the globals */
+	php_epeg_memory_limit_set((EPEG_G(memory_limit) > 0) ? (size_t)EPEG_G(memory_limit) : 0);
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ ini entries */
+PHP_INI_BEGIN()
+	STD_PHP_INI_ENTRY("epeg.header_cache_entries", "0", PHP_INI_SYSTEM, OnUpdateLong,
+			header_cache_entries, zend_epeg_globals, epeg_globals)
+	STD_PHP_INI_ENTRY("epeg.cache_dir", "", PHP_INI_ALL, OnUpdateString,
+			cache_dir, zend_epeg_globals, epeg_globals)
+	STD_PHP_INI_ENTRY("epeg.cache_size", "0", PHP_INI_ALL, OnUpdateLong,
+			cache_size, zend_epeg_globals, epeg_globals)
+	STD_PHP_INI_ENTRY("epeg.memory_limit", "0", PHP_INI_SYSTEM, OnUpdateEpegMemoryLimit,
+			memory_limit, zend_epeg_globals, epeg_globals)
+	STD_PHP_INI_ENTRY("epeg.stripe_pixels", "16777216", PHP_INI_ALL, OnUpdateLong,
+			stripe_pixels, zend_epeg_globals, epeg_globals)
+	STD_PHP_INI_ENTRY("epeg.parallel_pixels", "4194304", PHP_INI_ALL, OnUpdateLong,
+			parallel_pixels, zend_epeg_globals, epeg_globals)
+PHP_INI_END()
+/* }}} */
+
 #define PHP_EPEG_REGISTER_CONSTANT(name) \
 	REGISTER_LONG_CONSTANT(#name, (long)name, CONST_PERSISTENT | CONST_CS)
 
 #define PHP_EPEG_REGISTER_CLASS_CONSTANT(name) \
 		zend_declare_class_constant_long(ce_Epeg, #name, strlen(#name), (long)EPEG_##name TSRMLS_CC)
 
+#define PHP_EPEG_REGISTER_FILTER_CONSTANT(name) \
+	REGISTER_LONG_CONSTANT("EPEG_FILTER_" #name, (long)PHP_EPEG_FILTER_##name, CONST_PERSISTENT | CONST_CS); \
+	zend_declare_class_constant_long(ce_Epeg, "FILTER_" #name, sizeof("FILTER_" #name) - 1, \
+			(long)PHP_EPEG_FILTER_##name TSRMLS_CC)
+
+#define PHP_EPEG_REGISTER_FIT_CONSTANT(name) \
+	REGISTER_LONG_CONSTANT("EPEG_FIT_" #name, (long)PHP_EPEG_FIT_##name, CONST_PERSISTENT | CONST_CS); \
+	zend_declare_class_constant_long(ce_Epeg, "FIT_" #name, sizeof("FIT_" #name) - 1, \
+			(long)PHP_EPEG_FIT_##name TSRMLS_CC)
+
+#define PHP_EPEG_REGISTER_PLACEHOLDER_CONSTANT(name) \
+	REGISTER_LONG_CONSTANT("EPEG_PLACEHOLDER_" #name, (long)PHP_EPEG_PLACEHOLDER_##name, CONST_PERSISTENT | CONST_CS); \
+	zend_declare_class_constant_long(ce_Epeg, "PLACEHOLDER_" #name, sizeof("PLACEHOLDER_" #name) - 1, \
+			(long)PHP_EPEG_PLACEHOLDER_##name TSRMLS_CC)
+
+#define PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(name) \
+	REGISTER_LONG_CONSTANT("EPEG_TRANSFORM_" #name, (long)PHP_EPEG_TRANSFORM_##name, CONST_PERSISTENT | CONST_CS); \
+	zend_declare_class_constant_long(ce_Epeg, "TRANSFORM_" #name, sizeof("TRANSFORM_" #name) - 1, \
+			(long)PHP_EPEG_TRANSFORM_##name TSRMLS_CC)
+
 /* {{{ PHP_MINIT_FUNCTION */
 static PHP_MINIT_FUNCTION(epeg)
 {
 	zend_class_entry ce;
 
+	ZEND_INIT_MODULE_GLOBALS(epeg, php_epeg_init_globals, php_epeg_destroy_globals);
+	REGISTER_INI_ENTRIES();
+
 	PHP_EPEG_REGISTER_CONSTANT(EPEG_GRAY8);
 	PHP_EPEG_REGISTER_CONSTANT(EPEG_YUV8);
 	PHP_EPEG_REGISTER_CONSTANT(EPEG_RGB8);
@@ -405,6 +845,105 @@ static PHP_MINIT_FUNCTION(epeg)
 	PHP_EPEG_REGISTER_CLASS_CONSTANT(ARGB32);
 	PHP_EPEG_REGISTER_CLASS_CONSTANT(CMYK);
 
+	PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(AUTO);
+	PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(NONE);
+	PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(FLIP_H);
+	PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(FLIP_V);
+	PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(TRANSPOSE);
+	PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(TRANSVERSE);
+	PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(ROT_90);
+	PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(ROT_180);
+	PHP_EPEG_REGISTER_TRANSFORM_CONSTANT(ROT_270);
+
+	PHP_EPEG_REGISTER_FIT_CONSTANT(EXACT);
+	PHP_EPEG_REGISTER_FIT_CONSTANT(FAST);
+	REGISTER_LONG_CONSTANT("EPEG_DECODE_DC_ONLY", (long)PHP_EPEG_DECODE_DC_ONLY, CONST_PERSISTENT | CONST_CS);
+	zend_declare_class_constant_long(ce_Epeg, "DECODE_DC_ONLY", sizeof("DECODE_DC_ONLY") - 1,
+			(long)PHP_EPEG_DECODE_DC_ONLY TSRMLS_CC);
+
+	PHP_EPEG_REGISTER_FILTER_CONSTANT(POINT);
+	PHP_EPEG_REGISTER_FILTER_CONSTANT(BOX);
+	PHP_EPEG_REGISTER_FILTER_CONSTANT(TRIANGLE);
+	PHP_EPEG_REGISTER_FILTER_CONSTANT(LANCZOS3);
+
+	PHP_EPEG_REGISTER_PLACEHOLDER_CONSTANT(RGB);
+	PHP_EPEG_REGISTER_PLACEHOLDER_CONSTANT(BLURHASH);
+	PHP_EPEG_REGISTER_PLACEHOLDER_CONSTANT(COLOR);
+	php_epeg_placeholder_startup();
+
+	/* made before the SAPI forks its workers, so that they share it */
+	if (EPEG_G(header_cache_entries) > 0) {
+		php_epeg_header_cache = php_epeg_header_cache_create(
+				(unsigned long)EPEG_G(header_cache_entries));
+	}
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_MSHUTDOWN_FUNCTION */
+static PHP_MSHUTDOWN_FUNCTION(epeg)
+{
+	if (php_epeg_header_cache != NULL) {
+		php_epeg_header_cache_destroy(php_epeg_header_cache);
+		php_epeg_header_cache = NULL;
+	}
+
+	UNREGISTER_INI_ENTRIES();
+	php_epeg_memory_shutdown();
+
+#ifdef ZTS
+	ts_free_id(epeg_globals_id);
+#else
+	php_epeg_destroy_globals(&epeg_globals);
+#endif
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_RINIT_FUNCTION */
+static PHP_RINIT_FUNCTION(epeg)
+{
+	/* a threaded SAPI shares the counters with the concurrent requests */
+#ifndef ZTS
+	php_epeg_memory_peak_reset();
+#endif
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ PHP_RSHUTDOWN_FUNCTION */
+static PHP_RSHUTDOWN_FUNCTION(epeg)
+{
+	php_epeg_task_t *task;
+
+	php_epeg_jobs_check_fork(TSRMLS_C);
+	if (EPEG_G(pending_jobs) == 0) {
+		return SUCCESS;
+	}
+
+	/* the results of the jobs left are no longer wanted, drop the ones not started */
+	task = php_epeg_pool_cancel(EPEG_G(pool), EPEG_G(queue));
+	while (task != NULL) {
+		php_epeg_task_t *next = task->next;
+		php_epeg_async_job_free((php_epeg_async_job_t *)task);
+		EPEG_G(pending_jobs)--;
+		task = next;
+	}
+
+	/* and wait for the running ones, they still refer to the queue */
+	while (EPEG_G(pending_jobs) > 0) {
+		task = php_epeg_queue_pop_all(EPEG_G(queue), 1);
+		while (task != NULL) {
+			php_epeg_task_t *next = task->next;
+			php_epeg_async_job_free((php_epeg_async_job_t *)task);
+			EPEG_G(pending_jobs)--;
+			task = next;
+		}
+	}
+
 	return SUCCESS;
 }
 /* }}} */
@@ -420,18 +959,216 @@ PHP_MINFO_FUNCTION(epeg)
 #else
 	php_info_print_table_row(2, "Epeg Library Version", "unknown");
 #endif
-	php_info_print_table_end();
+	if (php_epeg_header_cache == NULL) {
+		php_info_print_table_row(2, "Header Cache", "disabled");
+	} else {
+		php_epeg_header_cache_stats_t stats;
+		char buf[64];
+
+		php_epeg_header_cache_stats(php_epeg_header_cache, &stats);
+		php_info_print_table_row(2, "Header Cache", "enabled");
+		snprintf(buf, sizeof(buf), "%lu / %lu", stats.used, stats.capacity);
+		php_info_print_table_row(2, "Header Cache Entries", buf);
+		snprintf(buf, sizeof(buf), "%lu", stats.hits);
+		php_info_print_table_row(2, "Header Cache Hits", buf);
+		snprintf(buf, sizeof(buf), "%lu", stats.misses);
+		php_info_print_table_row(2, "Header Cache Misses", buf);
+		snprintf(buf, sizeof(buf), "%lu", stats.evictions);
+		php_info_print_table_row(2, "Header Cache Evictions", buf);
+	}
+	php_info_print_table_end();
+
+	DISPLAY_INI_ENTRIES();
 }
 /* }}} */
 
 /* {{{ php_epeg_file_open */
 static php_epeg_t *
 php_epeg_file_open(char *file TSRMLS_DC)
+{
+#ifdef PHP_EPEG_USE_HEADER_CACHE
+	php_epeg_header_key_t key;
+	php_epeg_header_t header;
+	php_epeg_t *im = NULL;
+
+	if (php_epeg_header_cache == NULL || !php_epeg_header_key_make(file, &key TSRMLS_CC)) {
+		return php_epeg_file_read(file TSRMLS_CC);
+	}
+
+	/* a hit reads neither the file nor the header */
+	if (php_epeg_header_cache_get(php_epeg_header_cache, &key, &header)) {
+		return php_epeg_header_open(&key, &header);
+	}
+
+	im = php_epeg_file_read(file TSRMLS_CC);
+	if (im != NULL && php_epeg_header_fill(im, &header) == SUCCESS) {
+		php_epeg_header_cache_put(php_epeg_header_cache, &key, &header);
+	}
+	return im;
+#else
+	return php_epeg_file_read(file TSRMLS_CC);
+#endif
+}
+/* }}} */
+
+/* {{{ php_epeg_header_key_make */
+/*
+ * Make the key of a plain local file.
+ * Returns 0 if the file is not a candidate for the caches.
+ */
+static int
+php_epeg_header_key_make(char *file, php_epeg_header_key_t *key TSRMLS_DC)
+{
+	char *path = NULL;
+	char resolved[MAXPATHLEN];
+	struct stat sb;
+
+#if PHP_VERSION_ID < 50400
+	/* the owner of the file would have to be checked on every hit */
+	if (PG(safe_mode)) {
+		return 0;
+	}
+#endif
+
+	/* a cached result must not skip the checks done on opening the file */
+	if (php_stream_locate_url_wrapper(file, &path, 0 TSRMLS_CC) != &php_plain_files_wrapper
+		|| path == NULL || VCWD_REALPATH(path, resolved) == NULL
+		|| php_check_open_basedir_ex(resolved, 0 TSRMLS_CC) != 0
+		|| VCWD_STAT(resolved, &sb) != 0 || !S_ISREG(sb.st_mode)
+		|| strlen(resolved) >= sizeof(key->path))
+	{
+		return 0;
+	}
+
+	memset(key, 0, sizeof(php_epeg_header_key_t));
+	strcpy(key->path, resolved);
+	key->inode = (unsigned long long)sb.st_ino;
+	key->size = (unsigned long long)sb.st_size;
+	key->mtime = (long long)sb.st_mtime;
+	key->ctime = (long long)sb.st_ctime;
+#if defined(HAVE_STRUCT_STAT_ST_MTIM_TV_NSEC)
+	key->mtime_nsec = (long)sb.st_mtim.tv_nsec;
+	key->ctime_nsec = (long)sb.st_ctim.tv_nsec;
+#elif defined(HAVE_STRUCT_STAT_ST_MTIMESPEC_TV_NSEC)
+	key->mtime_nsec = (long)sb.st_mtimespec.tv_nsec;
+	key->ctime_nsec = (long)sb.st_ctimespec.tv_nsec;
+#endif
+	return 1;
+}
+/* }}} */
+
+#ifdef PHP_EPEG_USE_HEADER_CACHE
+
+/* {{{ php_epeg_header_fill */
+/*
+ * Copy what the header getters return from an open image.
+ * Fails if a string is too long to be cached.
+ */
+static int
+php_epeg_header_fill(php_epeg_t *im, php_epeg_header_t *header)
+{
+	const char *comment = NULL;
+	Epeg_Thumbnail_Info info = {0};
+
+	memset(header, 0, sizeof(php_epeg_header_t));
+	header->width = im->width;
+	header->height = im->height;
+
+	comment = epeg_comment_get(im->ptr);
+	if (comment != NULL) {
+		if (strlen(comment) >= sizeof(header->comment)) {
+			return FAILURE;
+		}
+		header->has_comment = 1;
+		strcpy(header->comment, comment);
+	}
+
+	epeg_thumbnail_comments_get(im->ptr, &info);
+	if (info.uri != NULL) {
+		if (strlen(info.uri) >= sizeof(header->uri)) {
+			return FAILURE;
+		}
+		header->has_uri = 1;
+		strcpy(header->uri, info.uri);
+	}
+	header->mtime = (unsigned long long)info.mtime;
+	header->thumb_width = info.w;
+	header->thumb_height = info.h;
+	if (info.mimetype != NULL) {
+		if (strlen(info.mimetype) >= sizeof(header->mimetype)) {
+			return FAILURE;
+		}
+		header->has_mimetype = 1;
+		strcpy(header->mimetype, info.mimetype);
+	}
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_header_open */
+/*
+ * Make a handle from a cached header, php_epeg_load() reads the file
+ * when anything but the header is wanted.
+ */
+static php_epeg_t *
+php_epeg_header_open(const php_epeg_header_key_t *key, const php_epeg_header_t *header)
+{
+	php_epeg_t *im = NULL;
+
+	im = (php_epeg_t *)ecalloc(1, sizeof(php_epeg_t));
+	im->quality = -1;
+	im->colorspace = PHP_EPEG_COLORSPACE_AUTO;
+	im->path = estrdup(key->path);
+	im->header = (php_epeg_header_t *)emalloc(sizeof(php_epeg_header_t));
+	memcpy(im->header, header, sizeof(php_epeg_header_t));
+	im->width = header->width;
+	im->height = header->height;
+
+	return im;
+}
+/* }}} */
+#endif
+
+/* {{{ php_epeg_load */
+static int
+php_epeg_load(php_epeg_t *im TSRMLS_DC)
+{
+	php_epeg_t *tmp = NULL;
+
+	tmp = php_epeg_file_read(im->path TSRMLS_CC);
+	if (tmp == NULL) {
+		return FAILURE;
+	}
+
+	/* take over the data, the settings of the handle are kept */
+	im->ptr = tmp->ptr;
+	im->data = tmp->data;
+	im->size = tmp->size;
+	im->data_type = tmp->data_type;
+	im->zdata = tmp->zdata;
+	im->width = tmp->width;
+	im->height = tmp->height;
+	tmp->ptr = NULL;
+	tmp->data = NULL;
+	php_epeg_free(tmp);
+
+	efree(im->path);
+	im->path = NULL;
+	efree(im->header);
+	im->header = NULL;
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_file_read */
+static php_epeg_t *
+php_epeg_file_read(char *file TSRMLS_DC)
 {
 	php_stream *sth = NULL;
 	char *data = NULL;
 	int data_len = 0;
-	php_epeg_t *im = NULL;
 
 	/* open stream for reading */
 	sth = php_stream_open_wrapper(file, "rb",
@@ -440,7 +1177,12 @@ php_epeg_file_open(char *file TSRMLS_DC)
 		return NULL;
 	}
 
-	/* copy image data to the buffer */
+	/*
+	 * copy image data to the buffer whatever the stream is, a handle is
+	 * decoded again on every encode after php_epeg_reset(), and hashed or
+	 * copied by the cache and the jobs, which a stream read once cannot
+	 * give. A mapping would fault if the file was truncated meanwhile.
+	 */
 	data_len = php_stream_copy_to_mem(sth, &data, PHP_STREAM_COPY_ALL, 0);
 
 	/* close the input stream */
@@ -450,28 +1192,50 @@ php_epeg_file_open(char *file TSRMLS_DC)
 		return NULL;
 	}
 
-	/* open the JPEG image stored in the buffer */
-	im = php_epeg_memory_open(data, data_len TSRMLS_CC);
-
-	/* free the buffer */
-	efree(data);
-
-	/* return Epeg image handle (or NULL) */
-	return im;
+	/* open the JPEG image stored in the buffer, the handle takes over the buffer */
+	return php_epeg_data_open((unsigned char *)data, data_len, PHP_EPEG_DATA_EMALLOC, NULL TSRMLS_CC);
 }
 /* }}} */
 
 /* {{{ php_epeg_memory_open */
 static php_epeg_t *
 php_epeg_memory_open(char *data, int data_len TSRMLS_DC)
+{
+	return php_epeg_data_open((unsigned char *)estrndup(data, data_len),
+			data_len, PHP_EPEG_DATA_EMALLOC, NULL TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ php_epeg_zval_open */
+static php_epeg_t *
+php_epeg_zval_open(zval *zdata TSRMLS_DC)
+{
+	/* a reference may be modified in place, so it cannot be borrowed */
+	if (PZVAL_IS_REF(zdata)) {
+		return php_epeg_memory_open(Z_STRVAL_P(zdata), Z_STRLEN_P(zdata) TSRMLS_CC);
+	}
+
+	/* keep the string alive while the handle points to it */
+	Z_ADDREF_P(zdata);
+	return php_epeg_data_open((unsigned char *)Z_STRVAL_P(zdata),
+			Z_STRLEN_P(zdata), PHP_EPEG_DATA_ZVAL, zdata TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ php_epeg_data_open */
+static php_epeg_t *
+php_epeg_data_open(unsigned char *data, int data_len, int data_type, zval *zdata TSRMLS_DC)
 {
 	php_epeg_t *im = NULL;
 
 	/* initialize */
 	im = (php_epeg_t *)ecalloc(1, sizeof(php_epeg_t));
-	im->data = (unsigned char *)estrndup(data, data_len);
+	im->data = data;
 	im->size = data_len;
+	im->data_type = data_type;
+	im->zdata = zdata;
 	im->quality = -1;
+	im->colorspace = PHP_EPEG_COLORSPACE_AUTO;
 
 	/* open the JPEG image stored in the buffer */
 	im->ptr = epeg_memory_open(im->data, im->size);
@@ -489,6 +1253,146 @@ php_epeg_memory_open(char *data, int data_len TSRMLS_DC)
 }
 /* }}} */
 
+#ifdef PHP_EPEG_USE_MMAP
+/* {{{ php_epeg_stream_mmap */
+static unsigned char *
+php_epeg_stream_mmap(php_stream *sth, int *data_len TSRMLS_DC)
+{
+	int fd = -1;
+	struct stat sb;
+	void *map;
+
+	/* only plain files can be mapped */
+	if (!php_stream_is(sth, PHP_STREAM_IS_STDIO)
+		|| php_stream_can_cast(sth, PHP_STREAM_AS_FD) != SUCCESS
+		|| php_stream_cast(sth, PHP_STREAM_AS_FD, (void **)&fd, 0) != SUCCESS)
+	{
+		return NULL;
+	}
+
+	/* empty and huge files are left to the buffered path */
+	if (fstat(fd, &sb) != 0 || !S_ISREG(sb.st_mode)
+		|| sb.st_size <= 0 || sb.st_size > (off_t)INT_MAX)
+	{
+		return NULL;
+	}
+
+	map = mmap(NULL, (size_t)sb.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+#ifdef MADV_SEQUENTIAL
+	/* libjpeg reads the data from head to tail */
+	(void)madvise(map, (size_t)sb.st_size, MADV_SEQUENTIAL);
+#endif
+
+	*data_len = (int)sb.st_size;
+	return (unsigned char *)map;
+}
+/* }}} */
+#endif
+
+/* {{{ php_epeg_data_free */
+static void
+php_epeg_data_free(php_epeg_t *im)
+{
+	switch (im->data_type) {
+	  case PHP_EPEG_DATA_ZVAL:
+		zval_ptr_dtor(&im->zdata);
+		break;
+	  default:
+		efree(im->data);
+	}
+	im->data = NULL;
+}
+/* }}} */
+
+/* {{{ php_epeg_input_open */
+static php_epeg_decoder_t *
+php_epeg_input_open(char *file, php_epeg_input_t *in TSRMLS_DC)
+{
+	php_epeg_decoder_t *dec = NULL;
+
+	memset(in, 0, sizeof(php_epeg_input_t));
+
+	/* open stream for reading */
+	in->stream = php_stream_open_wrapper(file, "rb",
+			ENFORCE_SAFE_MODE | IGNORE_PATH | REPORT_ERRORS, NULL);
+	if (!in->stream) {
+		return NULL;
+	}
+
+#ifdef PHP_EPEG_USE_MMAP
+	/* map a plain file, the mapping outlives the stream */
+	in->data = php_epeg_stream_mmap(in->stream, &in->data_len TSRMLS_CC);
+	if (in->data != NULL) {
+		in->mapped = 1;
+		php_stream_close(in->stream);
+		in->stream = NULL;
+		dec = php_epeg_decoder_open_memory(in->data, (size_t)in->data_len);
+	} else
+#endif
+	{
+		/* the decoder pulls chunks from the stream as it goes */
+		dec = php_epeg_decoder_open_stream(in->stream, &in->head TSRMLS_CC);
+		if (dec == NULL && in->head.len == 0) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Cannot read image data");
+			php_epeg_input_close(in TSRMLS_CC);
+			return NULL;
+		}
+	}
+
+	if (dec == NULL) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Not a valid JPEG data");
+		php_epeg_input_close(in TSRMLS_CC);
+	}
+
+	return dec;
+}
+/* }}} */
+
+/* {{{ php_epeg_input_read_all */
+static int
+php_epeg_input_read_all(php_epeg_input_t *in TSRMLS_DC)
+{
+	char buf[PHP_EPEG_STREAM_CHUNK_SIZE];
+	size_t n;
+
+	if (in->mapped) {
+		return SUCCESS;
+	}
+
+	/* the bytes consumed by the header parser are already in head */
+	while ((n = php_stream_read(in->stream, buf, sizeof(buf))) > 0) {
+		smart_str_appendl(&in->head, buf, n);
+	}
+	if (in->head.len > (size_t)INT_MAX) {
+		return FAILURE;
+	}
+	in->data = (unsigned char *)in->head.c;
+	in->data_len = (int)in->head.len;
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_input_close */
+static void
+php_epeg_input_close(php_epeg_input_t *in TSRMLS_DC)
+{
+#ifdef PHP_EPEG_USE_MMAP
+	if (in->mapped) {
+		(void)munmap((void *)in->data, (size_t)in->data_len);
+	}
+#endif
+	if (in->stream) {
+		php_stream_close(in->stream);
+	}
+	smart_str_free(&in->head);
+	memset(in, 0, sizeof(php_epeg_input_t));
+}
+/* }}} */
+
 /* {{{ php_epeg_open_wrapper */
 static void
 php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAMETERS, int mode)
@@ -496,16 +1400,18 @@ php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAMETERS, int mode)
 	/* declaration of the arguments */
 	char *str = NULL;
 	int str_len = 0;
+	zval **zdata = NULL;
 
 	/* declaration of the local variables */
 	php_epeg_t *im = NULL;
 
 	/* parse the arguments and open the JPEG image */
 	if (mode & EO_FROM_BUFFER) {
-		if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "S", &str, &str_len) == FAILURE) {
+		if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Z", &zdata) == FAILURE) {
 			RETURN_FALSE;
 		}
-		im = php_epeg_memory_open(str, str_len TSRMLS_CC);
+		convert_to_string_ex(zdata);
+		im = php_epeg_zval_open(*zdata TSRMLS_CC);
 	} else {
 		if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &str, &str_len) == FAILURE) {
 			RETURN_FALSE;
@@ -528,26 +1434,147 @@ php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAMETERS, int mode)
 }
 /* }}} */
 
+/* {{{ php_epeg_stream_read_all */
+static int
+php_epeg_stream_read_all(php_stream *sth, unsigned char *buf, size_t len TSRMLS_DC)
+{
+	while (len > 0) {
+		size_t n = php_stream_read(sth, (char *)buf, len);
+		if (n == 0) {
+			return FAILURE;
+		}
+		buf += n;
+		len -= n;
+	}
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_probe_stream */
+static int
+php_epeg_probe_stream(php_stream *sth, php_epeg_probe_t *info TSRMLS_DC)
+{
+	unsigned char buf[6 + 3 * 255];
+	long pos = 0;
+	zend_bool have_sof = 0;
+
+	memset(info, 0, sizeof(php_epeg_probe_t));
+
+	/* check for SOI (Start Of Image Segment) marker */
+	if (php_epeg_stream_read_all(sth, buf, 2 TSRMLS_CC) == FAILURE
+		|| buf[0] != 0xFF || buf[1] != 0xD8)
+	{
+		return FAILURE;
+	}
+	pos = 2;
+
+	/* walk the markers up to SOS, segment bodies are skipped unread */
+	while (1) {
+		long marker_pos = pos;
+		int c, marker;
+		size_t field_len;
+
+		if ((c = php_stream_getc(sth)) != 0xFF) {
+			return FAILURE;
+		}
+		pos++;
+		/* skip padding */
+		do {
+			c = php_stream_getc(sth);
+			pos++;
+		} while (c == 0xFF);
+		if (c == EOF) {
+			return FAILURE;
+		}
+		marker = c;
+
+		/* standalone markers: TEM, RST[0-7] */
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7)) {
+			continue;
+		}
+		/* EOI before SOS */
+		if (marker == 0xD9) {
+			return FAILURE;
+		}
+
+		if (php_epeg_stream_read_all(sth, buf, 2 TSRMLS_CC) == FAILURE) {
+			return FAILURE;
+		}
+		field_len = (((size_t)buf[0]) << 8) | (size_t)buf[1];
+		if (field_len < 2) {
+			return FAILURE;
+		}
+		pos += 2;
+		field_len -= 2;
+
+		if (marker == 0xDA) {
+			/* SOS (Start Of Scan), the entropy-coded data follows */
+			if (!have_sof) {
+				return FAILURE;
+			}
+			info->sos_offset = marker_pos;
+			return SUCCESS;
+		} else if (marker >= 0xC0 && marker <= 0xCF
+			&& marker != 0xC4 && marker != 0xC8 && marker != 0xCC)
+		{
+			/* SOF[0-15] (Start Of Frame), except DHT, JPG and DAC */
+			int i;
+
+			if (field_len < 6 || field_len > sizeof(buf)
+				|| php_epeg_stream_read_all(sth, buf, field_len TSRMLS_CC) == FAILURE)
+			{
+				return FAILURE;
+			}
+			info->precision = (int)buf[0];
+			info->height = ((int)buf[1] << 8) | (int)buf[2];
+			info->width = ((int)buf[3] << 8) | (int)buf[4];
+			info->components = (int)buf[5];
+			if (field_len < 6 + 3 * (size_t)info->components) {
+				return FAILURE;
+			}
+			for (i = 0; i < info->components && i < PHP_EPEG_PROBE_MAX_COMPONENTS; i++) {
+				info->h_samp[i] = (int)(buf[7 + 3 * i] >> 4);
+				info->v_samp[i] = (int)(buf[7 + 3 * i] & 0x0F);
+			}
+			info->progressive = (marker == 0xC2 || marker == 0xC6
+					|| marker == 0xCA || marker == 0xCE);
+			have_sof = 1;
+		} else if (php_stream_seek(sth, (off_t)field_len, SEEK_CUR) != 0) {
+			return FAILURE;
+		}
+		pos += (long)field_len;
+	}
+}
+/* }}} */
+
 /* {{{ php_epeg_set_retval */
+/*
+ * buf must be allocated by emalloc() and be terminated by NUL,
+ * it is either passed to retval or released.
+ */
 static void
 php_epeg_set_retval(unsigned char *buf, int buf_len,
 		char *file, int file_len, zval *retval TSRMLS_DC)
 {
 	/* if the output is an empty string, the content of the thubmnail is returned */
 	if (file_len == 0) {
-		/* set return value to the content of the thumbnail */
-		ZVAL_STRINGL(retval, (char *)buf, buf_len, 1);
+		/* set return value to the content of the thumbnail without copying */
+		ZVAL_STRINGL(retval, (char *)buf, buf_len, 0);
 	} else {
 		/* open stream for writing */
 		php_stream *sth = NULL;
-		sth = php_stream_open_wrapper(file, "wb",
-				ENFORCE_SAFE_MODE | IGNORE_PATH | REPORT_ERRORS, NULL);
+		char *path, *tmp_path;
+		sth = php_epeg_file_stream_open(file, NULL, &path, &tmp_path TSRMLS_CC);
 		if (!sth) {
 			/* set return value to false */
 			ZVAL_FALSE(retval);
 		} else {
-			int expected_written_len = buf_len;
-			if (expected_written_len != php_stream_write(sth, (char *)buf, buf_len)) {
+			int written = (buf_len == php_stream_write(sth, (char *)buf, buf_len));
+			/* close the output stream */
+			if (php_epeg_file_stream_close(sth, path, tmp_path, written TSRMLS_CC) == FAILURE) {
+				/* set return value to false */
+				ZVAL_FALSE(retval);
+			} else if (!written) {
 				php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to write image data to stream");
 				/* set return value to false */
 				ZVAL_FALSE(retval);
@@ -555,57 +1582,308 @@ php_epeg_set_retval(unsigned char *buf, int buf_len,
 				/* set return value to true */
 				ZVAL_TRUE(retval);
 			}
-			/* close the output stream */
-			php_stream_close(sth);
 		}
+		efree(buf);
 	}
 }
 /* }}} */
 
-/* {{{ php_epeg_encode_error */
-static void
-php_epeg_encode_error(int errcode TSRMLS_DC)
+/* {{{ php_epeg_file_stream_open */
+/*
+ * Open a stream to write an image to file. If file is the plain file src
+ * which is still being read, it is not opened itself, a temporary file
+ * beside it is written instead and renamed over it by
+ * php_epeg_file_stream_close(), so the source is not truncated under the
+ * decoder. *path and *tmp_path are set to the emalloc()'d paths of the
+ * file and the temporary file in that case, or to NULL otherwise.
+ */
+static php_stream *
+php_epeg_file_stream_open(char *file, char *src, char **path, char **tmp_path TSRMLS_DC)
 {
-	switch (errcode) {
-	  case 3:
-	  case 4:
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode image");
-		break;
-	  case 1:
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to scale image");
-		break;
-	  case 2:
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to encode image");
-		break;
-	  default:
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Unknown error");
+	php_stream *sth = NULL;
+	char *plain = NULL, *src_plain = NULL;
+	char resolved[MAXPATHLEN];
+	struct stat sb, src_sb;
+	int fd = -1;
+
+	*path = NULL;
+	*tmp_path = NULL;
+
+	/* anything but the source itself is written in place */
+	if (src == NULL
+		|| php_stream_locate_url_wrapper(file, &plain, 0 TSRMLS_CC) != &php_plain_files_wrapper
+		|| php_stream_locate_url_wrapper(src, &src_plain, 0 TSRMLS_CC) != &php_plain_files_wrapper
+		|| plain == NULL || src_plain == NULL
+		|| VCWD_STAT(plain, &sb) != 0 || !S_ISREG(sb.st_mode)
+		|| VCWD_STAT(src_plain, &src_sb) != 0
+		|| sb.st_dev != src_sb.st_dev || sb.st_ino != src_sb.st_ino)
+	{
+		return php_stream_open_wrapper(file, "wb",
+				ENFORCE_SAFE_MODE | IGNORE_PATH | REPORT_ERRORS, NULL);
 	}
-}
-/* }}} */
 
-/* {{{ php_epeg_trim_error */
-static void
-php_epeg_trim_error(int errcode TSRMLS_DC)
-{
-	switch (errcode) {
-	  case 1:
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to trim image");
-		break;
-	  default:
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Unknown error");
+	/* replace the file which a symbolic link points to, not the link */
+	*path = estrdup((VCWD_REALPATH(plain, resolved) != NULL) ? resolved : plain);
+	spprintf(tmp_path, 0, "%s.%08lx.tmp", *path,
+			(unsigned long)(php_combined_lcg(TSRMLS_C) * 0xFFFFFFFFUL));
+	sth = php_stream_open_wrapper(*tmp_path, "xb",
+			ENFORCE_SAFE_MODE | IGNORE_PATH | REPORT_ERRORS, NULL);
+	if (!sth) {
+		efree(*path);
+		efree(*tmp_path);
+		*path = NULL;
+		*tmp_path = NULL;
+		return NULL;
+	}
+
+#ifndef PHP_WIN32
+	/* keep the owner and the permissions of the file */
+	if (php_stream_cast(sth, PHP_STREAM_AS_FD, (void **)&fd, 0) == SUCCESS) {
+		(void)!fchown(fd, sb.st_uid, sb.st_gid);
+		(void)fchmod(fd, sb.st_mode & 07777);
 	}
+#endif
+
+	return sth;
 }
 /* }}} */
 
-/* {{{ php_epeg_free_resource */
-static void
-php_epeg_free_resource(zend_rsrc_list_entry *rsrc TSRMLS_DC)
+/* {{{ php_epeg_file_stream_close */
+/*
+ * Close a stream of php_epeg_file_stream_open(). If ok is set the
+ * temporary file replaces the file, otherwise it is removed.
+ * Returns FAILURE if the file could not be replaced.
+ */
+static int
+php_epeg_file_stream_close(php_stream *sth, char *path, char *tmp_path, int ok TSRMLS_DC)
 {
-	php_epeg_free((php_epeg_t *)(rsrc->ptr));
+	int result = SUCCESS;
+
+	php_stream_close(sth);
+	if (tmp_path == NULL) {
+		return SUCCESS;
+	}
+	if (ok && VCWD_RENAME(tmp_path, path) != 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Cannot replace '%s'", path);
+		ok = 0;
+		result = FAILURE;
+	}
+	if (!ok) {
+		(void)VCWD_UNLINK(tmp_path);
+	}
+	efree(tmp_path);
+	efree(path);
+
+	return result;
 }
 /* }}} */
 
-/* {{{ php_epeg_free */
+/* {{{ php_epeg_output_open */
+/*
+ * Set the output to the stream of file, or to a Zend string
+ * if file is an empty string. src is the file still being read, if any,
+ * see php_epeg_file_stream_open().
+ */
+static int
+php_epeg_output_open(php_epeg_output_t *out, char *file, int file_len, char *src TSRMLS_DC)
+{
+	php_stream *sth = NULL;
+	char *path, *tmp_path;
+
+	if (file_len == 0) {
+		php_epeg_output_init(out, php_epeg_erealloc, php_epeg_efree);
+		return SUCCESS;
+	}
+
+	/* open stream for writing */
+	sth = php_epeg_file_stream_open(file, src, &path, &tmp_path TSRMLS_CC);
+	if (!sth) {
+		return FAILURE;
+	}
+	php_epeg_output_init_stream(out, sth TSRMLS_CC);
+	out->path = path;
+	out->tmp_path = tmp_path;
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_output_close */
+/*
+ * Set retval by the result of the encoder like php_epeg_set_retval(),
+ * and close the output stream. FAILURE is returned if the caller has to
+ * raise the error for the result.
+ */
+static int
+php_epeg_output_close(php_epeg_output_t *out, int result, zval *retval TSRMLS_DC)
+{
+	if (out->stream != NULL) {
+		/* close the output stream, the source is replaced only by a complete image */
+		int replaced = php_epeg_file_stream_close(out->stream, out->path, out->tmp_path,
+				!out->write_error && result == 0 TSRMLS_CC);
+		out->stream = NULL;
+		out->path = NULL;
+		out->tmp_path = NULL;
+		if (replaced == FAILURE) {
+			ZVAL_FALSE(retval);
+			return SUCCESS;
+		}
+		if (out->write_error) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to write image data to stream");
+			ZVAL_FALSE(retval);
+			return SUCCESS;
+		}
+		if (result != 0) {
+			ZVAL_FALSE(retval);
+			return FAILURE;
+		}
+		/* set return value to true */
+		ZVAL_TRUE(retval);
+	} else {
+		if (result != 0) {
+			ZVAL_FALSE(retval);
+			return FAILURE;
+		}
+		/* set return value to the content of the thumbnail without copying */
+		ZVAL_STRINGL(retval, (char *)out->buf, (int)out->len, 0);
+		out->buf = NULL;
+	}
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_outputs_discard */
+static void
+php_epeg_outputs_discard(php_epeg_output_t *outs, int count TSRMLS_DC)
+{
+	int k;
+
+	for (k = 0; k < count; k++) {
+		if (outs[k].stream != NULL) {
+			(void)php_epeg_file_stream_close(outs[k].stream, outs[k].path, outs[k].tmp_path, 0 TSRMLS_CC);
+			outs[k].stream = NULL;
+			outs[k].path = NULL;
+			outs[k].tmp_path = NULL;
+		}
+		php_epeg_output_free(&outs[k]);
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_erealloc */
+/*
+ * Grow an output buffer, or return NULL if it would exceed memory_limit.
+ * erealloc() would bail out past the cleanups of the codec instead of
+ * letting the destination manager raise the error.
+ */
+static void *
+php_epeg_erealloc(void *ptr, size_t size)
+{
+	TSRMLS_FETCH();
+
+	/* the old block is still in use while the new one is allocated */
+	if (PG(memory_limit) > 0) {
+		size_t usage = zend_memory_usage(0 TSRMLS_CC);
+		if (usage > (size_t)PG(memory_limit) || size > (size_t)PG(memory_limit) - usage) {
+			return NULL;
+		}
+	}
+
+	return erealloc(ptr, size);
+}
+/* }}} */
+
+/* {{{ php_epeg_efree */
+static void
+php_epeg_efree(void *ptr)
+{
+	efree(ptr);
+}
+/* }}} */
+
+/* {{{ php_epeg_error_string */
+static const char *
+php_epeg_error_string(int errcode)
+{
+	switch (errcode) {
+	  case 3:
+	  case PHP_EPEG_ERROR_DECODE:
+		return "Failed to decode image";
+	  case PHP_EPEG_ERROR_SCALE:
+		return "Failed to scale image";
+	  case PHP_EPEG_ERROR_ENCODE:
+		return "Failed to encode image";
+	  case PHP_EPEG_ERROR_OPEN:
+		return "Not a valid JPEG data";
+	  case PHP_EPEG_ERROR_STRUCTURE:
+		return "Invalid data structure";
+	  case PHP_EPEG_ERROR_READ:
+		return "Cannot read image data";
+	  case PHP_EPEG_ERROR_WRITE:
+		return "Failed to write image data to stream";
+	  case PHP_EPEG_ERROR_ARGS:
+		return "Invalid job parameters";
+	  default:
+		return "Unknown error";
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_encode_error */
+static void
+php_epeg_encode_error(int errcode TSRMLS_DC)
+{
+	if (php_epeg_memory_exhausted_get()) {
+		php_epeg_memory_error(TSRMLS_C);
+		return;
+	}
+	php_error_docref(NULL TSRMLS_CC, E_WARNING, "%s", php_epeg_error_string(errcode));
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_error */
+static void
+php_epeg_memory_error(TSRMLS_D)
+{
+	php_error_docref(NULL TSRMLS_CC, E_WARNING,
+			"Allowed memory size of %ld bytes for the JPEG codec exhausted", EPEG_G(memory_limit));
+}
+/* }}} */
+
+/* {{{ php_epeg_trim_error */
+static void
+php_epeg_trim_error(int errcode TSRMLS_DC)
+{
+	if (php_epeg_memory_exhausted_get()) {
+		php_epeg_memory_error(TSRMLS_C);
+		return;
+	}
+	switch (errcode) {
+	  case PHP_EPEG_ERROR_SCALE:
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to trim image");
+		break;
+	  case PHP_EPEG_ERROR_ENCODE:
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to encode image");
+		break;
+	  case PHP_EPEG_ERROR_DECODE:
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to decode image");
+		break;
+	  default:
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Unknown error");
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_free_resource */
+static void
+php_epeg_free_resource(zend_rsrc_list_entry *rsrc TSRMLS_DC)
+{
+	php_epeg_free((php_epeg_t *)(rsrc->ptr));
+}
+/* }}} */
+
+/* {{{ php_epeg_free */
 static void
 php_epeg_free(php_epeg_t *im)
 {
@@ -613,8 +1891,18 @@ php_epeg_free(php_epeg_t *im)
 		epeg_close(im->ptr);
 	}
 	if (im->data != NULL) {
-		efree(im->data);
+		php_epeg_data_free(im);
+	}
+	if (im->comment != NULL) {
+		efree(im->comment);
 	}
+	if (im->path != NULL) {
+		efree(im->path);
+	}
+	if (im->header != NULL) {
+		efree(im->header);
+	}
+	php_epeg_pixels_free(&im->pixels);
 	efree(im);
 }
 /* }}} */
@@ -706,411 +1994,2512 @@ php_epeg_calc_thumb_size(
 }
 /* }}} */
 
-/* {{{ php_epeg_reset */
+/* {{{ php_epeg_fit_fast */
+/*
+ * Snap the size to the nearest size the decoder makes by itself,
+ * the source scaled by 1/1, 1/2, 1/4 or 1/8 in the DCT domain.
+ * The size is kept if none is within PHP_EPEG_FIT_FAST_TOLERANCE of it.
+ */
 static void
-php_epeg_reset(php_epeg_t *im)
+php_epeg_fit_fast(int src_width, int src_height, int *width, int *height)
 {
-	epeg_close(im->ptr);
-	im->ptr = epeg_memory_open(im->data, im->size);
+	double best = PHP_EPEG_FIT_FAST_TOLERANCE;
+	int scale, fit_width = 0, fit_height = 0;
 
-	if (im->quality != -1) {
-		epeg_quality_set(im->ptr, im->quality);
+	if (*width < 1 || *height < 1) {
+		return;
+	}
+
+	/* prefer the smaller one on a tie, it is cheaper to decode */
+	for (scale = 8; scale >= 1; scale >>= 1) {
+		int w = (src_width + scale - 1) / scale;
+		int h = (src_height + scale - 1) / scale;
+		double dw = fabs((double)(w - *width)) / (double)*width;
+		double dh = fabs((double)(h - *height)) / (double)*height;
+		double d = (dw > dh) ? dw : dh;
+
+		if (d <= best && (fit_width == 0 || d < best)) {
+			best = d;
+			fit_width = w;
+			fit_height = h;
+		}
+	}
+
+	if (fit_width > 0) {
+		*width = fit_width;
+		*height = fit_height;
 	}
 }
 /* }}} */
 
-/* {{{ proto mixed epeg_thumbnail_create(string in_file, string out_file, int max_width, int max_height[, int quality]) */
-/**
- * bool|string epeg_thumbnail(string in_file, string out_file, int max_width, int max_height[, int quality])
- *
- * Create thumbnail using the Epeg library.
- * This function can be used for only JPEG image.
- *
- * @param	string	$in_file	The pathname or the URL of the source image.
- * @param	string	$out_file	The pathname or the URL of the thumbnail.
- * @param	int	$max_width	The maximum width of the thumbnail.
- *							The value must be greater than 0.
- * @param	int	$max_height	The maximum height of the thumbnail.
- *							The value must be greater than 0.
- * @param	int	$quality	The quality of the thumbnail. (optional)
- *							The value must be greater than or equal to 0
- *							and must be less than or equal to 100.
- *							The default is 75.
- * @return	mixed	False is returned if failed to create the thumbnail.
- *					True is returned if succeeded in creating and writing the thumbnail.
- *					If $out_file is an empty string and succeeded in creating
- *					the thumbnail, the content of the thumbnail is returned.
+/* {{{ php_epeg_fit_dc */
+/*
+ * Shrink the size into the image made of the DC coefficients,
+ * 1/8 of the source rounded up, keeping the aspect ratio of the size.
  */
-static PHP_FUNCTION(epeg_thumbnail_create)
+static void
+php_epeg_fit_dc(int src_width, int src_height, int *width, int *height)
 {
-	/* declaration of the arguments */
-	char *in_file = NULL;
-	int in_file_len = 0;
-	char *out_file = NULL;
-	int out_file_len = 0;
-	long max_width = 0;
-	long max_height = 0;
-	long quality = 75;
+	int dc_width = (src_width + 7) / 8;
+	int dc_height = (src_height + 7) / 8;
+	double ratio;
 
-	/* declaration of the local variables */
-	php_epeg_t *im = NULL;
-	php_stream *sth = NULL;
-	char *in_buf;
-	unsigned char *out_buf;
-	int in_buf_len, out_buf_len;
-	zend_bool out_buf_free_stdc = 0; /* use free() */
-	zend_bool out_buf_free_zend = 0; /* use efree() */
+	if (*width <= dc_width && *height <= dc_height) {
+		return;
+	}
+	ratio = MIN((double)dc_width / (double)*width, (double)dc_height / (double)*height);
+	*width = MAX(1, MIN(dc_width, round_to_i((double)*width * ratio)));
+	*height = MAX(1, MIN(dc_height, round_to_i((double)*height * ratio)));
+}
+/* }}} */
 
-	/* parse the arguments */
-	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ssll|l",
-			&in_file, &in_file_len, &out_file, &out_file_len,
-			&max_width, &max_height, &quality) == FAILURE)
-	{
-		RETURN_FALSE;
+/* {{{ php_epeg_size_array */
+/*
+ * Make zv an array of the size, the same as epeg_size_get() returns.
+ */
+static void
+php_epeg_size_array(zval *zv, int width, int height)
+{
+	array_init(zv);
+	add_index_long(zv, 0, (long)width);
+	add_index_long(zv, 1, (long)height);
+	add_assoc_long(zv, "width", (long)width);
+	add_assoc_long(zv, "height", (long)height);
+}
+/* }}} */
+
+/* {{{ php_epeg_reset */
+static void
+php_epeg_reset(php_epeg_t *im)
+{
+	/* only the quality is kept, as the Epeg library used to be re-opened here */
+	im->colorspace = PHP_EPEG_COLORSPACE_AUTO;
+	if (im->comment != NULL) {
+		efree(im->comment);
+		im->comment = NULL;
 	}
+	im->thumbnail_comments = 0;
+	im->out_width = 0;
+	im->out_height = 0;
+	im->bounds_x = 0;
+	im->bounds_y = 0;
+	im->transform = PHP_EPEG_TRANSFORM_NONE;
+	im->filter = PHP_EPEG_FILTER_POINT;
+	im->sharpen = 0.0;
+	im->dc_only = 0;
+}
+/* }}} */
 
-	/* check output size */
-	if (max_width <= 0 || max_height <= 0) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING,
-				"Invalid image dimensions '%ldx%ld'", max_width, max_height);
-		RETURN_FALSE;
+/* {{{ php_epeg_params_fill */
+static void
+php_epeg_params_fill(php_epeg_t *im, php_epeg_params_t *params TSRMLS_DC)
+{
+	php_epeg_params_init(params);
+	if (im->quality != -1) {
+		params->quality = im->quality;
 	}
+	params->colorspace = im->colorspace;
+	params->comment = im->comment;
+	params->thumbnail_comments = (int)im->thumbnail_comments;
+	params->filter = im->filter;
+	params->sharpen = im->sharpen;
+	params->dc_only = (int)im->dc_only;
+	params->stripe_pixels = EPEG_G(stripe_pixels);
+	params->width = (im->out_width > 0) ? im->out_width : im->width;
+	params->height = (im->out_height > 0) ? im->out_height : im->height;
+}
+/* }}} */
 
-	/* check quality */
-	if (quality < 0 || quality > 100) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid quality '%ld'", quality);
-		RETURN_FALSE;
+/* {{{ php_epeg_pixels_retain */
+/*
+ * Decode and keep the pixels in the handle if they are missing
+ * or were decoded with another size or colorspace.
+ */
+static int
+php_epeg_pixels_retain(php_epeg_t *im, const php_epeg_params_t *params)
+{
+	php_epeg_pixels_t *px = &im->pixels;
+	php_epeg_decoder_t *dec;
+	int result;
+
+	if (px->buf != NULL && px->width == params->width && px->height == params->height
+		&& px->colorspace == params->colorspace
+		&& px->filter == params->filter && px->sharpen == params->sharpen
+		&& px->dc_only == params->dc_only)
+	{
+		return 0;
 	}
 
-	/* open stream for reading */
-	sth = php_stream_open_wrapper(in_file, "rb",
-			ENFORCE_SAFE_MODE | IGNORE_PATH | REPORT_ERRORS, NULL);
-	if (!sth) {
-		RETURN_FALSE;
+	php_epeg_pixels_free(px);
+	dec = php_epeg_decoder_open_memory(im->data, (size_t)im->size);
+	if (dec == NULL) {
+		return PHP_EPEG_ERROR_DECODE;
 	}
+	result = php_epeg_decoder_scale(dec, params, px);
+	php_epeg_decoder_close(dec);
 
-	/* copy image data to the buffer */
-	in_buf_len = php_stream_copy_to_mem(sth, &in_buf, PHP_STREAM_COPY_ALL, 0);
+	return result;
+}
+/* }}} */
 
-	/* close the input stream */
-	php_stream_close(sth);
-	if (in_buf_len == 0) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Cannot read image data");
-		RETURN_FALSE;
-	}
+/* {{{ php_epeg_encode_retained */
+/*
+ * Encode from the pixels kept in the handle.
+ */
+static int
+php_epeg_encode_retained(php_epeg_t *im, php_epeg_output_t *out TSRMLS_DC)
+{
+	php_epeg_params_t params;
+	int result;
 
-	/* open the JPEG image stored in the buffer */
-	im = php_epeg_memory_open(in_buf, in_buf_len TSRMLS_CC);
-	if (im == NULL) {
-		/* free the input buffer */
-		efree(in_buf);
-		RETURN_FALSE;
+	php_epeg_params_fill(im, &params TSRMLS_CC);
+	result = php_epeg_pixels_retain(im, &params);
+	if (result != 0) {
+		return result;
 	}
 
-	/* get image size and check whether to do resampling */
-	if (im->width > max_width || im->height > max_height) {
-		unsigned char *tmp_buf;
-		int result, tw, th, tmp_buf_len;
+	return php_epeg_pixels_encode(&im->pixels, &params, out);
+}
+/* }}} */
 
-		/* free the input buffer */
-		efree(in_buf);
-		/* calculate size */
-		(void)php_epeg_calc_thumb_size(im->width, im->height, max_width, max_height, &tw, &th);
-		/* set the size of thumbnail */
-		epeg_decode_size_set(im->ptr, tw, th);
-		/* set output to the buffer */
-		epeg_memory_output_set(im->ptr, &tmp_buf, &tmp_buf_len);
-		/* set quality */
-		epeg_quality_set(im->ptr, (int)quality);
-		/* encode the image and save to the buffer */
-		result = epeg_encode(im->ptr);
-		/* close the Epeg image handle */
-		php_epeg_free(im);
-		if (result != 0) {
-			/* free the temporary buffer */
-			if (tmp_buf) {
-				free(tmp_buf);
-			}
-			/* raise error by the result */
-			php_epeg_encode_error(result TSRMLS_CC);
-			RETURN_FALSE;
+/* {{{ php_epeg_transform_handle */
+/*
+ * Encode the image of the handle rotated or flipped by im->transform.
+ * Without resizing nor color conversion the DCT coefficients are moved
+ * losslessly, otherwise the transform is applied to the scaled pixels
+ * while they are encoded.
+ */
+static int
+php_epeg_transform_handle(php_epeg_t *im, php_epeg_output_t *out TSRMLS_DC)
+{
+	php_epeg_params_t params;
+	php_epeg_pixels_t px;
+	int result;
+
+	/* the decode size is of the transformed image, scale in the orientation of the source */
+	php_epeg_params_fill(im, &params TSRMLS_CC);
+	if (PHP_EPEG_TRANSFORM_SWAPS_AXES(im->transform) && im->out_width > 0) {
+		params.width = im->out_height;
+		params.height = im->out_width;
+	}
+
+	if (params.width == im->width && params.height == im->height
+		&& params.colorspace == PHP_EPEG_COLORSPACE_AUTO)
+	{
+		php_epeg_decoder_t *dec = php_epeg_decoder_open_memory(im->data, (size_t)im->size);
+		if (dec == NULL) {
+			return PHP_EPEG_ERROR_DECODE;
 		}
+		result = php_epeg_decoder_transform(dec, im->transform, &params, out);
+		php_epeg_decoder_close(dec);
+		return result;
+	}
 
-		/* set the result */
-		out_buf = tmp_buf;
-		out_buf_len = tmp_buf_len;
-		out_buf_free_stdc = 1;
-	} else {
-		unsigned char *in_ptr, *in_end, *out_ptr;
+	if (im->retain_pixels) {
+		result = php_epeg_pixels_retain(im, &params);
+		if (result == 0) {
+			result = php_epeg_pixels_encode_transform(&im->pixels, im->transform, &params, out);
+		}
+		return result;
+	}
 
-		/* close the Epeg image handle */
-		php_epeg_free(im);
+	result = php_epeg_scale_handle(im, &params, &px TSRMLS_CC);
+	if (result == 0) {
+		result = php_epeg_pixels_encode_transform(&px, im->transform, &params, out);
+		php_epeg_pixels_free(&px);
+	}
 
-		/* cast the input data to unsigned char */
-		in_ptr = (unsigned char *)in_buf;
-		in_end = in_ptr + in_buf_len;
+	return result;
+}
+/* }}} */
 
-		/* check for SOI (Start Of Image Segment) marker */
-		if (*in_ptr != 0xFF && *(in_ptr + 1) != 0xD8) {
-			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Not a valid JPEG data");
-			efree(in_buf);
-			RETURN_FALSE;
-		}
+/* {{{ thumbnail cache */
 
-		/* allocate memory for the output buffer */
-		out_buf = (unsigned char *)emalloc((size_t)in_buf_len);
-		out_ptr = out_buf;
-		out_buf_free_zend = 1;
+/* a thumbnail in the cache directory */
+typedef struct _php_epeg_cache_file_t {
+	char name[40];
+	long long mtime;
+	long long size;
+} php_epeg_cache_file_t;
 
-		/* write SOI marker  */
-		*out_ptr++ = 0xFF;
-		*out_ptr++ = 0xD8;
-		in_ptr += 2;
-
-		/* search and skip extra markers */
-		while (in_ptr < in_end) {
-			unsigned char marker;
-			size_t field_len;
-
-			if (*in_ptr == 0xFF) {
-				/* skip padding */
-				while (*in_ptr == 0xFF && in_ptr < in_end) {
-					in_ptr++;
-				}
-				marker = *in_ptr++;
-				field_len = (((size_t)*in_ptr) << 8) | (size_t)*(in_ptr + 1);
+/* {{{ php_epeg_cache_enabled */
+/*
+ * Whether epeg.cache_dir is set to a local directory allowed by open_basedir.
+ */
+static int
+php_epeg_cache_enabled(TSRMLS_D)
+{
+	char *dir = EPEG_G(cache_dir);
+	char *path = NULL;
 
-				if (in_ptr + field_len > in_end) {
-					php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid data structure");
-					efree(out_buf);
-					RETURN_FALSE;
-				}
+	if (dir == NULL || *dir == '\0') {
+		return 0;
+	}
+#if PHP_VERSION_ID < 50400
+	if (PG(safe_mode)) {
+		return 0;
+	}
+#endif
+	if (php_stream_locate_url_wrapper(dir, &path, 0 TSRMLS_CC) != &php_plain_files_wrapper
+		|| path != dir || php_check_open_basedir_ex(dir, 0 TSRMLS_CC) != 0)
+	{
+		return 0;
+	}
 
-				/* following markers are dropped :
-				 * RES:        0xFF [0x02-0xBF] (reserved)
-				 * APP[1-15]:  0xFF [0xE1-0xEF] (application markers, APP0 (0xE0) is JFIF (kept), APP1 is EXIF)
-				 * JPEG[0-13]: 0xFF [0xF0-0xFD] (reserved for expansion of JPEG)
-				 * COM:        0xFF 0xFE (comment)
-				 */
-				if ((marker > 0x01 && marker < 0xC0) || (marker > 0xE0 && marker < 0xFF)) {
-					in_ptr += field_len;
-					continue;
-				} else {
-					*out_ptr++ = 0xFF;
-					*out_ptr++ = marker;
-					(void)memcpy(out_ptr, in_ptr, field_len);
-					in_ptr += field_len;
-					out_ptr += field_len;
-
-					/* break if SOS (Start Of Scan) marker found */
-					if (marker == 0xDA) {
-						break;
-					}
-				}
-			} else {
-				*out_ptr++ = *in_ptr++;
+	return 1;
+}
+/* }}} */
+
+/* {{{ php_epeg_cache_path */
+/*
+ * Finish the key of a thumbnail and get its pathname in the cache directory.
+ * The name is the MD5 of the source and of every setting of the output.
+ */
+static void
+php_epeg_cache_path(PHP_MD5_CTX *ctx, char *path, size_t path_size TSRMLS_DC)
+{
+	unsigned char digest[16];
+	char name[33];
+
+	PHP_MD5Final(digest, ctx);
+	make_digest_ex(name, digest, 16);
+	snprintf(path, path_size, "%s%c%s.jpg", EPEG_G(cache_dir), PHP_DIR_SEPARATOR, name);
+}
+/* }}} */
+
+/* {{{ php_epeg_cache_key_handle */
+/*
+ * Get the pathname of the thumbnail epeg_encode() makes with the settings of the handle.
+ */
+static void
+php_epeg_cache_key_handle(php_epeg_t *im, char *path, size_t path_size TSRMLS_DC)
+{
+	PHP_MD5_CTX ctx;
+	int settings[11];
+	double amounts[2];
+
+	settings[0] = im->out_width;
+	settings[1] = im->out_height;
+	settings[2] = im->quality;
+	settings[3] = im->colorspace;
+	settings[4] = (int)im->thumbnail_comments;
+	settings[5] = im->bounds_x;
+	settings[6] = im->bounds_y;
+	settings[7] = im->transform;
+	settings[8] = im->filter;
+	settings[9] = (int)im->dc_only;
+	settings[10] = (int)im->exif_thumbnail;
+	amounts[0] = im->sharpen;
+	amounts[1] = im->exif_thumbnail ? im->exif_tolerance : 0.0;
+
+	PHP_MD5Init(&ctx);
+	PHP_MD5Update(&ctx, (const unsigned char *)PHP_EPEG_CACHE_TAG_ENCODE, sizeof(PHP_EPEG_CACHE_TAG_ENCODE));
+	PHP_MD5Update(&ctx, im->data, (unsigned int)im->size);
+	PHP_MD5Update(&ctx, (const unsigned char *)settings, sizeof(settings));
+	PHP_MD5Update(&ctx, (const unsigned char *)amounts, sizeof(amounts));
+	/* the NUL tells no comment from an empty one */
+	if (im->comment != NULL) {
+		PHP_MD5Update(&ctx, (const unsigned char *)im->comment, (unsigned int)strlen(im->comment) + 1);
+	}
+	php_epeg_cache_path(&ctx, path, path_size TSRMLS_CC);
+}
+/* }}} */
+
+/* {{{ php_epeg_cache_fetch */
+/*
+ * Read a thumbnail from the cache directory, a missing file is no error.
+ * buf is allocated by emalloc() and terminated by NUL as php_epeg_set_retval() takes.
+ */
+static int
+php_epeg_cache_fetch(const char *path, unsigned char **buf, int *buf_len TSRMLS_DC)
+{
+	php_stream *sth = NULL;
+	char *data = NULL;
+	int data_len;
+
+	sth = php_stream_open_wrapper((char *)path, "rb", IGNORE_PATH, NULL);
+	if (!sth) {
+		return FAILURE;
+	}
+	data_len = php_stream_copy_to_mem(sth, &data, PHP_STREAM_COPY_ALL, 0);
+	php_stream_close(sth);
+	if (data_len <= 0) {
+		if (data != NULL) {
+			efree(data);
+		}
+		return FAILURE;
+	}
+
+#ifdef HAVE_UTIME
+	/* the oldest thumbnails are evicted first */
+	(void)VCWD_UTIME(path, NULL);
+#endif
+
+	*buf = (unsigned char *)data;
+	*buf_len = data_len;
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_cache_store */
+/*
+ * Write a thumbnail to the cache directory. It is written to a temporary
+ * file and renamed, so the readers never see a partial file.
+ * Any failure just leaves the thumbnail uncached.
+ */
+static void
+php_epeg_cache_store(const char *path, const unsigned char *buf, size_t len TSRMLS_DC)
+{
+	php_stream *sth = NULL;
+	char tmp[MAXPATHLEN];
+	size_t written;
+
+	snprintf(tmp, sizeof(tmp), "%s.%08lx.tmp", path,
+			(unsigned long)(php_combined_lcg(TSRMLS_C) * 0xFFFFFFFFUL));
+	sth = php_stream_open_wrapper(tmp, "xb", IGNORE_PATH, NULL);
+	if (!sth) {
+		return;
+	}
+	written = php_stream_write(sth, (char *)buf, len);
+	php_stream_close(sth);
+	if (written != len || VCWD_RENAME(tmp, path) != 0) {
+		(void)VCWD_UNLINK(tmp);
+		return;
+	}
+
+	if (EPEG_G(cache_size) > 0 && EPEG_G(cache_stores)++ % PHP_EPEG_CACHE_SWEEP_INTERVAL == 0) {
+		php_epeg_cache_sweep(TSRMLS_C);
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_cache_file_compare */
+static int
+php_epeg_cache_file_compare(const void *a, const void *b)
+{
+	const php_epeg_cache_file_t *fa = (const php_epeg_cache_file_t *)a;
+	const php_epeg_cache_file_t *fb = (const php_epeg_cache_file_t *)b;
+
+	if (fa->mtime != fb->mtime) {
+		return (fa->mtime < fb->mtime) ? -1 : 1;
+	}
+	return strcmp(fa->name, fb->name);
+}
+/* }}} */
+
+/* {{{ php_epeg_cache_sweep */
+/*
+ * Delete the least recently used thumbnails while the cache directory
+ * is over epeg.cache_size, and the temporary files of crashed writers.
+ */
+static void
+php_epeg_cache_sweep(TSRMLS_D)
+{
+	php_stream *dirp = NULL;
+	php_stream_dirent entry;
+	php_epeg_cache_file_t *files = NULL;
+	int count = 0, allocated = 0, i;
+	long long total = 0, target;
+	char path[MAXPATHLEN];
+	time_t now = time(NULL);
+
+	dirp = php_stream_opendir(EPEG_G(cache_dir), IGNORE_PATH, NULL);
+	if (!dirp) {
+		return;
+	}
+	while (php_stream_readdir(dirp, &entry) != NULL) {
+		size_t name_len = strlen(entry.d_name);
+		struct stat sb;
+
+		/* only the files named by php_epeg_cache_path() and php_epeg_cache_store() */
+		if (name_len < 36 || strspn(entry.d_name, "0123456789abcdef") != 32
+			|| strncmp(entry.d_name + 32, ".jpg", 4) != 0)
+		{
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s%c%s", EPEG_G(cache_dir), PHP_DIR_SEPARATOR, entry.d_name);
+		if (VCWD_STAT(path, &sb) != 0 || !S_ISREG(sb.st_mode)) {
+			continue;
+		}
+		if (name_len != 36) {
+			if (name_len > 4 && strcmp(entry.d_name + name_len - 4, ".tmp") == 0
+				&& now - sb.st_mtime > PHP_EPEG_CACHE_STALE_SECONDS)
+			{
+				(void)VCWD_UNLINK(path);
+			}
+			continue;
+		}
+
+		if (count == allocated) {
+			allocated = (allocated == 0) ? 64 : allocated * 2;
+			files = (php_epeg_cache_file_t *)safe_erealloc(files,
+					(size_t)allocated, sizeof(php_epeg_cache_file_t), 0);
+		}
+		memcpy(files[count].name, entry.d_name, name_len + 1);
+		files[count].mtime = (long long)sb.st_mtime;
+		files[count].size = (long long)sb.st_size;
+		total += files[count].size;
+		count++;
+	}
+	php_stream_closedir(dirp);
+
+	/* leave some room not to sweep again on the next store */
+	if (total > (long long)EPEG_G(cache_size)) {
+		target = (long long)(EPEG_G(cache_size) * PHP_EPEG_CACHE_SWEEP_TARGET);
+		qsort(files, (size_t)count, sizeof(php_epeg_cache_file_t), php_epeg_cache_file_compare);
+		for (i = 0; i < count && total > target; i++) {
+			snprintf(path, sizeof(path), "%s%c%s", EPEG_G(cache_dir), PHP_DIR_SEPARATOR, files[i].name);
+			if (VCWD_UNLINK(path) == 0) {
+				total -= files[i].size;
+			}
+		}
+	}
+	if (files != NULL) {
+		efree(files);
+	}
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ php_epeg_encode_handle */
+/*
+ * Encode or trim the image with the settings of the handle.
+ * The embedded EXIF thumbnail is scaled instead if enabled and large enough.
+ * A large image is decoded by the worker threads if it has restart markers.
+ */
+static int
+php_epeg_encode_handle(php_epeg_t *im, zend_bool trim, php_epeg_output_t *out TSRMLS_DC)
+{
+	php_epeg_params_t params;
+	php_epeg_decoder_t *dec;
+	php_epeg_pool_t *pool = NULL;
+	int result;
+
+	if (!trim && im->exif_thumbnail && im->out_width > 0) {
+		const unsigned char *thumb;
+		size_t thumb_len;
+
+		thumb = php_epeg_exif_thumbnail_fit(im->data, (size_t)im->size, im->width, im->height,
+				im->transform, im->out_width, im->out_height, im->exif_tolerance, &thumb_len);
+		if (thumb != NULL) {
+			/* the decode size is of the transformed image, as php_epeg_transform_run() takes */
+			php_epeg_params_fill(im, &params TSRMLS_CC);
+			params.dc_only = 0;
+			return php_epeg_transform_run(thumb, thumb_len, im->transform, &params, out);
+		}
+	}
+	if (!trim && im->transform != PHP_EPEG_TRANSFORM_NONE) {
+		return php_epeg_transform_handle(im, out TSRMLS_CC);
+	}
+	if (!trim && im->retain_pixels) {
+		return php_epeg_encode_retained(im, out TSRMLS_CC);
+	}
+
+	php_epeg_params_fill(im, &params TSRMLS_CC);
+	dec = php_epeg_decoder_open_memory(im->data, (size_t)im->size);
+	if (dec == NULL) {
+		return PHP_EPEG_ERROR_DECODE;
+	}
+	if (!trim && (params.stripe_pixels <= 0 || (double)params.width * params.height <= (double)params.stripe_pixels)
+		&& (pool = php_epeg_parallel_pool(im TSRMLS_CC)) != NULL)
+	{
+		php_epeg_pixels_t px;
+
+		/* the whole output is kept, larger ones are encoded row by row below */
+		result = php_epeg_decoder_scale_parallel(dec, im->data, (size_t)im->size, &params, pool, &px);
+		if (result != PHP_EPEG_PARALLEL_UNSUPPORTED) {
+			php_epeg_decoder_close(dec);
+			if (result == 0) {
+				result = php_epeg_pixels_encode(&px, &params, out);
+				php_epeg_pixels_free(&px);
 			}
+			return result;
+		}
+	}
+	if (trim) {
+		params.x = im->bounds_x;
+		params.y = im->bounds_y;
+		result = php_epeg_decoder_trim(dec, &params, out);
+	} else {
+		result = php_epeg_decoder_encode(dec, &params, out);
+	}
+	php_epeg_decoder_close(dec);
+
+	return result;
+}
+/* }}} */
+
+/* {{{ php_epeg_init_globals */
+static void
+php_epeg_init_globals(zend_epeg_globals *epeg_globals)
+{
+	memset(epeg_globals, 0, sizeof(zend_epeg_globals));
+}
+/* }}} */
+
+/* {{{ php_epeg_destroy_globals */
+static void
+php_epeg_destroy_globals(zend_epeg_globals *epeg_globals)
+{
+	int forked = 0;
+
+#ifdef HAVE_UNISTD_H
+	/* a forked child which never ran a job still holds the parent's copies */
+	forked = (epeg_globals->owner_pid != 0 && epeg_globals->owner_pid != (long)getpid());
+#endif
+
+	/* no job is pending after RSHUTDOWN */
+	if (epeg_globals->band_pool != NULL) {
+		if (forked) {
+			php_epeg_pool_abandon(epeg_globals->band_pool);
+		} else {
+			php_epeg_pool_destroy(epeg_globals->band_pool);
+		}
+		epeg_globals->band_pool = NULL;
+	}
+	if (epeg_globals->pool != NULL) {
+		if (forked) {
+			php_epeg_pool_abandon(epeg_globals->pool);
+		} else {
+			php_epeg_pool_destroy(epeg_globals->pool);
 		}
+		epeg_globals->pool = NULL;
+	}
+	if (epeg_globals->queue != NULL) {
+		if (forked) {
+			php_epeg_queue_abandon(epeg_globals->queue);
+		} else {
+			php_epeg_queue_destroy(epeg_globals->queue);
+		}
+		epeg_globals->queue = NULL;
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_pool_get */
+/*
+ * Get the worker threads of the asynchronous jobs, they are started
+ * on demand and live until shutdown. Returns NULL on failure.
+ */
+static php_epeg_pool_t *
+php_epeg_pool_get(TSRMLS_D)
+{
+	php_epeg_jobs_check_fork(TSRMLS_C);
+	if (EPEG_G(pool) == NULL) {
+		EPEG_G(pool) = php_epeg_pool_create(0);
+	}
+
+	return EPEG_G(pool);
+}
+/* }}} */
+
+/* {{{ php_epeg_parallel_pool */
+/*
+ * Get the worker threads to decode the image with, or NULL if it has
+ * fewer pixels than epeg.parallel_pixels or there is only one worker.
+ * They are not those of the asynchronous jobs, so that the bands of a
+ * request never wait behind the jobs queued before.
+ */
+static php_epeg_pool_t *
+php_epeg_parallel_pool(php_epeg_t *im TSRMLS_DC)
+{
+	php_epeg_pool_t *pool;
+
+	if (EPEG_G(parallel_pixels) <= 0
+		|| (double)im->width * im->height < (double)EPEG_G(parallel_pixels))
+	{
+		return NULL;
+	}
+	php_epeg_jobs_check_fork(TSRMLS_C);
+	if (EPEG_G(band_pool) == NULL) {
+		EPEG_G(band_pool) = php_epeg_pool_create(0);
+	}
+	pool = EPEG_G(band_pool);
+	if (pool == NULL || php_epeg_pool_size(pool) < 2) {
+		return NULL;
+	}
+
+	return pool;
+}
+/* }}} */
+
+/* {{{ php_epeg_jobs_check_fork */
+/*
+ * Forget the workers and the jobs inherited from the parent process,
+ * the threads do not survive fork() so the jobs would never finish.
+ */
+static void
+php_epeg_jobs_check_fork(TSRMLS_D)
+{
+#ifdef HAVE_UNISTD_H
+	long pid = (long)getpid();
+
+	if (EPEG_G(owner_pid) == pid) {
+		return;
+	}
+	if (EPEG_G(owner_pid) != 0) {
+		/* the jobs are copies whose state is unknown, they are leaked */
+		if (EPEG_G(band_pool) != NULL) {
+			php_epeg_pool_abandon(EPEG_G(band_pool));
+			EPEG_G(band_pool) = NULL;
+		}
+		if (EPEG_G(pool) != NULL) {
+			php_epeg_pool_abandon(EPEG_G(pool));
+			EPEG_G(pool) = NULL;
+		}
+		if (EPEG_G(queue) != NULL) {
+			php_epeg_queue_abandon(EPEG_G(queue));
+			EPEG_G(queue) = NULL;
+		}
+		EPEG_G(pending_jobs) = 0;
+	}
+	EPEG_G(owner_pid) = pid;
+#endif
+}
+/* }}} */
+
+/* {{{ php_epeg_jobs_start */
+/*
+ * Prepare the workers and the queue of the asynchronous jobs.
+ */
+static int
+php_epeg_jobs_start(TSRMLS_D)
+{
+	php_epeg_jobs_check_fork(TSRMLS_C);
+	if (EPEG_G(queue) == NULL) {
+		EPEG_G(queue) = php_epeg_queue_create();
+		if (EPEG_G(queue) == NULL) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to create job queue");
+			return FAILURE;
+		}
+	}
+	if (php_epeg_pool_get(TSRMLS_C) == NULL) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to start worker threads");
+		return FAILURE;
+	}
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_async_job_run */
+static void
+php_epeg_async_job_run(php_epeg_task_t *task)
+{
+	php_epeg_async_job_t *job = (php_epeg_async_job_t *)task;
+	php_epeg_decoder_t *dec;
+
+	if (job->transform != PHP_EPEG_TRANSFORM_NONE) {
+		job->result = php_epeg_transform_run(job->data, job->data_len, job->transform,
+				&job->params, &job->out);
+	} else if ((dec = php_epeg_decoder_open_memory(job->data, job->data_len)) == NULL) {
+		job->result = PHP_EPEG_ERROR_DECODE;
+	} else {
+		job->result = php_epeg_decoder_encode(dec, &job->params, &job->out);
+		php_epeg_decoder_close(dec);
+	}
+
+	/* the source is not needed any more */
+	free(job->data);
+	job->data = NULL;
+}
+/* }}} */
+
+/* {{{ php_epeg_async_job_free */
+static void
+php_epeg_async_job_free(php_epeg_async_job_t *job)
+{
+	if (job->data != NULL) {
+		free(job->data);
+	}
+	if (job->comment != NULL) {
+		free(job->comment);
+	}
+	php_epeg_output_free(&job->out);
+	free(job);
+}
+/* }}} */
+
+/* {{{ php_epeg_scale_handle */
+/*
+ * Decode the image of the handle scaled to params->width x params->height,
+ * a large image is decoded by the worker threads if it has restart markers.
+ */
+static int
+php_epeg_scale_handle(php_epeg_t *im, const php_epeg_params_t *params,
+		php_epeg_pixels_t *px TSRMLS_DC)
+{
+	php_epeg_decoder_t *dec;
+	php_epeg_pool_t *pool = NULL;
+	int result = PHP_EPEG_PARALLEL_UNSUPPORTED;
+
+	dec = php_epeg_decoder_open_memory(im->data, (size_t)im->size);
+	if (dec == NULL) {
+		return PHP_EPEG_ERROR_DECODE;
+	}
+	if ((pool = php_epeg_parallel_pool(im TSRMLS_CC)) != NULL) {
+		result = php_epeg_decoder_scale_parallel(dec, im->data, (size_t)im->size, params, pool, px);
+	}
+	if (result == PHP_EPEG_PARALLEL_UNSUPPORTED) {
+		result = php_epeg_decoder_scale(dec, params, px);
+	}
+	php_epeg_decoder_close(dec);
+
+	return result;
+}
+/* }}} */
+
+/* {{{ php_epeg_tile_emit */
+/*
+ * Encode a tile and write it to dir/level/col_row.jpg,
+ * or pass it to sink(level, col, row, data) if dir is NULL.
+ */
+static int
+php_epeg_tile_emit(const php_epeg_pixels_t *px, const php_epeg_params_t *params,
+		int level, int col, int row, int x, int y, int width, int height,
+		const char *dir, zval *sink TSRMLS_DC)
+{
+	php_epeg_output_t out;
+	zval retval;
+	char *path = NULL;
+	int path_len = 0;
+	int result;
+
+	if (dir != NULL) {
+		path_len = spprintf(&path, 0, "%s/%d/%d_%d.jpg", dir, level, col, row);
+	}
+	if (php_epeg_output_open(&out, path, path_len, NULL TSRMLS_CC) == FAILURE) {
+		if (path != NULL) {
+			efree(path);
+		}
+		return FAILURE;
+	}
+	if (path != NULL) {
+		efree(path);
+	}
+
+	result = php_epeg_pixels_encode_area(px, x, y, width, height, params, &out);
+
+	INIT_ZVAL(retval);
+	if (php_epeg_output_close(&out, result, &retval TSRMLS_CC) == FAILURE) {
+		php_epeg_encode_error(result TSRMLS_CC);
+		return FAILURE;
+	}
+	if (Z_TYPE(retval) != IS_STRING) {
+		return (Z_TYPE(retval) == IS_BOOL && Z_LVAL(retval)) ? SUCCESS : FAILURE;
+	}
+
+	/* pass the tile to the callback, returning false stops */
+	{
+		zval *args[4];
+		zval *zret = NULL;
+		int i, status;
+
+		MAKE_STD_ZVAL(args[0]);
+		MAKE_STD_ZVAL(args[1]);
+		MAKE_STD_ZVAL(args[2]);
+		MAKE_STD_ZVAL(args[3]);
+		ZVAL_LONG(args[0], level);
+		ZVAL_LONG(args[1], col);
+		ZVAL_LONG(args[2], row);
+		ZVAL_STRINGL(args[3], Z_STRVAL(retval), Z_STRLEN(retval), 0);
+
+		MAKE_STD_ZVAL(zret);
+		status = call_user_function(EG(function_table), NULL, sink, zret, 4, args TSRMLS_CC);
+		if (status == SUCCESS && Z_TYPE_P(zret) == IS_BOOL && !Z_LVAL_P(zret)) {
+			status = FAILURE;
+		}
+		zval_ptr_dtor(&zret);
+		for (i = 0; i < 4; i++) {
+			zval_ptr_dtor(&args[i]);
+		}
+		if (status == FAILURE || EG(exception)) {
+			return FAILURE;
+		}
+	}
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_size_fetch */
+/*
+ * Fetch width, height and optional filename from an element
+ * of the sizes array of epeg_encode_multiple().
+ */
+static int
+php_epeg_size_fetch(zval *entry, long *width, long *height,
+		char **file, int *file_len TSRMLS_DC)
+{
+	zval **zv = NULL;
+	zval tmp;
+
+	if (Z_TYPE_P(entry) != IS_ARRAY) {
+		return FAILURE;
+	}
+
+	if (zend_hash_index_find(Z_ARRVAL_P(entry), 0, (void **)&zv) == FAILURE) {
+		return FAILURE;
+	}
+	tmp = **zv;
+	zval_copy_ctor(&tmp);
+	convert_to_long(&tmp);
+	*width = Z_LVAL(tmp);
+
+	if (zend_hash_index_find(Z_ARRVAL_P(entry), 1, (void **)&zv) == FAILURE) {
+		return FAILURE;
+	}
+	tmp = **zv;
+	zval_copy_ctor(&tmp);
+	convert_to_long(&tmp);
+	*height = Z_LVAL(tmp);
+
+	*file = NULL;
+	*file_len = 0;
+	if (zend_hash_index_find(Z_ARRVAL_P(entry), 2, (void **)&zv) == SUCCESS
+		&& Z_TYPE_PP(zv) != IS_NULL)
+	{
+		if (Z_TYPE_PP(zv) != IS_STRING) {
+			return FAILURE;
+		}
+		*file = Z_STRVAL_PP(zv);
+		*file_len = Z_STRLEN_PP(zv);
+	}
+
+	return (*width > 0 && *height > 0) ? SUCCESS : FAILURE;
+}
+/* }}} */
+
+/* {{{ php_epeg_strip_markers */
+/*
+ * Copy the JPEG image in to out without the comments and the application
+ * markers except JFIF. out must have in_len bytes at least.
+ * Returns 0 on success or one of PHP_EPEG_ERROR_*.
+ */
+static int
+php_epeg_strip_markers(const unsigned char *in, size_t in_len,
+		unsigned char *out, size_t *out_len)
+{
+	const unsigned char *in_ptr = in;
+	const unsigned char *in_end = in + in_len;
+	unsigned char *out_ptr = out;
+
+	/* check for SOI (Start Of Image Segment) marker */
+	if (in_len < 4 || in[0] != 0xFF || in[1] != 0xD8) {
+		return PHP_EPEG_ERROR_OPEN;
+	}
+
+	/* write SOI marker  */
+	*out_ptr++ = 0xFF;
+	*out_ptr++ = 0xD8;
+	in_ptr += 2;
+
+	/* search and skip extra markers */
+	while (in_ptr < in_end) {
+		const unsigned char *ff;
+		unsigned char marker;
+		size_t field_len;
+
+		/* copy the bytes before the next marker at once */
+		ff = php_epeg_find_ff(in_ptr, in_end);
+		if (ff > in_ptr) {
+			(void)memcpy(out_ptr, in_ptr, (size_t)(ff - in_ptr));
+			out_ptr += ff - in_ptr;
+			in_ptr = ff;
+			if (in_ptr == in_end) {
+				break;
+			}
+		}
+
+		/* skip padding */
+		while (in_ptr < in_end && *in_ptr == 0xFF) {
+			in_ptr++;
+		}
+		if (in_ptr == in_end) {
+			return PHP_EPEG_ERROR_STRUCTURE;
+		}
+		marker = *in_ptr++;
+
+		/* TEM, RSTn, SOI and EOI have no length field */
+		if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD9)) {
+			*out_ptr++ = 0xFF;
+			*out_ptr++ = marker;
+			if (marker == 0xD9) {
+				break;
+			}
+			continue;
+		}
+
+		/* the length field counts itself */
+		if (in_end - in_ptr < 2) {
+			return PHP_EPEG_ERROR_STRUCTURE;
+		}
+		field_len = (((size_t)in_ptr[0]) << 8) | (size_t)in_ptr[1];
+		if (field_len < 2 || field_len > (size_t)(in_end - in_ptr)) {
+			return PHP_EPEG_ERROR_STRUCTURE;
+		}
+
+		/* following markers are dropped :
+		 * RES:        0xFF [0x02-0xBF] (reserved)
+		 * APP[1-15]:  0xFF [0xE1-0xEF] (application markers, APP0 (0xE0) is JFIF (kept), APP1 is EXIF)
+		 * JPEG[0-13]: 0xFF [0xF0-0xFD] (reserved for expansion of JPEG)
+		 * COM:        0xFF 0xFE (comment)
+		 */
+		if ((marker > 0x01 && marker < 0xC0) || (marker > 0xE0 && marker < 0xFF)) {
+			in_ptr += field_len;
+			continue;
+		}
+
+		*out_ptr++ = 0xFF;
+		*out_ptr++ = marker;
+		(void)memcpy(out_ptr, in_ptr, field_len);
+		in_ptr += field_len;
+		out_ptr += field_len;
+
+		/* break if SOS (Start Of Scan) marker found */
+		if (marker == 0xDA) {
+			break;
+		}
+	}
+
+	/* copy the entropy-coded data and the rest */
+	if (in_ptr < in_end) {
+		size_t rest_len = (size_t)(in_end - in_ptr);
+		(void)memcpy(out_ptr, in_ptr, rest_len);
+		out_ptr += rest_len;
+	}
+
+	*out_len = (size_t)(out_ptr - out);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_thumbnail_run */
+/*
+ * Make a thumbnail of the JPEG image in memory like epeg_thumbnail_create().
+ * Returns 0 on success or one of PHP_EPEG_ERROR_*.
+ */
+static int
+php_epeg_thumbnail_run(const unsigned char *data, size_t data_len,
+		int max_width, int max_height, int quality, php_epeg_output_t *out)
+{
+	php_epeg_decoder_t *dec = NULL;
+	unsigned char *buf;
+	size_t len = 0;
+	int result;
+
+	dec = php_epeg_decoder_open_memory(data, data_len);
+	if (dec == NULL) {
+		return PHP_EPEG_ERROR_OPEN;
+	}
+
+	/* get image size and check whether to do resampling */
+	if ((int)dec->cinfo.image_width > max_width || (int)dec->cinfo.image_height > max_height) {
+		php_epeg_params_t params;
+
+		php_epeg_params_init(&params);
+		(void)php_epeg_calc_thumb_size(
+				(int)dec->cinfo.image_width, (int)dec->cinfo.image_height,
+				max_width, max_height, &params.width, &params.height);
+		params.quality = quality;
+		result = php_epeg_decoder_encode(dec, &params, out);
+		php_epeg_decoder_close(dec);
+		return result;
+	}
+	php_epeg_decoder_close(dec);
+
+	/* copy the image without extra markers */
+	buf = (unsigned char *)out->realloc_func(NULL, data_len + 1);
+	if (buf == NULL) {
+		return PHP_EPEG_ERROR_ENCODE;
+	}
+	result = php_epeg_strip_markers(data, data_len, buf, &len);
+	if (result != 0) {
+		out->free_func(buf);
+		return result;
+	}
+	buf[len] = '\0';
+	out->buf = buf;
+	out->len = len;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_transform_run */
+/*
+ * Rotate or flip the JPEG image in memory by transform, one of
+ * PHP_EPEG_TRANSFORM_*. params->width and params->height are the size
+ * after the transform, or 0 for the full size.
+ * Without resizing nor color conversion the DCT coefficients are moved
+ * losslessly, otherwise the scaled pixels are transformed while they
+ * are encoded.
+ * Returns 0 on success or one of PHP_EPEG_ERROR_*.
+ */
+static int
+php_epeg_transform_run(const unsigned char *data, size_t data_len, int transform,
+		const php_epeg_params_t *params, php_epeg_output_t *out)
+{
+	php_epeg_decoder_t *dec;
+	php_epeg_params_t scaled;
+	php_epeg_pixels_t px;
+	int result;
+
+	dec = php_epeg_decoder_open_memory(data, data_len);
+	if (dec == NULL) {
+		return PHP_EPEG_ERROR_DECODE;
+	}
+
+	/* scale in the orientation of the source */
+	scaled = *params;
+	if (PHP_EPEG_TRANSFORM_SWAPS_AXES(transform)) {
+		scaled.width = params->height;
+		scaled.height = params->width;
+	}
+	if (scaled.width <= 0) {
+		scaled.width = (int)dec->cinfo.image_width;
+	}
+	if (scaled.height <= 0) {
+		scaled.height = (int)dec->cinfo.image_height;
+	}
+
+	if (scaled.width == (int)dec->cinfo.image_width && scaled.height == (int)dec->cinfo.image_height
+		&& scaled.colorspace == PHP_EPEG_COLORSPACE_AUTO)
+	{
+		result = php_epeg_decoder_transform(dec, transform, &scaled, out);
+	} else {
+		result = php_epeg_decoder_scale(dec, &scaled, &px);
+		if (result == 0) {
+			result = php_epeg_pixels_encode_transform(&px, transform, &scaled, out);
+			php_epeg_pixels_free(&px);
+		}
+	}
+	php_epeg_decoder_close(dec);
+
+	return result;
+}
+/* }}} */
+
+/* {{{ php_epeg_exif_thumbnail_fit */
+/*
+ * Find the JPEG thumbnail embedded in the EXIF segment of the image in
+ * data, which needs not be more than the header, if it can be scaled to
+ * width x height, the size after the transform. The aspect ratio of the
+ * thumbnail must be within tolerance of the one of the source, which is
+ * src_width x src_height. Returns NULL if there is no such thumbnail.
+ */
+static const unsigned char *
+php_epeg_exif_thumbnail_fit(const unsigned char *data, size_t data_len,
+		int src_width, int src_height, int transform, int width, int height,
+		double tolerance, size_t *thumb_len)
+{
+	const unsigned char *thumb;
+	php_epeg_decoder_t *dec;
+	double src_ratio, thumb_ratio;
+	int thumb_width, thumb_height;
+
+	thumb = php_epeg_exif_thumbnail(data, data_len, thumb_len);
+	if (thumb == NULL || src_width < 1 || src_height < 1) {
+		return NULL;
+	}
+
+	/* only the header of the thumbnail is read */
+	dec = php_epeg_decoder_open_memory(thumb, *thumb_len);
+	if (dec == NULL) {
+		return NULL;
+	}
+	thumb_width = (int)dec->cinfo.image_width;
+	thumb_height = (int)dec->cinfo.image_height;
+	php_epeg_decoder_close(dec);
+
+	/* compare in the orientation of the source */
+	if (PHP_EPEG_TRANSFORM_SWAPS_AXES(transform)) {
+		int t = width;
+		width = height;
+		height = t;
+	}
+	if (thumb_width < width || thumb_height < height
+		|| thumb_width > src_width || thumb_height > src_height)
+	{
+		return NULL;
+	}
+	src_ratio = (double)src_width / (double)src_height;
+	thumb_ratio = (double)thumb_width / (double)thumb_height;
+	if (fabs(thumb_ratio - src_ratio) > src_ratio * tolerance) {
+		return NULL;
+	}
+
+	return thumb;
+}
+/* }}} */
+
+/* {{{ php_epeg_batch_job_fetch */
+/*
+ * Fetch the parameters of an element of the jobs array
+ * of epeg_thumbnail_batch().
+ */
+static int
+php_epeg_batch_job_fetch(zval *entry, php_epeg_batch_job_t *job, char **in_file TSRMLS_DC)
+{
+	zval **zv = NULL;
+	zval tmp;
+	HashTable *ht;
+
+	if (Z_TYPE_P(entry) != IS_ARRAY) {
+		return FAILURE;
+	}
+	ht = Z_ARRVAL_P(entry);
+
+	/* input, required */
+	if (zend_hash_find(ht, "in", sizeof("in"), (void **)&zv) == FAILURE
+		|| Z_TYPE_PP(zv) != IS_STRING || Z_STRLEN_PP(zv) == 0)
+	{
+		return FAILURE;
+	}
+	*in_file = Z_STRVAL_PP(zv);
+
+	/* output, optional */
+	job->out_file = NULL;
+	job->out_file_len = 0;
+	if (zend_hash_find(ht, "out", sizeof("out"), (void **)&zv) == SUCCESS
+		&& Z_TYPE_PP(zv) != IS_NULL)
+	{
+		if (Z_TYPE_PP(zv) != IS_STRING) {
+			return FAILURE;
+		}
+		job->out_file = Z_STRVAL_PP(zv);
+		job->out_file_len = Z_STRLEN_PP(zv);
+	}
+
+	/* output size, required */
+	if (zend_hash_find(ht, "max_width", sizeof("max_width"), (void **)&zv) == FAILURE) {
+		return FAILURE;
+	}
+	tmp = **zv;
+	zval_copy_ctor(&tmp);
+	convert_to_long(&tmp);
+	if (Z_LVAL(tmp) <= 0 || Z_LVAL(tmp) > INT_MAX) {
+		return FAILURE;
+	}
+	job->max_width = (int)Z_LVAL(tmp);
+
+	if (zend_hash_find(ht, "max_height", sizeof("max_height"), (void **)&zv) == FAILURE) {
+		return FAILURE;
+	}
+	tmp = **zv;
+	zval_copy_ctor(&tmp);
+	convert_to_long(&tmp);
+	if (Z_LVAL(tmp) <= 0 || Z_LVAL(tmp) > INT_MAX) {
+		return FAILURE;
+	}
+	job->max_height = (int)Z_LVAL(tmp);
+
+	/* quality, optional */
+	job->quality = 75;
+	if (zend_hash_find(ht, "quality", sizeof("quality"), (void **)&zv) == SUCCESS
+		&& Z_TYPE_PP(zv) != IS_NULL)
+	{
+		tmp = **zv;
+		zval_copy_ctor(&tmp);
+		convert_to_long(&tmp);
+		if (Z_LVAL(tmp) < 0 || Z_LVAL(tmp) > 100) {
+			return FAILURE;
+		}
+		job->quality = (int)Z_LVAL(tmp);
+	}
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_batch_job_read */
+/*
+ * Read the whole input of the job, the workers cannot use streams.
+ * A plain file is not mapped, since the job may wait in the queue for
+ * long and the file truncated meanwhile would fault the process.
+ */
+static int
+php_epeg_batch_job_read(php_epeg_batch_job_t *job, char *in_file TSRMLS_DC)
+{
+	php_stream *sth = NULL;
+	char *data = NULL;
+	int data_len = 0;
+
+	/* open stream for reading */
+	sth = php_stream_open_wrapper(in_file, "rb",
+			ENFORCE_SAFE_MODE | IGNORE_PATH | REPORT_ERRORS, NULL);
+	if (!sth) {
+		return FAILURE;
+	}
+
+	/* copy image data to the buffer */
+	data_len = php_stream_copy_to_mem(sth, &data, PHP_STREAM_COPY_ALL, 0);
+	php_stream_close(sth);
+	if (data_len == 0) {
+		return FAILURE;
+	}
+	job->data = (unsigned char *)data;
+	job->data_len = data_len;
+
+	return SUCCESS;
+}
+/* }}} */
+
+/* {{{ php_epeg_batch_job_run */
+static void
+php_epeg_batch_job_run(php_epeg_task_t *task)
+{
+	php_epeg_batch_job_t *job = (php_epeg_batch_job_t *)task;
+
+	job->result = php_epeg_thumbnail_run(job->data, (size_t)job->data_len,
+			job->max_width, job->max_height, job->quality, &job->out);
+}
+/* }}} */
+
+/* {{{ php_epeg_batch_job_finish */
+/*
+ * Wait for the job, release its input and add
+ * array('result' => mixed, 'error' => string|null) to results.
+ */
+static void
+php_epeg_batch_job_finish(php_epeg_pool_t *pool, php_epeg_batch_job_t *job,
+		zval *results TSRMLS_DC)
+{
+	php_stream *sth = NULL;
+	zval *retval = NULL;
+	int result;
+
+	php_epeg_pool_wait(pool, &job->task);
+	result = job->result;
+
+	/* release the input data */
+	if (job->data != NULL) {
+		efree(job->data);
+		job->data = NULL;
+	}
+
+	MAKE_STD_ZVAL(retval);
+	array_init(retval);
+
+	if (result == 0 && job->out_file_len == 0) {
+		/* return the content of the thumbnail */
+		add_assoc_stringl(retval, "result", (char *)job->out.buf, (int)job->out.len, 1);
+	} else if (result == 0) {
+		/* write the thumbnail to the output stream */
+		char *path, *tmp_path;
+
+		sth = php_epeg_file_stream_open(job->out_file, NULL, &path, &tmp_path TSRMLS_CC);
+		if (!sth) {
+			result = PHP_EPEG_ERROR_WRITE;
+		} else {
+			if ((size_t)php_stream_write(sth, (char *)job->out.buf, job->out.len) != job->out.len) {
+				result = PHP_EPEG_ERROR_WRITE;
+			}
+			if (php_epeg_file_stream_close(sth, path, tmp_path, result == 0 TSRMLS_CC) == FAILURE) {
+				result = PHP_EPEG_ERROR_WRITE;
+			}
+		}
+		if (result == 0) {
+			add_assoc_bool(retval, "result", 1);
+		}
+	}
+	php_epeg_output_free(&job->out);
+
+	if (result == 0) {
+		add_assoc_null(retval, "error");
+	} else {
+		add_assoc_bool(retval, "result", 0);
+		add_assoc_string(retval, "error", (char *)php_epeg_error_string(result), 1);
+	}
+
+	/* keep the key of the job */
+	if (job->key != NULL) {
+		add_assoc_zval_ex(results, job->key, job->key_len, retval);
+	} else {
+		add_index_zval(results, job->index, retval);
+	}
+}
+/* }}} */
+
+/* {{{ proto mixed epeg_thumbnail_create(string in_file, string out_file, int max_width, int max_height[, int quality[, bool auto_orient[, int fit[, array &size]]]]) */
+/**
+ * bool|string epeg_thumbnail(string in_file, string out_file, int max_width, int max_height[, int quality[, bool auto_orient[, int fit[, array &size[, float exif_tolerance]]]]])
+ *
+ * Create thumbnail using the Epeg library.
+ * This function can be used for only JPEG image.
+ *
+ * @param	string	$in_file	The pathname or the URL of the source image.
+ * @param	string	$out_file	The pathname or the URL of the thumbnail.
+ * @param	int	$max_width	The maximum width of the thumbnail.
+ *							The value must be greater than 0.
+ * @param	int	$max_height	The maximum height of the thumbnail.
+ *							The value must be greater than 0.
+ * @param	int	$quality	The quality of the thumbnail. (optional)
+ *							The value must be greater than or equal to 0
+ *							and must be less than or equal to 100.
+ *							The default is 75.
+ * @param	bool	$auto_orient	Whether to make the thumbnail upright by
+ *							the EXIF orientation of the source. (optional)
+ *							The default is false. Without resizing the image
+ *							is rotated losslessly, see epeg_transform().
+ * @param	int	$fit	EPEG_FIT_EXACT, EPEG_FIT_FAST or EPEG_DECODE_DC_ONLY,
+ *							see epeg_decode_size_set(). (optional)
+ *							The default is EPEG_FIT_EXACT.
+ * @param	array	&$size	Set to the size of the thumbnail. (optional)
+ * @param	float	$exif_tolerance	If given, the JPEG thumbnail embedded in
+ *							the EXIF segment is scaled instead of decoding
+ *							the whole image when it is large enough and its
+ *							aspect ratio is within this relative tolerance of
+ *							the source, e.g. 0.02. The value must be less
+ *							than 1. The default is -1, not to use it. (optional)
+ * @return	mixed	False is returned if failed to create the thumbnail.
+ *					True is returned if succeeded in creating and writing the thumbnail.
+ *					If $out_file is an empty string and succeeded in creating
+ *					the thumbnail, the content of the thumbnail is returned.
+ *
+ * If epeg.cache_dir is set and $in_file is a local file, the thumbnail
+ * is kept there and returned without opening the source the next time.
+ */
+static PHP_FUNCTION(epeg_thumbnail_create)
+{
+	/* declaration of the arguments */
+	char *in_file = NULL;
+	int in_file_len = 0;
+	char *out_file = NULL;
+	int out_file_len = 0;
+	long max_width = 0;
+	long max_height = 0;
+	long quality = 75;
+	zend_bool auto_orient = 0;
+	long fit = PHP_EPEG_FIT_EXACT;
+	zval *zsize = NULL;
+	double exif_tolerance = -1.0;
+
+	/* declaration of the local variables */
+	php_epeg_input_t in;
+	php_epeg_decoder_t *dec = NULL;
+	unsigned char *out_buf;
+	int out_buf_len;
+	int transform = PHP_EPEG_TRANSFORM_NONE;
+	int thumb_width, thumb_height;
+	const unsigned char *head;
+	size_t head_len;
+	const unsigned char *exif_thumb = NULL;
+	size_t exif_thumb_len = 0;
+	php_epeg_header_key_t key;
+	zend_bool cached = 0;
+	char cache_path[MAXPATHLEN];
+	char *dst_file;
+	int dst_file_len;
+
+	/* parse the arguments */
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "ssll|lblzd",
+			&in_file, &in_file_len, &out_file, &out_file_len,
+			&max_width, &max_height, &quality, &auto_orient, &fit, &zsize,
+			&exif_tolerance) == FAILURE)
+	{
+		RETURN_FALSE;
+	}
+
+	/* check output size */
+	if (max_width <= 0 || max_height <= 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"Invalid image dimensions '%ldx%ld'", max_width, max_height);
+		RETURN_FALSE;
+	}
+
+	/* check quality */
+	if (quality < 0 || quality > 100) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid quality '%ld'", quality);
+		RETURN_FALSE;
+	}
+
+	/* check fit mode */
+	if (fit != PHP_EPEG_FIT_EXACT && fit != PHP_EPEG_FIT_FAST && fit != PHP_EPEG_DECODE_DC_ONLY) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid fit mode '%ld'", fit);
+		RETURN_FALSE;
+	}
+
+	/* check tolerance, negative not to use the embedded thumbnail */
+	if (exif_tolerance >= 1.0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid tolerance (%f)", exif_tolerance);
+		RETURN_FALSE;
+	}
+
+	/* a thumbnail made before is returned without opening the source */
+	dst_file = out_file;
+	dst_file_len = out_file_len;
+	if (php_epeg_cache_enabled(TSRMLS_C) && php_epeg_header_key_make(in_file, &key TSRMLS_CC)) {
+		PHP_MD5_CTX ctx;
+		long args[5];
+
+		args[0] = max_width;
+		args[1] = max_height;
+		args[2] = quality;
+		args[3] = (long)auto_orient;
+		args[4] = fit;
+		PHP_MD5Init(&ctx);
+		PHP_MD5Update(&ctx, (const unsigned char *)PHP_EPEG_CACHE_TAG_CREATE, sizeof(PHP_EPEG_CACHE_TAG_CREATE));
+		PHP_MD5Update(&ctx, (const unsigned char *)&key, sizeof(key));
+		PHP_MD5Update(&ctx, (const unsigned char *)args, sizeof(args));
+		PHP_MD5Update(&ctx, (const unsigned char *)&exif_tolerance, sizeof(exif_tolerance));
+		php_epeg_cache_path(&ctx, cache_path, sizeof(cache_path) TSRMLS_CC);
+
+		if (php_epeg_cache_fetch(cache_path, &out_buf, &out_buf_len TSRMLS_CC) == SUCCESS) {
+			if (zsize != NULL) {
+				php_stream *sth = php_stream_memory_open(TEMP_STREAM_READONLY, (char *)out_buf, (size_t)out_buf_len);
+				php_epeg_probe_t info;
+
+				memset(&info, 0, sizeof(info));
+				if (sth) {
+					(void)php_epeg_probe_stream(sth, &info TSRMLS_CC);
+					php_stream_close(sth);
+				}
+				thumb_width = info.width;
+				thumb_height = info.height;
+			}
+			php_epeg_set_retval(out_buf, out_buf_len, out_file, out_file_len, return_value TSRMLS_CC);
+			if (zsize != NULL && zend_is_true(return_value)) {
+				zval_dtor(zsize);
+				php_epeg_size_array(zsize, thumb_width, thumb_height);
+			}
+			return;
+		}
+
+		/* made in memory to be stored, and then written to the output */
+		cached = 1;
+		dst_file = "";
+		dst_file_len = 0;
+	}
+
+	/* open the JPEG image and read its header */
+	dec = php_epeg_input_open(in_file, &in TSRMLS_CC);
+	if (dec == NULL) {
+		RETURN_FALSE;
+	}
+
+	/* the EXIF segment is in the header read by the decoder */
+	head = in.mapped ? in.data : (unsigned char *)in.head.c;
+	head_len = in.mapped ? (size_t)in.data_len : in.head.len;
+	if (auto_orient) {
+		transform = php_epeg_exif_transform(head, head_len);
+	}
+
+	/* the image of the DC coefficients is 1/8 of the source */
+	if (fit == PHP_EPEG_DECODE_DC_ONLY) {
+		long dc_width = ((long)dec->cinfo.image_width + 7) / 8;
+		long dc_height = ((long)dec->cinfo.image_height + 7) / 8;
+
+		if (PHP_EPEG_TRANSFORM_SWAPS_AXES(transform)) {
+			long t = dc_width;
+			dc_width = dc_height;
+			dc_height = t;
+		}
+		max_width = MIN(max_width, dc_width);
+		max_height = MIN(max_height, dc_height);
+	}
+
+	/* the embedded thumbnail may be large enough for the upright thumbnail */
+	if (exif_tolerance >= 0.0) {
+		int width = (int)dec->cinfo.image_width;
+		int height = (int)dec->cinfo.image_height;
+
+		if (PHP_EPEG_TRANSFORM_SWAPS_AXES(transform)) {
+			width = (int)dec->cinfo.image_height;
+			height = (int)dec->cinfo.image_width;
+		}
+		if ((long)width > max_width || (long)height > max_height) {
+			(void)php_epeg_calc_thumb_size(width, height,
+					(int)max_width, (int)max_height, &thumb_width, &thumb_height);
+			exif_thumb = php_epeg_exif_thumbnail_fit(head, head_len,
+					(int)dec->cinfo.image_width, (int)dec->cinfo.image_height,
+					transform, thumb_width, thumb_height, exif_tolerance, &exif_thumb_len);
+		}
+	}
+
+	if (exif_thumb != NULL) {
+		php_epeg_params_t params;
+		php_epeg_output_t out;
+		int result;
+
+		/* the source is not decoded at all */
+		php_epeg_decoder_close(dec);
+		if (php_epeg_output_open(&out, dst_file, dst_file_len, in_file TSRMLS_CC) == FAILURE) {
+			php_epeg_input_close(&in TSRMLS_CC);
+			RETURN_FALSE;
+		}
+
+		/* scale and rotate the embedded thumbnail, or copy it if it is of the size */
+		php_epeg_params_init(&params);
+		params.width = thumb_width;
+		params.height = thumb_height;
+		params.quality = (int)quality;
+		result = php_epeg_transform_run(exif_thumb, exif_thumb_len, transform, &params, &out);
+		php_epeg_input_close(&in TSRMLS_CC);
+
+		/* set return value */
+		if (php_epeg_output_close(&out, result, return_value TSRMLS_CC) == FAILURE) {
+			/* raise error by the result */
+			php_epeg_encode_error(result TSRMLS_CC);
+		}
+	} else if (transform != PHP_EPEG_TRANSFORM_NONE) {
+		php_epeg_params_t params;
+		php_epeg_output_t out;
+		int width, height, result;
+
+		/* the whole image is needed to rotate it */
+		width = (int)dec->cinfo.image_width;
+		height = (int)dec->cinfo.image_height;
+		if (PHP_EPEG_TRANSFORM_SWAPS_AXES(transform)) {
+			width = (int)dec->cinfo.image_height;
+			height = (int)dec->cinfo.image_width;
+		}
+		php_epeg_decoder_close(dec);
+		if (php_epeg_input_read_all(&in TSRMLS_CC) == FAILURE) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Cannot read image data");
+			php_epeg_input_close(&in TSRMLS_CC);
+			RETURN_FALSE;
+		}
+		if (php_epeg_output_open(&out, dst_file, dst_file_len, in_file TSRMLS_CC) == FAILURE) {
+			php_epeg_input_close(&in TSRMLS_CC);
+			RETURN_FALSE;
+		}
+
+		/* calculate size of the upright image, or keep it to rotate losslessly */
+		php_epeg_params_init(&params);
+		if ((long)width > max_width || (long)height > max_height) {
+			(void)php_epeg_calc_thumb_size(width, height,
+					(int)max_width, (int)max_height, &params.width, &params.height);
+			if (fit == PHP_EPEG_FIT_FAST) {
+				php_epeg_fit_fast(width, height, &params.width, &params.height);
+			}
+		}
+		thumb_width = (params.width > 0) ? params.width : width;
+		thumb_height = (params.height > 0) ? params.height : height;
+		params.quality = (int)quality;
+		params.dc_only = (fit == PHP_EPEG_DECODE_DC_ONLY);
+		/* rotate or flip the scaled image while encoding it */
+		result = php_epeg_transform_run(in.data, (size_t)in.data_len, transform, &params, &out);
+		php_epeg_input_close(&in TSRMLS_CC);
+
+		/* set return value */
+		if (php_epeg_output_close(&out, result, return_value TSRMLS_CC) == FAILURE) {
+			/* raise error by the result */
+			php_epeg_encode_error(result TSRMLS_CC);
+		}
+	} else if ((long)dec->cinfo.image_width > max_width || (long)dec->cinfo.image_height > max_height) {
+		/* get image size and check whether to do resampling */
+		php_epeg_params_t params;
+		php_epeg_output_t out;
+		int result;
+
+		/* write the thumbnail to the output stream while it is encoded */
+		if (php_epeg_output_open(&out, dst_file, dst_file_len, in_file TSRMLS_CC) == FAILURE) {
+			php_epeg_decoder_close(dec);
+			php_epeg_input_close(&in TSRMLS_CC);
+			RETURN_FALSE;
+		}
+
+		/* calculate size */
+		php_epeg_params_init(&params);
+		(void)php_epeg_calc_thumb_size(
+				(int)dec->cinfo.image_width, (int)dec->cinfo.image_height,
+				(int)max_width, (int)max_height, &params.width, &params.height);
+		if (fit == PHP_EPEG_FIT_FAST) {
+			/* let the decoder make the size by itself */
+			php_epeg_fit_fast((int)dec->cinfo.image_width, (int)dec->cinfo.image_height,
+					&params.width, &params.height);
+		}
+		thumb_width = params.width;
+		thumb_height = params.height;
+		/* set quality */
+		params.quality = (int)quality;
+		params.dc_only = (fit == PHP_EPEG_DECODE_DC_ONLY);
+		/* decode, scale and encode the image while reading the input */
+		result = php_epeg_decoder_encode(dec, &params, &out);
+		/* close the decoder and the input */
+		php_epeg_decoder_close(dec);
+		php_epeg_input_close(&in TSRMLS_CC);
+
+		/* set return value */
+		if (php_epeg_output_close(&out, result, return_value TSRMLS_CC) == FAILURE) {
+			/* raise error by the result */
+			php_epeg_encode_error(result TSRMLS_CC);
+		}
+	} else {
+		size_t out_len = 0;
+		int result;
+
+		/* close the decoder and get the whole input */
+		thumb_width = (int)dec->cinfo.image_width;
+		thumb_height = (int)dec->cinfo.image_height;
+		php_epeg_decoder_close(dec);
+		if (php_epeg_input_read_all(&in TSRMLS_CC) == FAILURE) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Cannot read image data");
+			php_epeg_input_close(&in TSRMLS_CC);
+			RETURN_FALSE;
+		}
+
+		/* allocate memory for the output buffer */
+		out_buf = (unsigned char *)emalloc((size_t)in.data_len + 1);
+
+		/* copy the image without extra markers */
+		result = php_epeg_strip_markers(in.data, (size_t)in.data_len, out_buf, &out_len);
+		if (result != 0) {
+			php_epeg_encode_error(result TSRMLS_CC);
+			efree(out_buf);
+			php_epeg_input_close(&in TSRMLS_CC);
+			RETURN_FALSE;
+		}
+
+		/* release the input data */
+		php_epeg_input_close(&in TSRMLS_CC);
+
+		/* set the result */
+		out_buf_len = (int)out_len;
+		out_buf[out_buf_len] = '\0';
+
+		/* set return value, the buffer is passed or released */
+		php_epeg_set_retval(out_buf, out_buf_len, dst_file, dst_file_len, return_value TSRMLS_CC);
+	}
+
+	/* store the thumbnail and write it to the output */
+	if (cached && Z_TYPE_P(return_value) == IS_STRING) {
+		php_epeg_cache_store(cache_path, (unsigned char *)Z_STRVAL_P(return_value),
+				(size_t)Z_STRLEN_P(return_value) TSRMLS_CC);
+		if (out_file_len > 0) {
+			php_epeg_set_retval((unsigned char *)Z_STRVAL_P(return_value), Z_STRLEN_P(return_value),
+					out_file, out_file_len, return_value TSRMLS_CC);
+		}
+	}
+
+	/* report the size of the thumbnail */
+	if (zsize != NULL && zend_is_true(return_value)) {
+		zval_dtor(zsize);
+		php_epeg_size_array(zsize, thumb_width, thumb_height);
+	}
+}
+/* }}} epeg_thumbnail_create */
+
+/* {{{ proto array epeg_thumbnail_batch(array jobs[, int threads]) */
+/**
+ * array epeg_thumbnail_batch(array jobs[, int threads])
+ *
+ * Create many thumbnails at once with native worker threads.
+ *
+ * Each element of $jobs is an array with the following keys:
+ *  'in'         => The pathname or the URL of the source image.
+ *  'out'        => The pathname or the URL of the thumbnail (optional).
+ *  'max_width'  => The maximum width of the thumbnail.
+ *  'max_height' => The maximum height of the thumbnail.
+ *  'quality'    => The quality of the thumbnail (optional, default 75).
+ * The thumbnails are the same as created by epeg_thumbnail_create().
+ *
+ * The inputs are read and the outputs are written by the calling thread,
+ * only decoding, scaling and encoding run in the workers.
+ * Without thread support the jobs are processed one by one.
+ *
+ * @param	array	$jobs	The list of the jobs.
+ * @param	int		$threads	The number of the worker threads.
+ *							The default is 0, the number of the processors.
+ * @return	array	An array with the same keys as $jobs in the same order,
+ *					each value is array('result' => mixed, 'error' => string|null).
+ *					'result' is the same as the return value of epeg_thumbnail_create()
+ *					and 'error' is the reason of the failure or null.
+ */
+static PHP_FUNCTION(epeg_thumbnail_batch)
+{
+	/* declaration of the arguments */
+	zval *zjobs = NULL;
+	long threads = 0;
+
+	/* declaration of the local variables */
+	HashTable *jobs_ht;
+	HashPosition pos;
+	zval **entry = NULL;
+	php_epeg_batch_job_t *jobs = NULL;
+	php_epeg_pool_t *pool = NULL;
+	int count, window, k, done;
+
+	/* parse the arguments */
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "a|l", &zjobs, &threads) == FAILURE) {
+		RETURN_FALSE;
+	}
+
+	/* check the number of the threads */
+	if (threads < 0 || threads > PHP_EPEG_POOL_MAX_THREADS) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid number of threads '%ld'", threads);
+		RETURN_FALSE;
+	}
+
+	array_init(return_value);
+	jobs_ht = Z_ARRVAL_P(zjobs);
+	count = zend_hash_num_elements(jobs_ht);
+	if (count == 0) {
+		return;
+	}
+
+	/* start the workers, no more than the jobs */
+	if (threads == 0) {
+		threads = php_epeg_cpu_count();
+	}
+	if (threads > count) {
+		threads = count;
+	}
+	pool = php_epeg_pool_create((int)threads);
+	if (pool == NULL) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to start worker threads");
+		zval_dtor(return_value);
+		RETURN_FALSE;
+	}
+
+	/* limit the number of the inputs held in memory */
+	window = php_epeg_pool_size(pool) * 2;
+	if (window < 1) {
+		window = 1;
+	}
+
+	jobs = (php_epeg_batch_job_t *)safe_emalloc((size_t)count, sizeof(php_epeg_batch_job_t), 0);
+	memset(jobs, 0, (size_t)count * sizeof(php_epeg_batch_job_t));
+
+	/* read the inputs and submit the jobs, collect the results in order */
+	k = done = 0;
+	zend_hash_internal_pointer_reset_ex(jobs_ht, &pos);
+	while (zend_hash_get_current_data_ex(jobs_ht, (void **)&entry, &pos) == SUCCESS) {
+		php_epeg_batch_job_t *job = &jobs[k];
+		char *in_file = NULL;
+
+		(void)zend_hash_get_current_key_ex(jobs_ht, &job->key, &job->key_len, &job->index, 0, &pos);
+		php_epeg_output_init(&job->out, realloc, free);
+		job->task.run = php_epeg_batch_job_run;
+
+		if (php_epeg_batch_job_fetch(*entry, job, &in_file TSRMLS_CC) == FAILURE) {
+			job->result = PHP_EPEG_ERROR_ARGS;
+			job->task.done = 1;
+		} else if (php_epeg_batch_job_read(job, in_file TSRMLS_CC) == FAILURE) {
+			job->result = PHP_EPEG_ERROR_READ;
+			job->task.done = 1;
+		} else {
+			php_epeg_pool_submit(pool, &job->task);
+		}
+
+		zend_hash_move_forward_ex(jobs_ht, &pos);
+		k++;
+
+		while (k - done > window) {
+			php_epeg_batch_job_finish(pool, &jobs[done++], return_value TSRMLS_CC);
+		}
+	}
+
+	/* collect the rest */
+	while (done < k) {
+		php_epeg_batch_job_finish(pool, &jobs[done++], return_value TSRMLS_CC);
+	}
+
+	php_epeg_pool_destroy(pool);
+	efree(jobs);
+}
+/* }}} epeg_thumbnail_batch */
+
+/* {{{ proto resource epeg_open(string filename[, boolean is_data]) */
+/**
+ * resource epeg epeg_open(string filename[, boolean is_data])
+ * object Epeg Epeg::__construct(string filename[, boolean is_data])
+ *
+ * Open a JPEG image for thumbnailing.
+ *
+ * @param	string	$filename	The pathname or the URL or the binary data of the source image.
+ * @param	bool	$is_data	Whether $file is a binary data or not.
+ * @return	resource epeg	An Epeg image handle is returned if succeeded in opening the image.
+ *							False is returned if failed to open the image.
+ */
+static PHP_FUNCTION(epeg_open)
+{
+	/* declaration of the resources */
+	zval *obj = getThis();
+	php_epeg_t *im = NULL;
+
+	/* declaration of the arguments */
+	zval **file = NULL;
+	zend_bool is_data = 0;
+
+	/* parse arguments */
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "Z|b", &file, &is_data) == FAILURE) {
+		RETURN_FALSE;
+	}
+	convert_to_string_ex(file);
+
+	if (is_data) {
+		/* open the JPEG image stored in the string without copying it */
+		im = php_epeg_zval_open(*file TSRMLS_CC);
+	} else {
+		/* open Epeg image handle */
+		im = php_epeg_file_open(Z_STRVAL_PP(file) TSRMLS_CC);
+	}
+	if (im == NULL) {
+		RETURN_FALSE;
+	}
+
+	if (obj) {
+		php_epeg_object *intern;
+		intern = (php_epeg_object *)zend_object_store_get_object(obj TSRMLS_CC);
+		if (intern->ptr != NULL) {
+			php_epeg_free(im);
+			zend_throw_exception(zend_exception_get_default(TSRMLS_C),
+					"Epeg already initialized", 0 TSRMLS_CC);
+			return;
+		}
+		intern->ptr = im;
+	} else {
+		ZEND_REGISTER_RESOURCE(return_value, im, le_epeg);
+	}
+}
+/* }}} epeg_open */
+
+/* {{{ proto resource epeg epeg_file_open(string filename) */
+/**
+ * resource epeg epeg_file_open(string filename)
+ *
+ * Open a JPEG image for thumbnailing from pathname or URL.
+ * The whole image is read into memory since the handle may be encoded
+ * more than once, use epeg_thumbnail_create() to decode a large image
+ * or a URL as it is read.
+ *
+ * @param	string	$filename	The pathname or the URL of the source image.
+ * @return	resource epeg	An Epeg image handle is returned if succeeded in opening the image.
+ *							False is returned if failed to open the image.
+ */
+static PHP_FUNCTION(epeg_file_open)
+{
+	php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAM_PASSTHRU, EO_FROM_FILE | EO_TO_RESOURCE);
+}
+/* }}} epeg_file_open */
+
+/* {{{ proto resource epeg epeg_memory_open(string data) */
+/**
+ * resource epeg epeg_memory_open(string data)
+ *
+ * Open a JPEG image for thumbnailing from string.
+ *
+ * @param	string	$data	The binary data of the source image.
+ * @return	resource epeg	An Epeg image handle is returned if succeeded in opening the image.
+ *							False is returned if failed to open the image.
+ */
+static PHP_FUNCTION(epeg_memory_open)
+{
+	php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAM_PASSTHRU, EO_FROM_BUFFER | EO_TO_RESOURCE);
+}
+/* }}} epeg_memory_open */
+
+/* {{{ proto object Epeg Epeg::openFile(string filename) */
+/**
+ * object Epeg Epeg::openFile(string filename)
+ *
+ * Open a JPEG image for thumbnailing from pathname or URL.
+ * The whole image is read into memory since the handle may be encoded
+ * more than once, use epeg_thumbnail_create() to decode a large image
+ * or a URL as it is read.
+ *
+ * @param	string	$filename	The pathname or the URL of the source image.
+ * @return	object Epeg	An instance of class Epeg is returned if succeeded in opening the image.
+ *							False is returned if failed to open the image.
+ * @access public
+ * @static
+ */
+PHP_METHOD(Epeg, openFile)
+{
+	php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAM_PASSTHRU, EO_FROM_FILE | EO_TO_OBJECT);
+}
+/* }}} Epeg::openFile */
+
+/* {{{ proto object Epeg Epeg::openBuffer(string data) */
+/**
+ * object Epeg Epeg::openBuffer(string data)
+ *
+ * Open a JPEG image for thumbnailing from string.
+ *
+ * @param	string	$data	The binary data of the source image.
+ * @return	object Epeg	An instance of class Epeg is returned if succeeded in opening the image.
+ *							False is returned if failed to open the image.
+ * @access public
+ * @static
+ */
+PHP_METHOD(Epeg, openBuffer)
+{
+	php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAM_PASSTHRU, EO_FROM_BUFFER | EO_TO_OBJECT);
+}
+/* }}} Epeg::openBuffer */
+
+/* {{{ proto array epeg_size_get(resource epeg image) */
+/**
+ * array epeg_size_get(resource epeg image)
+ * array Epeg::getSize(void)
+ *
+ * Get the size of the source image.
+ * The width is stored in both offset 0 and index "width" of return value.
+ * The height is stored in both offset 1 and index "height" of return value.
+ *
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @return	array	The size of the image.
+ */
+static PHP_FUNCTION(epeg_size_get)
+{
+	/* declaration of the resources */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
+
+	/* parse the arguments */
+	PHP_EPEG_FETCH_PARAMETER();
+
+	/* set return value to the width and the height */
+	php_epeg_size_array(return_value, im->width, im->height);
+}
+/* }}} epeg_size_get */
+
+/* {{{ proto array epeg_decode_size_set(resource epeg image, int width, int height[, bool keep_aspect[, int fit]]) */
+/**
+ * array epeg_decode_size_set(resource epeg image, int width, int height[, bool keep_aspect[, int fit]])
+ * array Epeg::setDecodeSize(int width, int height[, bool keep_aspect[, int fit]])
+ *
+ * Set the size of the thumbnail.
+ *
+ * With EPEG_FIT_FAST the size is snapped to the source scaled by 1/2, 1/4
+ * or 1/8 if one of them is within 15% of it. The decoder makes that size
+ * in the DCT domain, so the rows are not resampled.
+ *
+ * With EPEG_DECODE_DC_ONLY the thumbnail is made from the DC coefficient
+ * of every 8x8 block, without any IDCT. The size is shrunk to 1/8 of the
+ * source if it is larger. A progressive image is read only until its DC
+ * scans, which is several times faster than decoding it at 1/8.
+ *
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @param	int	$width	The width of the thumbnail.
+ *						The value must be greater than 0.
+ * @param	int	$height	The height of the thumbnail.
+ *						The value must be greater than 0.
+ * @param	bool	$keep_aspect	Whether to keep the aspect ratio.
+ *						The default is false.
+ * @param	int	$fit	EPEG_FIT_EXACT, EPEG_FIT_FAST or EPEG_DECODE_DC_ONLY. (optional)
+ *						The default is EPEG_FIT_EXACT.
+ * @return	array	The size of the thumbnail, in the same form as epeg_size_get().
+ */
+static PHP_FUNCTION(epeg_decode_size_set)
+{
+	/* declaration of the resources */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
+
+	/* declaration of the arguments */
+	long w = 0;
+	long h = 0;
+	zend_bool keep_aspect = 0;
+	long fit = PHP_EPEG_FIT_EXACT;
+
+	/* declaration of the local variables */
+	int width, height;
+
+	/* parse the arguments */
+	PHP_EPEG_PARSE_PARAMETERS("ll|bl", &w, &h, &keep_aspect, &fit);
+
+	/* check decode size */
+	if (w <= 0 || h <= 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid image dimensions");
+		return;
+	}
+
+	/* check fit mode */
+	if (fit != PHP_EPEG_FIT_EXACT && fit != PHP_EPEG_FIT_FAST && fit != PHP_EPEG_DECODE_DC_ONLY) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid fit mode '%ld'", fit);
+		return;
+	}
+
+	/* the size is of the transformed image */
+	width = im->width;
+	height = im->height;
+	if (PHP_EPEG_TRANSFORM_SWAPS_AXES(im->transform)) {
+		width = im->height;
+		height = im->width;
+	}
+
+	/* set decode size */
+	if (keep_aspect) {
+		int tw = 0, th = 0;
+		(void)php_epeg_calc_thumb_size(width, height, (int)w, (int)h, &tw, &th);
+		im->out_width = tw;
+		im->out_height = th;
+	} else {
+		/* do not enlarge the image, like the Epeg library */
+		im->out_width = (w > (long)width) ? width : (int)w;
+		im->out_height = (h > (long)height) ? height : (int)h;
+	}
+	if (fit == PHP_EPEG_FIT_FAST) {
+		php_epeg_fit_fast(width, height, &im->out_width, &im->out_height);
+	} else if (fit == PHP_EPEG_DECODE_DC_ONLY) {
+		php_epeg_fit_dc(width, height, &im->out_width, &im->out_height);
+	}
+	im->dc_only = (fit == PHP_EPEG_DECODE_DC_ONLY);
+
+	/* set return value to the chosen size */
+	php_epeg_size_array(return_value, im->out_width, im->out_height);
+}
+/* }}} epeg_decode_size_set */
+
+#ifdef PHP_EPEG_ENABLE_DECODE_BOUNDS_SET
+/* {{{ proto void epeg_decode_bounds_set(resource epeg image, int x, int y, int width, int height) */
+/**
+ * void epeg_decode_bounds_set(resource epeg image, int x, int y, int width, int height)
+ * void Epeg::setDecodeBounds(int x, int y, int width, int height)
+ *
+ * Set the bounds of the thumbnail.
+ * Usually used with epeg_trim().
+ *
+ * $x and $y must not be less than 0,
+ * $width and $height must be greater than 0,
+ * ($x + $width) and ($y + $height) must not be greater than the original.
+ *
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @param	int	$x	The horizontal start position of the source image.
+ * @param	int	$y	The vertical start position of the source image.
+ * @param	int	$width	The horizontal distance from the start position.
+ * @param	int	$height	The vertical distance from the start position.
+ * @return	void
+ */
+static PHP_FUNCTION(epeg_decode_bounds_set)
+{
+	/* declaration of the resources */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
+
+	/* declaration of the arguments */
+	long x = 0;
+	long y = 0;
+	long w = 0;
+	long h = 0;
+
+	/* parse the arguments */
+	PHP_EPEG_PARSE_PARAMETERS("llll", &x, &y, &w, &h);
+
+	/* check decode bounds */
+	if (x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > (long)im->width || y + h > (long)im->height) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid image dimensions");
+		return;
+	}
+
+	/* set decode bounds */
+	im->bounds_x = (int)x;
+	im->bounds_y = (int)y;
+	im->out_width = (int)w;
+	im->out_height = (int)h;
+}
+/* }}} epeg_decode_bounds_set */
+#endif
+
+/* {{{ proto void epeg_decode_colorspace_set(resource epeg image, int colorspace) */
+/**
+ * void epeg_decode_colorspace_set(resource epeg image, int colorspace)
+ * void Epeg::getSize(int colorspace)
+ *
+ * Set the colorspace of the thumbnail.
+ *
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @param	int	$colorspace	The colorspace of the thumbnail.
+ *							The value must be one of the following:
+ *								EPEG_GRAY8
+ *								EPEG_YUV8
+ *								EPEG_RGB8
+ *								EPEG_BGR8
+ *								EPEG_RGBA8
+ *								EPEG_BGRA8
+ *								EPEG_ARGB32
+ *								EPEG_CMYK
+ * @return	void
+ */
+static PHP_FUNCTION(epeg_decode_colorspace_set)
+{
+	/* declaration of the resources */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
 
-		/* copy leftovers */
-		if (in_ptr < in_end) {
-			size_t rest_len = (size_t)(in_end - in_ptr);
-			(void)memcpy(out_ptr, in_ptr, rest_len);
-			out_ptr += rest_len;
-		}
+	/* declaration of the arguments */
+	long colorspace = 0;
 
-		/* free the input buffer */
-		efree(in_buf);
+	/* parse the arguments */
+	PHP_EPEG_PARSE_PARAMETERS("l", &colorspace);
 
-		/* set the result */
-		out_buf_len = (int)(out_ptr - out_buf);
+	/* check colorspace */
+	if (colorspace < (long)EPEG_GRAY8 || colorspace > (long)EPEG_CMYK) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid colorspace");
+	} else {
+		im->colorspace = (int)colorspace;
 	}
+}
+/* }}} epeg_decode_colorspace_set */
 
-	/* set return value */
-	php_epeg_set_retval(out_buf, out_buf_len, out_file, out_file_len, return_value TSRMLS_CC);
+/* {{{ proto string epeg_comment_get(resource epeg image) */
+/**
+ * string epeg_comment_get(resource epeg image)
+ * string Epeg::getComment(void)
+ *
+ * Get the comment field of the source image.
+ *
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @return	string	The comment field of the source image.
+ */
+static PHP_FUNCTION(epeg_comment_get)
+{
+	/* declaration of the arguments */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
+
+	/* declaration of the local variables */
+	const char *comment = NULL;
 
-	/* free the output buffer */
-	if (out_buf_free_stdc) {
-		free(out_buf);
-	} else if (out_buf_free_zend) {
-		efree(out_buf);
+	/* parse the arguments */
+	PHP_EPEG_FETCH_PARAMETER();
+
+	/* get comment */
+	if (im->ptr == NULL) {
+		comment = im->header->has_comment ? im->header->comment : NULL;
+	} else {
+		comment = epeg_comment_get(im->ptr);
+	}
+	if (comment == NULL) {
+		RETURN_EMPTY_STRING();
+	} else {
+		RETURN_STRING((char *)comment, 1);
 	}
 }
-/* }}} epeg_thumbnail_create */
+/* }}} epeg_comment_get */
 
-/* {{{ proto resource epeg_open(string filename[, boolean is_data]) */
+/* {{{ proto void epeg_comment_set(resource epeg image, string comment) */
 /**
- * resource epeg epeg_open(string filename[, boolean is_data])
- * object Epeg Epeg::__construct(string filename[, boolean is_data])
+ * void epeg_comment_set(resource epeg image, string comment)
+ * void Epeg::setComment(string comment)
  *
- * Open a JPEG image for thumbnailing.
+ * Set the comment field of the thumbnail.
  *
- * @param	string	$filename	The pathname or the URL or the binary data of the source image.
- * @param	bool	$is_data	Whether $file is a binary data or not.
- * @return	resource epeg	An Epeg image handle is returned if succeeded in opening the image.
- *							False is returned if failed to open the image.
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @param	string	$comment	The comment field of the thumbnail.
+ * @return	void
  */
-static PHP_FUNCTION(epeg_open)
+static PHP_FUNCTION(epeg_comment_set)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
+	zval *zim = NULL;
 	php_epeg_t *im = NULL;
 
 	/* declaration of the arguments */
-	char *file = NULL;
-	int file_len = 0;
-	zend_bool is_data = 0;
+	const char *comment = NULL;
+	int comment_len = 0;
 
-	/* parse arguments */
-	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s|b", &file, &file_len, &is_data) == FAILURE) {
-		RETURN_FALSE;
-	}
+	/* parse the arguments */
+	PHP_EPEG_PARSE_PARAMETERS("s", &comment, &comment_len);
 
-	if (is_data) {
-		/* open the JPEG image stored in the buffer */
-		im = php_epeg_memory_open(file, file_len TSRMLS_CC);
-	} else {
-		/* open Epeg image handle */
-		im = php_epeg_file_open(file TSRMLS_CC);
-	}
-	if (im == NULL) {
-		RETURN_FALSE;
+	/* set the comment */
+	if (im->comment != NULL) {
+		efree(im->comment);
 	}
+	im->comment = estrndup(comment, comment_len);
+}
+/* }}} epeg_comment_set */
 
-	if (obj) {
-		php_epeg_object *intern;
-		intern = (php_epeg_object *)zend_object_store_get_object(obj TSRMLS_CC);
-		if (intern->ptr != NULL) {
-			php_epeg_free(im);
-			zend_throw_exception(zend_exception_get_default(TSRMLS_C),
-					"Epeg already initialized", 0 TSRMLS_CC);
-			return;
-		}
-		intern->ptr = im;
-	} else {
-		ZEND_REGISTER_RESOURCE(return_value, im, le_epeg);
+/* {{{ proto void epeg_quality_set(resource epeg image, int quality) */
+/**
+ * void epeg_quality_set(resource epeg image, int quality)
+ * void Epeg::setQuality(int quality)
+ *
+ * Set the quality of the thumbnail.
+ *
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @param	int	$quality	The quality of the thumbnail. (optional)
+ *							The value must be greater than or equal to 0
+ *							and must be less than or equal to 100.
+ *							The default is 75.
+ * @return	void
+ */
+static PHP_FUNCTION(epeg_quality_set)
+{
+	/* declaration of the resources */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
+
+	/* declaration of the arguments */
+	long quality = 0;
+
+	/* parse the arguments */
+	PHP_EPEG_PARSE_PARAMETERS("l", &quality);
+
+	/* check quality */
+	if (quality < 0 || quality > 100L) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid quality (%ld)", quality);
+		return;
 	}
+
+	/* set the quality */
+	im->quality = (int)quality;
 }
-/* }}} epeg_open */
+/* }}} epeg_quality_set */
 
-/* {{{ proto resource epeg epeg_file_open(string filename) */
+/* {{{ proto void epeg_filter_set(resource epeg image, int filter[, float sharpen]) */
 /**
- * resource epeg epeg_file_open(string filename)
+ * void epeg_filter_set(resource epeg image, int filter[, float sharpen])
+ * void Epeg::setFilter(int filter[, float sharpen])
  *
- * Open a JPEG image for thumbnailing from pathname or URL.
+ * Set the filter to resample the thumbnail with.
  *
- * @param	string	$filename	The pathname or the URL of the source image.
- * @return	resource epeg	An Epeg image handle is returned if succeeded in opening the image.
- *							False is returned if failed to open the image.
+ * The image is decoded at 1/2, 1/4 or 1/8 scale in the DCT domain and
+ * then resampled to the decode size. EPEG_FILTER_POINT picks the nearest
+ * pixels like the Epeg library, EPEG_FILTER_BOX, EPEG_FILTER_TRIANGLE and
+ * EPEG_FILTER_LANCZOS3 average the pixels and do not alias.
+ * The thumbnail is sharpened with an unsharp mask if $sharpen is greater
+ * than 0, 0.5 is a moderate amount.
+ *
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @param	int	$filter	One of EPEG_FILTER_*.
+ * @param	float	$sharpen	The amount of sharpening. (optional)
+ *							The value must not be less than 0.
+ *							The default is 0.
+ * @return	void
  */
-static PHP_FUNCTION(epeg_file_open)
+static PHP_FUNCTION(epeg_filter_set)
 {
-	php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAM_PASSTHRU, EO_FROM_FILE | EO_TO_RESOURCE);
+	/* declaration of the resources */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
+
+	/* declaration of the arguments */
+	long filter = 0;
+	double sharpen = 0.0;
+
+	/* parse the arguments */
+	PHP_EPEG_PARSE_PARAMETERS("l|d", &filter, &sharpen);
+
+	/* check filter */
+	if (filter < PHP_EPEG_FILTER_POINT || filter > PHP_EPEG_FILTER_LANCZOS3) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid filter '%ld'", filter);
+		return;
+	}
+	if (sharpen < 0.0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid sharpening amount (%f)", sharpen);
+		return;
+	}
+
+	/* set the filter */
+	im->filter = (int)filter;
+	im->sharpen = sharpen;
 }
-/* }}} epeg_file_open */
+/* }}} epeg_filter_set */
 
-/* {{{ proto resource epeg epeg_memory_open(string data) */
+/* {{{ proto array epeg_thumbnail_comments_get(resource epeg image) */
 /**
- * resource epeg epeg_memory_open(string data)
+ * array epeg_thumbnail_comments_get(resource epeg image)
+ * array Epeg::getThumbnailComments(void)
  *
- * Open a JPEG image for thumbnailing from string.
+ * Get thumbnail comments of loaded image.
  *
- * @param	string	$data	The binary data of the source image.
- * @return	resource epeg	An Epeg image handle is returned if succeeded in opening the image.
- *							False is returned if failed to open the image.
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @return	array	Thumbnail comments written by Epeg to any saved JPEG files.
  */
-static PHP_FUNCTION(epeg_memory_open)
+static PHP_FUNCTION(epeg_thumbnail_comments_get)
 {
-	php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAM_PASSTHRU, EO_FROM_BUFFER | EO_TO_RESOURCE);
+	/* declaration of the resources */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
+
+	/* declaration of the local variables */
+	Epeg_Thumbnail_Info info = {0};
+
+	/* parse the arguments */
+	PHP_EPEG_FETCH_PARAMETER();
+
+	/* get thumbnail comments */
+	if (im->ptr == NULL) {
+		info.uri = im->header->has_uri ? im->header->uri : NULL;
+		info.mtime = (unsigned long long)im->header->mtime;
+		info.w = im->header->thumb_width;
+		info.h = im->header->thumb_height;
+		info.mimetype = im->header->has_mimetype ? im->header->mimetype : NULL;
+	} else {
+		epeg_thumbnail_comments_get(im->ptr, &info);
+	}
+
+	/* initialize return_value as an array */
+	array_init(return_value);
+
+	/* set return value to the width and the height */
+	if (info.uri == NULL) {
+		add_assoc_null(return_value, "uri");
+	} else {
+		add_assoc_string(return_value, "uri", (char *)info.uri, 1);
+	}
+	add_assoc_long(return_value, "mtime", (long)info.mtime);
+	add_assoc_long(return_value, "width", (long)info.w);
+	add_assoc_long(return_value, "height", (long)info.h);
+	if (info.mimetype == NULL) {
+		add_assoc_null(return_value, "mimetype");
+	} else {
+		add_assoc_string(return_value, "mimetype", (char *)info.mimetype, 1);
+	}
 }
-/* }}} epeg_memory_open */
+/* }}} epeg_thumbnail_comments_get */
 
-/* {{{ proto object Epeg Epeg::openFile(string filename) */
+/* {{{ proto void epeg_thumbnail_comments_enable(resource epeg image, bool onoff) */
 /**
- * object Epeg Epeg::openFile(string filename)
+ * void epeg_thumbnail_comments_enable(resource epeg image, bool onoff)
+ * void Epeg::enableThumbnailComments(bool onoff)
  *
- * Open a JPEG image for thumbnailing from pathname or URL.
+ * Enable or disable thumbnail comments in saved image.
+ * The default is false (disabled).
  *
- * @param	string	$filename	The pathname or the URL of the source image.
- * @return	object Epeg	An instance of class Epeg is returned if succeeded in opening the image.
- *							False is returned if failed to open the image.
- * @access public
- * @static
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @param	bool	$onoff	A boolean on and off enabling flag.
+ * @return	void
  */
-PHP_METHOD(Epeg, openFile)
+static PHP_FUNCTION(epeg_thumbnail_comments_enable)
 {
-	php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAM_PASSTHRU, EO_FROM_FILE | EO_TO_OBJECT);
+	/* declaration of the resources */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
+
+	/* declaration of the arguments */
+	zend_bool onoff = 1;
+
+	/* parse the arguments */
+	PHP_EPEG_PARSE_PARAMETERS("|b", &onoff);
+
+	/* enable/disable thumbnail comments */
+	im->thumbnail_comments = onoff;
 }
-/* }}} Epeg::openFile */
+/* }}} epeg_thumbnail_comments_enable */
 
-/* {{{ proto object Epeg Epeg::openBuffer(string data) */
+/* {{{ proto void epeg_retained_pixels_enable(resource epeg image, bool onoff) */
 /**
- * object Epeg Epeg::openBuffer(string data)
+ * void epeg_retained_pixels_enable(resource epeg image, bool onoff)
+ * void Epeg::enableRetainedPixels(bool onoff)
  *
- * Open a JPEG image for thumbnailing from string.
+ * Enable or disable keeping the scaled pixels between epeg_encode() calls.
+ * The default is false (disabled).
  *
- * @param	string	$data	The binary data of the source image.
- * @return	object Epeg	An instance of class Epeg is returned if succeeded in opening the image.
- *							False is returned if failed to open the image.
- * @access public
- * @static
+ * While enabled, epeg_encode() decodes the image only when the decode size
+ * or the colorspace differs from the previous call, so encoding the same
+ * size with another quality or comment costs only the encoding.
+ * The pixels stay in memory until disabled or the handle is closed.
+ *
+ * @param	resource epeg	$image	An Epeg image handle.
+ * @param	bool	$onoff	A boolean on and off enabling flag.
+ * @return	void
  */
-PHP_METHOD(Epeg, openBuffer)
+static PHP_FUNCTION(epeg_retained_pixels_enable)
 {
-	php_epeg_open_wrapper(INTERNAL_FUNCTION_PARAM_PASSTHRU, EO_FROM_BUFFER | EO_TO_OBJECT);
+	/* declaration of the resources */
+	zval *obj = getThis();
+	zval *zim = NULL;
+	php_epeg_t *im = NULL;
+
+	/* declaration of the arguments */
+	zend_bool onoff = 1;
+
+	/* parse the arguments */
+	PHP_EPEG_PARSE_PARAMETERS("|b", &onoff);
+
+	/* enable/disable retained pixels */
+	im->retain_pixels = onoff;
+	if (!onoff) {
+		php_epeg_pixels_free(&im->pixels);
+	}
 }
-/* }}} Epeg::openBuffer */
+/* }}} epeg_retained_pixels_enable */
 
-/* {{{ proto array epeg_size_get(resource epeg image) */
+/* {{{ proto void epeg_exif_thumbnail_enable(resource epeg image, bool onoff[, float tolerance]) */
 /**
- * array epeg_size_get(resource epeg image)
- * array Epeg::getSize(void)
+ * void epeg_exif_thumbnail_enable(resource epeg image, bool onoff[, float tolerance])
+ * void Epeg::enableExifThumbnail(bool onoff[, float tolerance])
  *
- * Get the size of the source image.
- * The width is stored in both offset 0 and index "width" of return value.
- * The height is stored in both offset 1 and index "height" of return value.
+ * Enable or disable encoding from the JPEG thumbnail embedded in the EXIF
+ * segment of the image. The default is false (disabled).
+ *
+ * While enabled, epeg_encode() scales the embedded thumbnail instead of
+ * decoding the whole image if a decode size is set, the thumbnail is at
+ * least that size and its aspect ratio is the same as the one of the image.
+ * An embedded thumbnail of just that size is copied losslessly.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @return	array	The size of the image.
+ * @param	bool	$onoff	A boolean on and off enabling flag.
+ * @param	float	$tolerance	How far the aspect ratio of the thumbnail
+ *							may be off the one of the image, relatively.
+ *							The value must be greater than or equal to 0
+ *							and must be less than 1. The default is 0.02.
+ * @return	void
  */
-static PHP_FUNCTION(epeg_size_get)
+static PHP_FUNCTION(epeg_exif_thumbnail_enable)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
 	zval *zim = NULL;
 	php_epeg_t *im = NULL;
 
+	/* declaration of the arguments */
+	zend_bool onoff = 1;
+	double tolerance = PHP_EPEG_EXIF_THUMBNAIL_TOLERANCE;
+
 	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETER();
+	PHP_EPEG_PARSE_PARAMETERS("|bd", &onoff, &tolerance);
 
-	/* initialize return_value as an array */
-	array_init(return_value);
+	/* check tolerance */
+	if (tolerance < 0.0 || tolerance >= 1.0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid tolerance (%f)", tolerance);
+		return;
+	}
 
-	/* set return value to the width and the height */
-	add_index_long(return_value, 0, (long)im->width);
-	add_index_long(return_value, 1, (long)im->height);
-	add_assoc_long(return_value, "width", (long)im->width);
-	add_assoc_long(return_value, "height", (long)im->height);
+	/* enable/disable the embedded thumbnail */
+	im->exif_thumbnail = onoff;
+	im->exif_tolerance = tolerance;
 }
-/* }}} epeg_size_get */
+/* }}} epeg_exif_thumbnail_enable */
 
-/* {{{ proto void epeg_decode_size_set(resource epeg image, int width, int height[, bool keep_aspect]) */
+/* {{{ proto void epeg_transform(resource epeg image, int op) */
 /**
- * void epeg_decode_size_set(resource epeg image, int width, int height[, bool keep_aspect])
- * void Epeg::setDecodeSize(int width, int height[, bool keep_aspect])
+ * void epeg_transform(resource epeg image, int op)
+ * void Epeg::transform(int op)
  *
- * Set the size of the thumbnail.
+ * Rotate or flip the image when it is encoded.
+ *
+ * If neither the decode size nor the colorspace is set, epeg_encode()
+ * rearranges the DCT coefficients like jpegtran instead of decoding
+ * the image, so the quality of the source is kept. The partial MCUs
+ * at the edges which would move to the top or the left are trimmed.
+ * Otherwise the scaled image is rotated while it is encoded, and the
+ * decode size is the size of the rotated image, so set the transform
+ * before the decode size. epeg_trim(), epeg_encode_multiple() and
+ * epeg_tile_pyramid() ignore the transform.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @param	int	$width	The width of the thumbnail.
- *						The value must be greater than 0.
- * @param	int	$height	The height of the thumbnail.
- *						The value must be greater than 0.
- * @param	bool	$keep_aspect	Whether to keep the aspect ratio.
- *						The default is false.
+ * @param	int	$op	The transform.
+ *						The value must be one of the following:
+ *							EPEG_TRANSFORM_NONE
+ *							EPEG_TRANSFORM_FLIP_H
+ *							EPEG_TRANSFORM_FLIP_V
+ *							EPEG_TRANSFORM_TRANSPOSE
+ *							EPEG_TRANSFORM_TRANSVERSE
+ *							EPEG_TRANSFORM_ROT_90
+ *							EPEG_TRANSFORM_ROT_180
+ *							EPEG_TRANSFORM_ROT_270
+ *							EPEG_TRANSFORM_AUTO (by the EXIF orientation)
  * @return	void
  */
-static PHP_FUNCTION(epeg_decode_size_set)
+static PHP_FUNCTION(epeg_transform)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
@@ -1118,51 +4507,39 @@ static PHP_FUNCTION(epeg_decode_size_set)
 	php_epeg_t *im = NULL;
 
 	/* declaration of the arguments */
-	long w = 0;
-	long h = 0;
-	zend_bool keep_aspect = 0;
+	long op = 0;
 
 	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETERS("ll|b", &w, &h, &keep_aspect);
-
-	/* check decode size */
-	if (w <= 0 || h <= 0) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid image dimensions");
-		return;
-	}
+	PHP_EPEG_PARSE_PARAMETERS("l", &op);
 
-	/* set decode size */
-	if (keep_aspect) {
-		int tw = 0, th = 0;
-		(void)php_epeg_calc_thumb_size(im->width, im->height, (int)w, (int)h, &tw, &th);
-		epeg_decode_size_set(im->ptr, tw, th);
+	/* check the transform */
+	if (op == PHP_EPEG_TRANSFORM_AUTO) {
+		im->transform = php_epeg_exif_transform(im->data, (size_t)im->size);
+	} else if (op < PHP_EPEG_TRANSFORM_NONE || op > PHP_EPEG_TRANSFORM_ROT_270) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid transform '%ld'", op);
 	} else {
-		epeg_decode_size_set(im->ptr, (int)w, (int)h);
+		im->transform = (int)op;
 	}
 }
-/* }}} epeg_decode_size_set */
+/* }}} epeg_transform */
 
-#ifdef PHP_EPEG_ENABLE_DECODE_BOUNDS_SET
-/* {{{ proto void epeg_decode_bounds_set(resource epeg image, int x, int y, int width, int height) */
+/* {{{ proto mixed epeg_encode(resource epeg image[, string filename]) */
 /**
- * void epeg_decode_bounds_set(resource epeg image, int x, int y, int width, int height)
- * void Epeg::setDecodeBounds(int x, int y, int width, int height)
- *
- * Set the bounds of the thumbnail.
- * Usually used with epeg_trim().
+ * mixed epeg_encode(resource epeg image[, string filename])
+ * mixed Epeg::encode([string filename])
  *
- * $x and $y must not be less than 0,
- * $width and $height must be greater than 0,
- * ($x + $width) and ($y + $height) must not be greater than the original.
+ * Save or get the scaled image.
+ * If epeg.cache_dir is set, the thumbnail is kept there and returned
+ * without decoding the image the next time it is made with the same settings.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @param	int	$x	The horizontal start position of the source image.
- * @param	int	$y	The vertical start position of the source image.
- * @param	int	$width	The horizontal distance from the start position.
- * @param	int	$height	The vertical distance from the start position.
- * @return	void
+ * @param	string	$filename	The pathname or the URL of the source image. (optional)
+ * @return	bool|string	False is returned if failed to create the thumbnail.
+ *						True is returned if succeeded in creating and writing the thumbnail.
+ *						If $out_file is an empty string and succeeded in creating
+ *						the thumbnail, the content of the thumbnail is returned.
  */
-static PHP_FUNCTION(epeg_decode_bounds_set)
+static PHP_FUNCTION(epeg_encode)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
@@ -1170,47 +4547,82 @@ static PHP_FUNCTION(epeg_decode_bounds_set)
 	php_epeg_t *im = NULL;
 
 	/* declaration of the arguments */
-	long x = 0;
-	long y = 0;
-	long w = 0;
-	long h = 0;
+	char *file = NULL;
+	int file_len = 0;
+
+	/* declaration of the local variables */
+	php_epeg_output_t out;
+	int result = 0;
+	zend_bool cached = 0;
+	char cache_path[MAXPATHLEN];
 
 	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETERS("llll", &x, &y, &w, &h);
+	PHP_EPEG_PARSE_PARAMETERS("|s", &file, &file_len);
 
-	/* check decode bounds */
-	if (x < 0 || y < 0 || w <= 0 || h <= 0 || x + w > (long)im->width || y + h > (long)im->height) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid image dimensions");
+	/* a thumbnail made before is returned without decoding the image */
+	if (php_epeg_cache_enabled(TSRMLS_C)) {
+		unsigned char *buf;
+		int buf_len;
+
+		php_epeg_cache_key_handle(im, cache_path, sizeof(cache_path) TSRMLS_CC);
+		if (php_epeg_cache_fetch(cache_path, &buf, &buf_len TSRMLS_CC) == SUCCESS) {
+			php_epeg_set_retval(buf, buf_len, file, file_len, return_value TSRMLS_CC);
+			php_epeg_reset(im);
+			return;
+		}
+		cached = 1;
+	}
+
+	/* encode the image into the output stream or a Zend string */
+	if (php_epeg_output_open(&out, cached ? "" : file, cached ? 0 : file_len, NULL TSRMLS_CC) == FAILURE) {
+		RETURN_FALSE;
+	}
+	result = php_epeg_encode_handle(im, 0, &out TSRMLS_CC);
+
+	/* set return value */
+	if (php_epeg_output_close(&out, result, return_value TSRMLS_CC) == FAILURE) {
+		/* raise error by the result */
+		php_epeg_encode_error(result TSRMLS_CC);
 		return;
 	}
 
-	/* set decode bounds */
-	epeg_decode_bounds_set(im->ptr, (int)x, (int)y, (int)w, (int)h);
+	/* store the thumbnail and write it to the output */
+	if (cached) {
+		php_epeg_cache_store(cache_path, (unsigned char *)Z_STRVAL_P(return_value),
+				(size_t)Z_STRLEN_P(return_value) TSRMLS_CC);
+		if (file_len > 0) {
+			php_epeg_set_retval((unsigned char *)Z_STRVAL_P(return_value), Z_STRLEN_P(return_value),
+					file, file_len, return_value TSRMLS_CC);
+		}
+	}
+
+	/* reset internal image handler */
+	php_epeg_reset(im);
 }
-/* }}} epeg_decode_bounds_set */
-#endif
+/* }}} epeg_encode */
 
-/* {{{ proto void epeg_decode_colorspace_set(resource epeg image, int colorspace) */
+/* {{{ proto array epeg_encode_multiple(resource epeg image, array sizes[, bool keep_aspect]) */
 /**
- * void epeg_decode_colorspace_set(resource epeg image, int colorspace)
- * void Epeg::getSize(int colorspace)
+ * array epeg_encode_multiple(resource epeg image, array sizes[, bool keep_aspect])
+ * array Epeg::encodeMultiple(array sizes[, bool keep_aspect])
  *
- * Set the colorspace of the thumbnail.
+ * Save or get the image scaled to several sizes at once.
+ * The source image is decoded only once for all sizes.
+ *
+ * Each element of $sizes is an array of the width, the height
+ * and the pathname or the URL of the thumbnail (optional).
+ * The quality, the colorspace, the filter and the comments set to
+ * the image are used for all sizes.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @param	int	$colorspace	The colorspace of the thumbnail.
- *							The value must be one of the following:
- *								EPEG_GRAY8
- *								EPEG_YUV8
- *								EPEG_RGB8
- *								EPEG_BGR8
- *								EPEG_RGBA8
- *								EPEG_BGRA8
- *								EPEG_ARGB32
- *								EPEG_CMYK
- * @return	void
+ * @param	array	$sizes	The list of array(width, height[, filename]).
+ * @param	bool	$keep_aspect	Whether to keep the aspect ratio.
+ *						The default is false.
+ * @return	array|bool	False is returned if failed to create the thumbnails.
+ *						Otherwise an array with the same keys as $sizes is returned,
+ *						each value is the same as the return value of epeg_encode().
  */
-static PHP_FUNCTION(epeg_decode_colorspace_set)
+static PHP_FUNCTION(epeg_encode_multiple)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
@@ -1218,65 +4630,235 @@ static PHP_FUNCTION(epeg_decode_colorspace_set)
 	php_epeg_t *im = NULL;
 
 	/* declaration of the arguments */
-	long colorspace = 0;
+	zval *zsizes = NULL;
+	zend_bool keep_aspect = 0;
+
+	/* declaration of the local variables */
+	HashTable *sizes;
+	HashPosition pos;
+	zval **entry = NULL;
+	php_epeg_decoder_t *dec = NULL;
+	php_epeg_params_t *params = NULL;
+	php_epeg_output_t *outs = NULL;
+	zend_bool *unopened = NULL;
+	int count, k, result;
 
 	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETERS("l", &colorspace);
+	PHP_EPEG_PARSE_PARAMETERS("a|b", &zsizes, &keep_aspect);
 
-	/* check colorspace */
-	if (colorspace < (long)EPEG_GRAY8 || colorspace > (long)EPEG_CMYK) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid colorspace");
+	/* check sizes */
+	sizes = Z_ARRVAL_P(zsizes);
+	count = zend_hash_num_elements(sizes);
+	if (count == 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "No image sizes given");
+		RETURN_FALSE;
+	}
+
+	params = (php_epeg_params_t *)safe_emalloc((size_t)count, sizeof(php_epeg_params_t), 0);
+	outs = (php_epeg_output_t *)safe_emalloc((size_t)count, sizeof(php_epeg_output_t), 0);
+	unopened = (zend_bool *)ecalloc((size_t)count, sizeof(zend_bool));
+	for (k = 0; k < count; k++) {
+		php_epeg_output_init(&outs[k], php_epeg_erealloc, php_epeg_efree);
+	}
+
+	/* set the output sizes */
+	k = 0;
+	zend_hash_internal_pointer_reset_ex(sizes, &pos);
+	while (zend_hash_get_current_data_ex(sizes, (void **)&entry, &pos) == SUCCESS) {
+		long w = 0, h = 0;
+		char *file;
+		int file_len;
+
+		if (php_epeg_size_fetch(*entry, &w, &h, &file, &file_len TSRMLS_CC) == FAILURE) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid image dimensions at offset %d", k);
+			php_epeg_outputs_discard(outs, count TSRMLS_CC);
+			efree(params);
+			efree(outs);
+			efree(unopened);
+			RETURN_FALSE;
+		}
+
+		/* write to the stream while encoding, the result is false if it cannot be opened */
+		if (php_epeg_output_open(&outs[k], file, file_len, NULL TSRMLS_CC) == FAILURE) {
+			php_epeg_output_init(&outs[k], php_epeg_erealloc, php_epeg_efree);
+			unopened[k] = 1;
+		}
+
+		php_epeg_params_fill(im, &params[k] TSRMLS_CC);
+		if (keep_aspect) {
+			(void)php_epeg_calc_thumb_size(im->width, im->height, (int)w, (int)h,
+					&params[k].width, &params[k].height);
+		} else {
+			/* the Epeg library does not enlarge the image either */
+			params[k].width = (w > (long)im->width) ? im->width : (int)w;
+			params[k].height = (h > (long)im->height) ? im->height : (int)h;
+		}
+
+		zend_hash_move_forward_ex(sizes, &pos);
+		k++;
+	}
+
+	/* decode once, encode all */
+	dec = php_epeg_decoder_open_memory(im->data, (size_t)im->size);
+	if (dec == NULL) {
+		result = PHP_EPEG_ERROR_DECODE;
 	} else {
-		epeg_decode_colorspace_set(im->ptr, (Epeg_Colorspace)colorspace);
+		result = php_epeg_decoder_encode_multiple(dec, params, count, outs);
+		php_epeg_decoder_close(dec);
+	}
+	if (result != 0) {
+		for (k = 0; k < count; k++) {
+			if (outs[k].write_error) {
+				php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to write image data to stream");
+				break;
+			}
+		}
+		if (k == count) {
+			/* raise error by the result */
+			php_epeg_encode_error(result TSRMLS_CC);
+		}
+		php_epeg_outputs_discard(outs, count TSRMLS_CC);
+		efree(params);
+		efree(outs);
+		efree(unopened);
+		RETURN_FALSE;
+	}
+	efree(params);
+
+	/* set return value */
+	array_init(return_value);
+	k = 0;
+	zend_hash_internal_pointer_reset_ex(sizes, &pos);
+	while (zend_hash_get_current_data_ex(sizes, (void **)&entry, &pos) == SUCCESS) {
+		zval *retval = NULL;
+		char *key = NULL;
+		uint key_len = 0;
+		ulong index = 0;
+
+		MAKE_STD_ZVAL(retval);
+		if (unopened[k]) {
+			php_epeg_output_free(&outs[k]);
+			ZVAL_FALSE(retval);
+		} else {
+			(void)php_epeg_output_close(&outs[k], 0, retval TSRMLS_CC);
+		}
+
+		if (zend_hash_get_current_key_ex(sizes, &key, &key_len, &index, 0, &pos) == HASH_KEY_IS_STRING) {
+			add_assoc_zval_ex(return_value, key, key_len, retval);
+		} else {
+			add_index_zval(return_value, index, retval);
+		}
+
+		zend_hash_move_forward_ex(sizes, &pos);
+		k++;
 	}
+	efree(outs);
+	efree(unopened);
 }
-/* }}} epeg_decode_colorspace_set */
+/* }}} epeg_encode_multiple */
 
-/* {{{ proto string epeg_comment_get(resource epeg image) */
+/* {{{ proto int epeg_encode_async(resource epeg image) */
 /**
- * string epeg_comment_get(resource epeg image)
- * string Epeg::getComment(void)
+ * int epeg_encode_async(resource epeg image)
+ * int Epeg::encodeAsync()
  *
- * Get the comment field of the source image.
+ * Encode the image in a background thread.
+ *
+ * The job takes a copy of the image and its settings, so the handle
+ * is reset and can be used again as soon as this function returns.
+ * The result is fetched by epeg_jobs_collect() when the stream
+ * returned by epeg_jobs_fd() becomes readable.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @return	string	The comment field of the source image.
+ * @return	int		The ID of the job is returned if succeeded in starting the job.
+ *					False is returned if failed to start the job.
  */
-static PHP_FUNCTION(epeg_comment_get)
+static PHP_FUNCTION(epeg_encode_async)
 {
-	/* declaration of the arguments */
+	/* declaration of the resources */
 	zval *obj = getThis();
 	zval *zim = NULL;
 	php_epeg_t *im = NULL;
 
 	/* declaration of the local variables */
-	const char *comment = NULL;
+	php_epeg_async_job_t *job = NULL;
 
 	/* parse the arguments */
 	PHP_EPEG_PARSE_PARAMETER();
 
-	/* get comment */
-	comment = epeg_comment_get(im->ptr);
-	if (comment == NULL) {
-		RETURN_EMPTY_STRING();
-	} else {
-		RETURN_STRING((char *)comment, 1);
+	if (php_epeg_jobs_start(TSRMLS_C) == FAILURE) {
+		RETURN_FALSE;
 	}
+
+	/* take a snapshot of the handle */
+	job = (php_epeg_async_job_t *)calloc(1, sizeof(php_epeg_async_job_t));
+	if (job != NULL) {
+		job->data = (unsigned char *)malloc((size_t)im->size);
+		if (im->comment != NULL) {
+			job->comment = strdup(im->comment);
+		}
+	}
+	if (job == NULL || job->data == NULL || (im->comment != NULL && job->comment == NULL)) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Failed to allocate memory for the job");
+		if (job != NULL) {
+			php_epeg_async_job_free(job);
+		}
+		RETURN_FALSE;
+	}
+	memcpy(job->data, im->data, (size_t)im->size);
+	job->data_len = (size_t)im->size;
+	php_epeg_params_fill(im, &job->params TSRMLS_CC);
+	job->params.comment = job->comment;
+	job->params.x = im->bounds_x;
+	job->params.y = im->bounds_y;
+	job->transform = im->transform;
+	if (job->transform != PHP_EPEG_TRANSFORM_NONE) {
+		/* the size of the transformed image or the full size */
+		job->params.width = im->out_width;
+		job->params.height = im->out_height;
+	}
+	php_epeg_output_init(&job->out, realloc, free);
+
+	job->id = ++EPEG_G(last_job_id);
+	job->task.run = php_epeg_async_job_run;
+	job->task.queue = EPEG_G(queue);
+	EPEG_G(pending_jobs)++;
+	RETVAL_LONG(job->id);
+
+	/* the job belongs to the workers from now on, it may be already finished */
+	php_epeg_pool_submit(EPEG_G(pool), &job->task);
+
+	/* reset internal image handler */
+	php_epeg_reset(im);
 }
-/* }}} epeg_comment_get */
+/* }}} epeg_encode_async */
 
-/* {{{ proto void epeg_comment_set(resource epeg image, string comment) */
+/* {{{ proto int epeg_tile_pyramid(resource epeg image, int tile_size, int overlap, mixed sink) */
 /**
- * void epeg_comment_set(resource epeg image, string comment)
- * void Epeg::setComment(string comment)
+ * int epeg_tile_pyramid(resource epeg image, int tile_size, int overlap, mixed sink)
+ * int Epeg::tilePyramid(int tile_size, int overlap, mixed sink)
  *
- * Set the comment field of the thumbnail.
+ * Create the tiles of a Deep Zoom image pyramid.
+ *
+ * The image is decoded only once at the full size, every other level
+ * is reduced from the level above it. The highest level is the full
+ * size and the level 0 is 1x1, each level is half the size of the next
+ * level rounded up. The tiles of each level are tile_size x tile_size
+ * pixels plus overlap pixels on each side which has a neighbor.
+ * The quality, the colorspace and the comments set to the image are used.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @param	string	$comment	The comment field of the thumbnail.
- * @return	void
+ * @param	int		$tile_size	The size of the tiles.
+ * @param	int		$overlap	The overlap of the tiles.
+ * @param	mixed	$sink	The directory to save the tiles as sink/level/column_row.jpg,
+ *						or a callback which receives (level, column, row, data)
+ *						for each tile. Returning false from the callback stops.
+ *						A string is always taken as a directory, use a closure
+ *						or an array to pass a callback.
+ * @return	int		The number of the tiles is returned if succeeded.
+ *					False is returned if failed to create the tiles.
  */
-static PHP_FUNCTION(epeg_comment_set)
+static PHP_FUNCTION(epeg_tile_pyramid)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
@@ -1284,115 +4866,294 @@ static PHP_FUNCTION(epeg_comment_set)
 	php_epeg_t *im = NULL;
 
 	/* declaration of the arguments */
-	const char *comment = NULL;
-	int comment_len = 0;
+	long tile_size = 0;
+	long overlap = 0;
+	zval *sink = NULL;
+
+	/* declaration of the local variables */
+	php_epeg_params_t params;
+	php_epeg_pixels_t px;
+	const char *dir = NULL;
+	long count = 0;
+	int level, max_level, result;
+
+	/* parse the arguments */
+	PHP_EPEG_PARSE_PARAMETERS("llz", &tile_size, &overlap, &sink);
+	memset(&px, 0, sizeof(php_epeg_pixels_t));
+	RETVAL_FALSE;
+
+	/* check the tile size */
+	if (tile_size < 1 || tile_size > INT_MAX / 2 || overlap < 0 || overlap > INT_MAX / 4) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"Invalid tile size '%ld' or overlap '%ld'", tile_size, overlap);
+		goto cleanup;
+	}
+
+	/* check the sink */
+	if (Z_TYPE_P(sink) == IS_STRING) {
+		if (Z_STRLEN_P(sink) == 0) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING, "Empty directory name");
+			goto cleanup;
+		}
+		dir = Z_STRVAL_P(sink);
+	} else if (!zend_is_callable(sink, 0, NULL TSRMLS_CC)) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Sink must be a directory name or a valid callback");
+		goto cleanup;
+	}
+
+	/* decode the highest level */
+	php_epeg_params_fill(im, &params TSRMLS_CC);
+	params.width = im->width;
+	params.height = im->height;
+	result = php_epeg_scale_handle(im, &params, &px TSRMLS_CC);
+	if (result != 0) {
+		php_epeg_encode_error(result TSRMLS_CC);
+		goto cleanup;
+	}
+
+	max_level = 0;
+	while ((1L << max_level) < (long)MAX(im->width, im->height)) {
+		max_level++;
+	}
+
+	for (level = max_level; level >= 0; level--) {
+		php_epeg_pixels_t next;
+		int cols = (px.width + (int)tile_size - 1) / (int)tile_size;
+		int rows = (px.height + (int)tile_size - 1) / (int)tile_size;
+		int col, row;
+
+		/* make the directory of the level */
+		if (dir != NULL) {
+			php_stream_statbuf ssb;
+			char *level_dir = NULL;
+			int made = 1;
+
+			(void)spprintf(&level_dir, 0, "%s/%d", dir, level);
+			if (php_stream_stat_path(level_dir, &ssb) != 0) {
+				made = php_stream_mkdir(level_dir, 0777,
+						PHP_STREAM_MKDIR_RECURSIVE | REPORT_ERRORS, NULL);
+			}
+			efree(level_dir);
+			if (!made) {
+				goto cleanup;
+			}
+		}
+
+		/* emit the tiles row by row */
+		for (row = 0; row < rows; row++) {
+			int y = row * (int)tile_size - ((row > 0) ? (int)overlap : 0);
+			int y_end = MIN((row + 1) * (int)tile_size + (int)overlap, px.height);
+			for (col = 0; col < cols; col++) {
+				int x = col * (int)tile_size - ((col > 0) ? (int)overlap : 0);
+				int x_end = MIN((col + 1) * (int)tile_size + (int)overlap, px.width);
+				if (php_epeg_tile_emit(&px, &params, level, col, row,
+						x, y, x_end - x, y_end - y, dir, sink TSRMLS_CC) == FAILURE)
+				{
+					goto cleanup;
+				}
+				count++;
+			}
+		}
+
+		/* reduce to the next level */
+		if (level > 0) {
+			result = php_epeg_pixels_halve(&px, &next);
+			php_epeg_pixels_free(&px);
+			if (result != 0) {
+				php_epeg_encode_error(result TSRMLS_CC);
+				goto cleanup;
+			}
+			px = next;
+		}
+	}
+	RETVAL_LONG(count);
+
+cleanup:
+	php_epeg_pixels_free(&px);
+
+	/* reset internal image handler, also after a failure */
+	php_epeg_reset(im);
+}
+/* }}} epeg_tile_pyramid */
+
+/* {{{ proto resource epeg_jobs_fd(void) */
+/**
+ * resource epeg_jobs_fd(void)
+ *
+ * Get a stream which becomes readable when asynchronous jobs finish.
+ *
+ * The stream is to be watched by stream_select() or an event loop,
+ * it must not be read. It stays readable until epeg_jobs_collect() is called.
+ *
+ * @return	resource	A stream is returned if succeeded.
+ *						False is returned if not supported on the platform.
+ */
+static PHP_FUNCTION(epeg_jobs_fd)
+{
+#ifdef HAVE_UNISTD_H
+	php_stream *sth = NULL;
+	int fd = -1;
+#endif
+
+	if (ZEND_NUM_ARGS() != 0) {
+		WRONG_PARAM_COUNT;
+	}
 
-	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETERS("s", &comment, &comment_len);
+	if (php_epeg_jobs_start(TSRMLS_C) == FAILURE) {
+		RETURN_FALSE;
+	}
 
-	/* set the comment */
-	epeg_comment_set(im->ptr, comment);
+#ifdef HAVE_UNISTD_H
+	/* the stream owns a duplicate, closing it does not affect the queue */
+	fd = php_epeg_queue_fd(EPEG_G(queue));
+	if (fd != -1) {
+		fd = dup(fd);
+	}
+	if (fd != -1) {
+		sth = php_stream_fopen_from_fd(fd, "r", NULL);
+		if (!sth) {
+			close(fd);
+			RETURN_FALSE;
+		}
+		php_stream_to_zval(sth, return_value);
+		return;
+	}
+#endif
+
+	php_error_docref(NULL TSRMLS_CC, E_WARNING, "Job notification is not supported");
+	RETURN_FALSE;
 }
-/* }}} epeg_comment_set */
+/* }}} epeg_jobs_fd */
 
-/* {{{ proto void epeg_quality_set(resource epeg image, int quality) */
+/* {{{ proto array epeg_jobs_collect([bool wait]) */
 /**
- * void epeg_quality_set(resource epeg image, int quality)
- * void Epeg::setQuality(int quality)
+ * array epeg_jobs_collect([bool wait])
  *
- * Set the quality of the thumbnail.
+ * Fetch the results of the finished asynchronous jobs.
  *
- * @param	resource epeg	$image	An Epeg image handle.
- * @param	int	$quality	The quality of the thumbnail. (optional)
- *							The value must be greater than or equal to 0
- *							and must be less than or equal to 100.
- *							The default is 75.
- * @return	void
+ * @param	bool	$wait	Whether to wait for all the pending jobs.
+ *						The default is false.
+ * @return	array	An array whose keys are the IDs of the finished jobs,
+ *					each value is array('result' => string|false, 'error' => string|null).
+ *					'result' is the content of the thumbnail
+ *					and 'error' is the reason of the failure or null.
  */
-static PHP_FUNCTION(epeg_quality_set)
+static PHP_FUNCTION(epeg_jobs_collect)
 {
-	/* declaration of the resources */
-	zval *obj = getThis();
-	zval *zim = NULL;
-	php_epeg_t *im = NULL;
-
 	/* declaration of the arguments */
-	long quality = 0;
+	zend_bool wait = 0;
 
 	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETERS("l", &quality);
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "|b", &wait) == FAILURE) {
+		RETURN_FALSE;
+	}
 
-	/* check quality */
-	if (quality < 0 || quality > 100L) {
-		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid quality (%ld)", quality);
+	array_init(return_value);
+	php_epeg_jobs_check_fork(TSRMLS_C);
+	if (EPEG_G(pending_jobs) == 0) {
 		return;
 	}
 
-	/* set the quality */
-	im->quality = (int)quality;
-	epeg_quality_set(im->ptr, im->quality);
+	do {
+		php_epeg_task_t *task = php_epeg_queue_pop_all(EPEG_G(queue), (int)wait);
+		while (task != NULL) {
+			php_epeg_async_job_t *job = (php_epeg_async_job_t *)task;
+			zval *retval = NULL;
+
+			MAKE_STD_ZVAL(retval);
+			array_init(retval);
+			if (job->result == 0) {
+				add_assoc_stringl(retval, "result", (char *)job->out.buf, (int)job->out.len, 1);
+				add_assoc_null(retval, "error");
+			} else {
+				add_assoc_bool(retval, "result", 0);
+				add_assoc_string(retval, "error", (char *)php_epeg_error_string(job->result), 1);
+			}
+			add_index_zval(return_value, (ulong)job->id, retval);
+
+			task = task->next;
+			php_epeg_async_job_free(job);
+			EPEG_G(pending_jobs)--;
+		}
+	} while (wait && EPEG_G(pending_jobs) > 0);
 }
-/* }}} epeg_quality_set */
+/* }}} epeg_jobs_collect */
 
-/* {{{ proto array epeg_thumbnail_comments_get(resource epeg image) */
+/* {{{ proto mixed epeg_trim(resource epeg image[, string filename]) */
 /**
- * array epeg_thumbnail_comments_get(resource epeg image)
- * array Epeg::getThumbnailComments(void)
+ * mixed epeg_trim(resource epeg image[, string filename])
+ * mixed Epeg::trim([string filename])
  *
- * Get thumbnail comments of loaded image.
+ * Save or get the trimed image.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @return	array	Thumbnail comments written by Epeg to any saved JPEG files.
+ * @param	string	$filename	The pathname or the URL of the source image. (optional)
+ * @return	bool|string	False is returned if failed to create the thumbnail.
+ *						True is returned if succeeded in creating and writing the thumbnail.
+ *						If $out_file is an empty string and succeeded in creating
+ *						the thumbnail, the content of the thumbnail is returned.
  */
-static PHP_FUNCTION(epeg_thumbnail_comments_get)
+static PHP_FUNCTION(epeg_trim)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
 	zval *zim = NULL;
 	php_epeg_t *im = NULL;
 
+	/* declaration of the arguments */
+	char *file = NULL;
+	int file_len = 0;
+
 	/* declaration of the local variables */
-	Epeg_Thumbnail_Info info = {0};
+	php_epeg_output_t out;
+	int result = 0;
 
 	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETER();
-
-	/* get thumbnail comments */
-	epeg_thumbnail_comments_get(im->ptr, &info);
-
-	/* initialize return_value as an array */
-	array_init(return_value);
+	PHP_EPEG_PARSE_PARAMETERS("|s", &file, &file_len);
 
-	/* set return value to the width and the height */
-	if (info.uri == NULL) {
-		add_assoc_null(return_value, "uri");
-	} else {
-		add_assoc_string(return_value, "uri", (char *)info.uri, 1);
+	/* trim the image into the output stream or a Zend string */
+	if (php_epeg_output_open(&out, file, file_len, NULL TSRMLS_CC) == FAILURE) {
+		RETURN_FALSE;
 	}
-	add_assoc_long(return_value, "mtime", (long)info.mtime);
-	add_assoc_long(return_value, "width", (long)info.w);
-	add_assoc_long(return_value, "height", (long)info.h);
-	if (info.mimetype == NULL) {
-		add_assoc_null(return_value, "mimetype");
-	} else {
-		add_assoc_string(return_value, "mimetype", (char *)info.mimetype, 1);
+	result = php_epeg_encode_handle(im, 1, &out TSRMLS_CC);
+
+	/* set return value */
+	if (php_epeg_output_close(&out, result, return_value TSRMLS_CC) == FAILURE) {
+		/* raise error by the result */
+		php_epeg_trim_error(result TSRMLS_CC);
+		return;
 	}
+
+	/* reset internal image handler */
+	php_epeg_reset(im);
 }
-/* }}} epeg_thumbnail_comments_get */
+/* }}} epeg_trim */
 
-/* {{{ proto void epeg_thumbnail_comments_enable(resource epeg image, bool onoff) */
+/* {{{ proto mixed epeg_crop_lossless(resource epeg image, int x, int y, int width, int height[, string filename]) */
 /**
- * void epeg_thumbnail_comments_enable(resource epeg image, bool onoff)
- * void Epeg::enableThumbnailComments(bool onoff)
+ * mixed epeg_crop_lossless(resource epeg image, int x, int y, int width, int height[, string filename])
+ * mixed Epeg::cropLossless(int x, int y, int width, int height[, string filename])
  *
- * Enable or disable thumbnail comments in saved image.
- * The default is false (disabled).
+ * Save or get an area of the image without decoding it.
+ *
+ * The DCT coefficients of the area are copied into the new image like
+ * jpegtran -crop, so the pixels are the same as the source. The top-left
+ * corner is moved up and left to the nearest MCU boundary (8 or 16 pixels
+ * for most images) and the size is grown by the same amount, the area
+ * is clipped to the image. The comments set to the image are used.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @param	bool	$onoff	A boolean on and off enabling flag.
- * @return	void
+ * @param	int	$x	The left of the area.
+ * @param	int	$y	The top of the area.
+ * @param	int	$width	The width of the area.
+ * @param	int	$height	The height of the area.
+ * @param	string	$filename	The pathname or the URL of the image. (optional)
+ * @return	bool|string	False is returned if failed to crop the image.
+ *						True is returned if succeeded in cropping and writing the image.
+ *						If $filename is omitted and succeeded in cropping
+ *						the image, the content of the image is returned.
  */
-static PHP_FUNCTION(epeg_thumbnail_comments_enable)
+static PHP_FUNCTION(epeg_crop_lossless)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
@@ -1400,31 +5161,81 @@ static PHP_FUNCTION(epeg_thumbnail_comments_enable)
 	php_epeg_t *im = NULL;
 
 	/* declaration of the arguments */
-	zend_bool onoff = 1;
+	long x = 0, y = 0, w = 0, h = 0;
+	char *file = NULL;
+	int file_len = 0;
+
+	/* declaration of the local variables */
+	php_epeg_params_t params;
+	php_epeg_decoder_t *dec;
+	php_epeg_output_t out;
+	int result = 0;
 
 	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETERS("|b", &onoff);
+	PHP_EPEG_PARSE_PARAMETERS("llll|s", &x, &y, &w, &h, &file, &file_len);
 
-	/* enable/disable thumbnail comments */
-	epeg_thumbnail_comments_enable(im->ptr, (int)onoff);
+	/* check the area */
+	if (x < 0 || y < 0 || x >= (long)im->width || y >= (long)im->height || w <= 0 || h <= 0) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"Invalid crop area '%ldx%ld+%ld+%ld'", w, h, x, y);
+		RETURN_FALSE;
+	}
+	php_epeg_params_fill(im, &params TSRMLS_CC);
+	params.x = (int)x;
+	params.y = (int)y;
+	params.width = (w > (long)im->width) ? im->width : (int)w;
+	params.height = (h > (long)im->height) ? im->height : (int)h;
+
+	/* copy the blocks into the output stream or a Zend string */
+	if (php_epeg_output_open(&out, file, file_len, NULL TSRMLS_CC) == FAILURE) {
+		RETURN_FALSE;
+	}
+	dec = php_epeg_decoder_open_memory(im->data, (size_t)im->size);
+	if (dec == NULL) {
+		result = PHP_EPEG_ERROR_DECODE;
+	} else {
+		result = php_epeg_decoder_crop(dec, &params, &out);
+		php_epeg_decoder_close(dec);
+	}
+
+	/* set return value */
+	if (php_epeg_output_close(&out, result, return_value TSRMLS_CC) == FAILURE) {
+		/* raise error by the result */
+		php_epeg_trim_error(result TSRMLS_CC);
+		return;
+	}
+
+	/* reset internal image handler */
+	php_epeg_reset(im);
 }
-/* }}} epeg_thumbnail_comments_enable */
+/* }}} epeg_crop_lossless */
 
-/* {{{ proto mixed epeg_encode(resource epeg image[, string filename]) */
+/* {{{ proto string epeg_placeholder(resource epeg image, int width, int height, int format) */
 /**
- * mixed epeg_encode(resource epeg image[, string filename])
- * mixed Epeg::encode([string filename])
+ * string epeg_placeholder(resource epeg image, int width, int height, int format)
+ * string Epeg::placeholder(int width, int height, int format)
  *
- * Save or get the scaled image.
+ * Make a placeholder of the image from its DC coefficients only.
+ * The image is decoded at 1/8 of its size like EPEG_DECODE_DC_ONLY,
+ * which is all a placeholder needs, and the settings of the handle
+ * are neither used nor reset.
+ *
+ * The format is one of the following:
+ *  EPEG_PLACEHOLDER_RGB      width x height RGB pixels as a binary string,
+ *                            each side from 1 to 64.
+ *  EPEG_PLACEHOLDER_BLURHASH the BlurHash with width x height components,
+ *                            each from 1 to 9.
+ *  EPEG_PLACEHOLDER_COLOR    the dominant color as "#rrggbb",
+ *                            the width and the height are not used.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @param	string	$filename	The pathname or the URL of the source image. (optional)
- * @return	bool|string	False is returned if failed to create the thumbnail.
- *						True is returned if succeeded in creating and writing the thumbnail.
- *						If $out_file is an empty string and succeeded in creating
- *						the thumbnail, the content of the thumbnail is returned.
+ * @param	int	$width	The width or the number of the horizontal components.
+ * @param	int	$height	The height or the number of the vertical components.
+ * @param	int	$format	The format of the placeholder.
+ * @return	string	The placeholder.
+ *					False is returned if failed to make the placeholder.
  */
-static PHP_FUNCTION(epeg_encode)
+static PHP_FUNCTION(epeg_placeholder)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
@@ -1432,99 +5243,182 @@ static PHP_FUNCTION(epeg_encode)
 	php_epeg_t *im = NULL;
 
 	/* declaration of the arguments */
-	char *file = NULL;
-	int file_len = 0;
+	long width = 0;
+	long height = 0;
+	long format = PHP_EPEG_PLACEHOLDER_RGB;
 
 	/* declaration of the local variables */
-	unsigned char *buf = NULL;
-	int buf_len = 0;
-	int result = 0;
+	php_epeg_params_t params;
+	php_epeg_pixels_t px;
+	int result;
 
 	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETERS("|s", &file, &file_len);
-
-	/* set output to the buffer */
-	epeg_memory_output_set(im->ptr, &buf, &buf_len);
-
-	/* encode the image */
-	if ((result = epeg_encode(im->ptr)) != 0) {
-		/* free the buffer */
-		if (buf) {
-			free(buf);
+	PHP_EPEG_PARSE_PARAMETERS("lll", &width, &height, &format);
+
+	/* check format and size */
+	switch (format) {
+	  case PHP_EPEG_PLACEHOLDER_RGB:
+		if (width < 1 || width > PHP_EPEG_PLACEHOLDER_MAX_SIZE
+			|| height < 1 || height > PHP_EPEG_PLACEHOLDER_MAX_SIZE)
+		{
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Invalid image dimensions '%ldx%ld'", width, height);
+			RETURN_FALSE;
 		}
-		/* raise error by the result */
+		break;
+	  case PHP_EPEG_PLACEHOLDER_BLURHASH:
+		if (width < 1 || width > 9 || height < 1 || height > 9) {
+			php_error_docref(NULL TSRMLS_CC, E_WARNING,
+					"Invalid number of components '%ldx%ld'", width, height);
+			RETURN_FALSE;
+		}
+		break;
+	  case PHP_EPEG_PLACEHOLDER_COLOR:
+		break;
+	  default:
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Invalid placeholder format '%ld'", format);
+		RETURN_FALSE;
+	}
+
+	/* decode the image of the DC coefficients in RGB */
+	php_epeg_params_init(&params);
+	params.width = (im->width + 7) / 8;
+	params.height = (im->height + 7) / 8;
+	params.colorspace = EPEG_RGB8;
+	params.dc_only = 1;
+	result = php_epeg_scale_handle(im, &params, &px TSRMLS_CC);
+	if (result != 0) {
 		php_epeg_encode_error(result TSRMLS_CC);
 		RETURN_FALSE;
 	}
 
-	/* set return value */
-	php_epeg_set_retval(buf, buf_len, file, file_len, return_value TSRMLS_CC);
+	if (format == PHP_EPEG_PLACEHOLDER_RGB) {
+		php_epeg_pixels_t tiny;
 
-	/* free the buffer */
-	free(buf);
+		/* average the blocks, or interpolate a small image */
+		result = php_epeg_pixels_resample(&px, (int)width, (int)height,
+				PHP_EPEG_FILTER_TRIANGLE, 0.0, &tiny);
+		if (result == 0) {
+			RETVAL_STRINGL((char *)tiny.buf, tiny.width * tiny.height * tiny.components, 1);
+			php_epeg_pixels_free(&tiny);
+		}
+	} else if (format == PHP_EPEG_PLACEHOLDER_BLURHASH) {
+		char hash[PHP_EPEG_BLURHASH_MAX_LENGTH];
 
-	/* reset internal image handler */
-	php_epeg_reset(im);
+		result = php_epeg_pixels_blurhash(&px, (int)width, (int)height, hash);
+		if (result == 0) {
+			RETVAL_STRING(hash, 1);
+		}
+	} else {
+		unsigned char rgb[3];
+		char color[8];
+
+		result = php_epeg_pixels_dominant(&px, rgb);
+		if (result == 0) {
+			snprintf(color, sizeof(color), "#%02x%02x%02x", rgb[0], rgb[1], rgb[2]);
+			RETVAL_STRINGL(color, 7, 1);
+		}
+	}
+	php_epeg_pixels_free(&px);
+
+	if (result != 0) {
+		php_epeg_encode_error(result TSRMLS_CC);
+		RETURN_FALSE;
+	}
 }
-/* }}} epeg_encode */
+/* }}} epeg_placeholder */
 
-/* {{{ proto mixed epeg_trim(resource epeg image[, string filename]) */
+/* {{{ proto array epeg_pixels_get(resource epeg image) */
 /**
- * mixed epeg_trim(resource epeg image[, string filename])
- * mixed Epeg::trim([string filename])
+ * array epeg_pixels_get(resource epeg image)
+ * array Epeg::getPixels(void)
  *
- * Save or get the trimed image.
+ * Get the pixels of the thumbnail instead of encoding it.
+ * The image is decoded, scaled and transformed with the settings of
+ * the handle the same as epeg_encode() does, then the settings are reset.
+ *
+ * The array has the following elements:
+ *  width       The width of the thumbnail.
+ *  height      The height of the thumbnail.
+ *  colorspace  The colorspace set by epeg_decode_colorspace_set(),
+ *              or that of the image, one of EPEG_*.
+ *  components  The bytes of a pixel.
+ *  stride      The bytes of a row, the rows are not padded.
+ *  data        The rows from top to bottom as a binary string.
  *
  * @param	resource epeg	$image	An Epeg image handle.
- * @param	string	$filename	The pathname or the URL of the source image. (optional)
- * @return	bool|string	False is returned if failed to create the thumbnail.
- *						True is returned if succeeded in creating and writing the thumbnail.
- *						If $out_file is an empty string and succeeded in creating
- *						the thumbnail, the content of the thumbnail is returned.
+ * @return	array	The pixels.
+ *					False is returned if failed to decode the image.
  */
-static PHP_FUNCTION(epeg_trim)
+static PHP_FUNCTION(epeg_pixels_get)
 {
 	/* declaration of the resources */
 	zval *obj = getThis();
 	zval *zim = NULL;
 	php_epeg_t *im = NULL;
 
-	/* declaration of the arguments */
-	char *file = NULL;
-	int file_len = 0;
-
 	/* declaration of the local variables */
-	unsigned char *buf = NULL;
-	int buf_len = 0;
-	int result = 0;
+	php_epeg_params_t params;
+	php_epeg_pixels_t scaled;
+	const php_epeg_pixels_t *px;
+	unsigned char *buf;
+	int result, colorspace, components, width, height;
 
 	/* parse the arguments */
-	PHP_EPEG_PARSE_PARAMETERS("|s", &file, &file_len);
+	PHP_EPEG_PARSE_PARAMETER();
+
+	/* the decode size is of the transformed image, scale in the orientation of the source */
+	php_epeg_params_fill(im, &params TSRMLS_CC);
+	if (PHP_EPEG_TRANSFORM_SWAPS_AXES(im->transform) && im->out_width > 0) {
+		params.width = im->out_height;
+		params.height = im->out_width;
+	}
 
-	/* set output to the buffer */
-	epeg_memory_output_set(im->ptr, &buf, &buf_len);
+	/* decode the image, or use the pixels kept in the handle */
+	if (im->retain_pixels) {
+		result = php_epeg_pixels_retain(im, &params);
+		px = &im->pixels;
+	} else {
+		result = php_epeg_scale_handle(im, &params, &scaled TSRMLS_CC);
+		px = &scaled;
+	}
+	if (result != 0) {
+		php_epeg_encode_error(result TSRMLS_CC);
+		RETURN_FALSE;
+	}
 
-	/* trim the image */
-	if ((result = epeg_trim(im->ptr)) != 0) {
-		/* free the buffer */
-		if (buf) {
-			free(buf);
+	/* write the pixels straight into the string */
+	components = php_epeg_pixels_format(px, &colorspace);
+	width = PHP_EPEG_TRANSFORM_SWAPS_AXES(im->transform) ? px->height : px->width;
+	height = PHP_EPEG_TRANSFORM_SWAPS_AXES(im->transform) ? px->width : px->height;
+	if ((size_t)width * components * height >= (size_t)INT_MAX) {
+		if (px == &scaled) {
+			php_epeg_pixels_free(&scaled);
 		}
-		/* raise error by the result */
-		php_epeg_trim_error(result TSRMLS_CC);
+		php_error_docref(NULL TSRMLS_CC, E_WARNING,
+				"The pixels of %dx%d are too large for a string", width, height);
 		RETURN_FALSE;
 	}
+	buf = (unsigned char *)safe_emalloc((size_t)width * components, (size_t)height, 1);
+	php_epeg_pixels_export(px, im->transform, buf);
+	buf[(size_t)width * components * height] = '\0';
+	if (px == &scaled) {
+		php_epeg_pixels_free(&scaled);
+	}
 
 	/* set return value */
-	php_epeg_set_retval(buf, buf_len, file, file_len, return_value TSRMLS_CC);
-
-	/* free the buffer */
-	free(buf);
+	array_init(return_value);
+	add_assoc_long(return_value, "width", width);
+	add_assoc_long(return_value, "height", height);
+	add_assoc_long(return_value, "colorspace", colorspace);
+	add_assoc_long(return_value, "components", components);
+	add_assoc_long(return_value, "stride", width * components);
+	add_assoc_stringl(return_value, "data", (char *)buf, width * components * height, 0);
 
 	/* reset internal image handler */
 	php_epeg_reset(im);
 }
-/* }}} epeg_trim */
+/* }}} epeg_pixels_get */
 
 /* {{{ proto void epeg_close(resource epeg image) */
 /**
@@ -1553,6 +5447,100 @@ static PHP_FUNCTION(epeg_close)
  }
 /* }}} epeg_close */
 
+/* {{{ proto array epeg_probe(string filename) */
+/**
+ * array epeg_probe(string filename)
+ * array Epeg::probe(string filename)
+ *
+ * Get the header information of a JPEG image without decoding it.
+ * Only the markers up to SOS (Start Of Scan) are read from the stream.
+ *
+ * The width and the height are stored in the same way as epeg_size_get().
+ * The sampling factors are stored in "subsampling" as "HxV" pairs
+ * separated by commas, e.g. "2x2,1x1,1x1" for 4:2:0 YCbCr images.
+ *
+ * @param	string	$filename	The pathname or the URL of the source image.
+ * @return	array	The header information of the image.
+ *					False is returned if failed to read the header.
+ */
+static PHP_FUNCTION(epeg_probe)
+{
+	/* declaration of the arguments */
+	char *file = NULL;
+	int file_len = 0;
+
+	/* declaration of the local variables */
+	php_stream *sth = NULL;
+	php_epeg_probe_t info;
+	char sampling[PHP_EPEG_PROBE_MAX_COMPONENTS * 8] = "";
+	int result, i;
+
+	/* parse the arguments */
+	if (zend_parse_parameters(ZEND_NUM_ARGS() TSRMLS_CC, "s", &file, &file_len) == FAILURE) {
+		RETURN_FALSE;
+	}
+
+	/* open stream for reading */
+	sth = php_stream_open_wrapper(file, "rb",
+			ENFORCE_SAFE_MODE | IGNORE_PATH | REPORT_ERRORS, NULL);
+	if (!sth) {
+		RETURN_FALSE;
+	}
+
+	/* read the header */
+	result = php_epeg_probe_stream(sth, &info TSRMLS_CC);
+
+	/* close the input stream */
+	php_stream_close(sth);
+	if (result == FAILURE) {
+		php_error_docref(NULL TSRMLS_CC, E_WARNING, "Not a valid JPEG data");
+		RETURN_FALSE;
+	}
+
+	/* format the sampling factors */
+	for (i = 0; i < info.components && i < PHP_EPEG_PROBE_MAX_COMPONENTS; i++) {
+		size_t len = strlen(sampling);
+		snprintf(sampling + len, sizeof(sampling) - len, "%s%dx%d",
+				(i == 0) ? "" : ",", info.h_samp[i], info.v_samp[i]);
+	}
+
+	/* initialize return_value as an array */
+	array_init(return_value);
+
+	/* set return value to the header information */
+	add_index_long(return_value, 0, (long)info.width);
+	add_index_long(return_value, 1, (long)info.height);
+	add_assoc_long(return_value, "width", (long)info.width);
+	add_assoc_long(return_value, "height", (long)info.height);
+	add_assoc_long(return_value, "components", (long)info.components);
+	add_assoc_long(return_value, "precision", (long)info.precision);
+	add_assoc_string(return_value, "subsampling", sampling, 1);
+	add_assoc_bool(return_value, "progressive", info.progressive);
+	add_assoc_long(return_value, "sos_offset", info.sos_offset);
+}
+/* }}} epeg_probe */
+
+/* {{{ proto int epeg_memory_get_peak_usage(void) */
+/**
+ * int epeg_memory_get_peak_usage(void)
+ *
+ * Get the most memory held at once by the JPEG decoders and encoders
+ * since the request started, counted against epeg.memory_limit.
+ * With a threaded SAPI the peak is the one of the whole process.
+ * The memory of the Epeg library itself is not included.
+ *
+ * @return	int	The peak usage in bytes.
+ */
+static PHP_FUNCTION(epeg_memory_get_peak_usage)
+{
+	if (ZEND_NUM_ARGS() != 0) {
+		WRONG_PARAM_COUNT;
+	}
+
+	RETURN_LONG((long)php_epeg_memory_peak_usage());
+}
+/* }}} epeg_memory_get_peak_usage */
+
 /*
  * Local variables:
  * tab-width: 4
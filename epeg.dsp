@@ -96,6 +96,30 @@ LINK32=link.exe
 
 SOURCE=./epeg.c
 # End Source File
+# Begin Source File
+
+SOURCE=./epeg_header_cache.c
+# End Source File
+# Begin Source File
+
+SOURCE=./epeg_jpeg.c
+# End Source File
+# Begin Source File
+
+SOURCE=./epeg_memory.c
+# End Source File
+# Begin Source File
+
+SOURCE=./epeg_placeholder.c
+# End Source File
+# Begin Source File
+
+SOURCE=./epeg_pool.c
+# End Source File
+# Begin Source File
+
+SOURCE=./epeg_resample.c
+# End Source File
 
 # End Group
 
@@ -0,0 +1,356 @@
+/**
+ * The Epeg PHP extension
+ *
+ * Copyright (c) 2006-2010 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-epeg
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2010 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * Cache of the headers of local files, shared by all the processes.
+ *
+ * The table is an anonymous shared mapping made in MINIT, so the workers
+ * forked by the SAPI afterwards all see the same one. It is split into
+ * sets of PHP_EPEG_HEADER_CACHE_WAYS entries, a key only ever lives in
+ * the set its hash selects and the least recently used entry of the set
+ * is the one replaced.
+ *
+ * Readers take no lock. Every entry has a sequence number which is odd
+ * while the entry is written, a reader copies the entry and retries when
+ * the number has changed meanwhile. Writers lock the set with a spin lock,
+ * but give up after a few tries; a put is only a hint, so losing one to
+ * a busy set costs one more header parse later and nothing else.
+ */
+
+#include "php_epeg.h"
+
+#ifdef PHP_EPEG_USE_HEADER_CACHE
+
+#ifndef MAP_ANONYMOUS
+#define MAP_ANONYMOUS MAP_ANON
+#endif
+
+/* upper bound of epeg.header_cache_entries */
+#define PHP_EPEG_HEADER_CACHE_MAX_ENTRIES   (1UL << 20)
+
+/* tries of the lock of a set before a put is given up */
+#define PHP_EPEG_HEADER_CACHE_LOCK_TRIES    64
+
+/* tries of a reader racing a writer before the entry is taken as a miss */
+#define PHP_EPEG_HEADER_CACHE_READ_TRIES    4
+
+typedef struct _php_epeg_header_cache_entry_t {
+	unsigned int seq;       /* odd while the entry is written */
+	unsigned int hash;      /* 0 if the entry is empty */
+	unsigned long tick;     /* the clock of the cache at the last use */
+	php_epeg_header_key_t key;
+	php_epeg_header_t header;
+} php_epeg_header_cache_entry_t;
+
+typedef struct _php_epeg_header_cache_set_t {
+	int lock;
+	php_epeg_header_cache_entry_t entries[PHP_EPEG_HEADER_CACHE_WAYS];
+} php_epeg_header_cache_set_t;
+
+struct _php_epeg_header_cache_t {
+	size_t map_size;
+	unsigned long mask;     /* the number of the sets minus 1 */
+	unsigned long clock;
+	unsigned long used;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+	php_epeg_header_cache_set_t sets[1];
+};
+
+#define PHP_EPEG_ATOMIC_LOAD(ptr)       __atomic_load_n((ptr), __ATOMIC_ACQUIRE)
+#define PHP_EPEG_ATOMIC_STORE(ptr, v)   __atomic_store_n((ptr), (v), __ATOMIC_RELEASE)
+#define PHP_EPEG_ATOMIC_INC(ptr)        __atomic_add_fetch((ptr), 1, __ATOMIC_RELAXED)
+
+/* {{{ php_epeg_header_key_hash */
+static unsigned int
+php_epeg_header_key_hash(const php_epeg_header_key_t *key)
+{
+	const unsigned char *p = (const unsigned char *)key->path;
+	unsigned int hash = 2166136261U;
+	unsigned long long n[6];
+	size_t i;
+
+	/* FNV-1a of the path and the numbers */
+	while (*p != '\0') {
+		hash = (hash ^ *p++) * 16777619U;
+	}
+	n[0] = key->inode;
+	n[1] = key->size;
+	n[2] = (unsigned long long)key->mtime;
+	n[3] = (unsigned long long)key->mtime_nsec;
+	n[4] = (unsigned long long)key->ctime;
+	n[5] = (unsigned long long)key->ctime_nsec;
+	p = (const unsigned char *)n;
+	for (i = 0; i < sizeof(n); i++) {
+		hash = (hash ^ p[i]) * 16777619U;
+	}
+
+	/* 0 marks an empty entry */
+	return (hash == 0) ? 1 : hash;
+}
+/* }}} */
+
+/* {{{ php_epeg_header_key_equals */
+static int
+php_epeg_header_key_equals(const php_epeg_header_key_t *a, const php_epeg_header_key_t *b)
+{
+	return a->inode == b->inode
+		&& a->size == b->size
+		&& a->mtime == b->mtime
+		&& a->mtime_nsec == b->mtime_nsec
+		&& a->ctime == b->ctime
+		&& a->ctime_nsec == b->ctime_nsec
+		&& strcmp(a->path, b->path) == 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_header_cache_create */
+/*
+ * Make a cache holding about the given number of entries,
+ * rounded up to a power of two sets. Returns NULL on failure.
+ */
+php_epeg_header_cache_t *
+php_epeg_header_cache_create(unsigned long entries)
+{
+	php_epeg_header_cache_t *cache;
+	unsigned long sets = 1;
+	size_t map_size;
+	void *map;
+
+	if (entries == 0) {
+		return NULL;
+	}
+	if (entries > PHP_EPEG_HEADER_CACHE_MAX_ENTRIES) {
+		entries = PHP_EPEG_HEADER_CACHE_MAX_ENTRIES;
+	}
+	while (sets * PHP_EPEG_HEADER_CACHE_WAYS < entries) {
+		sets <<= 1;
+	}
+
+	/* a fresh anonymous mapping is zero-filled, i.e. every entry is empty */
+	map_size = sizeof(php_epeg_header_cache_t)
+		+ (sets - 1) * sizeof(php_epeg_header_cache_set_t);
+	map = mmap(NULL, map_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+
+	cache = (php_epeg_header_cache_t *)map;
+	cache->map_size = map_size;
+	cache->mask = sets - 1;
+	return cache;
+}
+/* }}} */
+
+/* {{{ php_epeg_header_cache_destroy */
+void
+php_epeg_header_cache_destroy(php_epeg_header_cache_t *cache)
+{
+	if (cache != NULL) {
+		(void)munmap((void *)cache, cache->map_size);
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_header_cache_get */
+/*
+ * Copy the header cached for the key.
+ * Returns 1 on a hit and 0 on a miss, without taking any lock.
+ */
+int
+php_epeg_header_cache_get(php_epeg_header_cache_t *cache,
+		const php_epeg_header_key_t *key, php_epeg_header_t *header)
+{
+	unsigned int hash = php_epeg_header_key_hash(key);
+	php_epeg_header_cache_set_t *set = &cache->sets[hash & cache->mask];
+	int i, tries;
+
+	for (i = 0; i < PHP_EPEG_HEADER_CACHE_WAYS; i++) {
+		php_epeg_header_cache_entry_t *entry = &set->entries[i];
+
+		for (tries = 0; tries < PHP_EPEG_HEADER_CACHE_READ_TRIES; tries++) {
+			unsigned int seq = PHP_EPEG_ATOMIC_LOAD(&entry->seq);
+			int found;
+
+			if (seq & 1) {
+				continue;
+			}
+			if (__atomic_load_n(&entry->hash, __ATOMIC_RELAXED) != hash) {
+				break;
+			}
+
+			found = php_epeg_header_key_equals(&entry->key, key);
+			if (found) {
+				memcpy(header, &entry->header, sizeof(php_epeg_header_t));
+			}
+
+			/* the copy is good only if no writer has touched the entry */
+			__atomic_thread_fence(__ATOMIC_ACQUIRE);
+			if (__atomic_load_n(&entry->seq, __ATOMIC_RELAXED) != seq) {
+				continue;
+			}
+			if (!found) {
+				break;
+			}
+
+			__atomic_store_n(&entry->tick, PHP_EPEG_ATOMIC_INC(&cache->clock), __ATOMIC_RELAXED);
+			PHP_EPEG_ATOMIC_INC(&cache->hits);
+			return 1;
+		}
+	}
+
+	PHP_EPEG_ATOMIC_INC(&cache->misses);
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_header_cache_put */
+/*
+ * Store the header for the key, replacing the entry of the same key,
+ * an empty entry or the least recently used one of the set, in that order.
+ * Nothing is stored if the set stays locked by another writer.
+ */
+void
+php_epeg_header_cache_put(php_epeg_header_cache_t *cache,
+		const php_epeg_header_key_t *key, const php_epeg_header_t *header)
+{
+	unsigned int hash = php_epeg_header_key_hash(key);
+	php_epeg_header_cache_set_t *set = &cache->sets[hash & cache->mask];
+	php_epeg_header_cache_entry_t *victim = NULL;
+	int i, tries;
+
+	for (tries = 0; __atomic_exchange_n(&set->lock, 1, __ATOMIC_ACQUIRE) != 0; tries++) {
+		if (tries == PHP_EPEG_HEADER_CACHE_LOCK_TRIES) {
+			return;
+		}
+	}
+
+	for (i = 0; i < PHP_EPEG_HEADER_CACHE_WAYS; i++) {
+		php_epeg_header_cache_entry_t *entry = &set->entries[i];
+
+		if (entry->hash == hash && php_epeg_header_key_equals(&entry->key, key)) {
+			victim = entry;
+			break;
+		}
+		if (entry->hash == 0) {
+			if (victim == NULL || victim->hash != 0) {
+				victim = entry;
+			}
+		} else if (victim == NULL || (victim->hash != 0
+			&& __atomic_load_n(&entry->tick, __ATOMIC_RELAXED)
+				< __atomic_load_n(&victim->tick, __ATOMIC_RELAXED)))
+		{
+			victim = entry;
+		}
+	}
+
+	if (victim->hash == 0) {
+		PHP_EPEG_ATOMIC_INC(&cache->used);
+	} else if (victim->hash != hash || !php_epeg_header_key_equals(&victim->key, key)) {
+		PHP_EPEG_ATOMIC_INC(&cache->evictions);
+	}
+
+	/* readers see the odd number and skip the entry until it is written */
+	__atomic_store_n(&victim->seq, victim->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+	__atomic_store_n(&victim->hash, hash, __ATOMIC_RELAXED);
+	memcpy(&victim->key, key, sizeof(php_epeg_header_key_t));
+	memcpy(&victim->header, header, sizeof(php_epeg_header_t));
+	__atomic_store_n(&victim->tick, PHP_EPEG_ATOMIC_INC(&cache->clock), __ATOMIC_RELAXED);
+	PHP_EPEG_ATOMIC_STORE(&victim->seq, victim->seq + 1);
+
+	PHP_EPEG_ATOMIC_STORE(&set->lock, 0);
+}
+/* }}} */
+
+/* {{{ php_epeg_header_cache_stats */
+void
+php_epeg_header_cache_stats(php_epeg_header_cache_t *cache, php_epeg_header_cache_stats_t *stats)
+{
+	stats->capacity = (cache->mask + 1) * PHP_EPEG_HEADER_CACHE_WAYS;
+	stats->used = __atomic_load_n(&cache->used, __ATOMIC_RELAXED);
+	stats->hits = __atomic_load_n(&cache->hits, __ATOMIC_RELAXED);
+	stats->misses = __atomic_load_n(&cache->misses, __ATOMIC_RELAXED);
+	stats->evictions = __atomic_load_n(&cache->evictions, __ATOMIC_RELAXED);
+}
+/* }}} */
+
+#else /* PHP_EPEG_USE_HEADER_CACHE */
+
+/* {{{ php_epeg_header_cache_create */
+php_epeg_header_cache_t *
+php_epeg_header_cache_create(unsigned long entries)
+{
+	return NULL;
+}
+/* }}} */
+
+/* {{{ php_epeg_header_cache_destroy */
+void
+php_epeg_header_cache_destroy(php_epeg_header_cache_t *cache)
+{
+}
+/* }}} */
+
+/* {{{ php_epeg_header_cache_get */
+int
+php_epeg_header_cache_get(php_epeg_header_cache_t *cache,
+		const php_epeg_header_key_t *key, php_epeg_header_t *header)
+{
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_header_cache_put */
+void
+php_epeg_header_cache_put(php_epeg_header_cache_t *cache,
+		const php_epeg_header_key_t *key, const php_epeg_header_t *header)
+{
+}
+/* }}} */
+
+/* {{{ php_epeg_header_cache_stats */
+void
+php_epeg_header_cache_stats(php_epeg_header_cache_t *cache, php_epeg_header_cache_stats_t *stats)
+{
+	memset(stats, 0, sizeof(php_epeg_header_cache_stats_t));
+}
+/* }}} */
+
+#endif /* PHP_EPEG_USE_HEADER_CACHE */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noet sw=4 ts=4 fdm=marker
+ * vim<600: noet sw=4 ts=4
+ */
@@ -0,0 +1,2660 @@
+/**
+ * The Epeg PHP extension
+ *
+ * Copyright (c) 2006-2010 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-epeg
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2010 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * The decode/scale/encode pipeline on top of libjpeg.
+ *
+ * The Epeg library only reads from a file or a memory block and only
+ * writes a complete image, so the parts that need their own source or
+ * destination managers talk to libjpeg directly. The settings follow
+ * the Epeg library so that both paths produce the same thumbnails.
+ *
+ * Nothing in here calls the Zend memory manager except the stream source,
+ * the pipeline itself only depends on libjpeg and the C library.
+ */
+
+#include "php_epeg.h"
+#include <jerror.h>
+
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* round up a to a multiple of b */
+#define PHP_EPEG_ROUND_UP(a, b) \
+	((JDIMENSION)((((long)(a) + (long)(b) - 1) / (long)(b)) * (long)(b)))
+
+/* {{{ type definitions */
+
+/* a band of MCU rows decoded by php_epeg_decoder_scale_parallel() */
+typedef struct _php_epeg_band {
+	php_epeg_task_t task;
+	php_epeg_decoder_t *dec;
+	/* the band as a standalone JPEG image */
+	unsigned char *data;
+	size_t data_len;
+	/* the first row of the band in the decoded image */
+	JDIMENSION first_row;
+	/* the height of the band in the source */
+	JDIMENSION pixel_height;
+	/* the height of the whole decoded image */
+	JDIMENSION total_height;
+	php_epeg_pixels_t *px;
+	int result;
+} php_epeg_band_t;
+
+typedef struct _php_epeg_memory_src {
+	struct jpeg_source_mgr pub;
+	const JOCTET *data;
+	size_t data_len;
+} php_epeg_memory_src_t;
+
+typedef struct _php_epeg_stream_src {
+	struct jpeg_source_mgr pub;
+	php_stream *stream;
+	smart_str *head;
+	JOCTET *buffer;
+	boolean start_of_file;
+#ifdef ZTS
+	void ***thread_ctx;
+#endif
+} php_epeg_stream_src_t;
+
+typedef struct _php_epeg_memory_dest {
+	struct jpeg_destination_mgr pub;
+	php_epeg_output_t *out;
+	size_t alloc;
+} php_epeg_memory_dest_t;
+
+typedef struct _php_epeg_stream_dest {
+	struct jpeg_destination_mgr pub;
+	php_epeg_output_t *out;
+	JOCTET *buffer;
+} php_epeg_stream_dest_t;
+
+/* }}} */
+
+/* {{{ error manager */
+
+static void
+php_epeg_jpeg_error_exit(j_common_ptr cinfo)
+{
+	php_epeg_jpeg_error_t *err = (php_epeg_jpeg_error_t *)cinfo->err;
+	longjmp(err->jb, 1);
+}
+
+static void
+php_epeg_jpeg_output_message(j_common_ptr cinfo)
+{
+	/* be quiet about corrupt data, like the Epeg library */
+}
+
+static struct jpeg_error_mgr *
+php_epeg_jpeg_error_init(php_epeg_jpeg_error_t *err)
+{
+	jpeg_std_error(&err->pub);
+	err->pub.error_exit = php_epeg_jpeg_error_exit;
+	err->pub.output_message = php_epeg_jpeg_output_message;
+	return &err->pub;
+}
+
+/* }}} */
+
+/* {{{ memory source manager */
+
+static void
+php_epeg_memory_src_init(j_decompress_ptr cinfo)
+{
+}
+
+static boolean
+php_epeg_memory_src_fill(j_decompress_ptr cinfo)
+{
+	static const JOCTET eoi[2] = { 0xFF, JPEG_EOI };
+
+	/* the data is truncated, insert a fake EOI marker */
+	WARNMS(cinfo, JWRN_JPEG_EOF);
+	cinfo->src->next_input_byte = eoi;
+	cinfo->src->bytes_in_buffer = 2;
+
+	return TRUE;
+}
+
+static void
+php_epeg_memory_src_skip(j_decompress_ptr cinfo, long num_bytes)
+{
+	struct jpeg_source_mgr *src = cinfo->src;
+
+	if (num_bytes <= 0) {
+		return;
+	}
+	if ((size_t)num_bytes > src->bytes_in_buffer) {
+		(void)php_epeg_memory_src_fill(cinfo);
+	} else {
+		src->next_input_byte += (size_t)num_bytes;
+		src->bytes_in_buffer -= (size_t)num_bytes;
+	}
+}
+
+static void
+php_epeg_memory_src_term(j_decompress_ptr cinfo)
+{
+}
+
+static void
+php_epeg_memory_src(j_decompress_ptr cinfo, const unsigned char *data, size_t data_len)
+{
+	php_epeg_memory_src_t *src;
+
+	src = (php_epeg_memory_src_t *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+			JPOOL_PERMANENT, sizeof(php_epeg_memory_src_t));
+	src->pub.init_source = php_epeg_memory_src_init;
+	src->pub.fill_input_buffer = php_epeg_memory_src_fill;
+	src->pub.skip_input_data = php_epeg_memory_src_skip;
+	src->pub.resync_to_restart = jpeg_resync_to_restart;
+	src->pub.term_source = php_epeg_memory_src_term;
+	src->pub.next_input_byte = (const JOCTET *)data;
+	src->pub.bytes_in_buffer = data_len;
+	src->data = (const JOCTET *)data;
+	src->data_len = data_len;
+	cinfo->src = &src->pub;
+}
+
+/* }}} */
+
+/* {{{ stream source manager */
+
+static void
+php_epeg_stream_src_init(j_decompress_ptr cinfo)
+{
+	php_epeg_stream_src_t *src = (php_epeg_stream_src_t *)cinfo->src;
+	src->start_of_file = TRUE;
+}
+
+static boolean
+php_epeg_stream_src_fill(j_decompress_ptr cinfo)
+{
+	php_epeg_stream_src_t *src = (php_epeg_stream_src_t *)cinfo->src;
+	size_t nbytes;
+#ifdef ZTS
+	TSRMLS_FETCH_FROM_CTX(src->thread_ctx);
+#endif
+
+	/* pull the next chunk, only this much of the input is resident */
+	nbytes = php_stream_read(src->stream, (char *)src->buffer, PHP_EPEG_STREAM_CHUNK_SIZE);
+	if (nbytes == 0) {
+		if (src->start_of_file) {
+			ERREXIT(cinfo, JERR_INPUT_EMPTY);
+		}
+		/* the data is truncated, insert a fake EOI marker */
+		WARNMS(cinfo, JWRN_JPEG_EOF);
+		src->buffer[0] = (JOCTET)0xFF;
+		src->buffer[1] = (JOCTET)JPEG_EOI;
+		nbytes = 2;
+	} else if (src->head != NULL) {
+		/* keep what has been read while the header is parsed */
+		smart_str_appendl(src->head, (const char *)src->buffer, nbytes);
+	}
+
+	src->pub.next_input_byte = src->buffer;
+	src->pub.bytes_in_buffer = nbytes;
+	src->start_of_file = FALSE;
+
+	return TRUE;
+}
+
+static void
+php_epeg_stream_src_skip(j_decompress_ptr cinfo, long num_bytes)
+{
+	php_epeg_stream_src_t *src = (php_epeg_stream_src_t *)cinfo->src;
+#ifdef ZTS
+	TSRMLS_FETCH_FROM_CTX(src->thread_ctx);
+#endif
+
+	if (num_bytes <= 0) {
+		return;
+	}
+	if ((size_t)num_bytes <= src->pub.bytes_in_buffer) {
+		src->pub.next_input_byte += (size_t)num_bytes;
+		src->pub.bytes_in_buffer -= (size_t)num_bytes;
+		return;
+	}
+
+	num_bytes -= (long)src->pub.bytes_in_buffer;
+	src->pub.bytes_in_buffer = 0;
+
+	/* seek over the rest unless it has to be recorded */
+	if (src->head == NULL && php_stream_seek(src->stream, (off_t)num_bytes, SEEK_CUR) == 0) {
+		return;
+	}
+	while (num_bytes > (long)src->pub.bytes_in_buffer) {
+		num_bytes -= (long)src->pub.bytes_in_buffer;
+		(void)php_epeg_stream_src_fill(cinfo);
+	}
+	src->pub.next_input_byte += (size_t)num_bytes;
+	src->pub.bytes_in_buffer -= (size_t)num_bytes;
+}
+
+static void
+php_epeg_stream_src_term(j_decompress_ptr cinfo)
+{
+}
+
+static void
+php_epeg_stream_src(j_decompress_ptr cinfo, php_stream *sth, smart_str *head TSRMLS_DC)
+{
+	php_epeg_stream_src_t *src;
+
+	src = (php_epeg_stream_src_t *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+			JPOOL_PERMANENT, sizeof(php_epeg_stream_src_t));
+	src->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+			JPOOL_PERMANENT, PHP_EPEG_STREAM_CHUNK_SIZE);
+	src->pub.init_source = php_epeg_stream_src_init;
+	src->pub.fill_input_buffer = php_epeg_stream_src_fill;
+	src->pub.skip_input_data = php_epeg_stream_src_skip;
+	src->pub.resync_to_restart = jpeg_resync_to_restart;
+	src->pub.term_source = php_epeg_stream_src_term;
+	src->pub.next_input_byte = NULL;
+	src->pub.bytes_in_buffer = 0;
+	src->stream = sth;
+	src->head = head;
+	src->start_of_file = TRUE;
+#ifdef ZTS
+	TSRMLS_SET_CTX(src->thread_ctx);
+#endif
+	cinfo->src = &src->pub;
+}
+
+/* }}} */
+
+/* {{{ memory destination manager */
+
+static void
+php_epeg_memory_dest_init(j_compress_ptr cinfo)
+{
+	php_epeg_memory_dest_t *dest = (php_epeg_memory_dest_t *)cinfo->dest;
+
+	dest->alloc = PHP_EPEG_STREAM_CHUNK_SIZE;
+	dest->out->buf = (unsigned char *)dest->out->realloc_func(NULL, dest->alloc);
+	dest->out->len = 0;
+	if (dest->out->buf == NULL) {
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 0);
+	}
+	/* keep the last byte for the terminating NUL */
+	dest->pub.next_output_byte = dest->out->buf;
+	dest->pub.free_in_buffer = dest->alloc - 1;
+}
+
+static boolean
+php_epeg_memory_dest_empty(j_compress_ptr cinfo)
+{
+	php_epeg_memory_dest_t *dest = (php_epeg_memory_dest_t *)cinfo->dest;
+	size_t alloc = dest->alloc * 2;
+	unsigned char *buf;
+
+	buf = (unsigned char *)dest->out->realloc_func(dest->out->buf, alloc);
+	if (buf == NULL) {
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+	}
+	dest->out->buf = buf;
+	dest->pub.next_output_byte = buf + dest->alloc - 1;
+	dest->pub.free_in_buffer = alloc - dest->alloc;
+	dest->alloc = alloc;
+
+	return TRUE;
+}
+
+static void
+php_epeg_memory_dest_term(j_compress_ptr cinfo)
+{
+	php_epeg_memory_dest_t *dest = (php_epeg_memory_dest_t *)cinfo->dest;
+	dest->out->len = dest->alloc - 1 - dest->pub.free_in_buffer;
+	dest->out->buf[dest->out->len] = '\0';
+}
+
+static void
+php_epeg_memory_dest(j_compress_ptr cinfo, php_epeg_output_t *out)
+{
+	php_epeg_memory_dest_t *dest;
+
+	dest = (php_epeg_memory_dest_t *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+			JPOOL_PERMANENT, sizeof(php_epeg_memory_dest_t));
+	dest->pub.init_destination = php_epeg_memory_dest_init;
+	dest->pub.empty_output_buffer = php_epeg_memory_dest_empty;
+	dest->pub.term_destination = php_epeg_memory_dest_term;
+	dest->out = out;
+	dest->alloc = 0;
+	cinfo->dest = &dest->pub;
+}
+
+/* }}} */
+
+/* {{{ stream destination manager */
+
+static void
+php_epeg_stream_dest_init(j_compress_ptr cinfo)
+{
+	php_epeg_stream_dest_t *dest = (php_epeg_stream_dest_t *)cinfo->dest;
+
+	dest->out->len = 0;
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = PHP_EPEG_STREAM_CHUNK_SIZE;
+}
+
+static void
+php_epeg_stream_dest_write(j_compress_ptr cinfo, size_t nbytes)
+{
+	php_epeg_stream_dest_t *dest = (php_epeg_stream_dest_t *)cinfo->dest;
+#ifdef ZTS
+	TSRMLS_FETCH_FROM_CTX(dest->out->thread_ctx);
+#endif
+
+	if (nbytes > 0 && php_stream_write(dest->out->stream, (char *)dest->buffer, nbytes) != nbytes) {
+		dest->out->write_error = 1;
+		ERREXIT(cinfo, JERR_FILE_WRITE);
+	}
+	dest->out->len += nbytes;
+}
+
+static boolean
+php_epeg_stream_dest_empty(j_compress_ptr cinfo)
+{
+	php_epeg_stream_dest_t *dest = (php_epeg_stream_dest_t *)cinfo->dest;
+
+	/* flush the whole chunk, only this much of the output is resident */
+	php_epeg_stream_dest_write(cinfo, PHP_EPEG_STREAM_CHUNK_SIZE);
+	dest->pub.next_output_byte = dest->buffer;
+	dest->pub.free_in_buffer = PHP_EPEG_STREAM_CHUNK_SIZE;
+
+	return TRUE;
+}
+
+static void
+php_epeg_stream_dest_term(j_compress_ptr cinfo)
+{
+	php_epeg_stream_dest_t *dest = (php_epeg_stream_dest_t *)cinfo->dest;
+
+	php_epeg_stream_dest_write(cinfo, PHP_EPEG_STREAM_CHUNK_SIZE - dest->pub.free_in_buffer);
+}
+
+static void
+php_epeg_stream_dest(j_compress_ptr cinfo, php_epeg_output_t *out)
+{
+	php_epeg_stream_dest_t *dest;
+
+	dest = (php_epeg_stream_dest_t *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+			JPOOL_PERMANENT, sizeof(php_epeg_stream_dest_t));
+	dest->buffer = (JOCTET *)(*cinfo->mem->alloc_small)((j_common_ptr)cinfo,
+			JPOOL_PERMANENT, PHP_EPEG_STREAM_CHUNK_SIZE);
+	dest->pub.init_destination = php_epeg_stream_dest_init;
+	dest->pub.empty_output_buffer = php_epeg_stream_dest_empty;
+	dest->pub.term_destination = php_epeg_stream_dest_term;
+	dest->out = out;
+	cinfo->dest = &dest->pub;
+}
+
+/* }}} */
+
+/* {{{ php_epeg_output_init */
+/*
+ * The buffer of the output is allocated with realloc_func() and is
+ * released with free_func() on failure. NULL means realloc() and free().
+ */
+void
+php_epeg_output_init(php_epeg_output_t *out,
+		void *(*realloc_func)(void *, size_t), void (*free_func)(void *))
+{
+	out->buf = NULL;
+	out->len = 0;
+	out->realloc_func = (realloc_func != NULL) ? realloc_func : realloc;
+	out->free_func = (free_func != NULL) ? free_func : free;
+	out->stream = NULL;
+	out->write_error = 0;
+	out->path = NULL;
+	out->tmp_path = NULL;
+}
+/* }}} */
+
+/* {{{ php_epeg_output_init_stream */
+/*
+ * Write the output to sth as it is produced, len is set to the number of
+ * bytes written and write_error is set if the stream refused the data.
+ */
+void
+php_epeg_output_init_stream(php_epeg_output_t *out, php_stream *sth TSRMLS_DC)
+{
+	php_epeg_output_init(out, NULL, NULL);
+	out->stream = sth;
+#ifdef ZTS
+	TSRMLS_SET_CTX(out->thread_ctx);
+#endif
+}
+/* }}} */
+
+/* {{{ php_epeg_output_free */
+void
+php_epeg_output_free(php_epeg_output_t *out)
+{
+	if (out->buf != NULL) {
+		out->free_func(out->buf);
+		out->buf = NULL;
+	}
+	out->len = 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_params_init */
+void
+php_epeg_params_init(php_epeg_params_t *params)
+{
+	params->width = 0;
+	params->height = 0;
+	params->quality = 75;
+	params->colorspace = PHP_EPEG_COLORSPACE_AUTO;
+	params->comment = NULL;
+	params->thumbnail_comments = 0;
+	params->x = 0;
+	params->y = 0;
+	params->filter = PHP_EPEG_FILTER_POINT;
+	params->sharpen = 0.0;
+	params->dc_only = 0;
+	params->stripe_pixels = PHP_EPEG_STRIPE_MIN_PIXELS;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_new */
+static php_epeg_decoder_t *
+php_epeg_decoder_new(void)
+{
+	php_epeg_decoder_t *dec;
+
+	dec = (php_epeg_decoder_t *)calloc(1, sizeof(php_epeg_decoder_t));
+	if (dec == NULL) {
+		return NULL;
+	}
+	dec->cinfo.err = php_epeg_jpeg_error_init(&dec->jerr);
+
+	return dec;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_open_memory */
+php_epeg_decoder_t *
+php_epeg_decoder_open_memory(const unsigned char *data, size_t data_len)
+{
+	php_epeg_decoder_t *dec;
+
+	if ((dec = php_epeg_decoder_new()) == NULL) {
+		return NULL;
+	}
+	if (setjmp(dec->jerr.jb)) {
+		php_epeg_decoder_close(dec);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&dec->cinfo);
+	php_epeg_memory_install((j_common_ptr)&dec->cinfo);
+	php_epeg_memory_src(&dec->cinfo, data, data_len);
+	(void)jpeg_read_header(&dec->cinfo, TRUE);
+
+	return dec;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_open_stream */
+/*
+ * If head is not NULL, every byte read until the header has been parsed
+ * is appended to it, so that the caller can get the original data back
+ * by reading the rest of the stream.
+ */
+php_epeg_decoder_t *
+php_epeg_decoder_open_stream(php_stream *sth, smart_str *head TSRMLS_DC)
+{
+	php_epeg_decoder_t *dec;
+
+	if ((dec = php_epeg_decoder_new()) == NULL) {
+		return NULL;
+	}
+	if (setjmp(dec->jerr.jb)) {
+		php_epeg_decoder_close(dec);
+		return NULL;
+	}
+
+	jpeg_create_decompress(&dec->cinfo);
+	php_epeg_memory_install((j_common_ptr)&dec->cinfo);
+	php_epeg_stream_src(&dec->cinfo, sth, head TSRMLS_CC);
+	(void)jpeg_read_header(&dec->cinfo, TRUE);
+
+	/* stop recording, the decoder only keeps one chunk from now on */
+	((php_epeg_stream_src_t *)dec->cinfo.src)->head = NULL;
+
+	return dec;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_close */
+void
+php_epeg_decoder_close(php_epeg_decoder_t *dec)
+{
+	jpeg_destroy_decompress(&dec->cinfo);
+	free(dec);
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_color_space */
+static J_COLOR_SPACE
+php_epeg_decoder_color_space(j_decompress_ptr cinfo, int colorspace)
+{
+	switch (colorspace) {
+	  case EPEG_GRAY8:
+		return JCS_GRAYSCALE;
+	  case EPEG_YUV8:
+		return JCS_YCbCr;
+	  case EPEG_CMYK:
+		return JCS_CMYK;
+	  case PHP_EPEG_COLORSPACE_AUTO:
+		/* keep the source colorspace and skip the color conversion */
+		switch (cinfo->jpeg_color_space) {
+		  case JCS_GRAYSCALE:
+			return JCS_GRAYSCALE;
+		  case JCS_YCbCr:
+			return JCS_YCbCr;
+		  case JCS_CMYK:
+		  case JCS_YCCK:
+			return JCS_CMYK;
+		  default:
+			return JCS_RGB;
+		}
+	  default:
+		return JCS_RGB;
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_scale_for */
+/*
+ * Pick the DCT scale to decode the image for the size.
+ * A size which is exactly the image scaled by 1/2, 1/4 or 1/8 is decoded
+ * at that scale, so the rows need no sampling afterwards.
+ */
+static int
+php_epeg_decoder_scale_for(j_decompress_ptr src, int width, int height)
+{
+	int scale;
+
+	for (scale = 8; scale > 1; scale >>= 1) {
+		if ((JDIMENSION)width == (src->image_width + scale - 1) / scale
+			&& (JDIMENSION)height == (src->image_height + scale - 1) / scale)
+		{
+			return scale;
+		}
+	}
+
+	scale = MIN((int)src->image_width / width, (int)src->image_height / height);
+	if (scale > 8) {
+		return 8;
+	} else if (scale < 1) {
+		return 1;
+	}
+	return scale;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_setup */
+static void
+php_epeg_decoder_setup(j_decompress_ptr src, int scale, int colorspace)
+{
+	/* the same decoding options as the Epeg library */
+	src->scale_num = 1;
+	src->scale_denom = (unsigned int)scale;
+	src->do_fancy_upsampling = FALSE;
+	src->do_block_smoothing = FALSE;
+	src->dct_method = JDCT_IFAST;
+	src->out_color_space = php_epeg_decoder_color_space(src, colorspace);
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_dc_ready */
+/*
+ * Whether every component has its DC coefficients, possibly without
+ * the low bits which come with a later refinement scan.
+ */
+static int
+php_epeg_decoder_dc_ready(j_decompress_ptr src)
+{
+	int ci;
+
+	for (ci = 0; ci < src->num_components; ci++) {
+		if (src->coef_bits[ci][0] < 0) {
+			return 0;
+		}
+	}
+	return 1;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_start */
+/*
+ * Start decompressing at 1/scale.
+ *
+ * With dc_only the image is decoded at 1/8, where every block is just its
+ * DC coefficient and no IDCT is done. A progressive image is read only up
+ * to the scans which carry the DC coefficients, the AC scans which make up
+ * most of the data are not even entropy decoded. A sequential image has
+ * to be entropy decoded anyway, it is the same as the 1/8 decode.
+ */
+static void
+php_epeg_decoder_start(j_decompress_ptr src, int scale, int colorspace, int dc_only)
+{
+	if (!dc_only) {
+		php_epeg_decoder_setup(src, scale, colorspace);
+		(void)jpeg_start_decompress(src);
+		return;
+	}
+
+	php_epeg_decoder_setup(src, 8, colorspace);
+	if (!src->progressive_mode) {
+		(void)jpeg_start_decompress(src);
+		return;
+	}
+	src->buffered_image = TRUE;
+	(void)jpeg_start_decompress(src);
+	for (;;) {
+		int ret = jpeg_consume_input(src);
+
+		if (ret == JPEG_SUSPENDED || ret == JPEG_REACHED_EOI
+			|| (ret == JPEG_SCAN_COMPLETED && php_epeg_decoder_dc_ready(src)))
+		{
+			break;
+		}
+	}
+	(void)jpeg_start_output(src, src->input_scan_number);
+}
+/* }}} */
+
+/* {{{ php_epeg_sample_row */
+static void
+php_epeg_sample_row(unsigned char *dp, int width,
+		const unsigned char *row, JDIMENSION row_width, int components)
+{
+	int x, i;
+
+	for (x = 0; x < width; x++) {
+		const unsigned char *sp = row
+			+ (((unsigned long)x * row_width) / (unsigned long)width) * components;
+		for (i = 0; i < components; i++) {
+			*dp++ = sp[i];
+		}
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_write_comments */
+/*
+ * Write the same comments as the Epeg library writes.
+ */
+static void
+php_epeg_write_comments(j_compress_ptr dst, const php_epeg_params_t *params,
+		int src_width, int src_height)
+{
+	if (params->comment != NULL) {
+		jpeg_write_marker(dst, JPEG_COM,
+				(const JOCTET *)params->comment, (unsigned int)strlen(params->comment));
+	}
+	if (params->thumbnail_comments) {
+		char buf[64];
+
+		snprintf(buf, sizeof(buf), "Thumb::MTime\n%lu", 0UL);
+		jpeg_write_marker(dst, JPEG_COM, (const JOCTET *)buf, (unsigned int)strlen(buf));
+		snprintf(buf, sizeof(buf), "Thumb::Image::Width\n%d", src_width);
+		jpeg_write_marker(dst, JPEG_COM, (const JOCTET *)buf, (unsigned int)strlen(buf));
+		snprintf(buf, sizeof(buf), "Thumb::Image::Height\n%d", src_height);
+		jpeg_write_marker(dst, JPEG_COM, (const JOCTET *)buf, (unsigned int)strlen(buf));
+		snprintf(buf, sizeof(buf), "Thumb::Mimetype\nimage/jpeg");
+		jpeg_write_marker(dst, JPEG_COM, (const JOCTET *)buf, (unsigned int)strlen(buf));
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_compress_start */
+static void
+php_epeg_compress_start(j_compress_ptr dst, const php_epeg_params_t *params,
+		int components, J_COLOR_SPACE color_space,
+		int src_width, int src_height, php_epeg_output_t *out)
+{
+	jpeg_create_compress(dst);
+	php_epeg_memory_install((j_common_ptr)dst);
+	if (out->stream != NULL) {
+		php_epeg_stream_dest(dst, out);
+	} else {
+		php_epeg_memory_dest(dst, out);
+	}
+	dst->image_width = (JDIMENSION)params->width;
+	dst->image_height = (JDIMENSION)params->height;
+	dst->input_components = components;
+	dst->in_color_space = color_space;
+	jpeg_set_defaults(dst);
+	dst->dct_method = JDCT_IFAST;
+	jpeg_set_quality(dst, params->quality, TRUE);
+	if (params->quality >= 90 && dst->num_components >= 3) {
+		dst->comp_info[0].h_samp_factor = 1;
+		dst->comp_info[0].v_samp_factor = 1;
+	}
+	jpeg_start_compress(dst, TRUE);
+	php_epeg_write_comments(dst, params, src_width, src_height);
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_striped */
+/*
+ * Whether the image decoded at 1/scale has more pixels than
+ * params->stripe_pixels, so that it is resampled in stripes
+ * instead of being kept whole.
+ */
+static int
+php_epeg_decoder_striped(j_decompress_ptr src, int scale, const php_epeg_params_t *params)
+{
+	double pixels = (double)((src->image_width + scale - 1) / scale)
+			* (double)((src->image_height + scale - 1) / scale);
+
+	return params->stripe_pixels > 0 && pixels > (double)params->stripe_pixels;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_encode_stripes */
+/*
+ * Same as php_epeg_decoder_encode_filtered(), but every decoded row is
+ * given to a resampler for each output as soon as it arrives, and the
+ * rows which come out are encoded at once. Only the windows of rows
+ * which the next output rows are made of are resident, so the memory
+ * grows with the width of the image, not with its area.
+ */
+static int
+php_epeg_decoder_encode_stripes(php_epeg_decoder_t *dec, int scale,
+		const php_epeg_params_t *sizes, int count, php_epeg_output_t *outs)
+{
+	j_decompress_ptr src = &dec->cinfo;
+	struct jpeg_compress_struct * volatile dsts = NULL;
+	php_epeg_resampler_t ** volatile resamplers = NULL;
+	unsigned char * volatile row = NULL;
+	volatile int stage = PHP_EPEG_ERROR_SCALE;
+	int k, pending, components;
+
+	if (setjmp(dec->jerr.jb)) {
+		jpeg_abort_decompress(src);
+		for (k = 0; k < count; k++) {
+			if (dsts != NULL) {
+				jpeg_destroy_compress(&dsts[k]);
+			}
+			if (resamplers != NULL) {
+				php_epeg_resampler_free(resamplers[k]);
+			}
+			php_epeg_output_free(&outs[k]);
+		}
+		free(dsts);
+		free(resamplers);
+		free(row);
+		return stage;
+	}
+
+	dsts = (struct jpeg_compress_struct *)calloc((size_t)count, sizeof(struct jpeg_compress_struct));
+	resamplers = (php_epeg_resampler_t **)calloc((size_t)count, sizeof(php_epeg_resampler_t *));
+	if (dsts == NULL || resamplers == NULL) {
+		ERREXIT1(src, JERR_OUT_OF_MEMORY, 1);
+	}
+
+	stage = PHP_EPEG_ERROR_DECODE;
+	php_epeg_decoder_start(src, scale, sizes[0].colorspace, sizes[0].dc_only);
+	components = src->output_components;
+
+	/* setup the resamplers and the compressors */
+	stage = PHP_EPEG_ERROR_SCALE;
+	row = (unsigned char *)malloc((size_t)src->output_width * components);
+	if (row == NULL) {
+		ERREXIT1(src, JERR_OUT_OF_MEMORY, 2);
+	}
+	for (k = 0; k < count; k++) {
+		resamplers[k] = php_epeg_resampler_new((int)src->output_width, (int)src->output_height,
+				sizes[k].width, sizes[k].height, components, sizes[0].filter, sizes[0].sharpen);
+		if (resamplers[k] == NULL) {
+			ERREXIT1(src, JERR_OUT_OF_MEMORY, 3);
+		}
+	}
+	stage = PHP_EPEG_ERROR_ENCODE;
+	for (k = 0; k < count; k++) {
+		dsts[k].err = &dec->jerr.pub;
+		php_epeg_compress_start(&dsts[k], &sizes[k], components, src->out_color_space,
+				(int)src->image_width, (int)src->image_height, &outs[k]);
+	}
+
+	/* resample and encode the rows until every output is complete */
+	pending = count;
+	while (pending > 0 && src->output_scanline < src->output_height) {
+		JSAMPROW rows[1];
+
+		stage = PHP_EPEG_ERROR_DECODE;
+		rows[0] = (JSAMPROW)row;
+		(void)jpeg_read_scanlines(src, rows, 1);
+
+		stage = PHP_EPEG_ERROR_ENCODE;
+		pending = 0;
+		for (k = 0; k < count; k++) {
+			const unsigned char *dp;
+
+			php_epeg_resampler_push(resamplers[k], row);
+			while ((dp = php_epeg_resampler_pull(resamplers[k])) != NULL) {
+				rows[0] = (JSAMPROW)dp;
+				(void)jpeg_write_scanlines(&dsts[k], rows, 1);
+			}
+			if (!php_epeg_resampler_done(resamplers[k])) {
+				pending++;
+			}
+		}
+	}
+	for (k = 0; k < count; k++) {
+		jpeg_finish_compress(&dsts[k]);
+	}
+
+	/* the remaining rows are not needed */
+	jpeg_abort_decompress(src);
+
+	for (k = 0; k < count; k++) {
+		jpeg_destroy_compress(&dsts[k]);
+		php_epeg_resampler_free(resamplers[k]);
+	}
+	free(dsts);
+	free(resamplers);
+	free(row);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_encode_filtered */
+/*
+ * Decode the whole image at the DCT scale, then resample it to every size
+ * with the filter of the first sizes and encode it. Used instead of the
+ * row by row sampling when a filter other than PHP_EPEG_FILTER_POINT or
+ * sharpening is requested. Returns 0 on success or one of PHP_EPEG_ERROR_*,
+ * on failure none of the outputs is set.
+ */
+static int
+php_epeg_decoder_encode_filtered(php_epeg_decoder_t *dec, int scale,
+		const php_epeg_params_t *sizes, int count, php_epeg_output_t *outs)
+{
+	j_decompress_ptr src = &dec->cinfo;
+	unsigned char * volatile buf = NULL;
+	volatile int stage = PHP_EPEG_ERROR_DECODE;
+	php_epeg_pixels_t px;
+	size_t stride;
+	int k, result = 0;
+
+	if (setjmp(dec->jerr.jb)) {
+		jpeg_abort_decompress(src);
+		free(buf);
+		return stage;
+	}
+
+	php_epeg_decoder_start(src, scale, sizes[0].colorspace, sizes[0].dc_only);
+
+	/* keep the DCT scaled image */
+	stage = PHP_EPEG_ERROR_SCALE;
+	stride = (size_t)src->output_width * src->output_components;
+	if ((size_t)src->output_height > ((size_t)-1) / stride
+		|| (buf = (unsigned char *)malloc(stride * src->output_height)) == NULL)
+	{
+		ERREXIT1(src, JERR_OUT_OF_MEMORY, 1);
+	}
+	stage = PHP_EPEG_ERROR_DECODE;
+	while (src->output_scanline < src->output_height) {
+		JSAMPROW rows[1];
+
+		rows[0] = (JSAMPROW)(buf + stride * src->output_scanline);
+		(void)jpeg_read_scanlines(src, rows, 1);
+	}
+	jpeg_abort_decompress(src);
+
+	memset(&px, 0, sizeof(php_epeg_pixels_t));
+	px.buf = buf;
+	px.width = (int)src->output_width;
+	px.height = (int)src->output_height;
+	px.components = src->output_components;
+	px.color_space = (int)src->out_color_space;
+	px.colorspace = sizes[0].colorspace;
+	px.src_width = (int)src->image_width;
+	px.src_height = (int)src->image_height;
+
+	/* resample and encode each output */
+	for (k = 0; k < count && result == 0; k++) {
+		php_epeg_pixels_t scaled;
+
+		if (sizes[k].width == px.width && sizes[k].height == px.height && sizes[0].sharpen <= 0.0) {
+			result = php_epeg_pixels_encode(&px, &sizes[k], &outs[k]);
+		} else if (php_epeg_pixels_resample(&px, sizes[k].width, sizes[k].height,
+				sizes[0].filter, sizes[0].sharpen, &scaled) != 0)
+		{
+			result = PHP_EPEG_ERROR_SCALE;
+		} else {
+			result = php_epeg_pixels_encode(&scaled, &sizes[k], &outs[k]);
+			php_epeg_pixels_free(&scaled);
+		}
+	}
+	if (result != 0) {
+		for (k = 0; k < count; k++) {
+			php_epeg_output_free(&outs[k]);
+		}
+	}
+	free(buf);
+
+	return result;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_encode */
+int
+php_epeg_decoder_encode(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, php_epeg_output_t *out)
+{
+	return php_epeg_decoder_encode_multiple(dec, params, 1, out);
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_encode_multiple */
+/*
+ * Decode the image once and encode it into count outputs in one pass.
+ *
+ * The source is decoded at the largest DCT scale which is not smaller than
+ * the largest output, then every output row is sampled from the nearest
+ * decoded row as soon as it arrives, so only one decoded row is resident
+ * at a time. The colorspace, the filter, the sharpening and dc_only of the
+ * first params are used for all outputs.
+ * Returns 0 on success or one of PHP_EPEG_ERROR_*, on failure none of
+ * the outputs is set.
+ */
+int
+php_epeg_decoder_encode_multiple(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, int count, php_epeg_output_t *outs)
+{
+	j_decompress_ptr src = &dec->cinfo;
+	struct jpeg_compress_struct * volatile dsts = NULL;
+	php_epeg_params_t * volatile sizes = NULL;
+	unsigned char ** volatile out_rows = NULL;
+	JDIMENSION * volatile next_y = NULL;
+	unsigned char * volatile row = NULL;
+	volatile int stage = PHP_EPEG_ERROR_SCALE;
+	int k, scale, components;
+	JDIMENSION src_y, last_y;
+
+	for (k = 0; k < count; k++) {
+		php_epeg_output_free(&outs[k]);
+	}
+
+	if (setjmp(dec->jerr.jb)) {
+		jpeg_abort_decompress(src);
+		for (k = 0; k < count; k++) {
+			if (dsts != NULL) {
+				jpeg_destroy_compress(&dsts[k]);
+			}
+			if (out_rows != NULL && out_rows[k] != NULL && out_rows[k] != row) {
+				free(out_rows[k]);
+			}
+			php_epeg_output_free(&outs[k]);
+		}
+		free(dsts);
+		free(sizes);
+		free(out_rows);
+		free(next_y);
+		free(row);
+		return stage;
+	}
+
+	/* allocate the per output states */
+	dsts = (struct jpeg_compress_struct *)calloc((size_t)count, sizeof(struct jpeg_compress_struct));
+	sizes = (php_epeg_params_t *)calloc((size_t)count, sizeof(php_epeg_params_t));
+	out_rows = (unsigned char **)calloc((size_t)count, sizeof(unsigned char *));
+	next_y = (JDIMENSION *)calloc((size_t)count, sizeof(JDIMENSION));
+	if (dsts == NULL || sizes == NULL || out_rows == NULL || next_y == NULL) {
+		ERREXIT1(src, JERR_OUT_OF_MEMORY, 1);
+	}
+
+	/* determine the output sizes and the scale for the largest one */
+	scale = 8;
+	for (k = 0; k < count; k++) {
+		int s;
+
+		sizes[k] = params[k];
+		if (sizes[k].width <= 0) {
+			sizes[k].width = (int)src->image_width;
+		}
+		if (sizes[k].height <= 0) {
+			sizes[k].height = (int)src->image_height;
+		}
+		s = params[0].dc_only ? 8 : php_epeg_decoder_scale_for(src, sizes[k].width, sizes[k].height);
+		if (s < scale) {
+			scale = s;
+		}
+	}
+
+	/* resampling with a filter needs the whole DCT scaled image, or a window of it */
+	if (params[0].filter != PHP_EPEG_FILTER_POINT || params[0].sharpen > 0.0) {
+		int result = php_epeg_decoder_striped(src, scale, &params[0])
+			? php_epeg_decoder_encode_stripes(dec, scale, sizes, count, outs)
+			: php_epeg_decoder_encode_filtered(dec, scale, sizes, count, outs);
+
+		free(dsts);
+		free(sizes);
+		free(out_rows);
+		free(next_y);
+		return result;
+	}
+
+	stage = PHP_EPEG_ERROR_DECODE;
+	php_epeg_decoder_start(src, scale, params[0].colorspace, params[0].dc_only);
+	components = src->output_components;
+
+	/* setup the compressors */
+	stage = PHP_EPEG_ERROR_ENCODE;
+	for (k = 0; k < count; k++) {
+		dsts[k].err = &dec->jerr.pub;
+		php_epeg_compress_start(&dsts[k], &sizes[k], components, src->out_color_space,
+				(int)src->image_width, (int)src->image_height, &outs[k]);
+	}
+
+	/* allocate the row buffers */
+	stage = PHP_EPEG_ERROR_SCALE;
+	row = (unsigned char *)malloc((size_t)src->output_width * components);
+	if (row == NULL) {
+		ERREXIT1(src, JERR_OUT_OF_MEMORY, 2);
+	}
+	last_y = 0;
+	for (k = 0; k < count; k++) {
+		JDIMENSION sy;
+
+		if (sizes[k].width == (int)src->output_width) {
+			out_rows[k] = row;
+		} else {
+			out_rows[k] = (unsigned char *)malloc((size_t)sizes[k].width * components);
+			if (out_rows[k] == NULL) {
+				ERREXIT1(src, JERR_OUT_OF_MEMORY, 3);
+			}
+		}
+		sy = (JDIMENSION)(((unsigned long)(sizes[k].height - 1) * src->output_height)
+				/ (unsigned long)sizes[k].height);
+		if (sy > last_y) {
+			last_y = sy;
+		}
+	}
+
+	/* sample each output row from the nearest decoded row */
+	for (src_y = 0; src_y <= last_y; src_y++) {
+		JSAMPROW rows[1];
+
+		stage = PHP_EPEG_ERROR_DECODE;
+		rows[0] = (JSAMPROW)row;
+		(void)jpeg_read_scanlines(src, rows, 1);
+
+		stage = PHP_EPEG_ERROR_ENCODE;
+		for (k = 0; k < count; k++) {
+			const int width = sizes[k].width;
+			const int height = sizes[k].height;
+
+			while (next_y[k] < (JDIMENSION)height
+				&& (JDIMENSION)(((unsigned long)next_y[k] * src->output_height)
+						/ (unsigned long)height) <= src_y)
+			{
+				if (out_rows[k] != row) {
+					php_epeg_sample_row(out_rows[k], width, row, src->output_width, components);
+				}
+				rows[0] = (JSAMPROW)out_rows[k];
+				(void)jpeg_write_scanlines(&dsts[k], rows, 1);
+				next_y[k]++;
+			}
+		}
+	}
+	for (k = 0; k < count; k++) {
+		jpeg_finish_compress(&dsts[k]);
+	}
+
+	/* the remaining rows are not needed */
+	jpeg_abort_decompress(src);
+
+	for (k = 0; k < count; k++) {
+		jpeg_destroy_compress(&dsts[k]);
+		if (out_rows[k] != row) {
+			free(out_rows[k]);
+		}
+	}
+	free(dsts);
+	free(sizes);
+	free(out_rows);
+	free(next_y);
+	free(row);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_filter */
+/*
+ * Resample the DCT scaled pixels to width x height with params->filter
+ * and sharpen them. px is replaced, or released on failure.
+ * Returns 0 on success or PHP_EPEG_ERROR_SCALE.
+ */
+static int
+php_epeg_pixels_filter(php_epeg_pixels_t *px, int width, int height,
+		const php_epeg_params_t *params)
+{
+	php_epeg_pixels_t dst;
+
+	px->filter = params->filter;
+	if (px->width == width && px->height == height && params->sharpen <= 0.0) {
+		return 0;
+	}
+	if (php_epeg_pixels_resample(px, width, height, params->filter, params->sharpen, &dst) != 0) {
+		php_epeg_pixels_free(px);
+		return PHP_EPEG_ERROR_SCALE;
+	}
+	php_epeg_pixels_free(px);
+	*px = dst;
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_scale */
+/*
+ * Decode the image and keep it scaled to params->width x params->height.
+ * The rows are sampled the same way as php_epeg_decoder_encode() does,
+ * so encoding the pixels gives the same image. With another filter than
+ * PHP_EPEG_FILTER_POINT the DCT scaled rows are kept as they are and
+ * resampled afterwards, or resampled as they arrive if there are more
+ * than params->stripe_pixels of them.
+ * Returns 0 on success or one of PHP_EPEG_ERROR_*.
+ */
+int
+php_epeg_decoder_scale(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, php_epeg_pixels_t *px)
+{
+	j_decompress_ptr src = &dec->cinfo;
+	unsigned char * volatile row = NULL;
+	php_epeg_resampler_t * volatile resampler = NULL;
+	volatile int stage = PHP_EPEG_ERROR_DECODE;
+	int width, height, out_width, out_height, components, scale, striped;
+	size_t stride;
+	JDIMENSION src_y, y;
+
+	memset(px, 0, sizeof(php_epeg_pixels_t));
+
+	if (setjmp(dec->jerr.jb)) {
+		jpeg_abort_decompress(src);
+		if (row != NULL) {
+			free(row);
+		}
+		php_epeg_resampler_free(resampler);
+		php_epeg_pixels_free(px);
+		return stage;
+	}
+
+	/* determine the output size */
+	out_width = (params->width > 0) ? params->width : (int)src->image_width;
+	out_height = (params->height > 0) ? params->height : (int)src->image_height;
+
+	scale = params->dc_only ? 8 : php_epeg_decoder_scale_for(src, out_width, out_height);
+	striped = (params->filter != PHP_EPEG_FILTER_POINT
+			&& php_epeg_decoder_striped(src, scale, params));
+	php_epeg_decoder_start(src, scale, params->colorspace, params->dc_only);
+	components = src->output_components;
+	width = out_width;
+	height = out_height;
+	if (params->filter != PHP_EPEG_FILTER_POINT && !striped) {
+		width = (int)src->output_width;
+		height = (int)src->output_height;
+	}
+
+	/* allocate the buffers */
+	stage = PHP_EPEG_ERROR_SCALE;
+	stride = (size_t)width * components;
+	if ((size_t)height > ((size_t)-1) / stride) {
+		ERREXIT1(src, JERR_OUT_OF_MEMORY, 1);
+	}
+	px->buf = (unsigned char *)malloc(stride * height);
+	row = (unsigned char *)malloc((size_t)src->output_width * components);
+	if (px->buf == NULL || row == NULL) {
+		ERREXIT1(src, JERR_OUT_OF_MEMORY, 2);
+	}
+
+	/* resample the rows as they arrive */
+	if (striped) {
+		const unsigned char *dp;
+
+		resampler = php_epeg_resampler_new((int)src->output_width, (int)src->output_height,
+				width, height, components, params->filter, params->sharpen);
+		if (resampler == NULL) {
+			ERREXIT1(src, JERR_OUT_OF_MEMORY, 3);
+		}
+		y = 0;
+		while (!php_epeg_resampler_done(resampler)) {
+			JSAMPROW rows[1];
+
+			stage = PHP_EPEG_ERROR_DECODE;
+			rows[0] = (JSAMPROW)row;
+			(void)jpeg_read_scanlines(src, rows, 1);
+			php_epeg_resampler_push(resampler, row);
+			while ((dp = php_epeg_resampler_pull(resampler)) != NULL) {
+				memcpy(px->buf + stride * y++, dp, stride);
+			}
+		}
+		php_epeg_resampler_free(resampler);
+		resampler = NULL;
+	}
+
+	/* sample each output row from the nearest decoded row */
+	src_y = 0;
+	for (y = 0; y < (JDIMENSION)height && !striped; y++) {
+		JDIMENSION sy = (JDIMENSION)(((unsigned long)y * src->output_height) / (unsigned long)height);
+		JSAMPROW rows[1];
+
+		stage = PHP_EPEG_ERROR_DECODE;
+		while (src_y <= sy) {
+			rows[0] = (JSAMPROW)row;
+			(void)jpeg_read_scanlines(src, rows, 1);
+			src_y++;
+		}
+		if (width == (int)src->output_width) {
+			memcpy(px->buf + stride * y, row, stride);
+		} else {
+			php_epeg_sample_row(px->buf + stride * y, width, row, src->output_width, components);
+		}
+	}
+
+	/* the remaining rows are not needed */
+	jpeg_abort_decompress(src);
+	free(row);
+
+	px->width = width;
+	px->height = height;
+	px->components = components;
+	px->color_space = (int)src->out_color_space;
+	px->colorspace = params->colorspace;
+	px->dc_only = params->dc_only;
+	px->src_width = (int)src->image_width;
+	px->src_height = (int)src->image_height;
+
+	if (striped) {
+		px->filter = params->filter;
+		px->sharpen = params->sharpen;
+	} else if (params->filter != PHP_EPEG_FILTER_POINT || params->sharpen > 0.0) {
+		return php_epeg_pixels_filter(px, out_width, out_height, params);
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_encode */
+/*
+ * Encode the pixels kept by php_epeg_decoder_scale().
+ * The size and the colorspace of params are ignored.
+ * Returns 0 on success or PHP_EPEG_ERROR_ENCODE.
+ */
+int
+php_epeg_pixels_encode(const php_epeg_pixels_t *px,
+		const php_epeg_params_t *params, php_epeg_output_t *out)
+{
+	return php_epeg_pixels_encode_area(px, 0, 0, px->width, px->height, params, out);
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_encode_area */
+/*
+ * Encode the width x height area at (x, y) of the pixels,
+ * the area must be inside of the pixels.
+ * The size and the colorspace of params are ignored.
+ * Returns 0 on success or PHP_EPEG_ERROR_ENCODE.
+ */
+int
+php_epeg_pixels_encode_area(const php_epeg_pixels_t *px, int x, int y, int width, int height,
+		const php_epeg_params_t *params, php_epeg_output_t *out)
+{
+	struct jpeg_compress_struct dst;
+	php_epeg_jpeg_error_t jerr;
+	php_epeg_params_t size;
+	size_t stride;
+	JDIMENSION row;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.err = php_epeg_jpeg_error_init(&jerr);
+	php_epeg_output_free(out);
+
+	if (setjmp(jerr.jb)) {
+		jpeg_destroy_compress(&dst);
+		php_epeg_output_free(out);
+		return PHP_EPEG_ERROR_ENCODE;
+	}
+
+	size = *params;
+	size.width = width;
+	size.height = height;
+	php_epeg_compress_start(&dst, &size, px->components, (J_COLOR_SPACE)px->color_space,
+			px->src_width, px->src_height, out);
+
+	stride = (size_t)px->width * px->components;
+	for (row = 0; row < (JDIMENSION)height; row++) {
+		JSAMPROW rows[1];
+		rows[0] = (JSAMPROW)(px->buf + stride * (y + row) + (size_t)x * px->components);
+		(void)jpeg_write_scanlines(&dst, rows, 1);
+	}
+	jpeg_finish_compress(&dst);
+	jpeg_destroy_compress(&dst);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_walk */
+/*
+ * Get how to walk the pixels rotated or flipped by op, the pixel (x, y)
+ * of the transformed image is at *origin + x * *x_step + y * *y_step.
+ */
+static void
+php_epeg_pixels_walk(const php_epeg_pixels_t *px, int op,
+		const unsigned char **origin, long *x_step, long *y_step)
+{
+	const int components = px->components;
+	const long stride = (long)px->width * components;
+
+	*origin = px->buf;
+	*x_step = components;
+	*y_step = stride;
+	if (PHP_EPEG_TRANSFORM_SWAPS_AXES(op)) {
+		*x_step = stride;
+		*y_step = components;
+	}
+	switch (op) {
+	  case PHP_EPEG_TRANSFORM_FLIP_H:
+	  case PHP_EPEG_TRANSFORM_ROT_180:
+		*origin += stride - components;
+		*x_step = -*x_step;
+		break;
+	  case PHP_EPEG_TRANSFORM_ROT_90:
+		*origin += stride * (px->height - 1);
+		*x_step = -*x_step;
+		break;
+	  case PHP_EPEG_TRANSFORM_ROT_270:
+		*origin += stride - components;
+		*y_step = -*y_step;
+		break;
+	  case PHP_EPEG_TRANSFORM_TRANSVERSE:
+		*origin += stride * (px->height - 1) + stride - components;
+		*x_step = -*x_step;
+		*y_step = -*y_step;
+		break;
+	}
+	if (op == PHP_EPEG_TRANSFORM_FLIP_V || op == PHP_EPEG_TRANSFORM_ROT_180) {
+		*origin += stride * (px->height - 1);
+		*y_step = -*y_step;
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_encode_transform */
+/*
+ * Encode the pixels rotated or flipped by op, one of PHP_EPEG_TRANSFORM_*.
+ * Each output row is gathered from the pixels while it is encoded,
+ * so no transformed copy of the pixels is made.
+ * The size and the colorspace of params are ignored.
+ * Returns 0 on success or PHP_EPEG_ERROR_ENCODE.
+ */
+int
+php_epeg_pixels_encode_transform(const php_epeg_pixels_t *px, int op,
+		const php_epeg_params_t *params, php_epeg_output_t *out)
+{
+	struct jpeg_compress_struct dst;
+	php_epeg_jpeg_error_t jerr;
+	php_epeg_params_t size;
+	unsigned char * volatile row = NULL;
+	const int components = px->components;
+	const unsigned char *origin;
+	long x_step, y_step;
+	int x, y, i;
+
+	if (op == PHP_EPEG_TRANSFORM_NONE) {
+		return php_epeg_pixels_encode(px, params, out);
+	}
+
+	memset(&dst, 0, sizeof(dst));
+	dst.err = php_epeg_jpeg_error_init(&jerr);
+	php_epeg_output_free(out);
+
+	if (setjmp(jerr.jb)) {
+		jpeg_destroy_compress(&dst);
+		php_epeg_output_free(out);
+		if (row != NULL) {
+			free(row);
+		}
+		return PHP_EPEG_ERROR_ENCODE;
+	}
+
+	php_epeg_pixels_walk(px, op, &origin, &x_step, &y_step);
+
+	size = *params;
+	size.width = PHP_EPEG_TRANSFORM_SWAPS_AXES(op) ? px->height : px->width;
+	size.height = PHP_EPEG_TRANSFORM_SWAPS_AXES(op) ? px->width : px->height;
+	php_epeg_compress_start(&dst, &size, components, (J_COLOR_SPACE)px->color_space,
+			px->src_width, px->src_height, out);
+
+	row = (unsigned char *)malloc((size_t)size.width * components);
+	if (row == NULL) {
+		ERREXIT1(&dst, JERR_OUT_OF_MEMORY, 1);
+	}
+
+	for (y = 0; y < size.height; y++) {
+		const unsigned char *sp = origin + y_step * y;
+		unsigned char *dp = row;
+		JSAMPROW rows[1];
+
+		for (x = 0; x < size.width; x++) {
+			for (i = 0; i < components; i++) {
+				*dp++ = sp[i];
+			}
+			sp += x_step;
+		}
+		rows[0] = (JSAMPROW)row;
+		(void)jpeg_write_scanlines(&dst, rows, 1);
+	}
+	jpeg_finish_compress(&dst);
+	jpeg_destroy_compress(&dst);
+	free(row);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_format */
+/*
+ * Get the colorspace of the pixels as one of EPEG_*, the requested one
+ * or that of the image, and return the bytes per pixel of it.
+ */
+int
+php_epeg_pixels_format(const php_epeg_pixels_t *px, int *colorspace)
+{
+	if (px->colorspace != PHP_EPEG_COLORSPACE_AUTO) {
+		*colorspace = px->colorspace;
+	} else {
+		switch ((J_COLOR_SPACE)px->color_space) {
+		  case JCS_GRAYSCALE:
+			*colorspace = EPEG_GRAY8;
+			break;
+		  case JCS_YCbCr:
+			*colorspace = EPEG_YUV8;
+			break;
+		  case JCS_CMYK:
+			*colorspace = EPEG_CMYK;
+			break;
+		  default:
+			*colorspace = EPEG_RGB8;
+			break;
+		}
+	}
+
+	switch (*colorspace) {
+	  case EPEG_GRAY8:
+		return 1;
+	  case EPEG_YUV8:
+	  case EPEG_RGB8:
+	  case EPEG_BGR8:
+		return 3;
+	  default:
+		return 4;
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_export */
+/*
+ * Write the pixels rotated or flipped by op to buf in the colorspace of
+ * php_epeg_pixels_format(), the rows from top to bottom without padding.
+ * The decoder makes RGB for EPEG_BGR8, EPEG_RGBA8, EPEG_BGRA8 and
+ * EPEG_ARGB32, they are rearranged here the same way as epeg_pixels_get()
+ * of the Epeg library does, with opaque alpha and ARGB32 as native 32 bit
+ * integers. The other colorspaces are copied as they are.
+ */
+void
+php_epeg_pixels_export(const php_epeg_pixels_t *px, int op, unsigned char *buf)
+{
+	const int components = px->components;
+	const int width = PHP_EPEG_TRANSFORM_SWAPS_AXES(op) ? px->height : px->width;
+	const int height = PHP_EPEG_TRANSFORM_SWAPS_AXES(op) ? px->width : px->height;
+	const unsigned char *origin;
+	long x_step, y_step;
+	int colorspace, x, y, i;
+
+	(void)php_epeg_pixels_format(px, &colorspace);
+	if (op == PHP_EPEG_TRANSFORM_NONE && colorspace != EPEG_BGR8 && colorspace != EPEG_RGBA8
+		&& colorspace != EPEG_BGRA8 && colorspace != EPEG_ARGB32)
+	{
+		memcpy(buf, px->buf, (size_t)px->width * px->height * components);
+		return;
+	}
+
+	php_epeg_pixels_walk(px, op, &origin, &x_step, &y_step);
+	for (y = 0; y < height; y++) {
+		const unsigned char *sp = origin + y_step * y;
+
+		for (x = 0; x < width; x++, sp += x_step) {
+			switch (colorspace) {
+			  case EPEG_BGR8:
+				*buf++ = sp[2];
+				*buf++ = sp[1];
+				*buf++ = sp[0];
+				break;
+			  case EPEG_RGBA8:
+				*buf++ = sp[0];
+				*buf++ = sp[1];
+				*buf++ = sp[2];
+				*buf++ = 0xff;
+				break;
+			  case EPEG_BGRA8:
+				*buf++ = sp[2];
+				*buf++ = sp[1];
+				*buf++ = sp[0];
+				*buf++ = 0xff;
+				break;
+			  case EPEG_ARGB32: {
+				unsigned int argb = 0xff000000U
+					| ((unsigned int)sp[0] << 16) | ((unsigned int)sp[1] << 8) | sp[2];
+				memcpy(buf, &argb, 4);
+				buf += 4;
+				break;
+			  }
+			  default:
+				for (i = 0; i < components; i++) {
+					*buf++ = sp[i];
+				}
+				break;
+			}
+		}
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_halve */
+/*
+ * Make dst the half size of src rounded up, each pixel is the average
+ * of the 2x2 pixels of src. Returns 0 on success or PHP_EPEG_ERROR_SCALE.
+ */
+int
+php_epeg_pixels_halve(const php_epeg_pixels_t *src, php_epeg_pixels_t *dst)
+{
+	int width = (src->width + 1) / 2;
+	int height = (src->height + 1) / 2;
+	int components = src->components;
+	size_t src_stride = (size_t)src->width * components;
+	size_t stride = (size_t)width * components;
+	unsigned char *dp;
+	int x, y, i;
+
+	*dst = *src;
+	dst->buf = (unsigned char *)malloc(stride * height);
+	if (dst->buf == NULL) {
+		memset(dst, 0, sizeof(php_epeg_pixels_t));
+		return PHP_EPEG_ERROR_SCALE;
+	}
+	dst->width = width;
+	dst->height = height;
+
+	dp = dst->buf;
+	for (y = 0; y < height; y++) {
+		/* the last row or column is repeated if the size is odd */
+		const unsigned char *r0 = src->buf + src_stride * (2 * y);
+		const unsigned char *r1 = (2 * y + 1 < src->height) ? r0 + src_stride : r0;
+		for (x = 0; x < width; x++) {
+			size_t c0 = (size_t)(2 * x) * components;
+			size_t c1 = (2 * x + 1 < src->width) ? c0 + components : c0;
+			for (i = 0; i < components; i++) {
+				*dp++ = (unsigned char)((r0[c0 + i] + r0[c1 + i] + r1[c0 + i] + r1[c1 + i] + 2) >> 2);
+			}
+		}
+	}
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_trim */
+/*
+ * Decode the image at full size and encode the params->width x params->height
+ * area at (params->x, params->y) without scaling, like epeg_trim() of the
+ * Epeg library. The area is clipped to the image.
+ * Returns 0 on success or one of PHP_EPEG_ERROR_*.
+ */
+int
+php_epeg_decoder_trim(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, php_epeg_output_t *out)
+{
+	j_decompress_ptr src = &dec->cinfo;
+	struct jpeg_compress_struct dst;
+	php_epeg_params_t area;
+	unsigned char * volatile row = NULL;
+	volatile int stage = PHP_EPEG_ERROR_SCALE;
+	int components;
+	JDIMENSION y;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.err = &dec->jerr.pub;
+	php_epeg_output_free(out);
+
+	if (setjmp(dec->jerr.jb)) {
+		jpeg_destroy_compress(&dst);
+		jpeg_abort_decompress(src);
+		php_epeg_output_free(out);
+		if (row != NULL) {
+			free(row);
+		}
+		return stage;
+	}
+
+	/* determine the area */
+	area = *params;
+	if (area.x < 0 || area.y < 0
+		|| area.x >= (int)src->image_width || area.y >= (int)src->image_height)
+	{
+		ERREXIT(src, JERR_EMPTY_IMAGE);
+	}
+	if (area.width <= 0 || area.width > (int)src->image_width - area.x) {
+		area.width = (int)src->image_width - area.x;
+	}
+	if (area.height <= 0 || area.height > (int)src->image_height - area.y) {
+		area.height = (int)src->image_height - area.y;
+	}
+
+	stage = PHP_EPEG_ERROR_DECODE;
+	php_epeg_decoder_start(src, 1, area.colorspace, 0);
+	components = src->output_components;
+
+	stage = PHP_EPEG_ERROR_ENCODE;
+	php_epeg_compress_start(&dst, &area, components, src->out_color_space,
+			(int)src->image_width, (int)src->image_height, out);
+
+	stage = PHP_EPEG_ERROR_SCALE;
+	row = (unsigned char *)malloc((size_t)src->output_width * components);
+	if (row == NULL) {
+		ERREXIT1(src, JERR_OUT_OF_MEMORY, 1);
+	}
+
+	for (y = 0; y < (JDIMENSION)(area.y + area.height); y++) {
+		JSAMPROW rows[1];
+
+		stage = PHP_EPEG_ERROR_DECODE;
+		rows[0] = (JSAMPROW)row;
+		(void)jpeg_read_scanlines(src, rows, 1);
+		if (y < (JDIMENSION)area.y) {
+			continue;
+		}
+
+		stage = PHP_EPEG_ERROR_ENCODE;
+		rows[0] = (JSAMPROW)(row + (size_t)area.x * components);
+		(void)jpeg_write_scanlines(&dst, rows, 1);
+	}
+	jpeg_finish_compress(&dst);
+
+	/* the remaining rows are not needed */
+	jpeg_destroy_compress(&dst);
+	jpeg_abort_decompress(src);
+	free(row);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_transform_block */
+/*
+ * Rotate or flip the coefficients of a block like the pixels of op,
+ * the blocks must not overlap.
+ */
+static void
+php_epeg_transform_block(JCOEFPTR dst, const JCOEF *src, int op)
+{
+	const int transpose = PHP_EPEG_TRANSFORM_SWAPS_AXES(op);
+	/* mirroring a block negates the odd frequencies in that direction */
+	const int flip_x = (op == PHP_EPEG_TRANSFORM_FLIP_H || op == PHP_EPEG_TRANSFORM_ROT_90
+			|| op == PHP_EPEG_TRANSFORM_ROT_180 || op == PHP_EPEG_TRANSFORM_TRANSVERSE);
+	const int flip_y = (op == PHP_EPEG_TRANSFORM_FLIP_V || op == PHP_EPEG_TRANSFORM_ROT_270
+			|| op == PHP_EPEG_TRANSFORM_ROT_180 || op == PHP_EPEG_TRANSFORM_TRANSVERSE);
+	int u, v;
+
+	for (v = 0; v < DCTSIZE; v++) {
+		for (u = 0; u < DCTSIZE; u++) {
+			JCOEF c = transpose ? src[u * DCTSIZE + v] : src[v * DCTSIZE + u];
+			if (((flip_x && (u & 1)) != 0) != ((flip_y && (v & 1)) != 0)) {
+				c = (JCOEF)-c;
+			}
+			dst[v * DCTSIZE + u] = c;
+		}
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_transform */
+/*
+ * Rotate or flip the image by op, one of PHP_EPEG_TRANSFORM_*, like jpegtran.
+ *
+ * The DCT coefficients are rearranged without decoding, so the quality of
+ * the source is kept. The partial MCUs at the edges which would move to
+ * the top or the left are trimmed, as jpegtran -trim does. An image smaller
+ * than an MCU in such direction is decoded and transformed pixel by pixel.
+ * Only the comments and the quality of params are used, the quality only
+ * in that case.
+ * Returns 0 on success or one of PHP_EPEG_ERROR_*.
+ */
+int
+php_epeg_decoder_transform(php_epeg_decoder_t *dec, int op,
+		const php_epeg_params_t *params, php_epeg_output_t *out)
+{
+	j_decompress_ptr src = &dec->cinfo;
+	struct jpeg_compress_struct dst;
+	jvirt_barray_ptr *src_coefs;
+	jvirt_barray_ptr dst_coefs[MAX_COMPONENTS];
+	const int transpose = PHP_EPEG_TRANSFORM_SWAPS_AXES(op);
+	const int flip_x = (op == PHP_EPEG_TRANSFORM_FLIP_H || op == PHP_EPEG_TRANSFORM_ROT_90
+			|| op == PHP_EPEG_TRANSFORM_ROT_180 || op == PHP_EPEG_TRANSFORM_TRANSVERSE);
+	const int flip_y = (op == PHP_EPEG_TRANSFORM_FLIP_V || op == PHP_EPEG_TRANSFORM_ROT_270
+			|| op == PHP_EPEG_TRANSFORM_ROT_180 || op == PHP_EPEG_TRANSFORM_TRANSVERSE);
+	volatile int stage = PHP_EPEG_ERROR_DECODE;
+	JDIMENSION width, height, mcu_width, mcu_height;
+	int ci, t;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.err = &dec->jerr.pub;
+	php_epeg_output_free(out);
+
+	/* the size of the output, the partial MCUs to be mirrored are trimmed */
+	width = transpose ? src->image_height : src->image_width;
+	height = transpose ? src->image_width : src->image_height;
+	mcu_width = (JDIMENSION)(transpose ? src->max_v_samp_factor : src->max_h_samp_factor) * DCTSIZE;
+	mcu_height = (JDIMENSION)(transpose ? src->max_h_samp_factor : src->max_v_samp_factor) * DCTSIZE;
+	if ((flip_x && width < mcu_width) || (flip_y && height < mcu_height)) {
+		/* nothing would be left, transform the decoded pixels instead */
+		php_epeg_params_t full = *params;
+		php_epeg_pixels_t px;
+		int result;
+
+		full.width = (int)src->image_width;
+		full.height = (int)src->image_height;
+		full.colorspace = PHP_EPEG_COLORSPACE_AUTO;
+		result = php_epeg_decoder_scale(dec, &full, &px);
+		if (result == 0) {
+			result = php_epeg_pixels_encode_transform(&px, op, &full, out);
+			php_epeg_pixels_free(&px);
+		}
+		return result;
+	}
+	width -= flip_x ? width % mcu_width : 0;
+	height -= flip_y ? height % mcu_height : 0;
+
+	if (setjmp(dec->jerr.jb)) {
+		jpeg_destroy_compress(&dst);
+		jpeg_abort_decompress(src);
+		php_epeg_output_free(out);
+		return stage;
+	}
+
+	src_coefs = jpeg_read_coefficients(src);
+
+	stage = PHP_EPEG_ERROR_ENCODE;
+	jpeg_create_compress(&dst);
+	php_epeg_memory_install((j_common_ptr)&dst);
+	if (out->stream != NULL) {
+		php_epeg_stream_dest(&dst, out);
+	} else {
+		php_epeg_memory_dest(&dst, out);
+	}
+	jpeg_copy_critical_parameters(src, &dst);
+
+	dst.image_width = width;
+	dst.image_height = height;
+
+	/* transpose the sampling factors and the quantization tables too */
+	if (transpose) {
+		for (ci = 0; ci < dst.num_components; ci++) {
+			jpeg_component_info *compptr = dst.comp_info + ci;
+			int samp = compptr->h_samp_factor;
+			compptr->h_samp_factor = compptr->v_samp_factor;
+			compptr->v_samp_factor = samp;
+		}
+		for (t = 0; t < NUM_QUANT_TBLS; t++) {
+			JQUANT_TBL *qtbl = dst.quant_tbl_ptrs[t];
+			int u, v;
+
+			if (qtbl == NULL) {
+				continue;
+			}
+			for (v = 0; v < DCTSIZE; v++) {
+				for (u = v + 1; u < DCTSIZE; u++) {
+					UINT16 q = qtbl->quantval[v * DCTSIZE + u];
+					qtbl->quantval[v * DCTSIZE + u] = qtbl->quantval[u * DCTSIZE + v];
+					qtbl->quantval[u * DCTSIZE + v] = q;
+				}
+			}
+		}
+	}
+
+	/* the same size as the source arrays, transposed */
+	for (ci = 0; ci < dst.num_components; ci++) {
+		jpeg_component_info *compptr = src->comp_info + ci;
+		JDIMENSION src_cols = PHP_EPEG_ROUND_UP(compptr->width_in_blocks, compptr->h_samp_factor);
+		JDIMENSION src_rows = PHP_EPEG_ROUND_UP(compptr->height_in_blocks, compptr->v_samp_factor);
+
+		dst_coefs[ci] = (*dst.mem->request_virt_barray)((j_common_ptr)&dst, JPOOL_IMAGE, FALSE,
+				transpose ? src_rows : src_cols, transpose ? src_cols : src_rows,
+				(JDIMENSION)dst.comp_info[ci].v_samp_factor);
+	}
+
+	jpeg_write_coefficients(&dst, dst_coefs);
+	php_epeg_write_comments(&dst, params, (int)src->image_width, (int)src->image_height);
+
+	/* move every block, the blocks of the partial MCUs are not mirrored */
+	for (ci = 0; ci < dst.num_components; ci++) {
+		jpeg_component_info *src_comp = src->comp_info + ci;
+		jpeg_component_info *dst_comp = dst.comp_info + ci;
+		JDIMENSION cols = PHP_EPEG_ROUND_UP(transpose ? src_comp->height_in_blocks
+				: src_comp->width_in_blocks, dst_comp->h_samp_factor);
+		JDIMENSION rows = PHP_EPEG_ROUND_UP(transpose ? src_comp->width_in_blocks
+				: src_comp->height_in_blocks, dst_comp->v_samp_factor);
+		JDIMENSION mirror_cols = (width / mcu_width) * (JDIMENSION)dst_comp->h_samp_factor;
+		JDIMENSION mirror_rows = (height / mcu_height) * (JDIMENSION)dst_comp->v_samp_factor;
+		JDIMENSION x, y;
+
+		for (y = 0; y < rows; y++) {
+			JBLOCKROW dst_row = (*dst.mem->access_virt_barray)((j_common_ptr)&dst,
+					dst_coefs[ci], y, 1, TRUE)[0];
+			JDIMENSION sy = (flip_y && y < mirror_rows) ? mirror_rows - 1 - y : y;
+			JBLOCKROW src_row = NULL;
+
+			if (!transpose) {
+				src_row = (*src->mem->access_virt_barray)((j_common_ptr)src,
+						src_coefs[ci], sy, 1, FALSE)[0];
+			}
+			for (x = 0; x < cols; x++) {
+				JDIMENSION sx = (flip_x && x < mirror_cols) ? mirror_cols - 1 - x : x;
+
+				if (transpose) {
+					src_row = (*src->mem->access_virt_barray)((j_common_ptr)src,
+							src_coefs[ci], sx, 1, FALSE)[0];
+					php_epeg_transform_block(dst_row[x], src_row[sy], op);
+				} else {
+					php_epeg_transform_block(dst_row[x], src_row[sx], op);
+				}
+			}
+		}
+	}
+
+	jpeg_finish_compress(&dst);
+	jpeg_destroy_compress(&dst);
+	jpeg_abort_decompress(src);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_crop */
+/*
+ * Copy the params->width x params->height area at (params->x, params->y)
+ * into a new JPEG image without decoding, like jpegtran -crop.
+ *
+ * The top-left corner is moved up and left to the nearest MCU boundary
+ * and the size is grown by the same amount, then the area is clipped to
+ * the image. Only the DCT coefficient blocks of the area are copied,
+ * so the pixels are the same as the source.
+ * Only the comments of params are used.
+ * Returns 0 on success or one of PHP_EPEG_ERROR_*.
+ */
+int
+php_epeg_decoder_crop(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, php_epeg_output_t *out)
+{
+	j_decompress_ptr src = &dec->cinfo;
+	struct jpeg_compress_struct dst;
+	jvirt_barray_ptr *src_coefs;
+	jvirt_barray_ptr dst_coefs[MAX_COMPONENTS];
+	volatile int stage = PHP_EPEG_ERROR_SCALE;
+	JDIMENSION mcu_width, mcu_height, x, y, width, height;
+	int ci;
+
+	memset(&dst, 0, sizeof(dst));
+	dst.err = &dec->jerr.pub;
+	php_epeg_output_free(out);
+
+	if (setjmp(dec->jerr.jb)) {
+		jpeg_destroy_compress(&dst);
+		jpeg_abort_decompress(src);
+		php_epeg_output_free(out);
+		return stage;
+	}
+
+	/* snap the area to the MCUs */
+	if (params->x < 0 || params->y < 0
+		|| params->x >= (int)src->image_width || params->y >= (int)src->image_height)
+	{
+		ERREXIT(src, JERR_EMPTY_IMAGE);
+	}
+	mcu_width = (JDIMENSION)src->max_h_samp_factor * DCTSIZE;
+	mcu_height = (JDIMENSION)src->max_v_samp_factor * DCTSIZE;
+	x = (JDIMENSION)params->x - (JDIMENSION)params->x % mcu_width;
+	y = (JDIMENSION)params->y - (JDIMENSION)params->y % mcu_height;
+	width = src->image_width - x;
+	if (params->width > 0 && (JDIMENSION)params->width + ((JDIMENSION)params->x - x) < width) {
+		width = (JDIMENSION)params->width + ((JDIMENSION)params->x - x);
+	}
+	height = src->image_height - y;
+	if (params->height > 0 && (JDIMENSION)params->height + ((JDIMENSION)params->y - y) < height) {
+		height = (JDIMENSION)params->height + ((JDIMENSION)params->y - y);
+	}
+
+	stage = PHP_EPEG_ERROR_DECODE;
+	src_coefs = jpeg_read_coefficients(src);
+
+	stage = PHP_EPEG_ERROR_ENCODE;
+	jpeg_create_compress(&dst);
+	php_epeg_memory_install((j_common_ptr)&dst);
+	if (out->stream != NULL) {
+		php_epeg_stream_dest(&dst, out);
+	} else {
+		php_epeg_memory_dest(&dst, out);
+	}
+	jpeg_copy_critical_parameters(src, &dst);
+	dst.image_width = width;
+	dst.image_height = height;
+
+	/* whole MCUs, the blocks beyond the area are kept as padding */
+	for (ci = 0; ci < dst.num_components; ci++) {
+		jpeg_component_info *compptr = dst.comp_info + ci;
+
+		dst_coefs[ci] = (*dst.mem->request_virt_barray)((j_common_ptr)&dst, JPOOL_IMAGE, FALSE,
+				((width + mcu_width - 1) / mcu_width) * (JDIMENSION)compptr->h_samp_factor,
+				((height + mcu_height - 1) / mcu_height) * (JDIMENSION)compptr->v_samp_factor,
+				(JDIMENSION)compptr->v_samp_factor);
+	}
+
+	jpeg_write_coefficients(&dst, dst_coefs);
+	php_epeg_write_comments(&dst, params, (int)src->image_width, (int)src->image_height);
+
+	for (ci = 0; ci < dst.num_components; ci++) {
+		jpeg_component_info *compptr = dst.comp_info + ci;
+		JDIMENSION cols = ((width + mcu_width - 1) / mcu_width) * (JDIMENSION)compptr->h_samp_factor;
+		JDIMENSION rows = ((height + mcu_height - 1) / mcu_height) * (JDIMENSION)compptr->v_samp_factor;
+		JDIMENSION col_offset = (x / mcu_width) * (JDIMENSION)compptr->h_samp_factor;
+		JDIMENSION row_offset = (y / mcu_height) * (JDIMENSION)compptr->v_samp_factor;
+		JDIMENSION row;
+
+		for (row = 0; row < rows; row++) {
+			JBLOCKARRAY dst_row = (*dst.mem->access_virt_barray)((j_common_ptr)&dst,
+					dst_coefs[ci], row, 1, TRUE);
+			JBLOCKARRAY src_row = (*src->mem->access_virt_barray)((j_common_ptr)src,
+					src_coefs[ci], row_offset + row, 1, FALSE);
+			(void)memcpy(dst_row[0], src_row[0] + col_offset, (size_t)cols * sizeof(JBLOCK));
+		}
+	}
+
+	jpeg_finish_compress(&dst);
+	jpeg_destroy_compress(&dst);
+	jpeg_abort_decompress(src);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ EXIF segment */
+
+#define PHP_EPEG_EXIF_U16(p) (le ? ((size_t)(p)[0] | ((size_t)(p)[1] << 8)) \
+		: (((size_t)(p)[0] << 8) | (size_t)(p)[1]))
+#define PHP_EPEG_EXIF_U32(p) (le ? (PHP_EPEG_EXIF_U16(p) | (PHP_EPEG_EXIF_U16((p) + 2) << 16)) \
+		: ((PHP_EPEG_EXIF_U16(p) << 16) | PHP_EPEG_EXIF_U16((p) + 2)))
+
+/*
+ * Find the TIFF header in the EXIF segment (APP1) before the first scan.
+ * Returns NULL if not found, otherwise sets the length of the TIFF data
+ * and whether it is little endian.
+ */
+static const unsigned char *
+php_epeg_exif_tiff(const unsigned char *data, size_t data_len, size_t *tiff_len, int *le)
+{
+	const unsigned char *ptr = data + 2;
+	const unsigned char *end = data + data_len;
+
+	if (data_len < 4 || data[0] != 0xFF || data[1] != 0xD8) {
+		return NULL;
+	}
+
+	while (end - ptr >= 4 && ptr[0] == 0xFF) {
+		const unsigned char marker = ptr[1];
+		size_t field_len = ((size_t)ptr[2] << 8) | (size_t)ptr[3];
+
+		if (marker == 0xFF) {
+			ptr++;
+			continue;
+		}
+		if (marker == 0xDA || marker == 0xD9 || field_len < 2
+			|| field_len > (size_t)(end - ptr - 2))
+		{
+			break;
+		}
+		if (marker != 0xE1 || field_len < 2 + 6 + 8 || memcmp(ptr + 4, "Exif\0\0", 6) != 0) {
+			ptr += 2 + field_len;
+			continue;
+		}
+
+		if (ptr[10] == 'I' && ptr[11] == 'I') {
+			*le = 1;
+		} else if (ptr[10] == 'M' && ptr[11] == 'M') {
+			*le = 0;
+		} else {
+			break;
+		}
+		*tiff_len = field_len - 8;
+		return ptr + 10;
+	}
+
+	return NULL;
+}
+
+/*
+ * Get the offset of the IFD which follows the IFD at ifd, 0 if none.
+ */
+static size_t
+php_epeg_exif_next_ifd(const unsigned char *tiff, size_t tiff_len, int le, size_t ifd)
+{
+	size_t next;
+
+	if (ifd < 8 || ifd > tiff_len - 2) {
+		return 0;
+	}
+	next = ifd + 2 + 12 * PHP_EPEG_EXIF_U16(tiff + ifd);
+	if (next > tiff_len - 4) {
+		return 0;
+	}
+	return PHP_EPEG_EXIF_U32(tiff + next);
+}
+
+/* }}} */
+
+/* {{{ php_epeg_exif_transform */
+/*
+ * Get the transform which makes the image upright
+ * by the orientation tag of the EXIF segment.
+ * Returns PHP_EPEG_TRANSFORM_NONE if the tag is not found.
+ */
+int
+php_epeg_exif_transform(const unsigned char *data, size_t data_len)
+{
+	static const int transforms[9] = {
+		PHP_EPEG_TRANSFORM_NONE,
+		PHP_EPEG_TRANSFORM_NONE,
+		PHP_EPEG_TRANSFORM_FLIP_H,
+		PHP_EPEG_TRANSFORM_ROT_180,
+		PHP_EPEG_TRANSFORM_FLIP_V,
+		PHP_EPEG_TRANSFORM_TRANSPOSE,
+		PHP_EPEG_TRANSFORM_ROT_90,
+		PHP_EPEG_TRANSFORM_TRANSVERSE,
+		PHP_EPEG_TRANSFORM_ROT_270
+	};
+	const unsigned char *tiff;
+	size_t tiff_len, ifd, count, k;
+	int le;
+
+	tiff = php_epeg_exif_tiff(data, data_len, &tiff_len, &le);
+	if (tiff == NULL) {
+		return PHP_EPEG_TRANSFORM_NONE;
+	}
+
+	/* IFD0 */
+	ifd = PHP_EPEG_EXIF_U32(tiff + 4);
+	if (ifd < 8 || ifd > tiff_len - 2) {
+		return PHP_EPEG_TRANSFORM_NONE;
+	}
+	count = PHP_EPEG_EXIF_U16(tiff + ifd);
+	for (k = 0; k < count && ifd + 2 + 12 * (k + 1) <= tiff_len; k++) {
+		const unsigned char *entry = tiff + ifd + 2 + 12 * k;
+
+		/* Orientation, SHORT */
+		if (PHP_EPEG_EXIF_U16(entry) == 0x0112 && PHP_EPEG_EXIF_U16(entry + 2) == 3) {
+			size_t orientation = PHP_EPEG_EXIF_U16(entry + 8);
+			return (orientation <= 8) ? transforms[orientation] : PHP_EPEG_TRANSFORM_NONE;
+		}
+	}
+
+	return PHP_EPEG_TRANSFORM_NONE;
+}
+/* }}} */
+
+/* {{{ php_epeg_exif_thumbnail */
+/*
+ * Find the JPEG thumbnail embedded in IFD1 of the EXIF segment,
+ * which is located by the JPEGInterchangeFormat tags.
+ * Returns a pointer into data and sets *thumb_len, or NULL if not found.
+ */
+const unsigned char *
+php_epeg_exif_thumbnail(const unsigned char *data, size_t data_len, size_t *thumb_len)
+{
+	const unsigned char *tiff;
+	size_t tiff_len, ifd, count, k;
+	size_t offset = 0, length = 0;
+	int le;
+
+	tiff = php_epeg_exif_tiff(data, data_len, &tiff_len, &le);
+	if (tiff == NULL) {
+		return NULL;
+	}
+
+	/* IFD1 follows IFD0 */
+	ifd = php_epeg_exif_next_ifd(tiff, tiff_len, le, PHP_EPEG_EXIF_U32(tiff + 4));
+	if (ifd < 8 || ifd > tiff_len - 2) {
+		return NULL;
+	}
+	count = PHP_EPEG_EXIF_U16(tiff + ifd);
+	for (k = 0; k < count && ifd + 2 + 12 * (k + 1) <= tiff_len; k++) {
+		const unsigned char *entry = tiff + ifd + 2 + 12 * k;
+		size_t tag = PHP_EPEG_EXIF_U16(entry);
+
+		/* JPEGInterchangeFormat and JPEGInterchangeFormatLength, LONG */
+		if (tag == 0x0201 && PHP_EPEG_EXIF_U16(entry + 2) == 4) {
+			offset = PHP_EPEG_EXIF_U32(entry + 8);
+		} else if (tag == 0x0202 && PHP_EPEG_EXIF_U16(entry + 2) == 4) {
+			length = PHP_EPEG_EXIF_U32(entry + 8);
+		}
+	}
+	if (offset < 8 || length < 4 || offset > tiff_len || length > tiff_len - offset
+		|| tiff[offset] != 0xFF || tiff[offset + 1] != 0xD8)
+	{
+		return NULL;
+	}
+
+	*thumb_len = length;
+	return tiff + offset;
+}
+/* }}} */
+
+#undef PHP_EPEG_EXIF_U16
+#undef PHP_EPEG_EXIF_U32
+
+/* {{{ php_epeg_find_ff */
+/*
+ * Find the first 0xFF byte in [p, end), which starts every marker.
+ * Returns end if not found.
+ */
+const unsigned char *
+php_epeg_find_ff(const unsigned char *p, const unsigned char *end)
+{
+#if defined(__GNUC__) && defined(__AVX2__)
+	const __m256i ff32 = _mm256_set1_epi8((char)0xFF);
+	while (end - p >= 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)p);
+		unsigned int mask = (unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(v, ff32));
+		if (mask != 0) {
+			return p + __builtin_ctz(mask);
+		}
+		p += 32;
+	}
+#endif
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__AVX2__))
+	{
+		const __m128i ff16 = _mm_set1_epi8((char)0xFF);
+		while (end - p >= 16) {
+			__m128i v = _mm_loadu_si128((const __m128i *)p);
+			unsigned int mask = (unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(v, ff16));
+			if (mask != 0) {
+				return p + __builtin_ctz(mask);
+			}
+			p += 16;
+		}
+	}
+#endif
+	p = (const unsigned char *)memchr(p, 0xFF, (size_t)(end - p));
+
+	return (p != NULL) ? p : end;
+}
+/* }}} */
+
+/* {{{ php_epeg_restart_scan */
+/*
+ * Find the frame header, the start and the end of the entropy-coded data
+ * and the offset of every segment that follows a restart marker.
+ * Returns the number of segments or 0 if the image cannot be split.
+ */
+static size_t
+php_epeg_restart_scan(const unsigned char *data, size_t data_len,
+		size_t *sof_offset, size_t *scan_offset, size_t *scan_end,
+		size_t *segments, size_t max_segments)
+{
+	const unsigned char *p = data + 2;
+	const unsigned char *end = data + data_len;
+	size_t count = 0;
+
+	*sof_offset = 0;
+
+	/* walk the marker segments until SOS */
+	for (;;) {
+		unsigned char marker;
+		size_t field_len;
+
+		if (p + 4 > end || p[0] != 0xFF) {
+			return 0;
+		}
+		marker = p[1];
+		if (marker == 0xFF) {
+			/* fill byte */
+			p++;
+			continue;
+		}
+		field_len = ((size_t)p[2] << 8) | (size_t)p[3];
+		if (field_len < 2 || p + 2 + field_len > end) {
+			return 0;
+		}
+		if (marker == 0xC0 || marker == 0xC1) {
+			*sof_offset = (size_t)(p - data);
+		}
+		p += 2 + field_len;
+		if (marker == 0xDA) {
+			break;
+		}
+	}
+	if (*sof_offset == 0) {
+		return 0;
+	}
+	*scan_offset = (size_t)(p - data);
+
+	/* search the restart markers, 0xFF 0x00 is a stuffed byte */
+	segments[count++] = *scan_offset;
+	for (;;) {
+		p = php_epeg_find_ff(p, end);
+		if (p + 1 >= end) {
+			return 0;
+		}
+		if (p[1] == 0x00 || p[1] == 0xFF) {
+			p++;
+		} else if (p[1] >= 0xD0 && p[1] <= 0xD7) {
+			if (count == max_segments) {
+				return 0;
+			}
+			p += 2;
+			segments[count++] = (size_t)(p - data);
+		} else {
+			/* EOI or anything else ends the scan */
+			break;
+		}
+	}
+	*scan_end = (size_t)(p - data);
+
+	return count;
+}
+/* }}} */
+
+/* {{{ php_epeg_band_build */
+/*
+ * Make a standalone JPEG image of the headers and the entropy-coded data
+ * between begin and end, which is rows pixels high. The restart markers
+ * are renumbered from 0 as the decoder expects.
+ */
+static unsigned char *
+php_epeg_band_build(const unsigned char *data, size_t sof_offset, size_t scan_offset,
+		size_t begin, size_t end, JDIMENSION rows, size_t *band_len)
+{
+	size_t len = scan_offset + (end - begin) + 2;
+	unsigned char *buf, *p, *q;
+	int restart_num = 0;
+
+	buf = (unsigned char *)malloc(len);
+	if (buf == NULL) {
+		return NULL;
+	}
+
+	memcpy(buf, data, scan_offset);
+	buf[sof_offset + 5] = (unsigned char)((rows >> 8) & 0xFF);
+	buf[sof_offset + 6] = (unsigned char)(rows & 0xFF);
+	memcpy(buf + scan_offset, data + begin, end - begin);
+
+	p = buf + scan_offset;
+	q = p + (end - begin);
+	while (p + 1 < q && (p = (unsigned char *)php_epeg_find_ff(p, q - 1)) < q - 1) {
+		if (p[1] >= 0xD0 && p[1] <= 0xD7) {
+			p[1] = (unsigned char)(0xD0 + (restart_num++ & 7));
+			p += 2;
+		} else {
+			p++;
+		}
+	}
+
+	buf[len - 2] = 0xFF;
+	buf[len - 1] = 0xD9;
+	*band_len = len;
+
+	return buf;
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_calc */
+/*
+ * Set the decoding options and compute the output size without
+ * starting the decompressor. Returns 0 on success or -1.
+ */
+static int
+php_epeg_decoder_calc(php_epeg_decoder_t *dec, int scale, int colorspace)
+{
+	if (setjmp(dec->jerr.jb)) {
+		return -1;
+	}
+	php_epeg_decoder_setup(&dec->cinfo, scale, colorspace);
+	jpeg_calc_output_dimensions(&dec->cinfo);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_band_run */
+/*
+ * Decode a band and sample the output rows which fall into it,
+ * the bands write to disjoint rows of the pixels.
+ */
+static void
+php_epeg_band_run(php_epeg_task_t *task)
+{
+	php_epeg_band_t *band = (php_epeg_band_t *)task;
+	j_decompress_ptr src = &band->dec->cinfo;
+	php_epeg_pixels_t *px = band->px;
+	unsigned char * volatile row = NULL;
+	JDIMENSION src_y, y;
+	size_t stride;
+
+	if (setjmp(band->dec->jerr.jb)) {
+		jpeg_abort_decompress(src);
+		if (row != NULL) {
+			free(row);
+		}
+		band->result = PHP_EPEG_ERROR_DECODE;
+		return;
+	}
+
+	(void)jpeg_start_decompress(src);
+	row = (unsigned char *)malloc((size_t)src->output_width * src->output_components);
+	if (row == NULL) {
+		ERREXIT1(src, JERR_OUT_OF_MEMORY, 2);
+	}
+
+	stride = (size_t)px->width * px->components;
+	src_y = band->first_row;
+	for (y = 0; y < (JDIMENSION)px->height; y++) {
+		JDIMENSION sy = (JDIMENSION)(((unsigned long)y * band->total_height) / (unsigned long)px->height);
+		JSAMPROW rows[1];
+
+		if (sy < band->first_row) {
+			continue;
+		}
+		if (sy >= band->first_row + src->output_height) {
+			break;
+		}
+		while (src_y <= sy) {
+			rows[0] = (JSAMPROW)row;
+			(void)jpeg_read_scanlines(src, rows, 1);
+			src_y++;
+		}
+		php_epeg_sample_row(px->buf + stride * y, px->width, row, src->output_width, px->components);
+	}
+
+	jpeg_abort_decompress(src);
+	free(row);
+	band->result = 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_bands_free */
+static void
+php_epeg_bands_free(php_epeg_band_t *bands, int count)
+{
+	int b;
+
+	for (b = 0; b < count; b++) {
+		if (bands[b].dec != NULL) {
+			php_epeg_decoder_close(bands[b].dec);
+		}
+		if (bands[b].data != NULL) {
+			free(bands[b].data);
+		}
+	}
+	free(bands);
+}
+/* }}} */
+
+/* {{{ php_epeg_decoder_scale_parallel */
+/*
+ * Same as php_epeg_decoder_scale(), but the bands of MCU rows between
+ * restart markers are decoded in parallel by the workers of pool.
+ * dec must have been opened from data and be untouched. The sequential
+ * baseline images whose restart intervals line up with MCU rows are
+ * supported, PHP_EPEG_PARALLEL_UNSUPPORTED is returned for the others
+ * before anything is decoded.
+ * Returns 0 on success or one of PHP_EPEG_ERROR_*.
+ */
+int
+php_epeg_decoder_scale_parallel(php_epeg_decoder_t *dec,
+		const unsigned char *data, size_t data_len,
+		const php_epeg_params_t *params, php_epeg_pool_t *pool, php_epeg_pixels_t *px)
+{
+	j_decompress_ptr src = &dec->cinfo;
+	php_epeg_band_t *bands = NULL;
+	size_t *segments = NULL;
+	size_t sof_offset, scan_offset, scan_end, nsegs, stride;
+	unsigned long mcu_width, mcu_height, mcus_per_row, mcu_rows, interval, step, groups, a, b;
+	JDIMENSION first_row;
+	int width, height, out_width, out_height, nbands, k, result;
+
+	memset(px, 0, sizeof(php_epeg_pixels_t));
+
+	/* only the single interleaved Huffman scan can be split */
+	if (php_epeg_pool_size(pool) < 2 || src->progressive_mode || src->arith_code
+		|| src->restart_interval == 0 || src->comps_in_scan != src->num_components)
+	{
+		return PHP_EPEG_PARALLEL_UNSUPPORTED;
+	}
+	if (src->comps_in_scan == 1) {
+		mcu_width = mcu_height = DCTSIZE;
+	} else {
+		mcu_width = (unsigned long)DCTSIZE * src->max_h_samp_factor;
+		mcu_height = (unsigned long)DCTSIZE * src->max_v_samp_factor;
+	}
+	mcus_per_row = (src->image_width + mcu_width - 1) / mcu_width;
+	mcu_rows = (src->image_height + mcu_height - 1) / mcu_height;
+	interval = (unsigned long)src->restart_interval;
+
+	/* the bands start at the MCU rows which start a restart interval */
+	a = mcus_per_row;
+	b = interval;
+	while (b != 0) {
+		unsigned long t = a % b;
+		a = b;
+		b = t;
+	}
+	step = interval / a;
+	groups = (mcu_rows + step - 1) / step;
+	nbands = php_epeg_pool_size(pool);
+	if ((unsigned long)nbands > groups) {
+		nbands = (int)groups;
+	}
+	if (nbands < 2) {
+		return PHP_EPEG_PARALLEL_UNSUPPORTED;
+	}
+
+	/* locate every restart interval */
+	nsegs = (size_t)((mcus_per_row * mcu_rows + interval - 1) / interval);
+	segments = (size_t *)malloc(nsegs * sizeof(size_t));
+	if (segments == NULL) {
+		return PHP_EPEG_PARALLEL_UNSUPPORTED;
+	}
+	if (php_epeg_restart_scan(data, data_len, &sof_offset, &scan_offset, &scan_end,
+			segments, nsegs) != nsegs)
+	{
+		free(segments);
+		return PHP_EPEG_PARALLEL_UNSUPPORTED;
+	}
+
+	/* determine the output size */
+	out_width = (params->width > 0) ? params->width : (int)src->image_width;
+	out_height = (params->height > 0) ? params->height : (int)src->image_height;
+	if (php_epeg_decoder_calc(dec,
+			params->dc_only ? 8 : php_epeg_decoder_scale_for(src, out_width, out_height),
+			params->colorspace) != 0)
+	{
+		free(segments);
+		return PHP_EPEG_PARALLEL_UNSUPPORTED;
+	}
+	width = out_width;
+	height = out_height;
+	if (params->filter != PHP_EPEG_FILTER_POINT) {
+		/* the bands keep the DCT scaled rows, resampled below */
+		width = (int)src->output_width;
+		height = (int)src->output_height;
+		if (php_epeg_decoder_striped(src, (int)src->scale_denom, params)) {
+			/* too many to keep, php_epeg_decoder_scale() resamples them in stripes */
+			free(segments);
+			return PHP_EPEG_PARALLEL_UNSUPPORTED;
+		}
+	}
+
+	/* make a decoder for each band */
+	bands = (php_epeg_band_t *)calloc((size_t)nbands, sizeof(php_epeg_band_t));
+	if (bands == NULL) {
+		free(segments);
+		return PHP_EPEG_PARALLEL_UNSUPPORTED;
+	}
+	first_row = 0;
+	for (k = 0; k < nbands; k++) {
+		php_epeg_band_t *band = &bands[k];
+		unsigned long row_begin = ((unsigned long)k * groups / nbands) * step;
+		unsigned long row_end = ((unsigned long)(k + 1) * groups / nbands) * step;
+		unsigned long pixel_begin, pixel_end;
+		size_t seg_begin, seg_end;
+
+		if (row_end > mcu_rows || k == nbands - 1) {
+			row_end = mcu_rows;
+		}
+		seg_begin = segments[row_begin * mcus_per_row / interval];
+		seg_end = (k == nbands - 1) ? scan_end : segments[row_end * mcus_per_row / interval] - 2;
+		pixel_begin = row_begin * mcu_height;
+		pixel_end = MIN(row_end * mcu_height, (unsigned long)src->image_height);
+
+		band->data = php_epeg_band_build(data, sof_offset, scan_offset, seg_begin, seg_end,
+				(JDIMENSION)(pixel_end - pixel_begin), &band->data_len);
+		if (band->data != NULL) {
+			band->dec = php_epeg_decoder_open_memory(band->data, band->data_len);
+		}
+		/* every band has to be decoded exactly as the part of the whole image */
+		if (band->dec == NULL
+			|| php_epeg_decoder_calc(band->dec, (int)src->scale_denom, params->colorspace) != 0
+			|| band->dec->cinfo.output_width != src->output_width
+			|| band->dec->cinfo.output_components != src->output_components
+			|| (k > 0 && (unsigned long)first_row * bands[0].pixel_height
+				!= pixel_begin * bands[0].dec->cinfo.output_height))
+		{
+			php_epeg_bands_free(bands, nbands);
+			free(segments);
+			return PHP_EPEG_PARALLEL_UNSUPPORTED;
+		}
+		band->first_row = first_row;
+		band->pixel_height = (JDIMENSION)(pixel_end - pixel_begin);
+		band->total_height = src->output_height;
+		band->px = px;
+		band->task.run = php_epeg_band_run;
+		first_row += band->dec->cinfo.output_height;
+	}
+	free(segments);
+	if (first_row != src->output_height) {
+		php_epeg_bands_free(bands, nbands);
+		return PHP_EPEG_PARALLEL_UNSUPPORTED;
+	}
+
+	/* allocate the pixels */
+	stride = (size_t)width * src->output_components;
+	if ((size_t)height > ((size_t)-1) / stride
+		|| (px->buf = (unsigned char *)malloc(stride * height)) == NULL)
+	{
+		php_epeg_bands_free(bands, nbands);
+		return PHP_EPEG_ERROR_SCALE;
+	}
+	px->width = width;
+	px->height = height;
+	px->components = src->output_components;
+	px->color_space = (int)src->out_color_space;
+	px->colorspace = params->colorspace;
+	px->dc_only = params->dc_only;
+	px->src_width = (int)src->image_width;
+	px->src_height = (int)src->image_height;
+
+	/* decode the bands */
+	for (k = 0; k < nbands; k++) {
+		php_epeg_pool_submit(pool, &bands[k].task);
+	}
+	result = 0;
+	for (k = 0; k < nbands; k++) {
+		php_epeg_pool_wait(pool, &bands[k].task);
+		if (result == 0) {
+			result = bands[k].result;
+		}
+	}
+	php_epeg_bands_free(bands, nbands);
+
+	if (result != 0) {
+		php_epeg_pixels_free(px);
+	} else if (params->filter != PHP_EPEG_FILTER_POINT || params->sharpen > 0.0) {
+		result = php_epeg_pixels_filter(px, out_width, out_height, params);
+	}
+
+	return result;
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_free */
+void
+php_epeg_pixels_free(php_epeg_pixels_t *px)
+{
+	if (px->buf != NULL) {
+		free(px->buf);
+	}
+	memset(px, 0, sizeof(php_epeg_pixels_t));
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noet sw=4 ts=4 fdm=marker
+ * vim<600: noet sw=4 ts=4
+ */
@@ -0,0 +1,588 @@
+/**
+ * The Epeg PHP extension
+ *
+ * Copyright (c) 2006-2010 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-epeg
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2010 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * libjpeg memory manager backed by reusable chunks.
+ *
+ * php_epeg_memory_install() replaces the manager of a JPEG object just
+ * created. Every pool of the object is a list of chunks, an allocation
+ * bumps a pointer in the first one and freeing a pool gives its chunks
+ * back to a process-wide cache instead of to free(), so the next image
+ * reuses them. Virtual arrays are always kept in memory, as they are by
+ * libjpeg-turbo without a backing store.
+ *
+ * The chunks handed out are counted against the limit set by
+ * php_epeg_memory_limit_set(); going over it fails the allocation with
+ * JERR_OUT_OF_MEMORY like running out of memory does.
+ *
+ * The worker threads allocate through it too.
+ */
+
+#include "php_epeg.h"
+#include <jerror.h>
+
+/* the alignment of every allocation, as libjpeg-turbo's SIMD code wants */
+#define PHP_EPEG_MEMORY_ALIGN       32
+
+/* rows of sample arrays are padded to this, the SIMD code writes past the width */
+#define PHP_EPEG_MEMORY_ROW_ALIGN   (2 * PHP_EPEG_MEMORY_ALIGN)
+
+/* the size of the chunks small allocations are carved from */
+#define PHP_EPEG_MEMORY_CHUNK_SIZE  (64 * 1024)
+
+/* the bytes of free chunks kept for the next images, the rest is freed */
+#define PHP_EPEG_MEMORY_CACHE_MAX   (16 * 1024 * 1024)
+
+#define PHP_EPEG_MEMORY_ROUND(n, a) (((n) + (a) - 1) & ~((size_t)(a) - 1))
+
+typedef struct _php_epeg_memory_chunk_t {
+	struct _php_epeg_memory_chunk_t *next;
+	size_t size;    /* the bytes after the header */
+	size_t used;
+	void *base;     /* as returned by malloc() */
+} php_epeg_memory_chunk_t;
+
+#define PHP_EPEG_MEMORY_HEADER \
+	PHP_EPEG_MEMORY_ROUND(sizeof(php_epeg_memory_chunk_t), PHP_EPEG_MEMORY_ALIGN)
+
+#define PHP_EPEG_MEMORY_DATA(chunk) ((char *)(chunk) + PHP_EPEG_MEMORY_HEADER)
+
+/* the opaque types of jpeglib.h */
+struct jvirt_sarray_control {
+	JSAMPARRAY mem_buffer;
+	JDIMENSION rows_in_array;
+	JDIMENSION samplesperrow;
+	JDIMENSION maxaccess;
+	boolean pre_zero;
+	jvirt_sarray_ptr next;
+};
+
+struct jvirt_barray_control {
+	JBLOCKARRAY mem_buffer;
+	JDIMENSION rows_in_array;
+	JDIMENSION blocksperrow;
+	JDIMENSION maxaccess;
+	boolean pre_zero;
+	jvirt_barray_ptr next;
+};
+
+typedef struct _php_epeg_memory_mgr_t {
+	struct jpeg_memory_mgr pub;
+	/* the manager made by jpeg_create_*(), it still owns what they allocated */
+	struct jpeg_memory_mgr *orig;
+	php_epeg_memory_chunk_t *pools[JPOOL_NUMPOOLS];
+	jvirt_sarray_ptr virt_sarray_list;
+	jvirt_barray_ptr virt_barray_list;
+} php_epeg_memory_mgr_t;
+
+/* {{{ chunk cache */
+
+static php_epeg_memory_chunk_t *php_epeg_memory_free_list = NULL;
+static size_t php_epeg_memory_cached = 0;
+static size_t php_epeg_memory_in_use = 0;
+static size_t php_epeg_memory_peak = 0;
+static size_t php_epeg_memory_limit = 0;
+static int php_epeg_memory_exhausted = 0;
+
+#ifdef PHP_EPEG_USE_THREADS
+static pthread_mutex_t php_epeg_memory_lock = PTHREAD_MUTEX_INITIALIZER;
+#define PHP_EPEG_MEMORY_LOCK()      pthread_mutex_lock(&php_epeg_memory_lock)
+#define PHP_EPEG_MEMORY_UNLOCK()    pthread_mutex_unlock(&php_epeg_memory_lock)
+#else
+#define PHP_EPEG_MEMORY_LOCK()
+#define PHP_EPEG_MEMORY_UNLOCK()
+#endif
+
+/* {{{ php_epeg_memory_chunk_get */
+/*
+ * Get a chunk of at least size bytes, from the cache if one fits without
+ * wasting more than half of it. Returns NULL over the limit or on failure.
+ */
+static php_epeg_memory_chunk_t *
+php_epeg_memory_chunk_get(size_t size)
+{
+	php_epeg_memory_chunk_t **pp, **best = NULL, *chunk;
+	void *base;
+
+	PHP_EPEG_MEMORY_LOCK();
+	if (php_epeg_memory_limit > 0 && php_epeg_memory_in_use + size > php_epeg_memory_limit) {
+		php_epeg_memory_exhausted = 1;
+		PHP_EPEG_MEMORY_UNLOCK();
+		return NULL;
+	}
+	for (pp = &php_epeg_memory_free_list; *pp != NULL; pp = &(*pp)->next) {
+		if ((*pp)->size >= size && (*pp)->size / 2 <= size
+			&& (best == NULL || (*pp)->size < (*best)->size))
+		{
+			best = pp;
+		}
+	}
+	if (best != NULL) {
+		chunk = *best;
+		*best = chunk->next;
+		php_epeg_memory_cached -= chunk->size;
+		size = chunk->size;
+	} else {
+		chunk = NULL;
+	}
+	php_epeg_memory_in_use += size;
+	if (php_epeg_memory_in_use > php_epeg_memory_peak) {
+		php_epeg_memory_peak = php_epeg_memory_in_use;
+	}
+	PHP_EPEG_MEMORY_UNLOCK();
+
+	if (chunk == NULL) {
+		base = malloc(PHP_EPEG_MEMORY_HEADER + size + PHP_EPEG_MEMORY_ALIGN);
+		if (base == NULL) {
+			PHP_EPEG_MEMORY_LOCK();
+			php_epeg_memory_in_use -= size;
+			PHP_EPEG_MEMORY_UNLOCK();
+			return NULL;
+		}
+		chunk = (php_epeg_memory_chunk_t *)PHP_EPEG_MEMORY_ROUND((size_t)base, PHP_EPEG_MEMORY_ALIGN);
+		chunk->base = base;
+		chunk->size = size;
+	}
+	chunk->used = 0;
+	chunk->next = NULL;
+
+	return chunk;
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_chunks_put */
+/*
+ * Give a list of chunks back to the cache.
+ */
+static void
+php_epeg_memory_chunks_put(php_epeg_memory_chunk_t *chunk)
+{
+	php_epeg_memory_chunk_t *unwanted = NULL;
+
+	PHP_EPEG_MEMORY_LOCK();
+	while (chunk != NULL) {
+		php_epeg_memory_chunk_t *next = chunk->next;
+
+		php_epeg_memory_in_use -= chunk->size;
+		if (php_epeg_memory_cached + chunk->size <= PHP_EPEG_MEMORY_CACHE_MAX) {
+			chunk->next = php_epeg_memory_free_list;
+			php_epeg_memory_free_list = chunk;
+			php_epeg_memory_cached += chunk->size;
+		} else {
+			chunk->next = unwanted;
+			unwanted = chunk;
+		}
+		chunk = next;
+	}
+	PHP_EPEG_MEMORY_UNLOCK();
+
+	while (unwanted != NULL) {
+		php_epeg_memory_chunk_t *next = unwanted->next;
+		free(unwanted->base);
+		unwanted = next;
+	}
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ allocation methods */
+
+/* {{{ php_epeg_memory_alloc */
+static void *
+php_epeg_memory_alloc(j_common_ptr cinfo, int pool_id, size_t size)
+{
+	php_epeg_memory_mgr_t *mem = (php_epeg_memory_mgr_t *)cinfo->mem;
+	php_epeg_memory_chunk_t *head, *chunk;
+
+	if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+		ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+	}
+	if (size > (size_t)mem->pub.max_alloc_chunk) {
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 1);
+	}
+	size = PHP_EPEG_MEMORY_ROUND(size, PHP_EPEG_MEMORY_ALIGN);
+
+	/* bump the pointer of the current chunk */
+	head = mem->pools[pool_id];
+	if (head != NULL && head->size - head->used >= size) {
+		void *ptr = PHP_EPEG_MEMORY_DATA(head) + head->used;
+		head->used += size;
+		return ptr;
+	}
+
+	chunk = php_epeg_memory_chunk_get(size > PHP_EPEG_MEMORY_CHUNK_SIZE / 4
+			? size : PHP_EPEG_MEMORY_CHUNK_SIZE);
+	if (chunk == NULL) {
+		ERREXIT1(cinfo, JERR_OUT_OF_MEMORY, 2);
+	}
+	chunk->used = size;
+
+	/* a large block does not take the place of the current chunk */
+	if (head != NULL && chunk->size - chunk->used < head->size - head->used) {
+		chunk->next = head->next;
+		head->next = chunk;
+	} else {
+		chunk->next = head;
+		mem->pools[pool_id] = chunk;
+	}
+
+	return PHP_EPEG_MEMORY_DATA(chunk);
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_alloc_sarray */
+static JSAMPARRAY
+php_epeg_memory_alloc_sarray(j_common_ptr cinfo, int pool_id,
+		JDIMENSION samplesperrow, JDIMENSION numrows)
+{
+	JSAMPARRAY result;
+	JSAMPROW rows;
+	size_t row_size;
+	JDIMENSION i;
+
+	row_size = PHP_EPEG_MEMORY_ROUND((size_t)samplesperrow * sizeof(JSAMPLE), PHP_EPEG_MEMORY_ROW_ALIGN);
+	if (numrows > 0 && row_size > (size_t)cinfo->mem->max_alloc_chunk / numrows) {
+		ERREXIT(cinfo, JERR_WIDTH_OVERFLOW);
+	}
+	result = (JSAMPARRAY)php_epeg_memory_alloc(cinfo, pool_id, (size_t)numrows * sizeof(JSAMPROW));
+	rows = (JSAMPROW)php_epeg_memory_alloc(cinfo, pool_id, (size_t)numrows * row_size);
+	for (i = 0; i < numrows; i++) {
+		result[i] = rows + (size_t)i * row_size / sizeof(JSAMPLE);
+	}
+
+	return result;
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_alloc_barray */
+static JBLOCKARRAY
+php_epeg_memory_alloc_barray(j_common_ptr cinfo, int pool_id,
+		JDIMENSION blocksperrow, JDIMENSION numrows)
+{
+	JBLOCKARRAY result;
+	JBLOCKROW rows;
+	JDIMENSION i;
+
+	if (numrows > 0 && (size_t)blocksperrow * sizeof(JBLOCK)
+		> (size_t)cinfo->mem->max_alloc_chunk / numrows)
+	{
+		ERREXIT(cinfo, JERR_WIDTH_OVERFLOW);
+	}
+	result = (JBLOCKARRAY)php_epeg_memory_alloc(cinfo, pool_id, (size_t)numrows * sizeof(JBLOCKROW));
+	rows = (JBLOCKROW)php_epeg_memory_alloc(cinfo, pool_id, (size_t)numrows * blocksperrow * sizeof(JBLOCK));
+	for (i = 0; i < numrows; i++) {
+		result[i] = rows + (size_t)i * blocksperrow;
+	}
+
+	return result;
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ virtual arrays */
+
+/* {{{ php_epeg_memory_request_virt_sarray */
+static jvirt_sarray_ptr
+php_epeg_memory_request_virt_sarray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+		JDIMENSION samplesperrow, JDIMENSION numrows, JDIMENSION maxaccess)
+{
+	php_epeg_memory_mgr_t *mem = (php_epeg_memory_mgr_t *)cinfo->mem;
+	jvirt_sarray_ptr result;
+
+	if (pool_id != JPOOL_IMAGE) {
+		ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+	}
+	result = (jvirt_sarray_ptr)php_epeg_memory_alloc(cinfo, pool_id,
+			sizeof(struct jvirt_sarray_control));
+	result->mem_buffer = NULL;
+	result->rows_in_array = numrows;
+	result->samplesperrow = samplesperrow;
+	result->maxaccess = maxaccess;
+	result->pre_zero = pre_zero;
+	result->next = mem->virt_sarray_list;
+	mem->virt_sarray_list = result;
+
+	return result;
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_request_virt_barray */
+static jvirt_barray_ptr
+php_epeg_memory_request_virt_barray(j_common_ptr cinfo, int pool_id, boolean pre_zero,
+		JDIMENSION blocksperrow, JDIMENSION numrows, JDIMENSION maxaccess)
+{
+	php_epeg_memory_mgr_t *mem = (php_epeg_memory_mgr_t *)cinfo->mem;
+	jvirt_barray_ptr result;
+
+	if (pool_id != JPOOL_IMAGE) {
+		ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+	}
+	result = (jvirt_barray_ptr)php_epeg_memory_alloc(cinfo, pool_id,
+			sizeof(struct jvirt_barray_control));
+	result->mem_buffer = NULL;
+	result->rows_in_array = numrows;
+	result->blocksperrow = blocksperrow;
+	result->maxaccess = maxaccess;
+	result->pre_zero = pre_zero;
+	result->next = mem->virt_barray_list;
+	mem->virt_barray_list = result;
+
+	return result;
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_realize_virt_arrays */
+static void
+php_epeg_memory_realize_virt_arrays(j_common_ptr cinfo)
+{
+	php_epeg_memory_mgr_t *mem = (php_epeg_memory_mgr_t *)cinfo->mem;
+	jvirt_sarray_ptr sptr;
+	jvirt_barray_ptr bptr;
+	JDIMENSION i;
+
+	/* the whole arrays are in memory, there is no backing store */
+	for (sptr = mem->virt_sarray_list; sptr != NULL; sptr = sptr->next) {
+		if (sptr->mem_buffer == NULL) {
+			sptr->mem_buffer = php_epeg_memory_alloc_sarray(cinfo, JPOOL_IMAGE,
+					sptr->samplesperrow, sptr->rows_in_array);
+			if (sptr->pre_zero) {
+				for (i = 0; i < sptr->rows_in_array; i++) {
+					memset(sptr->mem_buffer[i], 0, (size_t)sptr->samplesperrow * sizeof(JSAMPLE));
+				}
+			}
+		}
+	}
+	for (bptr = mem->virt_barray_list; bptr != NULL; bptr = bptr->next) {
+		if (bptr->mem_buffer == NULL) {
+			bptr->mem_buffer = php_epeg_memory_alloc_barray(cinfo, JPOOL_IMAGE,
+					bptr->blocksperrow, bptr->rows_in_array);
+			if (bptr->pre_zero) {
+				for (i = 0; i < bptr->rows_in_array; i++) {
+					memset(bptr->mem_buffer[i], 0, (size_t)bptr->blocksperrow * sizeof(JBLOCK));
+				}
+			}
+		}
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_access_virt_sarray */
+static JSAMPARRAY
+php_epeg_memory_access_virt_sarray(j_common_ptr cinfo, jvirt_sarray_ptr ptr,
+		JDIMENSION start_row, JDIMENSION num_rows, boolean writable)
+{
+	if (start_row + num_rows > ptr->rows_in_array || num_rows > ptr->maxaccess
+		|| ptr->mem_buffer == NULL)
+	{
+		ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+	}
+	return ptr->mem_buffer + start_row;
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_access_virt_barray */
+static JBLOCKARRAY
+php_epeg_memory_access_virt_barray(j_common_ptr cinfo, jvirt_barray_ptr ptr,
+		JDIMENSION start_row, JDIMENSION num_rows, boolean writable)
+{
+	if (start_row + num_rows > ptr->rows_in_array || num_rows > ptr->maxaccess
+		|| ptr->mem_buffer == NULL)
+	{
+		ERREXIT(cinfo, JERR_BAD_VIRTUAL_ACCESS);
+	}
+	return ptr->mem_buffer + start_row;
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ pools */
+
+/* {{{ php_epeg_memory_free_pool */
+static void
+php_epeg_memory_free_pool(j_common_ptr cinfo, int pool_id)
+{
+	php_epeg_memory_mgr_t *mem = (php_epeg_memory_mgr_t *)cinfo->mem;
+
+	if (pool_id < 0 || pool_id >= JPOOL_NUMPOOLS) {
+		ERREXIT1(cinfo, JERR_BAD_POOL_ID, pool_id);
+	}
+	if (pool_id == JPOOL_IMAGE) {
+		mem->virt_sarray_list = NULL;
+		mem->virt_barray_list = NULL;
+	}
+	php_epeg_memory_chunks_put(mem->pools[pool_id]);
+	mem->pools[pool_id] = NULL;
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_self_destruct */
+static void
+php_epeg_memory_self_destruct(j_common_ptr cinfo)
+{
+	php_epeg_memory_mgr_t *mem = (php_epeg_memory_mgr_t *)cinfo->mem;
+	int pool;
+
+	for (pool = JPOOL_NUMPOOLS - 1; pool >= JPOOL_PERMANENT; pool--) {
+		php_epeg_memory_chunks_put(mem->pools[pool]);
+	}
+
+	/* the original manager frees itself and what it allocated */
+	cinfo->mem = mem->orig;
+	free(mem);
+	(*cinfo->mem->self_destruct)(cinfo);
+}
+/* }}} */
+
+/* }}} */
+
+/* {{{ php_epeg_memory_install */
+/*
+ * Replace the memory manager of a JPEG object just made by jpeg_create_*().
+ * If it fails the object keeps the manager of libjpeg.
+ */
+void
+php_epeg_memory_install(j_common_ptr cinfo)
+{
+	php_epeg_memory_mgr_t *mem;
+
+	mem = (php_epeg_memory_mgr_t *)calloc(1, sizeof(php_epeg_memory_mgr_t));
+	if (mem == NULL) {
+		return;
+	}
+	mem->orig = cinfo->mem;
+	mem->pub.alloc_small = php_epeg_memory_alloc;
+	mem->pub.alloc_large = php_epeg_memory_alloc;
+	mem->pub.alloc_sarray = php_epeg_memory_alloc_sarray;
+	mem->pub.alloc_barray = php_epeg_memory_alloc_barray;
+	mem->pub.request_virt_sarray = php_epeg_memory_request_virt_sarray;
+	mem->pub.request_virt_barray = php_epeg_memory_request_virt_barray;
+	mem->pub.realize_virt_arrays = php_epeg_memory_realize_virt_arrays;
+	mem->pub.access_virt_sarray = php_epeg_memory_access_virt_sarray;
+	mem->pub.access_virt_barray = php_epeg_memory_access_virt_barray;
+	mem->pub.free_pool = php_epeg_memory_free_pool;
+	mem->pub.self_destruct = php_epeg_memory_self_destruct;
+	mem->pub.max_memory_to_use = mem->orig->max_memory_to_use;
+	mem->pub.max_alloc_chunk = mem->orig->max_alloc_chunk;
+	cinfo->mem = &mem->pub;
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_limit_set */
+/*
+ * Set the bytes the JPEG objects may hold at once, 0 for no limit.
+ */
+void
+php_epeg_memory_limit_set(size_t limit)
+{
+	PHP_EPEG_MEMORY_LOCK();
+	php_epeg_memory_limit = limit;
+	PHP_EPEG_MEMORY_UNLOCK();
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_peak_usage */
+/*
+ * Get the most bytes held at once since php_epeg_memory_peak_reset().
+ */
+size_t
+php_epeg_memory_peak_usage(void)
+{
+	size_t peak;
+
+	PHP_EPEG_MEMORY_LOCK();
+	peak = php_epeg_memory_peak;
+	PHP_EPEG_MEMORY_UNLOCK();
+
+	return peak;
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_peak_reset */
+void
+php_epeg_memory_peak_reset(void)
+{
+	PHP_EPEG_MEMORY_LOCK();
+	php_epeg_memory_peak = php_epeg_memory_in_use;
+	php_epeg_memory_exhausted = 0;
+	PHP_EPEG_MEMORY_UNLOCK();
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_exhausted_get */
+/*
+ * Whether an allocation has failed on the limit since the last call.
+ */
+int
+php_epeg_memory_exhausted_get(void)
+{
+	int exhausted;
+
+	PHP_EPEG_MEMORY_LOCK();
+	exhausted = php_epeg_memory_exhausted;
+	php_epeg_memory_exhausted = 0;
+	PHP_EPEG_MEMORY_UNLOCK();
+
+	return exhausted;
+}
+/* }}} */
+
+/* {{{ php_epeg_memory_shutdown */
+/*
+ * Free the cached chunks, called once when the module shuts down.
+ */
+void
+php_epeg_memory_shutdown(void)
+{
+	php_epeg_memory_chunk_t *chunk;
+
+	PHP_EPEG_MEMORY_LOCK();
+	chunk = php_epeg_memory_free_list;
+	php_epeg_memory_free_list = NULL;
+	php_epeg_memory_cached = 0;
+	PHP_EPEG_MEMORY_UNLOCK();
+
+	while (chunk != NULL) {
+		php_epeg_memory_chunk_t *next = chunk->next;
+		free(chunk->base);
+		chunk = next;
+	}
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noet sw=4 ts=4 fdm=marker
+ * vim<600: noet sw=4 ts=4
+ */
@@ -0,0 +1,276 @@
+/**
+ * The Epeg PHP extension
+ *
+ * Copyright (c) 2006-2010 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-epeg
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2010 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * Placeholders made from the image of the DC coefficients.
+ *
+ * The decoder makes that image at 1/8 of the source, one pixel per block,
+ * which is already far more than a placeholder needs. The BlurHash of it
+ * is the same as of the full image up to rounding, since both are the low
+ * frequencies only, and so is the dominant color.
+ */
+
+#include "php_epeg.h"
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* levels per channel of the histogram of php_epeg_pixels_dominant() */
+#define PHP_EPEG_DOMINANT_BITS  4
+#define PHP_EPEG_DOMINANT_BINS  (1 << (PHP_EPEG_DOMINANT_BITS * 3))
+
+/* {{{ sRGB */
+
+static double php_epeg_srgb_linear[256];
+
+/*
+ * Fill the table of the linear values of the sRGB levels,
+ * called once when the module starts.
+ */
+void
+php_epeg_placeholder_startup(void)
+{
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		double v = (double)i / 255.0;
+		php_epeg_srgb_linear[i] = (v <= 0.04045) ? v / 12.92 : pow((v + 0.055) / 1.055, 2.4);
+	}
+}
+
+static int
+php_epeg_linear_srgb(double v)
+{
+	v = (v < 0.0) ? 0.0 : (v > 1.0) ? 1.0 : v;
+	if (v <= 0.0031308) {
+		return (int)(v * 12.92 * 255.0 + 0.5);
+	}
+	return (int)((1.055 * pow(v, 1.0 / 2.4) - 0.055) * 255.0 + 0.5);
+}
+
+/* }}} */
+
+/* {{{ php_epeg_base83 */
+static char *
+php_epeg_base83(char *p, int value, int length)
+{
+	static const char digits[] =
+		"0123456789ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz#$%*+,-.:;=?@[]^_{|}~";
+	int i;
+
+	for (i = length - 1; i >= 0; i--) {
+		p[i] = digits[value % 83];
+		value /= 83;
+	}
+
+	return p + length;
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_blurhash */
+/*
+ * Compute the BlurHash of RGB pixels with x_components x y_components
+ * cosine components, each 1 to 9. The hash is written to hash, which must
+ * hold PHP_EPEG_BLURHASH_MAX_LENGTH bytes, and is terminated by '\0'.
+ * The sums are separable, so every pixel is converted and multiplied by
+ * the horizontal cosines only once per row.
+ * Returns 0 on success or PHP_EPEG_ERROR_SCALE.
+ */
+int
+php_epeg_pixels_blurhash(const php_epeg_pixels_t *px, int x_components, int y_components, char *hash)
+{
+	const int width = px->width;
+	const int height = px->height;
+	const int nc = x_components * y_components;
+	double *cos_x = NULL, *cos_y = NULL, *row = NULL, *factors = NULL;
+	double maximum = 1.0;
+	char *p = hash;
+	int x, y, i, j, c, result = PHP_EPEG_ERROR_SCALE;
+
+	if (px->components != 3 || width < 1 || height < 1
+		|| x_components < 1 || x_components > 9 || y_components < 1 || y_components > 9)
+	{
+		return PHP_EPEG_ERROR_SCALE;
+	}
+	cos_x = (double *)malloc((size_t)width * x_components * sizeof(double));
+	cos_y = (double *)malloc((size_t)height * y_components * sizeof(double));
+	row = (double *)malloc((size_t)x_components * 3 * sizeof(double));
+	factors = (double *)calloc((size_t)nc * 3, sizeof(double));
+	if (cos_x == NULL || cos_y == NULL || row == NULL || factors == NULL) {
+		goto done;
+	}
+
+	for (i = 0; i < x_components; i++) {
+		for (x = 0; x < width; x++) {
+			cos_x[i * width + x] = cos(M_PI * i * x / width);
+		}
+	}
+	for (j = 0; j < y_components; j++) {
+		for (y = 0; y < height; y++) {
+			cos_y[j * height + y] = cos(M_PI * j * y / height);
+		}
+	}
+
+	for (y = 0; y < height; y++) {
+		const unsigned char *sp = px->buf + (size_t)y * width * 3;
+
+		memset(row, 0, (size_t)x_components * 3 * sizeof(double));
+		for (x = 0; x < width; x++, sp += 3) {
+			const double r = php_epeg_srgb_linear[sp[0]];
+			const double g = php_epeg_srgb_linear[sp[1]];
+			const double b = php_epeg_srgb_linear[sp[2]];
+
+			for (i = 0; i < x_components; i++) {
+				const double basis = cos_x[i * width + x];
+				row[i * 3] += basis * r;
+				row[i * 3 + 1] += basis * g;
+				row[i * 3 + 2] += basis * b;
+			}
+		}
+		for (j = 0; j < y_components; j++) {
+			const double basis = cos_y[j * height + y];
+			for (i = 0; i < x_components; i++) {
+				for (c = 0; c < 3; c++) {
+					factors[(j * x_components + i) * 3 + c] += basis * row[i * 3 + c];
+				}
+			}
+		}
+	}
+	for (i = 0; i < nc; i++) {
+		const double scale = ((i == 0) ? 1.0 : 2.0) / ((double)width * height);
+		for (c = 0; c < 3; c++) {
+			factors[i * 3 + c] *= scale;
+		}
+	}
+
+	/* the number of the components, the maximum of the AC components and the average color */
+	p = php_epeg_base83(p, (x_components - 1) + (y_components - 1) * 9, 1);
+	if (nc > 1) {
+		double actual = 0.0;
+		int quantised;
+
+		for (i = 3; i < nc * 3; i++) {
+			actual = MAX(actual, fabs(factors[i]));
+		}
+		quantised = (int)floor(actual * 166.0 - 0.5);
+		quantised = (quantised < 0) ? 0 : (quantised > 82) ? 82 : quantised;
+		maximum = (double)(quantised + 1) / 166.0;
+		p = php_epeg_base83(p, quantised, 1);
+	} else {
+		p = php_epeg_base83(p, 0, 1);
+	}
+	p = php_epeg_base83(p, (php_epeg_linear_srgb(factors[0]) << 16)
+			+ (php_epeg_linear_srgb(factors[1]) << 8) + php_epeg_linear_srgb(factors[2]), 4);
+
+	/* the AC components, the square root keeps the small ones apart */
+	for (i = 1; i < nc; i++) {
+		int q[3];
+
+		for (c = 0; c < 3; c++) {
+			double v = factors[i * 3 + c] / maximum;
+			v = (v < 0.0) ? -sqrt(-v) : sqrt(v);
+			q[c] = (int)floor(v * 9.0 + 9.5);
+			q[c] = (q[c] < 0) ? 0 : (q[c] > 18) ? 18 : q[c];
+		}
+		p = php_epeg_base83(p, q[0] * 19 * 19 + q[1] * 19 + q[2], 2);
+	}
+	*p = '\0';
+	result = 0;
+
+  done:
+	free(cos_x);
+	free(cos_y);
+	free(row);
+	free(factors);
+
+	return result;
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_dominant */
+/*
+ * Find the dominant color of RGB pixels, the average of the pixels
+ * in the most populated cell of a 16x16x16 histogram.
+ * Returns 0 on success or PHP_EPEG_ERROR_SCALE.
+ */
+int
+php_epeg_pixels_dominant(const php_epeg_pixels_t *px, unsigned char *rgb)
+{
+	const size_t count = (size_t)px->width * px->height;
+	const int shift = 8 - PHP_EPEG_DOMINANT_BITS;
+	unsigned int *bins;
+	unsigned long sum[3] = { 0, 0, 0 };
+	const unsigned char *sp;
+	size_t k, n = 0;
+	int best = 0, bin;
+
+	if (px->components != 3 || count == 0) {
+		return PHP_EPEG_ERROR_SCALE;
+	}
+	bins = (unsigned int *)calloc(PHP_EPEG_DOMINANT_BINS, sizeof(unsigned int));
+	if (bins == NULL) {
+		return PHP_EPEG_ERROR_SCALE;
+	}
+
+	for (k = 0, sp = px->buf; k < count; k++, sp += 3) {
+		bin = ((sp[0] >> shift) << (PHP_EPEG_DOMINANT_BITS * 2))
+			| ((sp[1] >> shift) << PHP_EPEG_DOMINANT_BITS) | (sp[2] >> shift);
+		if (++bins[bin] > bins[best]) {
+			best = bin;
+		}
+	}
+	for (k = 0, sp = px->buf; k < count; k++, sp += 3) {
+		bin = ((sp[0] >> shift) << (PHP_EPEG_DOMINANT_BITS * 2))
+			| ((sp[1] >> shift) << PHP_EPEG_DOMINANT_BITS) | (sp[2] >> shift);
+		if (bin == best) {
+			sum[0] += sp[0];
+			sum[1] += sp[1];
+			sum[2] += sp[2];
+			n++;
+		}
+	}
+	free(bins);
+
+	rgb[0] = (unsigned char)((sum[0] + n / 2) / n);
+	rgb[1] = (unsigned char)((sum[1] + n / 2) / n);
+	rgb[2] = (unsigned char)((sum[2] + n / 2) / n);
+
+	return 0;
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noet sw=4 ts=4 fdm=marker
+ * vim<600: noet sw=4 ts=4
+ */
@@ -0,0 +1,495 @@
+/**
+ * The Epeg PHP extension
+ *
+ * Copyright (c) 2006-2010 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-epeg
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2010 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * A minimal pool of native worker threads.
+ *
+ * The tasks run outside the Zend engine, they must not call any PHP API
+ * nor the Zend memory manager. Without thread support every task runs
+ * in the calling thread as soon as it is submitted.
+ *
+ * Finished tasks can be handed over to a queue whose file descriptor
+ * becomes readable, so that an event loop can wait for them.
+ */
+
+#include "php_epeg.h"
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+#ifdef HAVE_SYS_EVENTFD_H
+#include <sys/eventfd.h>
+#endif
+#include <errno.h>
+
+/* {{{ type definitions */
+
+struct _php_epeg_pool_t {
+#ifdef PHP_EPEG_USE_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	pthread_cond_t done_cond;
+	pthread_t *threads;
+	int nthreads;
+	php_epeg_task_t *head;
+	php_epeg_task_t *tail;
+	int shutdown;
+#else
+	int dummy;
+#endif
+};
+
+struct _php_epeg_queue_t {
+#ifdef PHP_EPEG_USE_THREADS
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+#endif
+	php_epeg_task_t *head;
+	php_epeg_task_t *tail;
+	/* read and write ends of the notification, both are the same for eventfd */
+	int fds[2];
+};
+
+/* }}} */
+
+/* {{{ php_epeg_cpu_count */
+int
+php_epeg_cpu_count(void)
+{
+#if defined(HAVE_UNISTD_H) && defined(_SC_NPROCESSORS_ONLN)
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	if (n > 0) {
+		return (n > PHP_EPEG_POOL_MAX_THREADS) ? PHP_EPEG_POOL_MAX_THREADS : (int)n;
+	}
+#endif
+	return 1;
+}
+/* }}} */
+
+#ifdef PHP_EPEG_USE_THREADS
+/* {{{ php_epeg_pool_worker */
+static void *
+php_epeg_pool_worker(void *arg)
+{
+	php_epeg_pool_t *pool = (php_epeg_pool_t *)arg;
+	php_epeg_task_t *task;
+	php_epeg_queue_t *queue;
+
+	for (;;) {
+		pthread_mutex_lock(&pool->lock);
+		while (pool->head == NULL && !pool->shutdown) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+		task = pool->head;
+		if (task == NULL) {
+			/* shut down and nothing left to do */
+			pthread_mutex_unlock(&pool->lock);
+			break;
+		}
+		pool->head = task->next;
+		if (pool->head == NULL) {
+			pool->tail = NULL;
+		}
+		pthread_mutex_unlock(&pool->lock);
+
+		task->next = NULL;
+		task->run(task);
+		queue = task->queue;
+
+		pthread_mutex_lock(&pool->lock);
+		task->done = 1;
+		pthread_cond_broadcast(&pool->done_cond);
+		pthread_mutex_unlock(&pool->lock);
+
+		/* the owner of the queue may release the task from now on */
+		if (queue != NULL) {
+			php_epeg_queue_push(queue, task);
+		}
+	}
+
+	return NULL;
+}
+/* }}} */
+#endif
+
+/* {{{ php_epeg_pool_create */
+/*
+ * Start a pool of nthreads workers, 0 means the number of CPUs.
+ * Returns NULL on failure.
+ */
+php_epeg_pool_t *
+php_epeg_pool_create(int nthreads)
+{
+	php_epeg_pool_t *pool;
+
+	pool = (php_epeg_pool_t *)calloc(1, sizeof(php_epeg_pool_t));
+	if (pool == NULL) {
+		return NULL;
+	}
+
+#ifdef PHP_EPEG_USE_THREADS
+	if (nthreads <= 0) {
+		nthreads = php_epeg_cpu_count();
+	} else if (nthreads > PHP_EPEG_POOL_MAX_THREADS) {
+		nthreads = PHP_EPEG_POOL_MAX_THREADS;
+	}
+
+	pool->threads = (pthread_t *)calloc((size_t)nthreads, sizeof(pthread_t));
+	if (pool->threads == NULL) {
+		free(pool);
+		return NULL;
+	}
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+	pthread_cond_init(&pool->done_cond, NULL);
+
+	for (pool->nthreads = 0; pool->nthreads < nthreads; pool->nthreads++) {
+		if (pthread_create(&pool->threads[pool->nthreads], NULL,
+				php_epeg_pool_worker, pool) != 0)
+		{
+			/* go on with the threads already started */
+			break;
+		}
+	}
+#endif
+
+	return pool;
+}
+/* }}} */
+
+/* {{{ php_epeg_pool_size */
+int
+php_epeg_pool_size(php_epeg_pool_t *pool)
+{
+#ifdef PHP_EPEG_USE_THREADS
+	return pool->nthreads;
+#else
+	return 0;
+#endif
+}
+/* }}} */
+
+/* {{{ php_epeg_pool_submit */
+void
+php_epeg_pool_submit(php_epeg_pool_t *pool, php_epeg_task_t *task)
+{
+	task->next = NULL;
+	task->done = 0;
+
+#ifdef PHP_EPEG_USE_THREADS
+	if (pool->nthreads > 0) {
+		pthread_mutex_lock(&pool->lock);
+		if (pool->tail == NULL) {
+			pool->head = task;
+		} else {
+			pool->tail->next = task;
+		}
+		pool->tail = task;
+		pthread_cond_signal(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+		return;
+	}
+#endif
+
+	/* no worker, run it right now */
+	task->run(task);
+	task->done = 1;
+	if (task->queue != NULL) {
+		php_epeg_queue_push(task->queue, task);
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_pool_wait */
+/*
+ * Block until the submitted task has finished.
+ */
+void
+php_epeg_pool_wait(php_epeg_pool_t *pool, php_epeg_task_t *task)
+{
+#ifdef PHP_EPEG_USE_THREADS
+	if (pool->nthreads > 0) {
+		pthread_mutex_lock(&pool->lock);
+		while (!task->done) {
+			pthread_cond_wait(&pool->done_cond, &pool->lock);
+		}
+		pthread_mutex_unlock(&pool->lock);
+	}
+#endif
+}
+/* }}} */
+
+/* {{{ php_epeg_pool_destroy */
+/*
+ * Wait for all submitted tasks and stop the workers.
+ */
+void
+php_epeg_pool_destroy(php_epeg_pool_t *pool)
+{
+#ifdef PHP_EPEG_USE_THREADS
+	int i;
+
+	pthread_mutex_lock(&pool->lock);
+	pool->shutdown = 1;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	for (i = 0; i < pool->nthreads; i++) {
+		pthread_join(pool->threads[i], NULL);
+	}
+	pthread_cond_destroy(&pool->done_cond);
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+	free(pool->threads);
+#endif
+	free(pool);
+}
+/* }}} */
+
+/* {{{ php_epeg_pool_cancel */
+/*
+ * Take back the tasks for queue which no worker has started yet,
+ * linked by next. The running ones are left to finish.
+ */
+php_epeg_task_t *
+php_epeg_pool_cancel(php_epeg_pool_t *pool, php_epeg_queue_t *queue)
+{
+	php_epeg_task_t *list = NULL;
+#ifdef PHP_EPEG_USE_THREADS
+	php_epeg_task_t **pp, *task, *prev = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	pp = &pool->head;
+	while ((task = *pp) != NULL) {
+		if (task->queue == queue) {
+			*pp = task->next;
+			task->next = list;
+			list = task;
+		} else {
+			prev = task;
+			pp = &task->next;
+		}
+	}
+	pool->tail = prev;
+	pthread_mutex_unlock(&pool->lock);
+#endif
+
+	return list;
+}
+/* }}} */
+
+/* {{{ php_epeg_pool_abandon */
+/*
+ * Release a pool inherited by a forked child. The workers only exist
+ * in the parent and the lock may have been held by one of them,
+ * so neither is touched. The tasks are left to the caller.
+ */
+void
+php_epeg_pool_abandon(php_epeg_pool_t *pool)
+{
+#ifdef PHP_EPEG_USE_THREADS
+	free(pool->threads);
+#endif
+	free(pool);
+}
+/* }}} */
+
+/* {{{ php_epeg_queue_create */
+/*
+ * Create a queue of finished tasks. Returns NULL on failure.
+ */
+php_epeg_queue_t *
+php_epeg_queue_create(void)
+{
+	php_epeg_queue_t *queue;
+
+	queue = (php_epeg_queue_t *)calloc(1, sizeof(php_epeg_queue_t));
+	if (queue == NULL) {
+		return NULL;
+	}
+	queue->fds[0] = queue->fds[1] = -1;
+
+#if defined(HAVE_SYS_EVENTFD_H) && defined(EFD_NONBLOCK)
+	queue->fds[0] = queue->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+#elif defined(HAVE_UNISTD_H) && defined(HAVE_FCNTL_H) && !defined(PHP_WIN32)
+	if (pipe(queue->fds) == 0) {
+		(void)fcntl(queue->fds[0], F_SETFL, fcntl(queue->fds[0], F_GETFL) | O_NONBLOCK);
+		(void)fcntl(queue->fds[1], F_SETFL, fcntl(queue->fds[1], F_GETFL) | O_NONBLOCK);
+		(void)fcntl(queue->fds[0], F_SETFD, FD_CLOEXEC);
+		(void)fcntl(queue->fds[1], F_SETFD, FD_CLOEXEC);
+	} else {
+		queue->fds[0] = queue->fds[1] = -1;
+	}
+#endif
+
+#ifdef PHP_EPEG_USE_THREADS
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->cond, NULL);
+#endif
+
+	return queue;
+}
+/* }}} */
+
+/* {{{ php_epeg_queue_fd */
+/*
+ * The file descriptor which is readable while finished tasks are queued,
+ * or -1 if not supported.
+ */
+int
+php_epeg_queue_fd(php_epeg_queue_t *queue)
+{
+	return queue->fds[0];
+}
+/* }}} */
+
+/* {{{ php_epeg_queue_push */
+void
+php_epeg_queue_push(php_epeg_queue_t *queue, php_epeg_task_t *task)
+{
+	task->next = NULL;
+
+#ifdef PHP_EPEG_USE_THREADS
+	pthread_mutex_lock(&queue->lock);
+#endif
+	if (queue->tail == NULL) {
+		queue->head = task;
+	} else {
+		queue->tail->next = task;
+	}
+	queue->tail = task;
+#ifdef PHP_EPEG_USE_THREADS
+	pthread_cond_broadcast(&queue->cond);
+	pthread_mutex_unlock(&queue->lock);
+#endif
+
+	/* notify after the task is visible, a full pipe is readable anyway */
+	if (queue->fds[1] != -1) {
+#if defined(HAVE_SYS_EVENTFD_H) && defined(EFD_NONBLOCK)
+		uint64_t one = 1;
+		(void)!write(queue->fds[1], &one, sizeof(one));
+#elif defined(HAVE_UNISTD_H)
+		char one = 1;
+		(void)!write(queue->fds[1], &one, 1);
+#endif
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_queue_pop_all */
+/*
+ * Take all the finished tasks in the order they finished,
+ * block until there is one if wait is set.
+ */
+php_epeg_task_t *
+php_epeg_queue_pop_all(php_epeg_queue_t *queue, int wait)
+{
+	php_epeg_task_t *list;
+
+	/* drain the notification first, a task pushed later notifies again */
+	if (queue->fds[0] != -1) {
+#if defined(HAVE_SYS_EVENTFD_H) && defined(EFD_NONBLOCK)
+		uint64_t count;
+		(void)!read(queue->fds[0], &count, sizeof(count));
+#elif defined(HAVE_UNISTD_H)
+		char buf[64];
+		while (read(queue->fds[0], buf, sizeof(buf)) > 0);
+#endif
+	}
+
+#ifdef PHP_EPEG_USE_THREADS
+	pthread_mutex_lock(&queue->lock);
+	while (wait && queue->head == NULL) {
+		pthread_cond_wait(&queue->cond, &queue->lock);
+	}
+#endif
+	list = queue->head;
+	queue->head = queue->tail = NULL;
+#ifdef PHP_EPEG_USE_THREADS
+	pthread_mutex_unlock(&queue->lock);
+#endif
+
+	return list;
+}
+/* }}} */
+
+/* {{{ php_epeg_queue_destroy */
+/*
+ * The tasks must have been taken and no task may be pushed any more.
+ */
+void
+php_epeg_queue_destroy(php_epeg_queue_t *queue)
+{
+#ifdef HAVE_UNISTD_H
+	if (queue->fds[0] != -1) {
+		close(queue->fds[0]);
+	}
+	if (queue->fds[1] != -1 && queue->fds[1] != queue->fds[0]) {
+		close(queue->fds[1]);
+	}
+#endif
+#ifdef PHP_EPEG_USE_THREADS
+	pthread_cond_destroy(&queue->cond);
+	pthread_mutex_destroy(&queue->lock);
+#endif
+	free(queue);
+}
+/* }}} */
+
+/* {{{ php_epeg_queue_abandon */
+/*
+ * Release a queue inherited by a forked child, see php_epeg_pool_abandon().
+ * The notification is shared with the parent, only this copy is closed.
+ */
+void
+php_epeg_queue_abandon(php_epeg_queue_t *queue)
+{
+#ifdef HAVE_UNISTD_H
+	if (queue->fds[0] != -1) {
+		close(queue->fds[0]);
+	}
+	if (queue->fds[1] != -1 && queue->fds[1] != queue->fds[0]) {
+		close(queue->fds[1]);
+	}
+#endif
+	free(queue);
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noet sw=4 ts=4 fdm=marker
+ * vim<600: noet sw=4 ts=4
+ */
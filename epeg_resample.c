@@ -0,0 +1,654 @@
+/**
+ * The Epeg PHP extension
+ *
+ * Copyright (c) 2006-2010 Ryusuke SEKIYAMA. All rights reserved.
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a
+ * copy of this software and associated documentation files (the "Software"),
+ * to deal in the Software without restriction, including without limitation
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense,
+ * and/or sell copies of the Software, and to permit persons to whom the
+ * Software is furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included
+ * in all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS
+ * OR IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL
+ * THE AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER
+ * DEALINGS IN THE SOFTWARE.
+ *
+ * @package     php-epeg
+ * @author      Ryusuke SEKIYAMA <rsky0711@gmail.com>
+ * @copyright   2006-2010 Ryusuke SEKIYAMA
+ * @license     http://www.opensource.org/licenses/mit-license.php  MIT License
+ */
+
+/*
+ * Separable resampling filters for the scaled pixels.
+ *
+ * The decoder only scales by 1/2, 1/4 and 1/8 in the DCT domain and then
+ * picks the nearest pixels, which aliases. The filters here resample the
+ * DCT scaled pixels to the exact size instead, first every row, then
+ * every column. The weights are 16 bit fixed point numbers so that the
+ * column pass, which runs over whole rows, can use SIMD multiply-adds.
+ *
+ * The resampler takes the rows one by one and keeps only the window of
+ * rows which the next output rows are made of, so a whole image never
+ * has to be resident when the rows come from the decoder.
+ */
+
+#include "php_epeg.h"
+
+#if defined(__GNUC__) && defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__GNUC__) && defined(__SSE2__)
+#include <emmintrin.h>
+#elif defined(__GNUC__) && defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+#ifndef M_PI
+#define M_PI 3.14159265358979323846
+#endif
+
+/* fraction bits of the weights, a weight of 1.0 still fits in a short */
+#define PHP_EPEG_WEIGHT_BITS    14
+#define PHP_EPEG_WEIGHT_ONE     (1 << PHP_EPEG_WEIGHT_BITS)
+#define PHP_EPEG_WEIGHT_HALF    (1 << (PHP_EPEG_WEIGHT_BITS - 1))
+
+/* {{{ type definitions */
+
+/* the weights of every output pixel along one axis */
+typedef struct _php_epeg_coeffs_t {
+	int *start;         /* the first input pixel */
+	int *count;         /* the number of the input pixels */
+	short *weights;     /* count weights from start, ksize apart */
+	int ksize;
+} php_epeg_coeffs_t;
+
+/* see php_epeg_resampler_new() */
+struct _php_epeg_resampler_t {
+	php_epeg_coeffs_t hc;       /* unused if the width is kept */
+	php_epeg_coeffs_t vc;       /* unused if the height is kept */
+	int src_width;
+	int src_height;
+	int width;
+	int height;
+	int components;
+	int amount;                 /* of the unsharp mask, 0 for none */
+	size_t stride;
+	unsigned char *window;      /* the last window_rows input rows, resampled horizontally */
+	int window_rows;
+	unsigned char *ring;        /* the last three output rows to sharpen */
+	unsigned char *row;         /* the row returned by php_epeg_resampler_pull() */
+	const unsigned char **rows;
+	int pushed;                 /* the input rows so far */
+	int made;                   /* the output rows resampled */
+	int pulled;                 /* the output rows returned */
+};
+
+/* }}} */
+
+/* {{{ php_epeg_clamp */
+static inline unsigned char
+php_epeg_clamp(int acc)
+{
+	acc >>= PHP_EPEG_WEIGHT_BITS;
+	return (unsigned char)((acc < 0) ? 0 : (acc > 255) ? 255 : acc);
+}
+/* }}} */
+
+/* {{{ filter functions */
+
+static double
+php_epeg_filter_box(double x)
+{
+	return (x > -0.5 && x <= 0.5) ? 1.0 : 0.0;
+}
+
+static double
+php_epeg_filter_triangle(double x)
+{
+	x = fabs(x);
+	return (x < 1.0) ? 1.0 - x : 0.0;
+}
+
+static double
+php_epeg_sinc(double x)
+{
+	if (x == 0.0) {
+		return 1.0;
+	}
+	x *= M_PI;
+	return sin(x) / x;
+}
+
+static double
+php_epeg_filter_lanczos3(double x)
+{
+	return (x > -3.0 && x < 3.0) ? php_epeg_sinc(x) * php_epeg_sinc(x / 3.0) : 0.0;
+}
+
+/* }}} */
+
+/* {{{ php_epeg_coeffs_free */
+static void
+php_epeg_coeffs_free(php_epeg_coeffs_t *c)
+{
+	free(c->start);
+	free(c->count);
+	free(c->weights);
+	memset(c, 0, sizeof(php_epeg_coeffs_t));
+}
+/* }}} */
+
+/* {{{ php_epeg_coeffs_init */
+/*
+ * Compute the weights to resample in_size pixels to out_size pixels.
+ * When shrinking the filter is stretched by the scale so that every
+ * input pixel contributes. EPEG_FILTER_POINT picks the same pixel as
+ * the decoder does. Returns 0 on success or -1.
+ */
+static int
+php_epeg_coeffs_init(php_epeg_coeffs_t *c, int in_size, int out_size, int filter)
+{
+	double (*func)(double) = NULL;
+	double support, scale, filter_scale;
+	double *tmp;
+	int i, x;
+
+	memset(c, 0, sizeof(php_epeg_coeffs_t));
+	scale = (double)in_size / (double)out_size;
+	filter_scale = (scale > 1.0) ? scale : 1.0;
+	switch (filter) {
+	  case PHP_EPEG_FILTER_BOX:
+		func = php_epeg_filter_box;
+		support = 0.5;
+		break;
+	  case PHP_EPEG_FILTER_TRIANGLE:
+		func = php_epeg_filter_triangle;
+		support = 1.0;
+		break;
+	  case PHP_EPEG_FILTER_LANCZOS3:
+		func = php_epeg_filter_lanczos3;
+		support = 3.0;
+		break;
+	  default:
+		support = 0.0;
+		break;
+	}
+	support *= filter_scale;
+	c->ksize = (func == NULL) ? 1 : (int)ceil(support) * 2 + 1;
+
+	c->start = (int *)malloc((size_t)out_size * sizeof(int));
+	c->count = (int *)malloc((size_t)out_size * sizeof(int));
+	c->weights = (short *)calloc((size_t)out_size * c->ksize, sizeof(short));
+	tmp = (double *)malloc((size_t)c->ksize * sizeof(double));
+	if (c->start == NULL || c->count == NULL || c->weights == NULL || tmp == NULL) {
+		free(tmp);
+		php_epeg_coeffs_free(c);
+		return -1;
+	}
+
+	for (i = 0; i < out_size; i++) {
+		short *k = c->weights + (size_t)i * c->ksize;
+		double center = ((double)i + 0.5) * scale;
+		double total = 0.0;
+		int xmin, xmax, sum, top;
+
+		if (func == NULL) {
+			c->start[i] = (int)(((long)i * in_size) / out_size);
+			c->count[i] = 1;
+			k[0] = PHP_EPEG_WEIGHT_ONE;
+			continue;
+		}
+
+		xmin = (int)(center - support + 0.5);
+		if (xmin < 0) {
+			xmin = 0;
+		}
+		xmax = (int)(center + support + 0.5);
+		if (xmax > in_size) {
+			xmax = in_size;
+		}
+		if (xmax - xmin > c->ksize) {
+			xmax = xmin + c->ksize;
+		}
+		for (x = 0; x < xmax - xmin; x++) {
+			tmp[x] = func(((double)(x + xmin) - center + 0.5) / filter_scale);
+			total += tmp[x];
+		}
+		if (xmax <= xmin || total == 0.0) {
+			/* nothing in reach, use the nearest pixel */
+			c->start[i] = (int)center;
+			if (c->start[i] >= in_size) {
+				c->start[i] = in_size - 1;
+			}
+			c->count[i] = 1;
+			k[0] = PHP_EPEG_WEIGHT_ONE;
+			continue;
+		}
+
+		/* normalize, the rounding error goes to the largest weight so that flat areas stay flat */
+		sum = 0;
+		top = 0;
+		for (x = 0; x < xmax - xmin; x++) {
+			double w = floor(tmp[x] / total * PHP_EPEG_WEIGHT_ONE + 0.5);
+			k[x] = (short)((w > 32767.0) ? 32767.0 : (w < -32768.0) ? -32768.0 : w);
+			sum += k[x];
+			if (k[x] > k[top]) {
+				top = x;
+			}
+		}
+		k[top] = (short)(k[top] + PHP_EPEG_WEIGHT_ONE - sum);
+		c->start[i] = xmin;
+		c->count[i] = xmax - xmin;
+	}
+	free(tmp);
+
+	return 0;
+}
+/* }}} */
+
+/* {{{ php_epeg_resample_row */
+/*
+ * Resample a row horizontally.
+ */
+static void
+php_epeg_resample_row(unsigned char *dp, const unsigned char *row, int components,
+		const php_epeg_coeffs_t *c, int width)
+{
+	int x, t, i;
+
+	for (x = 0; x < width; x++) {
+		const short *k = c->weights + (size_t)x * c->ksize;
+		const unsigned char *sp = row + (size_t)c->start[x] * components;
+		const int n = c->count[x];
+
+		if (components == 3) {
+			int a0 = PHP_EPEG_WEIGHT_HALF, a1 = PHP_EPEG_WEIGHT_HALF, a2 = PHP_EPEG_WEIGHT_HALF;
+			for (t = 0; t < n; t++, sp += 3) {
+				a0 += sp[0] * k[t];
+				a1 += sp[1] * k[t];
+				a2 += sp[2] * k[t];
+			}
+			*dp++ = php_epeg_clamp(a0);
+			*dp++ = php_epeg_clamp(a1);
+			*dp++ = php_epeg_clamp(a2);
+		} else {
+			for (i = 0; i < components; i++) {
+				int acc = PHP_EPEG_WEIGHT_HALF;
+				for (t = 0; t < n; t++) {
+					acc += sp[t * components + i] * k[t];
+				}
+				*dp++ = php_epeg_clamp(acc);
+			}
+		}
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_resample_column */
+/*
+ * Make a row of len bytes from count rows weighted by k.
+ */
+static void
+php_epeg_resample_column(unsigned char *dp, const unsigned char **rows,
+		const short *k, int count, size_t len)
+{
+	size_t i = 0;
+	int t;
+
+#if defined(__GNUC__) && defined(__AVX2__)
+	/* two rows at a time, each 32 bit lane gets a * ka + b * kb */
+	for (; i + 16 <= len; i += 16) {
+		__m256i lo = _mm256_set1_epi32(PHP_EPEG_WEIGHT_HALF);
+		__m256i hi = lo;
+		for (t = 0; t < count; t += 2) {
+			__m256i a = _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[t] + i)));
+			__m256i b = (t + 1 < count)
+				? _mm256_cvtepu8_epi16(_mm_loadu_si128((const __m128i *)(rows[t + 1] + i)))
+				: _mm256_setzero_si256();
+			__m256i w = _mm256_set1_epi32((int)(((unsigned int)(unsigned short)((t + 1 < count) ? k[t + 1] : 0) << 16)
+					| (unsigned short)k[t]));
+			lo = _mm256_add_epi32(lo, _mm256_madd_epi16(_mm256_unpacklo_epi16(a, b), w));
+			hi = _mm256_add_epi32(hi, _mm256_madd_epi16(_mm256_unpackhi_epi16(a, b), w));
+		}
+		lo = _mm256_packs_epi32(_mm256_srai_epi32(lo, PHP_EPEG_WEIGHT_BITS), _mm256_srai_epi32(hi, PHP_EPEG_WEIGHT_BITS));
+		lo = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, lo), 0xD8);
+		_mm_storeu_si128((__m128i *)(dp + i), _mm256_castsi256_si128(lo));
+	}
+#endif
+#if defined(__GNUC__) && (defined(__SSE2__) || defined(__AVX2__))
+	for (; i + 8 <= len; i += 8) {
+		const __m128i zero = _mm_setzero_si128();
+		__m128i lo = _mm_set1_epi32(PHP_EPEG_WEIGHT_HALF);
+		__m128i hi = lo;
+		for (t = 0; t < count; t += 2) {
+			__m128i a = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[t] + i)), zero);
+			__m128i b = (t + 1 < count)
+				? _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(rows[t + 1] + i)), zero)
+				: zero;
+			__m128i w = _mm_set1_epi32((int)(((unsigned int)(unsigned short)((t + 1 < count) ? k[t + 1] : 0) << 16)
+					| (unsigned short)k[t]));
+			lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+			hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+		}
+		lo = _mm_packs_epi32(_mm_srai_epi32(lo, PHP_EPEG_WEIGHT_BITS), _mm_srai_epi32(hi, PHP_EPEG_WEIGHT_BITS));
+		_mm_storel_epi64((__m128i *)(dp + i), _mm_packus_epi16(lo, lo));
+	}
+#elif defined(__GNUC__) && defined(__ARM_NEON)
+	for (; i + 8 <= len; i += 8) {
+		int32x4_t lo = vdupq_n_s32(PHP_EPEG_WEIGHT_HALF);
+		int32x4_t hi = lo;
+		for (t = 0; t < count; t++) {
+			int16x8_t a = vreinterpretq_s16_u16(vmovl_u8(vld1_u8(rows[t] + i)));
+			lo = vmlal_n_s16(lo, vget_low_s16(a), k[t]);
+			hi = vmlal_n_s16(hi, vget_high_s16(a), k[t]);
+		}
+		vst1_u8(dp + i, vqmovun_s16(vcombine_s16(
+				vqmovn_s32(vshrq_n_s32(lo, PHP_EPEG_WEIGHT_BITS)),
+				vqmovn_s32(vshrq_n_s32(hi, PHP_EPEG_WEIGHT_BITS)))));
+	}
+#endif
+	for (; i < len; i++) {
+		int acc = PHP_EPEG_WEIGHT_HALF;
+		for (t = 0; t < count; t++) {
+			acc += rows[t][i] * k[t];
+		}
+		dp[i] = php_epeg_clamp(acc);
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_sharpen_row */
+/*
+ * Unsharp mask a row with a 3x3 binomial blur, the rows above and below
+ * are repeated at the edges. amount is a fixed point number of 8 bits.
+ */
+static void
+php_epeg_sharpen_row(unsigned char *dp, const unsigned char *above, const unsigned char *row,
+		const unsigned char *below, int width, int components, int amount)
+{
+	size_t len = (size_t)width * components;
+	size_t i;
+
+	for (i = 0; i < len; i++) {
+		size_t l = (i >= (size_t)components) ? i - components : i;
+		size_t r = (i + components < len) ? i + components : i;
+		int blur = above[l] + 2 * above[i] + above[r]
+			+ 2 * (row[l] + 2 * row[i] + row[r])
+			+ below[l] + 2 * below[i] + below[r];
+		int v = row[i] + ((row[i] * 16 - blur) * amount) / (16 * 256);
+		dp[i] = (unsigned char)((v < 0) ? 0 : (v > 255) ? 255 : v);
+	}
+}
+/* }}} */
+
+/* {{{ php_epeg_resampler_new */
+/*
+ * Make a resampler from src_width x src_height to width x height with
+ * the filter, sharpened if sharpen is greater than 0. The input rows are
+ * given by php_epeg_resampler_push() from top to bottom, and after each
+ * one php_epeg_resampler_pull() has to be called until it returns NULL.
+ * Returns NULL on failure.
+ */
+php_epeg_resampler_t *
+php_epeg_resampler_new(int src_width, int src_height, int width, int height,
+		int components, int filter, double sharpen)
+{
+	php_epeg_resampler_t *r;
+	int y, end;
+
+	if (src_width < 1 || src_height < 1 || width < 1 || height < 1 || components < 1) {
+		return NULL;
+	}
+	r = (php_epeg_resampler_t *)calloc(1, sizeof(php_epeg_resampler_t));
+	if (r == NULL) {
+		return NULL;
+	}
+	r->src_width = src_width;
+	r->src_height = src_height;
+	r->width = width;
+	r->height = height;
+	r->components = components;
+	r->amount = (sharpen > 0.0) ? (int)(sharpen * 256.0 + 0.5) : 0;
+	r->stride = (size_t)width * components;
+	r->window_rows = 1;
+
+	if (width != src_width && php_epeg_coeffs_init(&r->hc, src_width, width, filter) != 0) {
+		goto fail;
+	}
+	if (height != src_height) {
+		if (php_epeg_coeffs_init(&r->vc, src_height, height, filter) != 0
+			|| (r->rows = (const unsigned char **)malloc(
+					(size_t)r->vc.ksize * sizeof(unsigned char *))) == NULL)
+		{
+			goto fail;
+		}
+		/* an output row is made when the last of the rows up to it has come,
+		   its first row has to be in the window by then */
+		end = 0;
+		for (y = 0; y < height; y++) {
+			if (r->vc.start[y] + r->vc.count[y] > end) {
+				end = r->vc.start[y] + r->vc.count[y];
+			}
+			if (end - r->vc.start[y] > r->window_rows) {
+				r->window_rows = end - r->vc.start[y];
+			}
+		}
+	}
+
+	r->window = (unsigned char *)malloc(r->stride * r->window_rows);
+	r->row = (unsigned char *)malloc(r->stride);
+	if (r->window == NULL || r->row == NULL
+		|| (r->amount > 0 && (r->ring = (unsigned char *)malloc(r->stride * 3)) == NULL))
+	{
+		goto fail;
+	}
+
+	return r;
+
+  fail:
+	php_epeg_resampler_free(r);
+	return NULL;
+}
+/* }}} */
+
+/* {{{ php_epeg_resampler_push */
+/*
+ * Give the next input row of src_width pixels, the rows after the last
+ * one are ignored.
+ */
+void
+php_epeg_resampler_push(php_epeg_resampler_t *r, const unsigned char *row)
+{
+	unsigned char *dp;
+
+	if (r->pushed >= r->src_height) {
+		return;
+	}
+	dp = r->window + r->stride * (r->pushed % r->window_rows);
+	if (r->hc.start != NULL) {
+		php_epeg_resample_row(dp, row, r->components, &r->hc, r->width);
+	} else {
+		memcpy(dp, row, r->stride);
+	}
+	r->pushed++;
+}
+/* }}} */
+
+/* {{{ php_epeg_resampler_ready */
+/*
+ * Whether the input rows of the output row y have come.
+ */
+static int
+php_epeg_resampler_ready(const php_epeg_resampler_t *r, int y)
+{
+	if (r->vc.start == NULL) {
+		return y < r->pushed;
+	}
+	return r->vc.start[y] + r->vc.count[y] <= r->pushed;
+}
+/* }}} */
+
+/* {{{ php_epeg_resampler_make */
+/*
+ * Resample the output row y vertically into dp. If dp is NULL the row
+ * of the window is returned as it is when the height is kept.
+ */
+static const unsigned char *
+php_epeg_resampler_make(php_epeg_resampler_t *r, int y, unsigned char *dp)
+{
+	int t;
+
+	if (r->vc.start == NULL) {
+		const unsigned char *sp = r->window + r->stride * (y % r->window_rows);
+
+		if (dp == NULL) {
+			return sp;
+		}
+		memcpy(dp, sp, r->stride);
+		return dp;
+	}
+
+	if (dp == NULL) {
+		dp = r->row;
+	}
+	for (t = 0; t < r->vc.count[y]; t++) {
+		r->rows[t] = r->window + r->stride * ((r->vc.start[y] + t) % r->window_rows);
+	}
+	php_epeg_resample_column(dp, r->rows, r->vc.weights + (size_t)y * r->vc.ksize,
+			r->vc.count[y], r->stride);
+	return dp;
+}
+/* }}} */
+
+/* {{{ php_epeg_resampler_pull */
+/*
+ * Get the next output row of width pixels, or NULL if it needs more input
+ * rows or all rows were returned. The row is valid until the next call.
+ * A sharpened row is returned once the row below it is resampled.
+ */
+const unsigned char *
+php_epeg_resampler_pull(php_epeg_resampler_t *r)
+{
+	int y;
+
+	if (r->amount == 0) {
+		if (r->made >= r->height || !php_epeg_resampler_ready(r, r->made)) {
+			return NULL;
+		}
+		r->pulled++;
+		return php_epeg_resampler_make(r, r->made++, NULL);
+	}
+
+	while (r->made < r->height && r->made <= r->pulled + 1) {
+		if (!php_epeg_resampler_ready(r, r->made)) {
+			return NULL;
+		}
+		(void)php_epeg_resampler_make(r, r->made, r->ring + r->stride * (r->made % 3));
+		r->made++;
+	}
+	if (r->pulled >= r->height) {
+		return NULL;
+	}
+
+	/* the rows above and below are repeated at the edges */
+	y = r->pulled++;
+	php_epeg_sharpen_row(r->row,
+			r->ring + r->stride * (((y > 0) ? y - 1 : 0) % 3),
+			r->ring + r->stride * (y % 3),
+			r->ring + r->stride * (((y + 1 < r->height) ? y + 1 : y) % 3),
+			r->width, r->components, r->amount);
+	return r->row;
+}
+/* }}} */
+
+/* {{{ php_epeg_resampler_done */
+/*
+ * Whether all output rows were returned.
+ */
+int
+php_epeg_resampler_done(const php_epeg_resampler_t *r)
+{
+	return r->pulled >= r->height;
+}
+/* }}} */
+
+/* {{{ php_epeg_resampler_free */
+void
+php_epeg_resampler_free(php_epeg_resampler_t *r)
+{
+	if (r == NULL) {
+		return;
+	}
+	php_epeg_coeffs_free(&r->hc);
+	php_epeg_coeffs_free(&r->vc);
+	free(r->window);
+	free(r->ring);
+	free(r->row);
+	free((void *)r->rows);
+	free(r);
+}
+/* }}} */
+
+/* {{{ php_epeg_pixels_resample */
+/*
+ * Make dst the pixels of src resampled to width x height with the filter
+ * and sharpened if sharpen is greater than 0.
+ * Returns 0 on success or PHP_EPEG_ERROR_SCALE.
+ */
+int
+php_epeg_pixels_resample(const php_epeg_pixels_t *src, int width, int height,
+		int filter, double sharpen, php_epeg_pixels_t *dst)
+{
+	const size_t src_stride = (size_t)src->width * src->components;
+	const size_t stride = (size_t)width * src->components;
+	php_epeg_resampler_t *r = NULL;
+	const unsigned char *row;
+	int y, sy;
+
+	*dst = *src;
+	dst->buf = NULL;
+
+	if (width < 1 || height < 1 || (size_t)height > ((size_t)-1) / stride
+		|| (r = php_epeg_resampler_new(src->width, src->height, width, height,
+				src->components, filter, sharpen)) == NULL
+		|| (dst->buf = (unsigned char *)malloc(stride * height)) == NULL)
+	{
+		php_epeg_resampler_free(r);
+		php_epeg_pixels_free(dst);
+		return PHP_EPEG_ERROR_SCALE;
+	}
+
+	y = 0;
+	for (sy = 0; sy < src->height; sy++) {
+		php_epeg_resampler_push(r, src->buf + src_stride * sy);
+		while ((row = php_epeg_resampler_pull(r)) != NULL) {
+			memcpy(dst->buf + stride * y++, row, stride);
+		}
+	}
+	php_epeg_resampler_free(r);
+
+	dst->width = width;
+	dst->height = height;
+	dst->filter = filter;
+	dst->sharpen = sharpen;
+
+	return 0;
+}
+/* }}} */
+
+/*
+ * Local variables:
+ * tab-width: 4
+ * c-basic-offset: 4
+ * End:
+ * vim600: noet sw=4 ts=4 fdm=marker
+ * vim<600: noet sw=4 ts=4
+ */
@@ -45,7 +45,28 @@
 #endif
 
 #include <math.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <ext/standard/php_smart_str.h>
+#include <ext/standard/md5.h>
+#include <ext/standard/php_lcg.h>
 #include <Epeg.h>
+#include <jpeglib.h>
+
+#if defined(HAVE_MMAP) && defined(HAVE_SYS_MMAN_H)
+#define PHP_EPEG_USE_MMAP 1
+#include <sys/mman.h>
+#endif
+
+#ifdef HAVE_PTHREAD_H
+#define PHP_EPEG_USE_THREADS 1
+#include <pthread.h>
+#endif
+
+/* the header cache is an anonymous shared mapping inherited by forked workers */
+#if defined(PHP_EPEG_USE_MMAP) && defined(__GNUC__) && (defined(MAP_ANONYMOUS) || defined(MAP_ANON))
+#define PHP_EPEG_USE_HEADER_CACHE 1
+#endif
 
 #define PHP_EPEG_MODULE_VERSION "0.3.0"
 
@@ -54,23 +75,328 @@
 #define EO_TO_RESOURCE  (1 << 2)
 #define EO_TO_OBJECT    (1 << 3)
 
-BEGIN_EXTERN_C()
+/* error codes of epeg_encode(), also used by the libjpeg pipeline */
+#define PHP_EPEG_ERROR_SCALE    1
+#define PHP_EPEG_ERROR_ENCODE   2
+#define PHP_EPEG_ERROR_DECODE   4
+#define PHP_EPEG_ERROR_OPEN     8
+#define PHP_EPEG_ERROR_STRUCTURE    16
+#define PHP_EPEG_ERROR_READ     32
+#define PHP_EPEG_ERROR_WRITE    64
+#define PHP_EPEG_ERROR_ARGS     128
 
-#ifdef PHP_EPEG_ENABLE_DECODE_BOUNDS_SET
-void epeg_decode_bounds_set(Epeg_Image *im, int x, int y, int w, int h);
-#endif
+/* let the decoder pick the colorspace of the source */
+#define PHP_EPEG_COLORSPACE_AUTO    -1
+
+/* rotations and flips of php_epeg_decoder_transform(), the same as jpegtran */
+#define PHP_EPEG_TRANSFORM_AUTO         -1  /* by the EXIF orientation, resolved by the caller */
+#define PHP_EPEG_TRANSFORM_NONE         0
+#define PHP_EPEG_TRANSFORM_FLIP_H       1
+#define PHP_EPEG_TRANSFORM_FLIP_V       2
+#define PHP_EPEG_TRANSFORM_TRANSPOSE    3
+#define PHP_EPEG_TRANSFORM_TRANSVERSE   4
+#define PHP_EPEG_TRANSFORM_ROT_90       5
+#define PHP_EPEG_TRANSFORM_ROT_180      6
+#define PHP_EPEG_TRANSFORM_ROT_270      7
+
+/* whether the transform swaps the width and the height */
+#define PHP_EPEG_TRANSFORM_SWAPS_AXES(op) \
+	((op) == PHP_EPEG_TRANSFORM_TRANSPOSE || (op) == PHP_EPEG_TRANSFORM_TRANSVERSE \
+	 || (op) == PHP_EPEG_TRANSFORM_ROT_90 || (op) == PHP_EPEG_TRANSFORM_ROT_270)
+
+/* how the decode size is fitted, EPEG_FIT_FAST snaps it to a DCT scaled size */
+#define PHP_EPEG_FIT_EXACT              0
+#define PHP_EPEG_FIT_FAST               1
+#define PHP_EPEG_DECODE_DC_ONLY         2   /* from the DC coefficients, at most 1/8 of the source */
+
+/* how far a DCT scaled size may be off the requested one for EPEG_FIT_FAST */
+#define PHP_EPEG_FIT_FAST_TOLERANCE     0.15
+
+/* formats of epeg_placeholder() */
+#define PHP_EPEG_PLACEHOLDER_RGB        0   /* raw RGB pixels */
+#define PHP_EPEG_PLACEHOLDER_BLURHASH   1
+#define PHP_EPEG_PLACEHOLDER_COLOR      2   /* the dominant color, "#rrggbb" */
+
+/* the largest size of PHP_EPEG_PLACEHOLDER_RGB */
+#define PHP_EPEG_PLACEHOLDER_MAX_SIZE   64
+
+/* 9x9 components and the terminating '\0' */
+#define PHP_EPEG_BLURHASH_MAX_LENGTH    (1 + 1 + 4 + 2 * 80 + 1)
+
+/* how far the aspect ratio of the embedded EXIF thumbnail may be off the source by default */
+#define PHP_EPEG_EXIF_THUMBNAIL_TOLERANCE 0.02
+
+/* resampling filters after the DCT scaled decode, see epeg_resample.c */
+#define PHP_EPEG_FILTER_POINT           0   /* the nearest pixel, like the Epeg library */
+#define PHP_EPEG_FILTER_BOX             1
+#define PHP_EPEG_FILTER_TRIANGLE        2
+#define PHP_EPEG_FILTER_LANCZOS3        3
+
+/* php_epeg_decoder_scale_parallel() cannot split the image */
+#define PHP_EPEG_PARALLEL_UNSUPPORTED   -1
+
+/* images decoded to more pixels than this are resampled in stripes by default */
+#define PHP_EPEG_STRIPE_MIN_PIXELS      (16 * 1024 * 1024)
+
+/* read-ahead of the stream source manager, initial size of memory outputs */
+#define PHP_EPEG_STREAM_CHUNK_SIZE  16384
+
+/* upper limit of the worker threads */
+#define PHP_EPEG_POOL_MAX_THREADS   64
+
+/* how php_epeg_t.data was allocated */
+#define PHP_EPEG_DATA_EMALLOC   0   /* emalloc()'d buffer owned by the handle */
+#define PHP_EPEG_DATA_ZVAL      1   /* borrowed from a PHP string, see zdata */
+
+BEGIN_EXTERN_C()
 
 /* {{{ type definitions */
 
+/* scaled pixels of php_epeg_decoder_scale(), the buffer is allocated by malloc() */
+typedef struct _php_epeg_pixels_t {
+	unsigned char *buf;
+	int width;
+	int height;
+	int components;
+	int color_space;    /* J_COLOR_SPACE of the buffer */
+	int colorspace;     /* the requested one, EPEG_* or PHP_EPEG_COLORSPACE_AUTO */
+	int src_width;
+	int src_height;
+	int filter;         /* PHP_EPEG_FILTER_* the pixels were resampled with */
+	double sharpen;
+	int dc_only;        /* decoded from the DC coefficients only */
+} php_epeg_pixels_t;
+
+/* sizes of the strings kept by the header cache, longer ones are not cached */
+#define PHP_EPEG_HEADER_PATH_MAX        512
+#define PHP_EPEG_HEADER_COMMENT_MAX     256
+#define PHP_EPEG_HEADER_URI_MAX         256
+#define PHP_EPEG_HEADER_MIMETYPE_MAX    32
+
+/* the first data of the keys of the thumbnail cache, a new version makes new keys */
+#define PHP_EPEG_CACHE_TAG_CREATE       "epeg_thumbnail_create " PHP_EPEG_MODULE_VERSION
+#define PHP_EPEG_CACHE_TAG_ENCODE       "epeg_encode " PHP_EPEG_MODULE_VERSION
+
+/* the thumbnail cache directory is swept every this many stores */
+#define PHP_EPEG_CACHE_SWEEP_INTERVAL   32
+
+/* a sweep deletes the oldest thumbnails until this fraction of the budget is used */
+#define PHP_EPEG_CACHE_SWEEP_TARGET     0.9
+
+/* temporary files older than this are left by a crashed writer */
+#define PHP_EPEG_CACHE_STALE_SECONDS    3600
+
+/* the entries of a set of the header cache, the least recently used one is evicted */
+#define PHP_EPEG_HEADER_CACHE_WAYS      8
+
+/* identity of a local file, the key of the header cache */
+typedef struct _php_epeg_header_key_t {
+	char path[PHP_EPEG_HEADER_PATH_MAX];    /* the real path */
+	unsigned long long inode;
+	unsigned long long size;
+	long long mtime;
+	long mtime_nsec;    /* 0 if the platform has no subsecond times */
+	long long ctime;    /* catches a rewrite which restores the modification time */
+	long ctime_nsec;
+} php_epeg_header_key_t;
+
+/* what epeg_size_get(), epeg_comment_get() and epeg_thumbnail_comments_get() return */
+typedef struct _php_epeg_header_t {
+	int width;
+	int height;
+	int has_comment;
+	char comment[PHP_EPEG_HEADER_COMMENT_MAX];
+	int has_uri;
+	char uri[PHP_EPEG_HEADER_URI_MAX];
+	unsigned long long mtime;
+	int thumb_width;
+	int thumb_height;
+	int has_mimetype;
+	char mimetype[PHP_EPEG_HEADER_MIMETYPE_MAX];
+} php_epeg_header_t;
+
+typedef struct _php_epeg_header_cache_t php_epeg_header_cache_t;
+
+typedef struct _php_epeg_header_cache_stats_t {
+	unsigned long capacity;
+	unsigned long used;
+	unsigned long hits;
+	unsigned long misses;
+	unsigned long evictions;
+} php_epeg_header_cache_stats_t;
+
 typedef struct _php_epeg_t {
 	Epeg_Image *ptr;
 	unsigned char *data;
 	int size;
+	int data_type;
+	zval *zdata;
 	int width;
 	int height;
 	int quality;
+	int colorspace;
+	char *comment;
+	zend_bool thumbnail_comments;
+	int out_width;
+	int out_height;
+	int bounds_x;
+	int bounds_y;
+	zend_bool retain_pixels;
+	php_epeg_pixels_t pixels;
+	int transform;
+	int filter;
+	double sharpen;
+	zend_bool dc_only;
+	zend_bool exif_thumbnail;
+	double exif_tolerance;
+	/* opened from the header cache, the data is read on the first use */
+	char *path;
+	php_epeg_header_t *header;
 } php_epeg_t;
 
+#define PHP_EPEG_PROBE_MAX_COMPONENTS 4
+
+typedef struct _php_epeg_probe_t {
+	int width;
+	int height;
+	int components;
+	int precision;
+	int progressive;
+	int h_samp[PHP_EPEG_PROBE_MAX_COMPONENTS];
+	int v_samp[PHP_EPEG_PROBE_MAX_COMPONENTS];
+	long sos_offset;
+} php_epeg_probe_t;
+
+/* source image of epeg_thumbnail_create(), either mapped or streamed */
+typedef struct _php_epeg_input_t {
+	php_stream *stream;
+	smart_str head;
+	unsigned char *data;
+	int data_len;
+	zend_bool mapped;
+} php_epeg_input_t;
+
+/* libjpeg error manager which returns to the caller with longjmp() */
+typedef struct _php_epeg_jpeg_error_t {
+	struct jpeg_error_mgr pub;
+	jmp_buf jb;
+} php_epeg_jpeg_error_t;
+
+/* libjpeg decompressor with its header already read */
+typedef struct _php_epeg_decoder_t {
+	struct jpeg_decompress_struct cinfo;
+	php_epeg_jpeg_error_t jerr;
+} php_epeg_decoder_t;
+
+/* output settings for php_epeg_decoder_encode() */
+typedef struct _php_epeg_params_t {
+	int width;
+	int height;
+	int quality;
+	int colorspace;
+	const char *comment;
+	int thumbnail_comments;
+	int x;              /* offset of php_epeg_decoder_trim() */
+	int y;
+	int filter;         /* PHP_EPEG_FILTER_* */
+	double sharpen;     /* amount of the unsharp mask, 0 for none */
+	int dc_only;        /* decode only the DC coefficients, at 1/8 */
+	long stripe_pixels; /* resample in stripes above this many decoded pixels, 0 for never */
+} php_epeg_params_t;
+
+/* encoded JPEG, see php_epeg_output_init() for the buffer */
+typedef struct _php_epeg_output_t {
+	unsigned char *buf;
+	size_t len;
+	void *(*realloc_func)(void *ptr, size_t size);
+	void (*free_func)(void *ptr);
+	/* if set, written to the stream chunk by chunk and buf is not used */
+	php_stream *stream;
+	int write_error;
+	/* the stream writes tmp_path, which replaces path when it is closed */
+	char *path;
+	char *tmp_path;
+#ifdef ZTS
+	void ***thread_ctx;
+#endif
+} php_epeg_output_t;
+
+typedef struct _php_epeg_resampler_t php_epeg_resampler_t;
+typedef struct _php_epeg_pool_t php_epeg_pool_t;
+typedef struct _php_epeg_queue_t php_epeg_queue_t;
+
+/* work item of php_epeg_pool_t, usually embedded in a larger struct */
+typedef struct _php_epeg_task_t {
+	void (*run)(struct _php_epeg_task_t *task);
+	struct _php_epeg_task_t *next;
+	volatile int done;
+	/* if set, the finished task is pushed to the queue instead of being waited for */
+	php_epeg_queue_t *queue;
+} php_epeg_task_t;
+
+/* a job of epeg_thumbnail_batch(), the task must be the first member */
+typedef struct _php_epeg_batch_job_t {
+	php_epeg_task_t task;
+	/* input, read by the calling thread */
+	unsigned char *data;
+	int data_len;
+	/* parameters */
+	int max_width;
+	int max_height;
+	int quality;
+	char *out_file;
+	int out_file_len;
+	/* output, allocated by malloc() */
+	php_epeg_output_t out;
+	int result;
+	/* key of the job in the jobs array */
+	char *key;
+	uint key_len;
+	ulong index;
+} php_epeg_batch_job_t;
+
+/* a job of epeg_encode_async(), owns a snapshot of the handle */
+typedef struct _php_epeg_async_job_t {
+	php_epeg_task_t task;
+	long id;
+	/* copies allocated by malloc() */
+	unsigned char *data;
+	size_t data_len;
+	char *comment;
+	php_epeg_params_t params;
+	int transform;
+	php_epeg_output_t out;
+	int result;
+} php_epeg_async_job_t;
+
+/* module globals */
+ZEND_BEGIN_MODULE_GLOBALS(epeg)
+	/* started on the first asynchronous job */
+	php_epeg_pool_t *pool;
+	php_epeg_queue_t *queue;
+	/* started on the first image decoded in parallel, kept apart from the jobs */
+	php_epeg_pool_t *band_pool;
+	/* the process which started them, a forked child starts its own */
+	long owner_pid;
+	long last_job_id;
+	int pending_jobs;
+	/* INI settings */
+	long header_cache_entries;
+	char *cache_dir;
+	long cache_size;
+	long memory_limit;
+	long stripe_pixels;
+	long parallel_pixels;
+	/* the thumbnails stored to the cache directory by this process */
+	long cache_stores;
+ZEND_END_MODULE_GLOBALS(epeg)
+
+#ifdef ZTS
+#define EPEG_G(v) TSRMG(epeg_globals_id, zend_epeg_globals *, v)
+#else
+#define EPEG_G(v) (epeg_globals.v)
+#endif
+
 #ifdef ZEND_ENGINE_2
 typedef struct _php_epeg_object {
 	zend_object std;
@@ -80,6 +406,227 @@ typedef struct _php_epeg_object {
 
 /* }}} */
 
+/*
+ * Everything declared below, as well as php_epeg_strip_markers() and the
+ * php_epeg_*_run() functions of epeg.c, may run in a worker thread, so it
+ * must not call the Zend engine nor any PHP API, emalloc() included.
+ * The exceptions take a php_stream and stay in the thread of the request.
+ */
+
+/* {{{ libjpeg pipeline (epeg_jpeg.c) */
+
+void
+php_epeg_params_init(php_epeg_params_t *params);
+
+void
+php_epeg_output_init(php_epeg_output_t *out,
+		void *(*realloc_func)(void *, size_t), void (*free_func)(void *));
+
+void
+php_epeg_output_init_stream(php_epeg_output_t *out, php_stream *sth TSRMLS_DC);
+
+void
+php_epeg_output_free(php_epeg_output_t *out);
+
+php_epeg_decoder_t *
+php_epeg_decoder_open_memory(const unsigned char *data, size_t data_len);
+
+php_epeg_decoder_t *
+php_epeg_decoder_open_stream(php_stream *sth, smart_str *head TSRMLS_DC);
+
+int
+php_epeg_decoder_encode(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, php_epeg_output_t *out);
+
+int
+php_epeg_decoder_encode_multiple(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, int count, php_epeg_output_t *outs);
+
+int
+php_epeg_decoder_trim(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, php_epeg_output_t *out);
+
+int
+php_epeg_decoder_scale(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, php_epeg_pixels_t *px);
+
+const unsigned char *
+php_epeg_find_ff(const unsigned char *p, const unsigned char *end);
+
+int
+php_epeg_decoder_scale_parallel(php_epeg_decoder_t *dec,
+		const unsigned char *data, size_t data_len,
+		const php_epeg_params_t *params, php_epeg_pool_t *pool, php_epeg_pixels_t *px);
+
+int
+php_epeg_pixels_encode(const php_epeg_pixels_t *px,
+		const php_epeg_params_t *params, php_epeg_output_t *out);
+
+int
+php_epeg_pixels_encode_area(const php_epeg_pixels_t *px, int x, int y, int width, int height,
+		const php_epeg_params_t *params, php_epeg_output_t *out);
+
+int
+php_epeg_pixels_encode_transform(const php_epeg_pixels_t *px, int op,
+		const php_epeg_params_t *params, php_epeg_output_t *out);
+
+int
+php_epeg_pixels_format(const php_epeg_pixels_t *px, int *colorspace);
+
+void
+php_epeg_pixels_export(const php_epeg_pixels_t *px, int op, unsigned char *buf);
+
+int
+php_epeg_decoder_transform(php_epeg_decoder_t *dec, int op,
+		const php_epeg_params_t *params, php_epeg_output_t *out);
+
+int
+php_epeg_decoder_crop(php_epeg_decoder_t *dec,
+		const php_epeg_params_t *params, php_epeg_output_t *out);
+
+int
+php_epeg_exif_transform(const unsigned char *data, size_t data_len);
+
+const unsigned char *
+php_epeg_exif_thumbnail(const unsigned char *data, size_t data_len, size_t *thumb_len);
+
+int
+php_epeg_pixels_halve(const php_epeg_pixels_t *src, php_epeg_pixels_t *dst);
+
+void
+php_epeg_pixels_free(php_epeg_pixels_t *px);
+
+void
+php_epeg_decoder_close(php_epeg_decoder_t *dec);
+
+/* }}} */
+
+/* {{{ resampling filters (epeg_resample.c) */
+
+int
+php_epeg_pixels_resample(const php_epeg_pixels_t *src, int width, int height,
+		int filter, double sharpen, php_epeg_pixels_t *dst);
+
+php_epeg_resampler_t *
+php_epeg_resampler_new(int src_width, int src_height, int width, int height,
+		int components, int filter, double sharpen);
+
+void
+php_epeg_resampler_push(php_epeg_resampler_t *r, const unsigned char *row);
+
+const unsigned char *
+php_epeg_resampler_pull(php_epeg_resampler_t *r);
+
+int
+php_epeg_resampler_done(const php_epeg_resampler_t *r);
+
+void
+php_epeg_resampler_free(php_epeg_resampler_t *r);
+
+/* }}} */
+
+/* {{{ memory manager (epeg_memory.c) */
+
+void
+php_epeg_memory_install(j_common_ptr cinfo);
+
+void
+php_epeg_memory_limit_set(size_t limit);
+
+size_t
+php_epeg_memory_peak_usage(void);
+
+void
+php_epeg_memory_peak_reset(void);
+
+int
+php_epeg_memory_exhausted_get(void);
+
+void
+php_epeg_memory_shutdown(void);
+
+/* }}} */
+
+/* {{{ placeholders (epeg_placeholder.c) */
+
+void
+php_epeg_placeholder_startup(void);
+
+int
+php_epeg_pixels_blurhash(const php_epeg_pixels_t *px, int x_components, int y_components, char *hash);
+
+int
+php_epeg_pixels_dominant(const php_epeg_pixels_t *px, unsigned char *rgb);
+
+/* }}} */
+
+/* {{{ header cache (epeg_header_cache.c) */
+
+php_epeg_header_cache_t *
+php_epeg_header_cache_create(unsigned long entries);
+
+void
+php_epeg_header_cache_destroy(php_epeg_header_cache_t *cache);
+
+int
+php_epeg_header_cache_get(php_epeg_header_cache_t *cache,
+		const php_epeg_header_key_t *key, php_epeg_header_t *header);
+
+void
+php_epeg_header_cache_put(php_epeg_header_cache_t *cache,
+		const php_epeg_header_key_t *key, const php_epeg_header_t *header);
+
+void
+php_epeg_header_cache_stats(php_epeg_header_cache_t *cache, php_epeg_header_cache_stats_t *stats);
+
+/* }}} */
+
+/* {{{ worker threads (epeg_pool.c) */
+
+int
+php_epeg_cpu_count(void);
+
+php_epeg_pool_t *
+php_epeg_pool_create(int nthreads);
+
+int
+php_epeg_pool_size(php_epeg_pool_t *pool);
+
+void
+php_epeg_pool_submit(php_epeg_pool_t *pool, php_epeg_task_t *task);
+
+void
+php_epeg_pool_wait(php_epeg_pool_t *pool, php_epeg_task_t *task);
+
+void
+php_epeg_pool_destroy(php_epeg_pool_t *pool);
+
+php_epeg_task_t *
+php_epeg_pool_cancel(php_epeg_pool_t *pool, php_epeg_queue_t *queue);
+
+void
+php_epeg_pool_abandon(php_epeg_pool_t *pool);
+
+php_epeg_queue_t *
+php_epeg_queue_create(void);
+
+int
+php_epeg_queue_fd(php_epeg_queue_t *queue);
+
+void
+php_epeg_queue_push(php_epeg_queue_t *queue, php_epeg_task_t *task);
+
+php_epeg_task_t *
+php_epeg_queue_pop_all(php_epeg_queue_t *queue, int wait);
+
+void
+php_epeg_queue_destroy(php_epeg_queue_t *queue);
+
+void
+php_epeg_queue_abandon(php_epeg_queue_t *queue);
+
+/* }}} */
+
 END_EXTERN_C()
 
 #endif /* _PHP_EPEG_H_ */
@@ -0,0 +1,17 @@
+--TEST--
+Epeg::cropLossless() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = new Epeg($sample, true);
+$image->setComment('crop');
+$thumb = new Epeg($image->cropLossless(32, 16, 32, 32), true);
+$size = $thumb->getSize();
+printf("%dx%d\n", $size['width'], $size['height']);
+var_dump($thumb->getComment());
+?>
+--EXPECT--
+32x32
+string(4) "crop"
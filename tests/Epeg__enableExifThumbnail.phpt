@@ -0,0 +1,27 @@
+--TEST--
+Epeg::enableExifThumbnail() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+// 32x24 grayscale thumbnail in IFD1 of the EXIF segment
+$image = new Epeg($sample, true);
+$image->setDecodeSize(32, 24);
+$image->setDecodeColorSpace(Epeg::GRAY8);
+$thumb = $image->encode();
+$tiff = "MM\0\x2a\0\0\0\x08\0\0\0\0\0\x0e\0\x02"
+      . "\x02\x01\0\x04\0\0\0\x01" . pack('N', 44)
+      . "\x02\x02\0\x04\0\0\0\x01" . pack('N', strlen($thumb))
+      . "\0\0\0\0" . $thumb;
+$image = new Epeg("\xFF\xD8\xFF\xE1" . pack('n', strlen($tiff) + 8) . "Exif\0\0" . $tiff . substr($sample, 2), true);
+$image->enableExifThumbnail(true, 0.01);
+foreach (array(array(16, 12), array(48, 36)) as $size) {
+    $image->setDecodeSize($size[0], $size[1]);
+    $info = Epeg::probe('data://image/jpeg;base64,' . base64_encode($image->encode()));
+    printf("%dx%d %d\n", $info['width'], $info['height'], $info['components']);
+}
+?>
+--EXPECT--
+16x12 1
+48x36 3
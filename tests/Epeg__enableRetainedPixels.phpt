@@ -0,0 +1,20 @@
+--TEST--
+Epeg::enableRetainedPixels() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = new Epeg($sample, true);
+$image->enableRetainedPixels();
+foreach (array(array(32, 24), array(16, 12), array(16, 12)) as $size) {
+    $image->setDecodeSize($size[0], $size[1]);
+    $thumb = new Epeg($image->encode(), true);
+    $size = $thumb->getSize();
+    printf("%dx%d\n", $size['width'], $size['height']);
+}
+?>
+--EXPECT--
+32x24
+16x12
+16x12
@@ -4,7 +4,20 @@ Epeg::encode() method
 <?php include 'skipif_oo.inc'; ?>
 --FILE--
 <?php
-echo 'OK'; // no test case for this function yet
+include dirname(__FILE__) . '/sample.inc';
+// the file the image is read from is overwritten by its thumbnail
+$file = tempnam(sys_get_temp_dir(), 'epeg');
+file_put_contents($file, $sample);
+$image = new Epeg($file);
+$image->setDecodeSize(32, 24);
+var_dump($image->encode($file));
+$size = epeg_size_get(epeg_open($file));
+printf("%dx%d %d\n", $size['width'], $size['height'], count(glob("$file.*")));
+// the image is still decoded from the original data
+var_dump(strlen($image->encode()) > 0);
+unlink($file);
 ?>
 --EXPECT--
-OK
\ No newline at end of file
+bool(true)
+32x24 0
+bool(true)
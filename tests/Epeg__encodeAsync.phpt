@@ -0,0 +1,20 @@
+--TEST--
+Epeg::encodeAsync() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = new Epeg($sample, true);
+$image->setDecodeSize(32, 32);
+$image->setComment('async');
+$id = $image->encodeAsync();
+$results = epeg_jobs_collect(true);
+$thumb = new Epeg($results[$id]['result'], true);
+$size = $thumb->getSize();
+printf("%dx%d\n", $size['width'], $size['height']);
+var_dump($thumb->getComment());
+?>
+--EXPECT--
+32x32
+string(5) "async"
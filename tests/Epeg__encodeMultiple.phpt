@@ -0,0 +1,18 @@
+--TEST--
+Epeg::encodeMultiple() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = new Epeg($sample, true);
+$thumbs = $image->encodeMultiple(array(array(32, 32), array(128, 16)));
+foreach ($thumbs as $key => $data) {
+    $thumb = new Epeg($data, true);
+    $size = $thumb->getSize();
+    printf("%s: %dx%d\n", $key, $size['width'], $size['height']);
+}
+?>
+--EXPECT--
+0: 32x32
+1: 64x16
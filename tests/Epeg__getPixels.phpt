@@ -0,0 +1,16 @@
+--TEST--
+Epeg::getPixels() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = new Epeg($sample, true);
+$image->setDecodeSize(32, 24);
+$image->setDecodeColorSpace(Epeg::BGR8);
+$pixels = $image->getPixels();
+printf("%dx%d %d %d %d\n", $pixels['width'], $pixels['height'],
+    $pixels['colorspace'] == Epeg::BGR8, $pixels['stride'], strlen($pixels['data']));
+?>
+--EXPECT--
+32x24 1 96 2304
@@ -0,0 +1,16 @@
+--TEST--
+Epeg::placeholder() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = new Epeg($sample, true);
+var_dump(strlen($image->placeholder(8, 6, Epeg::PLACEHOLDER_RGB)));
+var_dump(strlen($image->placeholder(9, 9, Epeg::PLACEHOLDER_BLURHASH)));
+var_dump(strlen($image->placeholder(1, 1, Epeg::PLACEHOLDER_COLOR)));
+?>
+--EXPECT--
+int(144)
+int(166)
+int(7)
@@ -0,0 +1,21 @@
+--TEST--
+Epeg::probe() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+$jpeg = "\xFF\xD8"
+      . "\xFF\xFE\x00\x06test"
+      . "\xFF\xC2\x00\x11\x08\x00\x78\x00\xA0\x03\x01\x22\x00\x02\x11\x01\x03\x11\x01"
+      . "\xFF\xDA\x00\x0C\x03\x01\x00\x02\x11\x03\x11\x00\x3F\x00";
+$info = Epeg::probe('data://image/jpeg;base64,' . base64_encode($jpeg));
+var_dump($info['width'], $info['height'], $info['components'],
+         $info['subsampling'], $info['progressive'], $info['sos_offset']);
+?>
+--EXPECT--
+int(160)
+int(120)
+int(3)
+string(11) "2x2,1x1,1x1"
+bool(true)
+int(29)
@@ -4,7 +4,15 @@ Epeg::setDecodeSize() method
 <?php include 'skipif_oo.inc'; ?>
 --FILE--
 <?php
-echo 'OK'; // no test case for this function yet
+include dirname(__FILE__) . '/sample.inc';
+$image = new Epeg($sample, true);
+$fit = $image->setDecodeSize(100, 100);
+printf("%dx%d\n", $fit['width'], $fit['height']);
+$fit = $image->setDecodeSize(9, 7, true, Epeg::FIT_FAST);
+$thumb = new Epeg($image->encode(), true);
+$size = $thumb->getSize();
+printf("%dx%d %dx%d\n", $fit['width'], $fit['height'], $size['width'], $size['height']);
 ?>
 --EXPECT--
-OK
\ No newline at end of file
+64x48
+8x6 8x6
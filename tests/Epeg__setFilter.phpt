@@ -0,0 +1,19 @@
+--TEST--
+Epeg::setFilter() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = new Epeg($sample, true);
+$image->setFilter(Epeg::FILTER_LANCZOS3);
+$thumbs = $image->encodeMultiple(array(array(30, 30), array(10, 10)), true);
+foreach ($thumbs as $thumb) {
+    $thumb = new Epeg($thumb, true);
+    $size = $thumb->getSize();
+    printf("%dx%d\n", $size['width'], $size['height']);
+}
+?>
+--EXPECT--
+30x23
+10x8
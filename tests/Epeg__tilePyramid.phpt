@@ -0,0 +1,27 @@
+--TEST--
+Epeg::tilePyramid() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$dir = sys_get_temp_dir() . '/epeg_tiles_' . getmypid();
+$image = new Epeg($sample, true);
+var_dump($image->tilePyramid(16, 0, $dir));
+foreach (array('6/0_0', '6/3_2', '5/1_1', '0/0_0') as $name) {
+    $thumb = new Epeg("$dir/$name.jpg");
+    $size = $thumb->getSize();
+    printf("%s: %dx%d\n", $name, $size['width'], $size['height']);
+}
+for ($level = 0; $level <= 6; $level++) {
+    array_map('unlink', glob("$dir/$level/*.jpg"));
+    rmdir("$dir/$level");
+}
+rmdir($dir);
+?>
+--EXPECT--
+int(21)
+6/0_0: 16x16
+6/3_2: 16x16
+5/1_1: 16x8
+0/0_0: 1x1
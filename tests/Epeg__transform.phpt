@@ -0,0 +1,25 @@
+--TEST--
+Epeg::transform() method
+--SKIPIF--
+<?php include 'skipif_oo.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = new Epeg($sample, true);
+foreach (array(Epeg::TRANSFORM_FLIP_V, Epeg::TRANSFORM_ROT_180, Epeg::TRANSFORM_TRANSPOSE) as $op) {
+    $image->transform($op);
+    $thumb = new Epeg($image->encode(), true);
+    $size = $thumb->getSize();
+    printf("%d: %dx%d\n", $op, $size['width'], $size['height']);
+}
+$image->transform(Epeg::TRANSFORM_ROT_90);
+$image->setDecodeSize(12, 16);
+$thumb = new Epeg($image->encode(), true);
+$size = $thumb->getSize();
+printf("%dx%d\n", $size['width'], $size['height']);
+?>
+--EXPECT--
+2: 64x48
+6: 64x48
+3: 48x64
+12x16
@@ -0,0 +1,23 @@
+--TEST--
+epeg_crop_lossless() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+// the sample has 16x16 MCUs, the corner is moved to the MCU boundary
+foreach (array(array(5, 5, 20, 20), array(17, 3, 1, 1), array(60, 40, 100, 100)) as $area) {
+    list($x, $y, $w, $h) = $area;
+    $size = epeg_size_get(epeg_memory_open(epeg_crop_lossless($image, $x, $y, $w, $h)));
+    printf("%dx%d\n", $size['width'], $size['height']);
+}
+var_dump(epeg_crop_lossless($image, 64, 0, 8, 8));
+?>
+--EXPECTF--
+25x25
+2x4
+16x16
+
+Warning: epeg_crop_lossless(): Invalid crop area '8x8+64+0' in %s on line %d
+bool(false)
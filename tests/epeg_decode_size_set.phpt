@@ -4,7 +4,22 @@ epeg_decode_size_set() function
 <?php include 'skipif.inc'; ?>
 --FILE--
 <?php
-echo 'OK'; // no test case for this function yet
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+foreach (array(array(20, 15, false, EPEG_FIT_EXACT), array(18, 14, false, EPEG_FIT_FAST),
+        array(30, 30, true, EPEG_FIT_FAST), array(40, 40, true, EPEG_FIT_FAST),
+        array(40, 30, true, EPEG_DECODE_DC_ONLY)) as $args) {
+    $fit = epeg_decode_size_set($image, $args[0], $args[1], $args[2], $args[3]);
+    $size = epeg_size_get(epeg_memory_open(epeg_encode($image)));
+    printf("%dx%d %dx%d\n", $fit['width'], $fit['height'], $size['width'], $size['height']);
+}
+epeg_decode_size_set($image, 32, 24, false, 3);
 ?>
---EXPECT--
-OK
\ No newline at end of file
+--EXPECTF--
+20x15 20x15
+16x12 16x12
+32x24 32x24
+40x30 40x30
+8x6 8x6
+
+Warning: epeg_decode_size_set(): Invalid fit mode '3' in %s on line %d
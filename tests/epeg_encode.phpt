@@ -4,7 +4,35 @@ epeg_encode() function
 <?php include 'skipif.inc'; ?>
 --FILE--
 <?php
-echo 'OK'; // no test case for this function yet
+include dirname(__FILE__) . '/sample.inc';
+$dir = tempnam(sys_get_temp_dir(), 'epeg');
+unlink($dir);
+mkdir($dir);
+ini_set('epeg.cache_dir', $dir);
+function thumb($sample, $quality) {
+    $image = epeg_memory_open($sample);
+    epeg_decode_size_set($image, 32, 24);
+    epeg_quality_set($image, $quality);
+    return epeg_encode($image);
+}
+$data = thumb($sample, 75);
+$files = glob("$dir/*.jpg");
+var_dump(count($files), file_get_contents($files[0]) === $data);
+// a hit returns the cached file as it is
+file_put_contents($files[0], $sample);
+var_dump(thumb($sample, 75) === $sample);
+// another setting is another thumbnail
+thumb($sample, 50);
+var_dump(count(glob("$dir/*.jpg")));
+// the least recently used thumbnails are deleted over the budget
+ini_set('epeg.cache_size', 1);
+thumb($sample, 25);
+var_dump(count(glob("$dir/*")));
+rmdir($dir);
 ?>
 --EXPECT--
-OK
\ No newline at end of file
+int(1)
+bool(true)
+bool(true)
+int(2)
+int(0)
@@ -0,0 +1,28 @@
+--TEST--
+epeg_encode_async() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+epeg_decode_size_set($image, 32, 24);
+$first = epeg_encode_async($image);
+epeg_decode_size_set($image, 16, 12);
+$second = epeg_encode_async($image);
+var_dump(is_int($first), $second > $first);
+$results = epeg_jobs_collect(true);
+ksort($results);
+foreach ($results as $id => $result) {
+    $size = epeg_size_get(epeg_memory_open($result['result']));
+    printf("%s: %dx%d\n", $id == $first ? 'first' : 'second', $size['width'], $size['height']);
+    var_dump($result['error']);
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+first: 32x24
+NULL
+second: 16x12
+NULL
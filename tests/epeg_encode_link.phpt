@@ -0,0 +1,37 @@
+--TEST--
+epeg_encode() function writing to an existing file
+--SKIPIF--
+<?php
+include 'skipif.inc';
+if (!function_exists('link') || !file_exists('/dev/null')) {
+    die('skip hard links and /dev/null are not available');
+}
+?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+// the file is written in place, a hard link to it sees the thumbnail
+$file = tempnam(sys_get_temp_dir(), 'epeg');
+$link = $file . '.link';
+file_put_contents($file, 'old');
+link($file, $link);
+$inode = fileinode($file);
+$image = epeg_memory_open($sample);
+epeg_decode_size_set($image, 32, 24);
+var_dump(epeg_encode($image, $file));
+clearstatcache();
+var_dump(fileinode($file) == $inode, file_get_contents($link) === file_get_contents($file));
+$size = epeg_size_get(epeg_open($link));
+printf("%dx%d\n", $size['width'], $size['height']);
+unlink($link);
+unlink($file);
+// a device is written as it is
+$image = epeg_memory_open($sample);
+var_dump(epeg_encode($image, '/dev/null'));
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+32x24
+bool(true)
@@ -0,0 +1,22 @@
+--TEST--
+epeg_encode_multiple() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+$thumbs = epeg_encode_multiple($image, array(
+    'large' => array(32, 24),
+    'small' => array(16, 16),
+    array(8, 8),
+), true);
+foreach ($thumbs as $key => $data) {
+    $size = epeg_size_get(epeg_memory_open($data));
+    printf("%s: %dx%d\n", $key, $size['width'], $size['height']);
+}
+?>
+--EXPECT--
+large: 32x24
+small: 16x12
+0: 8x6
@@ -0,0 +1,33 @@
+--TEST--
+epeg_exif_thumbnail_enable() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+// 32x24 grayscale thumbnail in IFD1 of the EXIF segment
+$image = epeg_memory_open($sample);
+epeg_decode_size_set($image, 32, 24);
+epeg_decode_colorspace_set($image, EPEG_GRAY8);
+$thumb = epeg_encode($image);
+$tiff = "MM\0\x2a\0\0\0\x08\0\0\0\0\0\x0e\0\x02"
+      . "\x02\x01\0\x04\0\0\0\x01" . pack('N', 44)
+      . "\x02\x02\0\x04\0\0\0\x01" . pack('N', strlen($thumb))
+      . "\0\0\0\0" . $thumb;
+$jpeg = "\xFF\xD8\xFF\xE1" . pack('n', strlen($tiff) + 8) . "Exif\0\0" . $tiff . substr($sample, 2);
+$image = epeg_memory_open($jpeg);
+foreach (array(array(20, 15, false), array(20, 15, true), array(32, 24, true), array(40, 30, true)) as $args) {
+    epeg_exif_thumbnail_enable($image, $args[2]);
+    epeg_decode_size_set($image, $args[0], $args[1]);
+    $info = epeg_probe('data://image/jpeg;base64,' . base64_encode(epeg_encode($image)));
+    printf("%dx%d %d\n", $info['width'], $info['height'], $info['components']);
+}
+epeg_exif_thumbnail_enable($image, true, 1.5);
+?>
+--EXPECTF--
+20x15 3
+20x15 1
+32x24 1
+40x30 3
+
+Warning: epeg_exif_thumbnail_enable(): Invalid tolerance (1.500000) in %s on line %d
@@ -2,9 +2,51 @@
 epeg_file_open() function
 --SKIPIF--
 <?php include 'skipif.inc'; ?>
+--INI--
+epeg.header_cache_entries=64
 --FILE--
 <?php
-echo 'OK'; // no test case for this function yet
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+epeg_decode_size_set($image, 32, 24);
+epeg_comment_set($image, 'cached');
+$file = tempnam(sys_get_temp_dir(), 'epeg');
+file_put_contents($file, epeg_encode($image));
+// the second handle is made from the header cache if it is enabled
+for ($i = 0; $i < 2; $i++) {
+    $image = epeg_file_open($file);
+    $size = epeg_size_get($image);
+    printf("%dx%d %s\n", $size['width'], $size['height'], epeg_comment_get($image));
+}
+// the file is read when the image is decoded
+epeg_decode_size_set($image, 16, 12);
+$size = epeg_size_get(epeg_memory_open(epeg_encode($image)));
+printf("%dx%d\n", $size['width'], $size['height']);
+// a new file is not taken for the cached one
+file_put_contents($file, $sample);
+$image = epeg_file_open($file);
+$size = epeg_size_get($image);
+printf("%dx%d '%s'\n", $size['width'], $size['height'], epeg_comment_get($image));
+// a rewrite of the same size which restores the modification time
+function commented($sample, $comment) {
+    $image = epeg_memory_open($sample);
+    epeg_comment_set($image, $comment);
+    return epeg_encode($image);
+}
+file_put_contents($file, commented($sample, 'before'));
+$mtime = filemtime($file);
+touch($file, $mtime);
+echo epeg_comment_get(epeg_file_open($file)), "\n";
+sleep(1);
+file_put_contents($file, commented($sample, 'after!'));
+touch($file, $mtime);
+echo epeg_comment_get(epeg_file_open($file)), "\n";
+unlink($file);
 ?>
 --EXPECT--
-OK
\ No newline at end of file
+32x24 cached
+32x24 cached
+16x12
+64x48 ''
+before
+after!
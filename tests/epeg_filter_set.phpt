@@ -0,0 +1,37 @@
+--TEST--
+epeg_filter_set() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+foreach (array(EPEG_FILTER_POINT, EPEG_FILTER_BOX, EPEG_FILTER_TRIANGLE, EPEG_FILTER_LANCZOS3) as $filter) {
+    epeg_filter_set($image, $filter, ($filter == EPEG_FILTER_LANCZOS3) ? 0.5 : 0.0);
+    epeg_decode_size_set($image, 20, 15);
+    $size = epeg_size_get(epeg_memory_open(epeg_encode($image)));
+    printf("%d: %dx%d\n", $filter, $size['width'], $size['height']);
+}
+// resampling in stripes makes the same image
+function lanczos($image) {
+    epeg_filter_set($image, EPEG_FILTER_LANCZOS3, 0.5);
+    epeg_decode_size_set($image, 20, 15);
+    return epeg_encode($image);
+}
+ini_set('epeg.stripe_pixels', 0);
+$whole = lanczos($image);
+ini_set('epeg.stripe_pixels', 1);
+var_dump(lanczos($image) === $whole);
+epeg_filter_set($image, 4);
+epeg_filter_set($image, EPEG_FILTER_BOX, -1.0);
+?>
+--EXPECTF--
+0: 20x15
+1: 20x15
+2: 20x15
+3: 20x15
+bool(true)
+
+Warning: epeg_filter_set(): Invalid filter '4' in %s on line %d
+
+Warning: epeg_filter_set(): Invalid sharpening amount (-1.000000) in %s on line %d
@@ -0,0 +1,35 @@
+--TEST--
+epeg_jobs_collect() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+var_dump(epeg_jobs_collect());
+$image = epeg_memory_open($sample);
+$ids = array();
+for ($i = 0; $i < 4; $i++) {
+    $ids[] = epeg_encode_async($image);
+}
+$results = epeg_jobs_collect(true);
+ksort($results);
+var_dump(array_keys($results) === $ids);
+foreach ($results as $result) {
+    var_dump(strlen($result['result']) > 0, $result['error']);
+}
+var_dump(epeg_jobs_collect(true));
+?>
+--EXPECT--
+array(0) {
+}
+bool(true)
+bool(true)
+NULL
+bool(true)
+NULL
+bool(true)
+NULL
+bool(true)
+NULL
+array(0) {
+}
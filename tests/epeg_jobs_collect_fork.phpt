@@ -0,0 +1,34 @@
+--TEST--
+epeg_jobs_collect() function in a forked child
+--SKIPIF--
+<?php
+include 'skipif.inc';
+if (!function_exists('pcntl_fork')) {
+    die('skip pcntl extension is not available');
+}
+?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+for ($i = 0; $i < 4; $i++) {
+    epeg_encode_async($image);
+}
+$pid = pcntl_fork();
+if ($pid == 0) {
+    // the jobs of the parent do not run in the child
+    var_dump(epeg_jobs_collect(true));
+    $id = epeg_encode_async($image);
+    $results = epeg_jobs_collect(true);
+    var_dump(array_keys($results) === array($id), strlen($results[$id]['result']) > 0);
+    exit(0);
+}
+pcntl_waitpid($pid, $status);
+var_dump(count(epeg_jobs_collect(true)));
+?>
+--EXPECT--
+array(0) {
+}
+bool(true)
+bool(true)
+int(4)
@@ -0,0 +1,33 @@
+--TEST--
+epeg_jobs_fd() function
+--SKIPIF--
+<?php
+include 'skipif.inc';
+if (!strncasecmp(PHP_OS, 'WIN', 3)) {
+    die('skip not for Windows');
+}
+?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$fd = epeg_jobs_fd();
+var_dump(is_resource($fd));
+$id = epeg_encode_async(epeg_memory_open($sample));
+$results = array();
+while (!$results) {
+    $read = array($fd);
+    $write = $except = null;
+    if (stream_select($read, $write, $except, 5) < 1) {
+        echo "timed out\n";
+        break;
+    }
+    $results = epeg_jobs_collect();
+}
+var_dump(array_keys($results) === array($id));
+var_dump(epeg_jobs_collect());
+?>
+--EXPECT--
+bool(true)
+bool(true)
+array(0) {
+}
@@ -0,0 +1,24 @@
+--TEST--
+epeg_memory_get_peak_usage() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+function thumb($sample) {
+    $image = epeg_memory_open($sample);
+    epeg_decode_size_set($image, 32, 24);
+    return epeg_encode($image);
+}
+var_dump(epeg_memory_get_peak_usage());
+var_dump(is_string(thumb($sample)));
+$peak = epeg_memory_get_peak_usage();
+var_dump($peak > 0);
+var_dump(is_string(thumb($sample)), epeg_memory_get_peak_usage() == $peak);
+?>
+--EXPECT--
+int(0)
+bool(true)
+bool(true)
+bool(true)
+bool(true)
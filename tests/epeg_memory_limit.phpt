@@ -0,0 +1,19 @@
+--TEST--
+epeg.memory_limit ini setting
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--INI--
+epeg.memory_limit=1000
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+var_dump(ini_set('epeg.memory_limit', 0));
+$image = epeg_memory_open($sample);
+epeg_decode_size_set($image, 32, 24);
+var_dump(epeg_encode($image));
+?>
+--EXPECTF--
+bool(false)
+
+Warning: epeg_encode(): Allowed memory size of 1000 bytes for the JPEG codec exhausted in %s on line %d
+bool(false)
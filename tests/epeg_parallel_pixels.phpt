@@ -0,0 +1,45 @@
+--TEST--
+epeg.parallel_pixels ini setting
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+// 64x64 YCbCr JPEG image with a restart marker at every MCU row
+$dri = base64_decode(
+    '/9j/4AAQSkZJRgABAQAAAQABAAD/2wBDAAgGBgcGBQgHBwcJCQgKDBQNDAsLDBkSEw8UHRofHh0a' .
+    'HBwgJC4nICIsIxwcKDcpLDAxNDQ0Hyc5PTgyPC4zNDL/2wBDAQkJCQwLDBgNDRgyIRwhMjIyMjIy' .
+    'MjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjL/wAARCABAAEADASIA' .
+    'AhEBAxEB/8QAHwAAAQUBAQEBAQEAAAAAAAAAAAECAwQFBgcICQoL/8QAtRAAAgEDAwIEAwUFBAQA' .
+    'AAF9AQIDAAQRBRIhMUEGE1FhByJxFDKBkaEII0KxwRVS0fAkM2JyggkKFhcYGRolJicoKSo0NTY3' .
+    'ODk6Q0RFRkdISUpTVFVWV1hZWmNkZWZnaGlqc3R1dnd4eXqDhIWGh4iJipKTlJWWl5iZmqKjpKWm' .
+    'p6ipqrKztLW2t7i5usLDxMXGx8jJytLT1NXW19jZ2uHi4+Tl5ufo6erx8vP09fb3+Pn6/8QAHwEA' .
+    'AwEBAQEBAQEBAQAAAAAAAAECAwQFBgcICQoL/8QAtREAAgECBAQDBAcFBAQAAQJ3AAECAxEEBSEx' .
+    'BhJBUQdhcRMiMoEIFEKRobHBCSMzUvAVYnLRChYkNOEl8RcYGRomJygpKjU2Nzg5OkNERUZHSElK' .
+    'U1RVVldYWVpjZGVmZ2hpanN0dXZ3eHl6goOEhYaHiImKkpOUlZaXmJmaoqOkpaanqKmqsrO0tba3' .
+    'uLm6wsPExcbHyMnK0tPU1dbX2Nna4uPk5ebn6Onq8vP09fb3+Pn6/90ABAAE/9oADAMBAAIRAxEA' .
+    'PwDw6OD2q1HB7VZjg9qsxwe1E6oYeuW44ParMcHtVmOD2q1HB7V+hTqnoYeuYUcHtVqOD2qzHB7V' .
+    'ajg9q/Kp1T6nD1y1HB7VZjg9qsxwe1Wo4Pav0KdU9DD1z//Q4eOD2qzHB7Vajg9qsxwe1fczqnze' .
+    'HrmHHB7VZjg9qsxwe1Wo4PavyqdU+pw9ctRwe1Wo4ParMcHtVqOD2r9CnVPQw9cwo4ParMcHtVqO' .
+    'D2qzHB7V+VTqn1OHrn//0eZjg9qtRwe1WY4ParMcHtXzU6p8fh65bjg9qsxwe1WY4ParUcHtX6FO' .
+    'qehh65hRwe1Wo4ParMcHtVqOD2r8pnVPqcPXLUcHtVmOD2q1HB7VZjg9q/Qp1T0MPXP/0tOOD2q1' .
+    'HB7VZjg9qsxwe1enOqfleHrmHHB7VZjg9qtRwe1WY4PavyqdU+pw9ctRwe1Wo4ParMcHtVqOD2r9' .
+    'CnVPQw9cwo4ParUcHtVmOD2qzHB7V+VTqn1OHrn/2Q==');
+function thumb($data, $filter) {
+    $image = epeg_memory_open($data);
+    epeg_decode_size_set($image, 40, 40);
+    epeg_filter_set($image, $filter);
+    return epeg_encode($image);
+}
+foreach (array(EPEG_FILTER_POINT, EPEG_FILTER_LANCZOS3) as $filter) {
+    ini_set('epeg.parallel_pixels', 1);
+    $parallel = thumb($dri, $filter);
+    ini_set('epeg.parallel_pixels', 0);
+    $serial = thumb($dri, $filter);
+    var_dump(strlen($parallel) > 0, $parallel === $serial);
+}
+?>
+--EXPECT--
+bool(true)
+bool(true)
+bool(true)
+bool(true)
@@ -0,0 +1,34 @@
+--TEST--
+epeg_pixels_get() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+epeg_decode_size_set($image, 32, 24);
+epeg_decode_colorspace_set($image, EPEG_RGB8);
+$pixels = epeg_pixels_get($image);
+printf("%dx%d %d %d %d %d\n", $pixels['width'], $pixels['height'],
+    $pixels['colorspace'] == EPEG_RGB8, $pixels['components'], $pixels['stride'], strlen($pixels['data']));
+// the settings are reset, the image is in its own colorspace
+$pixels = epeg_pixels_get($image);
+printf("%dx%d %d %d\n", $pixels['width'], $pixels['height'],
+    $pixels['colorspace'] == EPEG_YUV8, strlen($pixels['data']));
+// the alpha is opaque
+epeg_decode_size_set($image, 4, 3);
+epeg_decode_colorspace_set($image, EPEG_RGBA8);
+$pixels = epeg_pixels_get($image);
+printf("%d %s\n", $pixels['stride'], bin2hex(substr($pixels['data'], 3, 1)));
+// the decode size is of the rotated image
+epeg_transform($image, EPEG_TRANSFORM_ROT_90);
+epeg_decode_size_set($image, 12, 16);
+epeg_decode_colorspace_set($image, EPEG_GRAY8);
+$pixels = epeg_pixels_get($image);
+printf("%dx%d %d %d\n", $pixels['width'], $pixels['height'], $pixels['stride'], strlen($pixels['data']));
+?>
+--EXPECT--
+32x24 1 3 96 2304
+64x48 1 9216
+16 ff
+12x16 12 192
@@ -0,0 +1,30 @@
+--TEST--
+epeg_placeholder() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+var_dump(strlen(epeg_placeholder($image, 4, 3, EPEG_PLACEHOLDER_RGB)));
+var_dump(strlen(epeg_placeholder($image, 16, 16, EPEG_PLACEHOLDER_RGB)));
+$hash = epeg_placeholder($image, 4, 3, EPEG_PLACEHOLDER_BLURHASH);
+var_dump(strlen($hash), $hash[0]);
+var_dump(strlen(epeg_placeholder($image, 1, 1, EPEG_PLACEHOLDER_BLURHASH)));
+var_dump(preg_match('/^#[0-9a-f]{6}$/', epeg_placeholder($image, 0, 0, EPEG_PLACEHOLDER_COLOR)));
+var_dump(epeg_placeholder($image, 10, 3, EPEG_PLACEHOLDER_BLURHASH));
+var_dump(epeg_placeholder($image, 4, 3, 3));
+?>
+--EXPECTF--
+int(36)
+int(768)
+int(28)
+string(1) "L"
+int(6)
+int(1)
+
+Warning: epeg_placeholder(): Invalid number of components '10x3' in %s on line %d
+bool(false)
+
+Warning: epeg_placeholder(): Invalid placeholder format '3' in %s on line %d
+bool(false)
@@ -0,0 +1,28 @@
+--TEST--
+epeg_retained_pixels_enable() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+epeg_retained_pixels_enable($image, true);
+$thumbs = array();
+foreach (array(95, 50, 95) as $quality) {
+    epeg_decode_size_set($image, 32, 24);
+    epeg_quality_set($image, $quality);
+    $thumbs[] = epeg_encode($image);
+}
+$size = epeg_size_get(epeg_memory_open($thumbs[1]));
+printf("%dx%d\n", $size['width'], $size['height']);
+var_dump($thumbs[0] === $thumbs[2], $thumbs[0] === $thumbs[1]);
+epeg_retained_pixels_enable($image, false);
+epeg_decode_size_set($image, 16, 12);
+$size = epeg_size_get(epeg_memory_open(epeg_encode($image)));
+printf("%dx%d\n", $size['width'], $size['height']);
+?>
+--EXPECT--
+32x24
+bool(true)
+bool(false)
+16x12
@@ -0,0 +1,57 @@
+--TEST--
+epeg_thumbnail_batch() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$in_file = tempnam(sys_get_temp_dir(), 'epeg');
+$out_file = tempnam(sys_get_temp_dir(), 'epeg');
+file_put_contents($in_file, $sample);
+$results = epeg_thumbnail_batch(array(
+    'file'  => array('in' => $in_file, 'out' => $out_file, 'max_width' => 32, 'max_height' => 32),
+    'data'  => array('in' => $in_file, 'max_width' => 16, 'max_height' => 16, 'quality' => 90),
+    'large' => array('in' => $in_file, 'max_width' => 100, 'max_height' => 100),
+    'bad'   => array('in' => $in_file, 'max_width' => 0, 'max_height' => 16),
+), 2);
+var_dump(array_keys($results));
+var_dump($results['file']);
+$size = epeg_size_get(epeg_file_open($out_file));
+printf("file: %dx%d\n", $size['width'], $size['height']);
+$size = epeg_size_get(epeg_memory_open($results['data']['result']));
+printf("data: %dx%d\n", $size['width'], $size['height']);
+$size = epeg_size_get(epeg_memory_open($results['large']['result']));
+printf("large: %dx%d\n", $size['width'], $size['height']);
+var_dump($results['bad']);
+var_dump(epeg_thumbnail_batch(array()));
+unlink($in_file);
+unlink($out_file);
+?>
+--EXPECT--
+array(4) {
+  [0]=>
+  string(4) "file"
+  [1]=>
+  string(4) "data"
+  [2]=>
+  string(5) "large"
+  [3]=>
+  string(3) "bad"
+}
+array(2) {
+  ["result"]=>
+  bool(true)
+  ["error"]=>
+  NULL
+}
+file: 32x24
+data: 16x12
+large: 64x48
+array(2) {
+  ["result"]=>
+  bool(false)
+  ["error"]=>
+  string(22) "Invalid job parameters"
+}
+array(0) {
+}
@@ -4,7 +4,76 @@ epeg_thumbnail_create() function
 <?php include 'skipif.inc'; ?>
 --FILE--
 <?php
-echo 'OK'; // no test case for this function yet
+include dirname(__FILE__) . '/sample.inc';
+// orientation 6 (rotated 90 degrees counterclockwise)
+$exif = "\xFF\xE1\x00\x22Exif\0\0MM\0\x2a\0\0\0\x08\0\x01\x01\x12\0\x03\0\0\0\x01\0\x06\0\0\0\0\0\0";
+$file = tempnam(sys_get_temp_dir(), 'epeg');
+file_put_contents($file, substr($sample, 0, 2) . $exif . substr($sample, 2));
+foreach (array(array(32, 32, false), array(32, 32, true), array(100, 100, true)) as $args) {
+    $data = epeg_thumbnail_create($file, '', $args[0], $args[1], 75, $args[2]);
+    $size = epeg_size_get(epeg_memory_open($data));
+    printf("%dx%d\n", $size['width'], $size['height']);
+}
+// snapped to the half size decoded in the DCT domain
+foreach (array(false, true) as $auto_orient) {
+    $data = epeg_thumbnail_create($file, '', 30, 30, 75, $auto_orient, EPEG_FIT_FAST, $fit);
+    $size = epeg_size_get(epeg_memory_open($data));
+    printf("%dx%d %dx%d\n", $fit['width'], $fit['height'], $size['width'], $size['height']);
+}
+// at most 1/8 of the source, decoded from the DC coefficients
+foreach (array(false, true) as $auto_orient) {
+    $data = epeg_thumbnail_create($file, '', 30, 30, 75, $auto_orient, EPEG_DECODE_DC_ONLY, $fit);
+    $size = epeg_size_get(epeg_memory_open($data));
+    printf("%dx%d %dx%d\n", $fit['width'], $fit['height'], $size['width'], $size['height']);
+}
+// 32x24 grayscale thumbnail in IFD1 after the orientation in IFD0
+$image = epeg_memory_open($sample);
+epeg_decode_size_set($image, 32, 24);
+epeg_decode_colorspace_set($image, EPEG_GRAY8);
+$thumb = epeg_encode($image);
+$tiff = "MM\0\x2a\0\0\0\x08\0\x01\x01\x12\0\x03\0\0\0\x01\0\x06\0\0\0\0\0\x1a\0\x02"
+      . "\x02\x01\0\x04\0\0\0\x01" . pack('N', 56)
+      . "\x02\x02\0\x04\0\0\0\x01" . pack('N', strlen($thumb))
+      . "\0\0\0\0" . $thumb;
+file_put_contents($file, "\xFF\xD8\xFF\xE1" . pack('n', strlen($tiff) + 8) . "Exif\0\0" . $tiff . substr($sample, 2));
+foreach (array(array(20, 20, false, -1), array(20, 20, false, 0.02), array(32, 32, false, 0.02),
+        array(32, 32, true, 0.02), array(40, 40, false, 0.02)) as $args) {
+    $data = epeg_thumbnail_create($file, '', $args[0], $args[1], 75, $args[2], EPEG_FIT_EXACT, $fit, $args[3]);
+    $info = epeg_probe('data://image/jpeg;base64,' . base64_encode($data));
+    printf("%dx%d %d\n", $info['width'], $info['height'], $info['components']);
+}
+// the second thumbnail is read from the cache directory
+$dir = tempnam(sys_get_temp_dir(), 'epeg');
+unlink($dir);
+mkdir($dir);
+ini_set('epeg.cache_dir', $dir);
+$data = epeg_thumbnail_create($file, '', 20, 20, 75, false, EPEG_FIT_EXACT, $fit);
+$cached = epeg_thumbnail_create($file, '', 20, 20, 75, false, EPEG_FIT_EXACT, $size);
+$files = glob("$dir/*.jpg");
+printf("%d %d %dx%d\n", count($files), $cached === $data, $size['width'], $size['height']);
+unlink($files[0]);
+rmdir($dir);
+ini_set('epeg.cache_dir', '');
+// the source is replaced only when the thumbnail is complete
+file_put_contents($file, $sample);
+var_dump(epeg_thumbnail_create($file, $file, 32, 32));
+$info = epeg_probe($file);
+printf("%dx%d %d\n", $info['width'], $info['height'], count(glob("$file.*")));
+unlink($file);
 ?>
 --EXPECT--
-OK
\ No newline at end of file
+32x24
+24x32
+48x64
+32x24 32x24
+24x32 24x32
+8x6 8x6
+6x8 6x8
+20x15 3
+20x15 1
+32x24 1
+24x32 1
+40x30 3
+1 1 20x15
+bool(true)
+32x24 0
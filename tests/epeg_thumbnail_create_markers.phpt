@@ -0,0 +1,37 @@
+--TEST--
+epeg_thumbnail_create() function copying an image without resizing
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$soi = substr($sample, 0, 2);
+$rest = substr($sample, 2);
+$file = tempnam(sys_get_temp_dir(), 'epeg');
+$cases = array(
+    // not starting with SOI
+    "\xFF\xD9" . $rest,
+    // a comment whose length field is shorter than itself
+    $soi . "\xFF\xFE\x00\x01" . $rest,
+    // a comment which goes past the end of the image
+    $soi . "\xFF\xFE\xFF\xF0" . $rest,
+    // the comment is dropped, TEM and RST0 have no length field and are kept
+    $soi . "\xFF\xFE\x00\x05abc\xFF\x01\xFF\xD0" . $rest,
+);
+foreach ($cases as $data) {
+    file_put_contents($file, $data);
+    $thumb = epeg_thumbnail_create($file, '', 100, 100);
+    var_dump(is_string($thumb) ? $thumb === $soi . "\xFF\x01\xFF\xD0" . $rest : $thumb);
+}
+unlink($file);
+?>
+--EXPECTF--
+Warning: epeg_thumbnail_create(): Not a valid JPEG data in %s on line %d
+bool(false)
+
+Warning: epeg_thumbnail_create(): Invalid data structure in %s on line %d
+bool(false)
+
+Warning: epeg_thumbnail_create(): Not a valid JPEG data in %s on line %d
+bool(false)
+bool(true)
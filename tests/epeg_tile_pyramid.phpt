@@ -0,0 +1,41 @@
+--TEST--
+epeg_tile_pyramid() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+var_dump(epeg_tile_pyramid($image, 32, 1, array(new ArrayObject(), 'offsetSet')));
+$tiles = array();
+$count = epeg_tile_pyramid($image, 32, 1, function ($level, $col, $row, $data) use (&$tiles) {
+    $size = epeg_size_get(epeg_memory_open($data));
+    $tiles[] = sprintf('%d/%d_%d: %dx%d', $level, $col, $row, $size['width'], $size['height']);
+});
+var_dump($count);
+echo implode("\n", $tiles), "\n";
+var_dump(epeg_tile_pyramid($image, 0, 0, function () {}));
+// the settings are reset even if the sink stops
+epeg_decode_size_set($image, 16, 12);
+var_dump(epeg_tile_pyramid($image, 32, 1, function () { return false; }));
+$size = epeg_size_get(epeg_memory_open(epeg_encode($image)));
+printf("%dx%d\n", $size['width'], $size['height']);
+?>
+--EXPECTF--
+int(10)
+int(10)
+6/0_0: 33x33
+6/1_0: 33x33
+6/0_1: 33x17
+6/1_1: 33x17
+5/0_0: 32x24
+4/0_0: 16x12
+3/0_0: 8x6
+2/0_0: 4x3
+1/0_0: 2x2
+0/0_0: 1x1
+
+Warning: epeg_tile_pyramid(): Invalid tile size '0' or overlap '0' in %s on line %d
+bool(false)
+bool(false)
+64x48
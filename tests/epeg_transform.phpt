@@ -0,0 +1,34 @@
+--TEST--
+epeg_transform() function
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+include dirname(__FILE__) . '/sample.inc';
+$image = epeg_memory_open($sample);
+foreach (array(EPEG_TRANSFORM_FLIP_H, EPEG_TRANSFORM_ROT_90, EPEG_TRANSFORM_TRANSVERSE) as $op) {
+    epeg_transform($image, $op);
+    $size = epeg_size_get(epeg_memory_open(epeg_encode($image)));
+    printf("%d: %dx%d\n", $op, $size['width'], $size['height']);
+}
+// the decode size is of the rotated image
+epeg_transform($image, EPEG_TRANSFORM_ROT_270);
+epeg_decode_size_set($image, 24, 32);
+$size = epeg_size_get(epeg_memory_open(epeg_encode($image)));
+printf("%dx%d\n", $size['width'], $size['height']);
+// orientation 6 (rotated 90 degrees counterclockwise)
+$exif = "\xFF\xE1\x00\x22Exif\0\0MM\0\x2a\0\0\0\x08\0\x01\x01\x12\0\x03\0\0\0\x01\0\x06\0\0\0\0\0\0";
+$image = epeg_memory_open(substr($sample, 0, 2) . $exif . substr($sample, 2));
+epeg_transform($image, EPEG_TRANSFORM_AUTO);
+$size = epeg_size_get(epeg_memory_open(epeg_encode($image)));
+printf("%dx%d\n", $size['width'], $size['height']);
+epeg_transform($image, 8);
+?>
+--EXPECTF--
+1: 64x48
+5: 48x64
+4: 48x64
+24x32
+48x64
+
+Warning: epeg_transform(): Invalid transform '8' in %s on line %d
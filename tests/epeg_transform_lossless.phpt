@@ -0,0 +1,55 @@
+--TEST--
+epeg_transform() function on an image with partial MCUs
+--SKIPIF--
+<?php include 'skipif.inc'; ?>
+--FILE--
+<?php
+// 50x38 YCbCr 4:2:0 JPEG image, neither side is a multiple of the 16x16 MCU
+$odd = base64_decode(
+    '/9j/4AAQSkZJRgABAQAAAQABAAD/2wBDAAgGBgcGBQgHBwcJCQgKDBQNDAsLDBkSEw8UHRofHh0a' .
+    'HBwgJC4nICIsIxwcKDcpLDAxNDQ0Hyc5PTgyPC4zNDL/2wBDAQkJCQwLDBgNDRgyIRwhMjIyMjIy' .
+    'MjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjIyMjL/wAARCAAmADIDASIA' .
+    'AhEBAxEB/8QAHwAAAQUBAQEBAQEAAAAAAAAAAAECAwQFBgcICQoL/8QAtRAAAgEDAwIEAwUFBAQA' .
+    'AAF9AQIDAAQRBRIhMUEGE1FhByJxFDKBkaEII0KxwRVS0fAkM2JyggkKFhcYGRolJicoKSo0NTY3' .
+    'ODk6Q0RFRkdISUpTVFVWV1hZWmNkZWZnaGlqc3R1dnd4eXqDhIWGh4iJipKTlJWWl5iZmqKjpKWm' .
+    'p6ipqrKztLW2t7i5usLDxMXGx8jJytLT1NXW19jZ2uHi4+Tl5ufo6erx8vP09fb3+Pn6/8QAHwEA' .
+    'AwEBAQEBAQEBAQAAAAAAAAECAwQFBgcICQoL/8QAtREAAgECBAQDBAcFBAQAAQJ3AAECAxEEBSEx' .
+    'BhJBUQdhcRMiMoEIFEKRobHBCSMzUvAVYnLRChYkNOEl8RcYGRomJygpKjU2Nzg5OkNERUZHSElK' .
+    'U1RVVldYWVpjZGVmZ2hpanN0dXZ3eHl6goOEhYaHiImKkpOUlZaXmJmaoqOkpaanqKmqsrO0tba3' .
+    'uLm6wsPExcbHyMnK0tPU1dbX2Nna4uPk5ebn6Onq8vP09fb3+Pn6/9oADAMBAAIRAxEAPwDxWKz9' .
+    'quRWftWpFZ+1XIrP2rCeJM8Liwis/arkVn7VpxWftV2Kz9q+/niT2MLizmIrP2q5FZ+1acVn7Vdi' .
+    's/avyieJPscLiyP7H7UVv/Y/aiv0T6ydP1s5qKz9quRWftWnFZ+1XIrP2oniT+ecLizmYrP2q5FZ' .
+    '+1acVn7Vcis/avyeeJPsMLiwis/arsVn7VpxWftVyKz9q+/niT2MLizlPsftRXQfY/aivy36yfRf' .
+    'WzmIrZfarkVstFFbzkz8Dws5HQRWy+1XIrZfaiiv0CcmevhZy7leO1WrsVsvtRRX5POTPscLJm39' .
+    'lWiiiv0TmZ088u5//9k=');
+function pixels($data, $op) {
+    $image = epeg_memory_open($data);
+    epeg_transform($image, $op);
+    return epeg_pixels_get($image);
+}
+foreach (array(EPEG_TRANSFORM_ROT_90, EPEG_TRANSFORM_ROT_180, EPEG_TRANSFORM_ROT_270) as $op) {
+    // rearranged DCT coefficients, the partial MCUs moved to the top or the left are trimmed
+    $image = epeg_memory_open($odd);
+    epeg_transform($image, $op);
+    $lossless = pixels(epeg_encode($image), EPEG_TRANSFORM_NONE);
+    // decoded and transformed pixel by pixel
+    $pixels = pixels($odd, $op);
+    $x = $pixels['width'] - $lossless['width'];
+    $y = $pixels['height'] - $lossless['height'];
+    $diff = 0;
+    for ($row = 0; $row < $lossless['height']; $row++) {
+        $a = substr($lossless['data'], $row * $lossless['stride'], $lossless['stride']);
+        $b = substr($pixels['data'], ($row + $y) * $pixels['stride'] + $x * 3, $lossless['stride']);
+        for ($i = 0; $i < $lossless['stride']; $i++) {
+            $diff = max($diff, abs(ord($a[$i]) - ord($b[$i])));
+        }
+    }
+    // both are decoded from the same coefficients, up to the rounding of the IDCT
+    printf("%d: %dx%d %dx%d %d\n", $op, $lossless['width'], $lossless['height'],
+        $pixels['width'], $pixels['height'], $diff <= 1);
+}
+?>
+--EXPECT--
+5: 32x50 38x50 1
+6: 48x32 50x38 1
+7: 38x48 38x50 1